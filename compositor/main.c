@@ -558,6 +558,7 @@ usage(int error_code)
 		"  -c, --config=FILE\tConfig file to load, defaults to weston.ini\n"
 		"  --no-config\t\tDo not read weston.ini\n"
 		"  --wait-for-debugger\tRaise SIGSTOP on start-up\n"
+		"  --debug\t\tExpose debugging interfaces to all clients\n"
 		"  -h, --help\t\tThis help message\n\n");
 
 #if defined(BUILD_DRM_COMPOSITOR)
@@ -606,6 +607,10 @@ usage(int error_code)
 		"  --transform=TR\tThe output transformation, TR is one of:\n"
 		"\tnormal 90 180 270 flipped flipped-90 flipped-180 flipped-270\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n"
+		"  --use-gl\t\tUse the GL renderer on a surfaceless EGL display\n"
+		"  --refresh-rate=RATE\tThe output refresh rate in mHz (default: 60000)\n"
+		"  --unthrottled\t\tRepaint as fast as possible instead of at the\n"
+		"\t\t\trefresh rate\n"
 		"  --no-outputs\t\tDo not create any virtual outputs\n"
 		"\n");
 #endif
@@ -921,6 +926,7 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int adaptive_repaint;
 	int vt_switching;
 
 	s = weston_config_get_section(config, "keyboard", NULL, NULL);
@@ -956,8 +962,15 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	} else {
 		ec->repaint_msec = repaint_msec;
 	}
-	weston_log("Output repaint window is %d ms maximum.\n",
-		   ec->repaint_msec);
+	weston_config_section_get_bool(s, "adaptive-repaint-window",
+				       &adaptive_repaint, false);
+	ec->adaptive_repaint = adaptive_repaint;
+	if (ec->adaptive_repaint)
+		weston_log("Output repaint window is adaptive, %d ms until "
+			   "the repaint cost is known.\n", ec->repaint_msec);
+	else
+		weston_log("Output repaint window is %d ms maximum.\n",
+			   ec->repaint_msec);
 
 	return 0;
 }
@@ -1321,6 +1334,7 @@ load_headless_backend(struct weston_compositor *c,
 {
 	const struct weston_windowed_output_api *api;
 	struct weston_headless_backend_config config = {{ 0, }};
+	struct weston_config_section *section;
 	int no_outputs = 0;
 	int ret = 0;
 	char *transform = NULL;
@@ -1333,10 +1347,17 @@ load_headless_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_INTEGER, "width", 0, &parsed_options->width },
 		{ WESTON_OPTION_INTEGER, "height", 0, &parsed_options->height },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &config.use_pixman },
+		{ WESTON_OPTION_BOOLEAN, "use-gl", 0, &config.use_gl },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
 		{ WESTON_OPTION_BOOLEAN, "no-outputs", 0, &no_outputs },
+		{ WESTON_OPTION_INTEGER, "refresh-rate", 0, &config.refresh },
+		{ WESTON_OPTION_BOOLEAN, "unthrottled", 0, &config.unthrottled },
 	};
 
+	section = weston_config_get_section(wc, "core", NULL, NULL);
+	weston_config_section_get_int(section, "headless-refresh-rate",
+				      &config.refresh, 0);
+
 	parse_options(options, ARRAY_LENGTH(options), argc, argv);
 
 	if (transform) {
@@ -1852,6 +1873,7 @@ int main(int argc, char *argv[])
 	struct wet_compositor user_data;
 	int require_input;
 	int32_t wait_for_debugger = 0;
+	int32_t debug_protocol = 0;
 
 	const struct weston_option core_options[] = {
 		{ WESTON_OPTION_STRING, "backend", 'B', &backend },
@@ -1866,6 +1888,7 @@ int main(int argc, char *argv[])
 		{ WESTON_OPTION_BOOLEAN, "no-config", 0, &noconfig },
 		{ WESTON_OPTION_STRING, "config", 'c', &config_file },
 		{ WESTON_OPTION_BOOLEAN, "wait-for-debugger", 0, &wait_for_debugger },
+		{ WESTON_OPTION_BOOLEAN, "debug", 0, &debug_protocol },
 	};
 
 	if (os_fd_set_cloexec(fileno(stdin))) {
@@ -1978,6 +2001,12 @@ int main(int argc, char *argv[])
 
 	weston_compositor_log_capabilities(ec);
 
+	if (debug_protocol &&
+	    weston_compositor_expose_repaint_profiler(ec) < 0) {
+		weston_log("fatal: failed to expose the repaint profiler\n");
+		goto out;
+	}
+
 	server_socket = getenv("WAYLAND_SERVER_SOCKET");
 	if (server_socket) {
 		weston_log("Running with single client\n");
@@ -37,6 +37,9 @@
 #include <linux/input.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 
 #include <wayland-client.h>
 
@@ -44,9 +47,37 @@
 #include "weston.h"
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
+#include "shared/thread-util.h"
 #include "shared/timespec-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 
+/* Repaints waiting for the share thread. When the queue is full, the
+ * repaint is dropped and its damage is carried over to the next one. */
+#define SHARE_QUEUE_LENGTH 3
+
+/* One buffer on the parent, one ready to go and one being painted */
+#define SHARE_BUFFER_COUNT 3
+
+struct ss_frame {
+	/* Damage in output coordinates */
+	pixman_region32_t damage;
+	/* The same damage in buffer coordinates, as read back */
+	pixman_region32_t buffer_damage;
+	/* Top-down rows of each rect of buffer_damage, as read back */
+	uint32_t *data;
+	size_t data_size;
+
+	pixman_transform_t transform;
+	int32_t scale;
+
+	/* Read-back progress, compositor thread only */
+	struct shared_output *so;
+	int pending;
+	uint32_t *next;
+	int n_read;
+	bool failed;
+};
+
 struct shared_output {
 	struct weston_output *output;
 	struct wl_listener output_destroyed;
@@ -71,14 +102,48 @@ struct shared_output {
 	struct {
 		int32_t width, height;
 
+		/* Only changed while the share thread is stopped */
 		struct wl_list buffers;
+		/* Protected by the thread mutex */
 		struct wl_list free_buffers;
+		struct ss_shm_buffer *ready;
 	} shm;
 
-	int cache_dirty;
-	pixman_image_t *cache_image;
-	uint32_t *tmp_data;
-	size_t tmp_data_size;
+	/* Size of the cache image, in buffer pixels */
+	int32_t mode_width, mode_height;
+	/* Damage of repaints dropped because the queue was full */
+	pixman_region32_t backlog;
+	/* Frames still being read back, right after the queued ones */
+	int reading;
+	/* Torn down, waiting for the read-backs to be freed */
+	bool destroyed;
+
+	/* Reads back on the compositor thread, paints the shm buffers
+	 * on the share thread and attaches them on the compositor
+	 * thread again once the share thread reports one ready. */
+	struct {
+		pthread_t thread;
+		bool running;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool quit;
+		struct ss_frame queue[SHARE_QUEUE_LENGTH];
+		int head, count;
+
+		int readfd, writefd;
+		struct wl_event_source *source;
+
+		/* Owned by the share thread while it runs */
+		pixman_image_t *cache_image;
+		bool cache_dirty;
+		pixman_transform_t transform;
+		int32_t scale;
+		int frames_applied;
+		uint32_t frames_coalesced;
+	} thread;
+
+	uint32_t frames_shared;
+	uint32_t frames_dropped;
 };
 
 struct ss_seat {
@@ -104,7 +169,10 @@ struct ss_shm_buffer {
 	struct wl_buffer *buffer;
 	void *data;
 	size_t size;
+	/* Output content that changed since this buffer was painted */
 	pixman_region32_t damage;
+	/* What the last paint updated, for wl_surface.damage */
+	pixman_region32_t commit_damage;
 
 	pixman_image_t *pm_image;
 };
@@ -399,6 +467,7 @@ ss_shm_buffer_destroy(struct ss_shm_buffer *buffer)
 	munmap(buffer->data, buffer->size);
 
 	pixman_region32_fini(&buffer->damage);
+	pixman_region32_fini(&buffer->commit_damage);
 
 	wl_list_remove(&buffer->link);
 	wl_list_remove(&buffer->free_link);
@@ -409,12 +478,17 @@ static void
 buffer_release(void *data, struct wl_buffer *buffer)
 {
 	struct ss_shm_buffer *sb = data;
+	struct shared_output *so = sb->output;
 
-	if (sb->output) {
-		wl_list_insert(&sb->output->shm.free_buffers, &sb->free_link);
-	} else {
+	if (!so) {
 		ss_shm_buffer_destroy(sb);
+		return;
 	}
+
+	pthread_mutex_lock(&so->thread.mutex);
+	wl_list_insert(&so->shm.free_buffers, &sb->free_link);
+	pthread_cond_signal(&so->thread.cond);
+	pthread_mutex_unlock(&so->thread.mutex);
 }
 
 static const struct wl_buffer_listener buffer_listener = {
@@ -422,44 +496,18 @@ static const struct wl_buffer_listener buffer_listener = {
 };
 
 static struct ss_shm_buffer *
-shared_output_get_shm_buffer(struct shared_output *so)
+shared_output_create_shm_buffer(struct shared_output *so)
 {
-	struct ss_shm_buffer *sb, *bnext;
+	struct ss_shm_buffer *sb;
 	struct wl_shm_pool *pool;
 	int width, height, stride;
 	int fd;
 	unsigned char *data;
 
-	width = so->output->width;
-	height = so->output->height;
+	width = so->shm.width;
+	height = so->shm.height;
 	stride = width * 4;
 
-	/* If the size of the output changed, we free the old buffers and
-	 * make new ones. */
-	if (so->shm.width != width ||
-	    so->shm.height != height) {
-
-		/* Destroy free buffers */
-		wl_list_for_each_safe(sb, bnext, &so->shm.free_buffers, free_link)
-			ss_shm_buffer_destroy(sb);
-
-		/* Orphan in-use buffers so they get destroyed */
-		wl_list_for_each(sb, &so->shm.buffers, link)
-			sb->output = NULL;
-
-		so->shm.width = width;
-		so->shm.height = height;
-	}
-
-	if (!wl_list_empty(&so->shm.free_buffers)) {
-		sb = container_of(so->shm.free_buffers.next,
-				  struct ss_shm_buffer, free_link);
-		wl_list_remove(&sb->free_link);
-		wl_list_init(&sb->free_link);
-
-		return sb;
-	}
-
 	fd = os_create_anonymous_file(height * stride);
 	if (fd < 0) {
 		weston_log("os_create_anonymous_file: %m\n");
@@ -477,14 +525,19 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		goto out_unmap;
 
 	sb->output = so;
-	wl_list_init(&sb->free_link);
-	wl_list_insert(&so->shm.buffers, &sb->link);
 
 	pixman_region32_init_rect(&sb->damage, 0, 0, width, height);
+	pixman_region32_init(&sb->commit_damage);
 
 	sb->data = data;
 	sb->size = height * stride;
 
+	sb->pm_image =
+		pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
+					 (uint32_t *)data, stride);
+	if (!sb->pm_image)
+		goto out_pixman_error;
+
 	pool = wl_shm_create_pool(so->parent.shm, fd, sb->size);
 
 	sb->buffer = wl_shm_pool_create_buffer(pool, 0,
@@ -493,25 +546,20 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	wl_buffer_add_listener(sb->buffer, &buffer_listener, sb);
 	wl_shm_pool_destroy(pool);
 	close(fd);
-	fd = -1;
-
-	memset(data, 0, sb->size);
 
-	sb->pm_image =
-		pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
-					 (uint32_t *)data, stride);
-	if (!sb->pm_image)
-		goto out_pixman_error;
+	wl_list_insert(&so->shm.buffers, &sb->link);
+	wl_list_insert(&so->shm.free_buffers, &sb->free_link);
 
 	return sb;
 
 out_pixman_error:
 	pixman_region32_fini(&sb->damage);
+	pixman_region32_fini(&sb->commit_damage);
+	free(sb);
 out_unmap:
 	munmap(data, height * stride);
 out_close:
-	if (fd != -1)
-		close(fd);
+	close(fd);
 	return NULL;
 }
 
@@ -567,42 +615,223 @@ output_compute_transform(struct weston_output *output,
 static void
 shared_output_destroy(struct shared_output *so);
 
-static int
-shared_output_ensure_tmp_data(struct shared_output *so,
-			      pixman_region32_t *region)
+/* Copies the read back rects of a frame into the cache and marks them
+ * stale in every buffer. */
+static void
+shared_output_apply_frame(struct shared_output *so, struct ss_frame *frame)
 {
-	pixman_box32_t *ext;
-	size_t size;
+	struct ss_shm_buffer *sb;
+	pixman_box32_t *r;
+	uint32_t *cache_data, *src;
+	int32_t stride, width, height;
+	int i, nrects;
 
-	if (!pixman_region32_not_empty(region))
-		return 0;
+	cache_data = pixman_image_get_data(so->thread.cache_image);
+	stride = pixman_image_get_stride(so->thread.cache_image) / 4;
 
-	ext = pixman_region32_extents(region);
+	src = frame->data;
+	r = pixman_region32_rectangles(&frame->buffer_damage, &nrects);
+	for (i = 0; i < nrects; ++i) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
 
-	/* Damage is in output coordinates.
-	 *
-	 * We are multiplying by 4 because the temporary data needs to be able
-	 * to store an 32 bit-per-pixel buffer.
-	 */
-	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
-		 * so->output->current_scale * so->output->current_scale;
+		pixman_blt(src, cache_data, width, stride,
+			   32, 32, 0, 0,
+			   r[i].x1, r[i].y1, width, height);
 
-	if (so->tmp_data != NULL && size <= so->tmp_data_size)
-		return 0;
+		src += width * height;
+	}
 
-	free(so->tmp_data);
-	so->tmp_data = malloc(size);
-	if (so->tmp_data == NULL) {
-		so->tmp_data_size = 0;
-		errno = ENOMEM;
+	so->thread.transform = frame->transform;
+	so->thread.scale = frame->scale;
+
+	wl_list_for_each(sb, &so->shm.buffers, link)
+		pixman_region32_union(&sb->damage, &sb->damage, &frame->damage);
+}
+
+/* Brings the stale parts of a buffer up to date with the cache. */
+static void
+shared_output_paint_buffer(struct shared_output *so, struct ss_shm_buffer *sb)
+{
+	pixman_image_t *cache_image = so->thread.cache_image;
+
+	pixman_image_set_transform(cache_image, &so->thread.transform);
+
+	pixman_image_set_clip_region32(sb->pm_image, &sb->damage);
+
+	if (so->thread.scale == 1) {
+		pixman_image_set_filter(cache_image,
+					PIXMAN_FILTER_NEAREST, NULL, 0);
+	} else {
+		pixman_image_set_filter(cache_image,
+					PIXMAN_FILTER_BILINEAR, NULL, 0);
+	}
+
+	pixman_image_composite32(PIXMAN_OP_SRC,
+				 cache_image, /* src */
+				 NULL, /* mask */
+				 sb->pm_image, /* dest */
+				 0, 0, /* src_x, src_y */
+				 0, 0, /* mask_x, mask_y */
+				 0, 0, /* dest_x, dest_y */
+				 so->shm.width, /* width */
+				 so->shm.height /* height */);
+
+	pixman_image_set_transform(cache_image, NULL);
+	pixman_image_set_clip_region32(sb->pm_image, NULL);
+
+	pixman_region32_copy(&sb->commit_damage, &sb->damage);
+	pixman_region32_fini(&sb->damage);
+	pixman_region32_init(&sb->damage);
+}
+
+static void *
+shared_output_thread(void *data)
+{
+	struct shared_output *so = data;
+	struct ss_frame *frame;
+	struct ss_shm_buffer *sb;
+	char c = 0;
+
+	pthread_mutex_lock(&so->thread.mutex);
+	for (;;) {
+		while (!so->thread.quit && so->thread.count == 0 &&
+		       !(so->thread.cache_dirty && !so->shm.ready &&
+			 !wl_list_empty(&so->shm.free_buffers)))
+			pthread_cond_wait(&so->thread.cond, &so->thread.mutex);
+
+		if (so->thread.quit)
+			break;
+
+		/* Catch up with all queued frames before painting, so a
+		 * slow parent costs frames but never latency. */
+		if (so->thread.count > 0) {
+			frame = &so->thread.queue[so->thread.head];
+			pthread_mutex_unlock(&so->thread.mutex);
+
+			shared_output_apply_frame(so, frame);
+
+			pthread_mutex_lock(&so->thread.mutex);
+			so->thread.head = (so->thread.head + 1) %
+					  SHARE_QUEUE_LENGTH;
+			so->thread.count--;
+			so->thread.cache_dirty = true;
+			so->thread.frames_applied++;
+			continue;
+		}
+
+		sb = container_of(so->shm.free_buffers.next,
+				  struct ss_shm_buffer, free_link);
+		wl_list_remove(&sb->free_link);
+		wl_list_init(&sb->free_link);
+		so->thread.cache_dirty = false;
+		so->thread.frames_coalesced += so->thread.frames_applied - 1;
+		so->thread.frames_applied = 0;
+		pthread_mutex_unlock(&so->thread.mutex);
+
+		shared_output_paint_buffer(so, sb);
+
+		pthread_mutex_lock(&so->thread.mutex);
+		so->shm.ready = sb;
+		if (write(so->thread.writefd, &c, 1) < 0)
+			weston_log("screen share: failed to signal a frame\n");
+	}
+	pthread_mutex_unlock(&so->thread.mutex);
+
+	return NULL;
+}
+
+static int
+shared_output_start_thread(struct shared_output *so)
+{
+	so->thread.quit = false;
+
+	if (thread_create_masked(&so->thread.thread, shared_output_thread,
+				 so, 0) != 0) {
+		weston_log("Screen share failed: cannot create thread\n");
 		return -1;
 	}
 
-	so->tmp_data_size = size;
+	so->thread.running = true;
 
 	return 0;
 }
 
+static void
+shared_output_stop_thread(struct shared_output *so)
+{
+	if (!so->thread.running)
+		return;
+
+	pthread_mutex_lock(&so->thread.mutex);
+	so->thread.quit = true;
+	pthread_cond_signal(&so->thread.cond);
+	pthread_mutex_unlock(&so->thread.mutex);
+
+	pthread_join(so->thread.thread, NULL);
+	so->thread.running = false;
+
+	/* Queued and unpainted frames are lost, repaints after a restart
+	 * start over with full damage. */
+	so->frames_dropped += so->thread.count + so->thread.frames_applied +
+			      so->thread.frames_coalesced;
+	so->thread.head = 0;
+	so->thread.count = 0;
+	so->thread.cache_dirty = false;
+	so->thread.frames_coalesced = 0;
+	so->thread.frames_applied = 0;
+}
+
+/* Drops everything sized after the output and starts over, on the
+ * first repaint and whenever the output size changes. */
+static int
+shared_output_reset(struct shared_output *so)
+{
+	struct ss_shm_buffer *sb, *bnext;
+	int32_t width, height;
+	int i;
+
+	shared_output_stop_thread(so);
+
+	/* Destroy free buffers and the one that was never attached */
+	wl_list_for_each_safe(sb, bnext, &so->shm.free_buffers, free_link)
+		ss_shm_buffer_destroy(sb);
+	if (so->shm.ready)
+		ss_shm_buffer_destroy(so->shm.ready);
+	so->shm.ready = NULL;
+
+	/* Orphan in-use buffers so they get destroyed */
+	wl_list_for_each_safe(sb, bnext, &so->shm.buffers, link) {
+		sb->output = NULL;
+		wl_list_remove(&sb->link);
+		wl_list_init(&sb->link);
+	}
+
+	so->shm.width = so->output->width;
+	so->shm.height = so->output->height;
+	for (i = 0; i < SHARE_BUFFER_COUNT; i++)
+		if (!shared_output_create_shm_buffer(so))
+			return -1;
+
+	width = so->output->current_mode->width;
+	height = so->output->current_mode->height;
+	if (so->thread.cache_image)
+		pixman_image_unref(so->thread.cache_image);
+	so->thread.cache_image =
+		pixman_image_create_bits(PIXMAN_a8r8g8b8,
+					 width, height, NULL, width * 4);
+	if (!so->thread.cache_image)
+		return -1;
+	so->mode_width = width;
+	so->mode_height = height;
+
+	pixman_region32_fini(&so->backlog);
+	pixman_region32_init_rect(&so->backlog, 0, 0,
+				  so->output->width, so->output->height);
+
+	return shared_output_start_thread(so);
+}
+
 static void
 shared_output_update(struct shared_output *so);
 
@@ -624,51 +853,29 @@ static const struct wl_callback_listener shared_output_frame_listener = {
 	shared_output_frame_callback
 };
 
+/* Attaches the buffer the share thread has painted, if any, unless
+ * the parent has not shown the previous one yet. */
 static void
 shared_output_update(struct shared_output *so)
 {
 	struct ss_shm_buffer *sb;
 	pixman_box32_t *r;
 	int i, nrects;
-	pixman_transform_t transform;
 
-	/* Only update if we need to */
-	if (!so->cache_dirty || so->parent.frame_cb)
+	if (so->parent.frame_cb)
 		return;
 
-	sb = shared_output_get_shm_buffer(so);
-	if (sb == NULL) {
-		shared_output_destroy(so);
-		return;
-	}
-
-	output_compute_transform(so->output, &transform);
-	pixman_image_set_transform(so->cache_image, &transform);
-
-	pixman_image_set_clip_region32(sb->pm_image, &sb->damage);
-
-	if (so->output->current_scale == 1) {
-		pixman_image_set_filter(so->cache_image,
-					PIXMAN_FILTER_NEAREST, NULL, 0);
-	} else {
-		pixman_image_set_filter(so->cache_image,
-					PIXMAN_FILTER_BILINEAR, NULL, 0);
-	}
-
-	pixman_image_composite32(PIXMAN_OP_SRC,
-				 so->cache_image, /* src */
-				 NULL, /* mask */
-				 sb->pm_image, /* dest */
-				 0, 0, /* src_x, src_y */
-				 0, 0, /* mask_x, mask_y */
-				 0, 0, /* dest_x, dest_y */
-				 so->output->width, /* width */
-				 so->output->height /* height */);
+	pthread_mutex_lock(&so->thread.mutex);
+	sb = so->shm.ready;
+	so->shm.ready = NULL;
+	if (sb)
+		pthread_cond_signal(&so->thread.cond);
+	pthread_mutex_unlock(&so->thread.mutex);
 
-	pixman_image_set_transform(sb->pm_image, NULL);
-	pixman_image_set_clip_region32(sb->pm_image, NULL);
+	if (!sb)
+		return;
 
-	r = pixman_region32_rectangles(&sb->damage, &nrects);
+	r = pixman_region32_rectangles(&sb->commit_damage, &nrects);
 	for (i = 0; i < nrects; ++i)
 		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
 				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
@@ -680,12 +887,23 @@ shared_output_update(struct shared_output *so)
 				 &shared_output_frame_listener, so);
 
 	wl_surface_commit(so->parent.surface);
-	wl_callback_destroy(wl_display_sync(so->parent.display));
 	wl_display_flush(so->parent.display);
 
-	/* Clear the buffer damage */
-	pixman_region32_fini(&sb->damage);
-	pixman_region32_init(&sb->damage);
+	so->frames_shared++;
+}
+
+static int
+shared_output_handle_ready(int fd, uint32_t mask, void *data)
+{
+	struct shared_output *so = data;
+	char buf[16];
+
+	if (read(fd, buf, sizeof buf) < 0)
+		weston_log("screen share: failed to read frame signal\n");
+
+	shared_output_update(so);
+
+	return 1;
 }
 
 static void
@@ -800,95 +1018,192 @@ struct zwp_fullscreen_shell_mode_feedback_v1_listener mode_feedback_listener = {
 	mode_feedback_ok,
 };
 
+static int
+ss_frame_ensure_data(struct ss_frame *frame, pixman_region32_t *region)
+{
+	pixman_box32_t *r;
+	size_t size = 0;
+	int i, nrects;
+
+	r = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; ++i)
+		size += 4 * (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	if (frame->data != NULL && size <= frame->data_size)
+		return 0;
+
+	free(frame->data);
+	frame->data = malloc(size);
+	if (frame->data == NULL) {
+		frame->data_size = 0;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	frame->data_size = size;
+
+	return 0;
+}
+
+static void
+shared_output_free(struct shared_output *so);
+
+/* Hands a frame to the share thread once all its rects are back; a
+ * frame that could not be read entirely is handed over empty and its
+ * damage goes to the backlog. */
+static void
+ss_frame_unref(struct ss_frame *frame)
+{
+	struct shared_output *so = frame->so;
+
+	if (--frame->pending > 0)
+		return;
+
+	so->reading--;
+	if (so->destroyed) {
+		if (so->reading == 0)
+			shared_output_free(so);
+		return;
+	}
+
+	if (frame->failed) {
+		pixman_region32_union(&so->backlog, &so->backlog,
+				      &frame->damage);
+		pixman_region32_clear(&frame->damage);
+		pixman_region32_clear(&frame->buffer_damage);
+	}
+
+	pthread_mutex_lock(&so->thread.mutex);
+	so->thread.count++;
+	pthread_cond_signal(&so->thread.cond);
+	pthread_mutex_unlock(&so->thread.mutex);
+}
+
+static void
+ss_frame_read_done(void *data, const void *pixels, int32_t stride)
+{
+	struct ss_frame *frame = data;
+	pixman_box32_t *r;
+	const uint8_t *src = pixels;
+	int32_t width, height, i, nrects;
+
+	/* Rects come back in the order they were requested. */
+	r = pixman_region32_rectangles(&frame->buffer_damage, &nrects);
+	r += frame->n_read++;
+	width = r->x2 - r->x1;
+	height = r->y2 - r->y1;
+
+	if (pixels == NULL) {
+		frame->failed = true;
+	} else if (!frame->failed) {
+		for (i = 0; i < height; i++) {
+			memcpy(frame->next, src, width * 4);
+			frame->next += width;
+			src += stride;
+		}
+	}
+
+	ss_frame_unref(frame);
+}
+
+/* Queues read-backs of the damaged rects, one after the other; the
+ * frame goes to the share thread when the last one completes. */
 static void
 shared_output_repainted(struct wl_listener *listener, void *data)
 {
 	struct shared_output *so =
 		container_of(listener, struct shared_output, frame_listener);
+	struct weston_output *output = so->output;
 	pixman_region32_t damage;
-	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
-	int i, nrects, do_yflip;
+	struct ss_frame *frame;
+	int i, nrects, full;
 	pixman_box32_t *r;
-	uint32_t *cache_data;
 
-	/* Damage in output coordinates */
-	pixman_region32_init(&damage);
-	pixman_region32_intersect(&damage, &so->output->region,
-				  &so->output->previous_damage);
-	pixman_region32_translate(&damage, -so->output->x, -so->output->y);
-
-	/* Apply damage to all buffers */
-	wl_list_for_each(sb, &so->shm.buffers, link)
-		pixman_region32_union(&sb->damage, &sb->damage, &damage);
-
-	/* Transform to buffer coordinates */
-	weston_transformed_region(so->output->width, so->output->height,
-				  so->output->transform,
-				  so->output->current_scale,
-				  &damage, &damage);
-
-	width = so->output->current_mode->width;
-	height = so->output->current_mode->height;
-	stride = width;
-
-	if (!so->cache_image ||
-	    pixman_image_get_width(so->cache_image) != width ||
-	    pixman_image_get_height(so->cache_image) != height) {
-		if (so->cache_image)
-			pixman_image_unref(so->cache_image);
-
-		so->cache_image =
-			pixman_image_create_bits(PIXMAN_a8r8g8b8,
-						 width, height, NULL,
-						 stride);
-		if (!so->cache_image) {
+	if (so->shm.width != output->width ||
+	    so->shm.height != output->height ||
+	    so->mode_width != output->current_mode->width ||
+	    so->mode_height != output->current_mode->height) {
+		/* Frames in flight still have the old size; the reset
+		 * starts over with full damage anyway. */
+		if (so->reading > 0) {
+			weston_output_schedule_repaint(output);
+			return;
+		}
+		if (shared_output_reset(so) < 0) {
 			shared_output_destroy(so);
 			return;
 		}
+	}
 
+	/* Damage in output coordinates */
+	pixman_region32_init(&damage);
+	pixman_region32_intersect(&damage, &output->region,
+				  &output->previous_damage);
+	pixman_region32_translate(&damage, -output->x, -output->y);
+	pixman_region32_union(&damage, &damage, &so->backlog);
+
+	if (!pixman_region32_not_empty(&damage)) {
 		pixman_region32_fini(&damage);
-		pixman_region32_init_rect(&damage, 0, 0, width, height);
+		return;
 	}
 
-	if (shared_output_ensure_tmp_data(so, &damage) < 0) {
-		shared_output_destroy(so);
+	pthread_mutex_lock(&so->thread.mutex);
+	full = so->thread.count + so->reading == SHARE_QUEUE_LENGTH;
+	frame = &so->thread.queue[(so->thread.head + so->thread.count +
+				   so->reading) % SHARE_QUEUE_LENGTH];
+	pthread_mutex_unlock(&so->thread.mutex);
+
+	if (full) {
+		pixman_region32_copy(&so->backlog, &damage);
+		pixman_region32_fini(&damage);
+		so->frames_dropped++;
 		return;
 	}
 
-	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	pixman_region32_copy(&frame->damage, &damage);
+	pixman_region32_fini(&damage);
 
-	cache_data = pixman_image_get_data(so->cache_image);
-	r = pixman_region32_rectangles(&damage, &nrects);
-	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
+	/* Transform to buffer coordinates */
+	weston_transformed_region(output->width, output->height,
+				  output->transform,
+				  output->current_scale,
+				  &frame->damage, &frame->buffer_damage);
 
-		if (do_yflip) {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, so->output->current_mode->height - r[i].y2,
-				width, height);
-
-			pixman_blt(so->tmp_data, cache_data, -width, stride,
-				   32, 32, 0, 1 - height, x, y, width, height);
-		} else {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, y, width, height);
-
-			pixman_blt(so->tmp_data, cache_data, width, stride,
-				   32, 32, 0, 0, x, y, width, height);
-		}
+	if (ss_frame_ensure_data(frame, &frame->buffer_damage) < 0) {
+		shared_output_destroy(so);
+		return;
 	}
 
-	pixman_region32_fini(&damage);
+	output_compute_transform(output, &frame->transform);
+	frame->scale = output->current_scale;
 
-	so->cache_dirty = 1;
+	frame->so = so;
+	frame->next = frame->data;
+	frame->n_read = 0;
+	frame->failed = false;
 
-	shared_output_update(so);
+	pixman_region32_fini(&so->backlog);
+	pixman_region32_init(&so->backlog);
+	so->reading++;
+
+	/* Held until every read-back is queued, as they may also
+	 * complete immediately. */
+	frame->pending = 1;
+	r = pixman_region32_rectangles(&frame->buffer_damage, &nrects);
+	for (i = 0; i < nrects; ++i) {
+		frame->pending++;
+		if (weston_output_read_pixels_async(output, PIXMAN_a8r8g8b8,
+						    r[i].x1, r[i].y1,
+						    r[i].x2 - r[i].x1,
+						    r[i].y2 - r[i].y1,
+						    ss_frame_read_done,
+						    frame) < 0) {
+			frame->pending--;
+			frame->failed = true;
+			break;
+		}
+	}
+	ss_frame_unref(frame);
 }
 
 static struct shared_output *
@@ -898,6 +1213,8 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	struct wl_event_loop *loop;
 	struct ss_seat *seat, *tmp;
 	int epoll_fd;
+	int fds[2];
+	int i;
 
 	so = zalloc(sizeof *so);
 	if (so == NULL)
@@ -968,21 +1285,49 @@ shared_output_create(struct weston_output *output, int parent_fd)
 		goto err_display;
 	}
 
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		weston_log("Screen share failed: %m\n");
+		goto err_event_source;
+	}
+	so->thread.readfd = fds[0];
+	so->thread.writefd = fds[1];
+
+	so->thread.source =
+		wl_event_loop_add_fd(loop, so->thread.readfd, WL_EVENT_READABLE,
+				     shared_output_handle_ready, so);
+	if (!so->thread.source) {
+		weston_log("Screen share failed: %m\n");
+		goto err_pipe;
+	}
+
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
 
+	pthread_mutex_init(&so->thread.mutex, NULL);
+	pthread_cond_init(&so->thread.cond, NULL);
+	for (i = 0; i < SHARE_QUEUE_LENGTH; i++) {
+		pixman_region32_init(&so->thread.queue[i].damage);
+		pixman_region32_init(&so->thread.queue[i].buffer_damage);
+	}
+	pixman_region32_init(&so->backlog);
+
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
 	wl_signal_add(&so->output->destroy_signal, &so->output_destroyed);
 
 	so->frame_listener.notify = shared_output_repainted;
 	wl_signal_add(&output->frame_signal, &so->frame_listener);
-	output->disable_planes++;
+	weston_output_capture_begin(output);
 	weston_output_damage(output);
 
 	return so;
 
+err_pipe:
+	close(so->thread.readfd);
+	close(so->thread.writefd);
+err_event_source:
+	wl_event_source_remove(so->event_source);
 err_display:
 	wl_list_for_each_safe(seat, tmp, &so->seat_list, link)
 		ss_seat_destroy(seat);
@@ -999,7 +1344,12 @@ shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
 
-	so->output->disable_planes--;
+	weston_output_capture_end(so->output);
+
+	shared_output_stop_thread(so);
+
+	weston_log("Screen share: %u frames shared, %u dropped\n",
+		   so->frames_shared, so->frames_dropped);
 
 	wl_list_for_each_safe(buffer, bnext, &so->shm.buffers, link)
 		ss_shm_buffer_destroy(buffer);
@@ -1009,11 +1359,38 @@ shared_output_destroy(struct shared_output *so)
 	wl_display_disconnect(so->parent.display);
 	wl_event_source_remove(so->event_source);
 
+	wl_event_source_remove(so->thread.source);
+	close(so->thread.readfd);
+	close(so->thread.writefd);
+
 	wl_list_remove(&so->output_destroyed.link);
 	wl_list_remove(&so->frame_listener.link);
 
-	pixman_image_unref(so->cache_image);
-	free(so->tmp_data);
+	/* The frames being read back are freed with the last one. */
+	if (so->reading > 0) {
+		so->destroyed = true;
+		return;
+	}
+
+	shared_output_free(so);
+}
+
+static void
+shared_output_free(struct shared_output *so)
+{
+	int i;
+
+	for (i = 0; i < SHARE_QUEUE_LENGTH; i++) {
+		pixman_region32_fini(&so->thread.queue[i].damage);
+		pixman_region32_fini(&so->thread.queue[i].buffer_damage);
+		free(so->thread.queue[i].data);
+	}
+	pixman_region32_fini(&so->backlog);
+	pthread_cond_destroy(&so->thread.cond);
+	pthread_mutex_destroy(&so->thread.mutex);
+
+	if (so->thread.cache_image)
+		pixman_image_unref(so->thread.cache_image);
 
 	free(so);
 }
@@ -39,6 +39,7 @@
 #include <sys/mman.h>
 #include <dlfcn.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -50,6 +51,7 @@
 #include "compositor.h"
 #include "compositor-drm.h"
 #include "shared/helpers.h"
+#include "shared/thread-util.h"
 #include "shared/timespec-util.h"
 #if defined(ENABLE_OPENGL)
 #include "gl-renderer.h"
@@ -76,6 +78,14 @@
 #define DRM_CLIENT_CAP_UNIVERSAL_PLANES 2
 #endif
 
+#ifndef DRM_CLIENT_CAP_WRITEBACK_CONNECTORS
+#define DRM_CLIENT_CAP_WRITEBACK_CONNECTORS 5
+#endif
+
+#ifndef DRM_MODE_CONNECTOR_WRITEBACK
+#define DRM_MODE_CONNECTOR_WRITEBACK 18
+#endif
+
 #ifndef DRM_CAP_CURSOR_WIDTH
 #define DRM_CAP_CURSOR_WIDTH 0x8
 #endif
@@ -198,6 +208,9 @@ enum wdrm_connector_property {
 	WDRM_CONNECTOR_EDID = 0,
 	WDRM_CONNECTOR_DPMS,
 	WDRM_CONNECTOR_CRTC_ID,
+	WDRM_CONNECTOR_WRITEBACK_PIXEL_FORMATS,
+	WDRM_CONNECTOR_WRITEBACK_FB_ID,
+	WDRM_CONNECTOR_WRITEBACK_OUT_FENCE_PTR,
 	WDRM_CONNECTOR__COUNT
 };
 
@@ -205,6 +218,11 @@ static const struct drm_property_info connector_props[] = {
 	[WDRM_CONNECTOR_EDID] = { .name = "EDID" },
 	[WDRM_CONNECTOR_DPMS] = { .name = "DPMS" },
 	[WDRM_CONNECTOR_CRTC_ID] = { .name = "CRTC_ID", },
+	[WDRM_CONNECTOR_WRITEBACK_PIXEL_FORMATS] =
+		{ .name = "WRITEBACK_PIXEL_FORMATS", },
+	[WDRM_CONNECTOR_WRITEBACK_FB_ID] = { .name = "WRITEBACK_FB_ID", },
+	[WDRM_CONNECTOR_WRITEBACK_OUT_FENCE_PTR] =
+		{ .name = "WRITEBACK_OUT_FENCE_PTR", },
 };
 
 /**
@@ -238,6 +256,37 @@ enum drm_state_apply_mode {
 	DRM_STATE_TEST_ONLY, /**< test if the state can be applied */
 };
 
+/* Entries kept by each drm_plane_cache. */
+#define DRM_PLANE_CACHE_SIZE 8
+
+/* Repaints after which a scene that could not go on planes alone is
+ * tried again, in case other outputs freed resources meanwhile. */
+#define DRM_PLANE_CACHE_RETRY 120
+
+/**
+ * One remembered outcome, keyed by an opaque byte string.
+ */
+struct drm_plane_cache_entry {
+	struct wl_array key; /**< size 0 when the entry is unused */
+	int result;
+	uint32_t stored; /**< drm_plane_cache::clock when stored */
+	uint32_t used; /**< drm_plane_cache::clock when last looked up */
+};
+
+/**
+ * Small LRU cache of plane assignment outcomes, so that repaints of an
+ * unchanged scene can skip work whose answer is already known.
+ *
+ * The backend keeps one for TEST_ONLY commits, keyed by the plane
+ * configuration of a whole pending state, and each output keeps one for
+ * drm_output_propose_state() in planes-only mode, keyed by the views on
+ * the output.
+ */
+struct drm_plane_cache {
+	struct drm_plane_cache_entry entries[DRM_PLANE_CACHE_SIZE];
+	uint32_t clock;
+};
+
 struct drm_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -280,6 +329,7 @@ struct drm_backend {
 
 	bool universal_planes;
 	bool atomic_modeset;
+	bool writeback_connectors;
 
 	int use_pixman;
 #if defined(ENABLE_IMXG2D)
@@ -294,6 +344,78 @@ struct drm_backend {
 	uint32_t pageflip_timeout;
 
 	bool shutting_down;
+
+	/* TEST_ONLY outcomes, and the key being looked up */
+	struct drm_plane_cache test_cache;
+	struct wl_array test_key;
+
+	/* NULL if hotplug probes run synchronously */
+	struct drm_prober *prober;
+
+	/* drm_writeback::link */
+	struct wl_list writeback_list;
+};
+
+/* Cursor images kept uploaded per output, so that a cursor cycling
+ * through a few images, like an animated theme cursor, flips between
+ * BOs instead of rewriting one. */
+#define DRM_CURSOR_CACHE_SIZE 8
+
+struct drm_cursor_image {
+	struct drm_fb *fb;
+	/* What fb holds, cursor_width x cursor_height; NULL if unknown */
+	uint32_t *pixels;
+	uint64_t hash;
+	uint32_t last_used;
+};
+
+/* Writeback buffers per output: one being attached to a repaint, one
+ * being written by the hardware, and one being read by captures. */
+#define DRM_WRITEBACK_BUFFERS 3
+
+/**
+ * A writeback connector, which writes what a CRTC scans out to memory
+ *
+ * Each one can serve one output whose CRTC it can be routed to, claimed
+ * when the output is created. Only XRGB8888 writeback is used.
+ */
+struct drm_writeback {
+	struct drm_backend *backend;
+	uint32_t connector_id;
+	uint32_t possible_crtcs;
+	struct drm_property_info props[WDRM_CONNECTOR__COUNT];
+	struct drm_output *output; /**< claiming output, or NULL */
+	struct wl_list link; /**< drm_backend::writeback_list */
+};
+
+/**
+ * A weston_output::queue_capture() request waiting for a writeback
+ */
+struct drm_writeback_capture {
+	bool failed; /**< queued behind a writeback of an older frame */
+	pixman_format_code_t format;
+	uint32_t x, y;
+	uint32_t width, height;
+	weston_read_pixels_done_func_t done;
+	void *data;
+	struct wl_list link; /**< drm_writeback_buffer::capture_list */
+};
+
+/**
+ * Destination of one writeback job
+ *
+ * A buffer is busy from being attached to a repaint until the kernel
+ * signals the writeback fence and the waiting captures have been given
+ * the pixels.
+ */
+struct drm_writeback_buffer {
+	struct drm_output *output;
+	struct drm_fb *fb;
+	bool busy;
+	bool submitted;
+	int32_t fence_fd; /**< written by the kernel on commit */
+	struct wl_event_source *fence_source;
+	struct wl_list capture_list;
 };
 
 struct drm_mode {
@@ -341,6 +463,51 @@ struct drm_edid {
 	char serial_number[13];
 };
 
+/**
+ * A connected connector, as found by a connector probe
+ */
+struct drm_probe_connector {
+	uint32_t connector_id;
+	drmModeConnector *connector; /**< NULL once handed to an output */
+	struct drm_edid edid;
+	bool has_edid;
+};
+
+/**
+ * Result of probing all connectors of the device
+ *
+ * Probing makes the kernel poll every connector and read EDID over DDC,
+ * which can take tens of milliseconds per connector. It only needs the
+ * DRM fd, so on hotplug it runs on the prober thread and the compositor
+ * merely creates and destroys outputs from the result.
+ */
+struct drm_probe {
+	drmModeRes *resources;
+	struct drm_probe_connector *connectors;
+	int count_connectors;
+};
+
+/**
+ * Thread probing connectors on hotplug
+ *
+ * Requests coalesce: hotplug events arriving while a probe runs cause a
+ * single new probe, and only the newest result is ever applied.
+ */
+struct drm_prober {
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool pending;
+	bool quit;
+	struct drm_probe *result; /**< protected by the mutex */
+
+	int readfd, writefd;
+	struct wl_event_source *source;
+	/* udev device of the last hotplug event, for backlight lookup */
+	struct udev_device *drm_device;
+};
+
 /**
  * Pending state holds one or more drm_output_state structures, collected from
  * performing repaint. This pending state is transient, and only lives between
@@ -368,6 +535,11 @@ struct drm_output_state {
 	struct wl_list link;
 	enum dpms_enum dpms;
 	struct wl_list plane_list;
+
+	/* Whether the output's writeback connector is routed to the CRTC,
+	 * and the buffer it writes this frame into, if any. */
+	bool writeback_bound;
+	struct drm_writeback_buffer *writeback;
 };
 
 /**
@@ -459,7 +631,8 @@ struct drm_output {
 	int disable_pending;
 	int dpms_off_pending;
 
-	struct drm_fb *gbm_cursor_fb[2];
+	struct drm_cursor_image cursor_images[DRM_CURSOR_CACHE_SIZE];
+	uint32_t cursor_clock;
 	struct drm_plane *cursor_plane;
 	struct weston_view *cursor_view;
 	int current_cursor;
@@ -488,6 +661,22 @@ struct drm_output {
 	struct wl_listener recorder_frame_listener;
 
 	struct wl_event_source *pageflip_timer;
+
+	/* Planes-only proposals, and the key being looked up */
+	struct drm_plane_cache scene_cache;
+	struct wl_array scene_key;
+	/* The kernel refused the last commit, so the core draws the next
+	 * frame with the renderer alone; see drm_repaint_flush(). */
+	bool planes_fallback;
+
+	/* Writeback for captures; see drm_output_queue_capture() */
+	struct drm_writeback *writeback;
+	struct drm_writeback_buffer writeback_buffers[DRM_WRITEBACK_BUFFERS];
+	/* Attached to the repaint in progress, and last submitted */
+	struct drm_writeback_buffer *writeback_pending;
+	struct drm_writeback_buffer *writeback_last;
+	/* Views on hardware planes in the last written back frame */
+	pixman_region32_t writeback_planes;
 };
 
 #if defined(ENABLE_OPENGL)
@@ -828,6 +1017,19 @@ drm_output_find_by_crtc(struct drm_backend *b, uint32_t crtc_id)
 	return NULL;
 }
 
+static struct drm_writeback *
+drm_writeback_find(struct drm_backend *b, uint32_t connector_id)
+{
+	struct drm_writeback *wb;
+
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (wb->connector_id == connector_id)
+			return wb;
+	}
+
+	return NULL;
+}
+
 static struct drm_output *
 drm_output_find_by_connector(struct drm_backend *b, uint32_t connector_id)
 {
@@ -989,7 +1191,7 @@ drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 	if (ret)
 		goto err_add_fb;
 
-	fb->map = mmap(NULL, fb->size, PROT_WRITE,
+	fb->map = mmap(NULL, fb->size, PROT_READ | PROT_WRITE,
 		       MAP_SHARED, b->drm.fd, map_arg.offset);
 	if (fb->map == MAP_FAILED)
 		goto err_add_fb;
@@ -1512,6 +1714,285 @@ drm_output_state_get_plane(struct drm_output_state *state_output,
 	return drm_plane_state_alloc(state_output, plane);
 }
 
+/**
+ * Give one capture its rectangle of a finished writeback
+ *
+ * @param capture The capture to complete
+ * @param src The written back frame, or NULL if writeback failed
+ */
+static void
+drm_writeback_capture_deliver(struct drm_writeback_capture *capture,
+			      pixman_image_t *src)
+{
+	pixman_image_t *dst;
+	uint8_t *pixels;
+	int32_t stride;
+
+	if (!src || capture->failed) {
+		capture->done(capture->data, NULL, 0);
+		return;
+	}
+
+	if (capture->format == PIXMAN_x8r8g8b8) {
+		stride = pixman_image_get_stride(src);
+		pixels = (uint8_t *) pixman_image_get_data(src);
+		pixels += capture->y * stride + capture->x * 4;
+		capture->done(capture->data, pixels, stride);
+		return;
+	}
+
+	/* Converting also makes the alpha channel, which writeback leaves
+	 * undefined, opaque. */
+	dst = pixman_image_create_bits(capture->format,
+				       capture->width, capture->height,
+				       NULL, 0);
+	if (!dst) {
+		capture->done(capture->data, NULL, 0);
+		return;
+	}
+
+	pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+				 capture->x, capture->y, 0, 0, 0, 0,
+				 capture->width, capture->height);
+	capture->done(capture->data, pixman_image_get_data(dst),
+		      pixman_image_get_stride(dst));
+	pixman_image_unref(dst);
+}
+
+/**
+ * Complete the captures waiting for a writeback buffer, and free it
+ *
+ * @param buffer The writeback buffer
+ * @param ok Whether the hardware wrote the buffer; if not, the captures
+ * are told their read-back failed
+ */
+static void
+drm_writeback_buffer_complete(struct drm_writeback_buffer *buffer, bool ok)
+{
+	struct drm_writeback_capture *capture, *tmp;
+	struct drm_output *output = buffer->output;
+	struct drm_fb *fb = buffer->fb;
+	pixman_image_t *src = NULL;
+
+	if (buffer->fence_source)
+		wl_event_source_remove(buffer->fence_source);
+	buffer->fence_source = NULL;
+	if (buffer->fence_fd >= 0)
+		close(buffer->fence_fd);
+	buffer->fence_fd = -1;
+
+	buffer->busy = false;
+	buffer->submitted = false;
+	if (output->writeback_pending == buffer)
+		output->writeback_pending = NULL;
+	if (output->writeback_last == buffer)
+		output->writeback_last = NULL;
+
+	if (ok)
+		src = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+					       fb->width, fb->height,
+					       fb->map, fb->strides[0]);
+
+	wl_list_for_each_safe(capture, tmp, &buffer->capture_list, link) {
+		wl_list_remove(&capture->link);
+		drm_writeback_capture_deliver(capture, src);
+		free(capture);
+	}
+
+	if (src)
+		pixman_image_unref(src);
+}
+
+#ifdef HAVE_DRM_ATOMIC
+static int
+drm_writeback_fence_handler(int fd, uint32_t mask, void *data)
+{
+	struct drm_writeback_buffer *buffer = data;
+
+	drm_writeback_buffer_complete(buffer, true);
+
+	return 0;
+}
+
+/**
+ * Start waiting for a writeback buffer attached to a successful commit
+ *
+ * The kernel signals the out-fence it returned once the frame has been
+ * written.
+ */
+static void
+drm_writeback_buffer_submit(struct drm_writeback_buffer *buffer)
+{
+	struct drm_output *output = buffer->output;
+	struct wl_event_loop *loop;
+
+	loop = wl_display_get_event_loop(output->base.compositor->wl_display);
+
+	buffer->submitted = true;
+	output->writeback_last = buffer;
+
+	if (buffer->fence_fd >= 0)
+		buffer->fence_source =
+			wl_event_loop_add_fd(loop, buffer->fence_fd,
+					     WL_EVENT_READABLE,
+					     drm_writeback_fence_handler,
+					     buffer);
+	if (!buffer->fence_source)
+		drm_writeback_buffer_complete(buffer, false);
+}
+#endif
+
+/**
+ * Take a free writeback buffer of the output, sized for the current mode
+ *
+ * @returns The buffer, or NULL if all are busy or allocation failed
+ */
+static struct drm_writeback_buffer *
+drm_output_get_writeback_buffer(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_mode *mode = output->base.current_mode;
+	struct drm_writeback_buffer *buffer = NULL;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(output->writeback_buffers); i++) {
+		if (!output->writeback_buffers[i].busy) {
+			buffer = &output->writeback_buffers[i];
+			break;
+		}
+	}
+	if (!buffer)
+		return NULL;
+
+	if (buffer->fb && (buffer->fb->width != mode->width ||
+			   buffer->fb->height != mode->height)) {
+		drm_fb_unref(buffer->fb);
+		buffer->fb = NULL;
+	}
+
+	if (!buffer->fb) {
+		buffer->fb = drm_fb_create_dumb(b, mode->width, mode->height,
+					       DRM_FORMAT_XRGB8888);
+		if (!buffer->fb)
+			return NULL;
+	}
+
+	buffer->busy = true;
+	buffer->fence_fd = -1;
+
+	return buffer;
+}
+
+/**
+ * Queue a capture of the frame being repainted, planes included
+ *
+ * Implements weston_output::queue_capture. It is called from the frame
+ * signal, i.e. from within drm_output_render(), and so gets the
+ * writeback attached to that repaint. If no buffer could be attached
+ * but a writeback is still in flight, the capture fails right after that
+ * one completes, so that captures stay in order. With neither, it fails
+ * at once: the renderer's frame lacks the planes, and is stale when the
+ * frame is scanned out from a client buffer.
+ */
+static int
+drm_output_queue_capture(struct weston_output *output_base,
+			 pixman_format_code_t format,
+			 uint32_t x, uint32_t y,
+			 uint32_t width, uint32_t height,
+			 weston_read_pixels_done_func_t done,
+			 void *data)
+{
+	struct drm_output *output = to_drm_output(output_base);
+	struct drm_writeback_buffer *buffer = output->writeback_pending;
+	struct drm_writeback_capture *capture;
+	bool failed = false;
+
+	if (buffer) {
+		if (x + width > (uint32_t) buffer->fb->width ||
+		    y + height > (uint32_t) buffer->fb->height)
+			return -1;
+	} else {
+		buffer = output->writeback_last;
+		failed = true;
+	}
+	if (!buffer) {
+		done(data, NULL, 0);
+		return 0;
+	}
+
+	capture = zalloc(sizeof *capture);
+	if (!capture)
+		return -1;
+
+	capture->failed = failed;
+	capture->format = format;
+	capture->x = x;
+	capture->y = y;
+	capture->width = width;
+	capture->height = height;
+	capture->done = done;
+	capture->data = data;
+	wl_list_insert(buffer->capture_list.prev, &capture->link);
+
+	return 0;
+}
+
+/**
+ * Claim a writeback connector which can be routed to the output's CRTC
+ *
+ * If there is one, captures of the output can include plane content.
+ */
+static void
+drm_output_init_writeback(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_writeback_buffer *buffer;
+	struct drm_writeback *wb;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(output->writeback_buffers); i++) {
+		buffer = &output->writeback_buffers[i];
+		buffer->output = output;
+		buffer->fence_fd = -1;
+		wl_list_init(&buffer->capture_list);
+	}
+
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (wb->output || !(wb->possible_crtcs & (1 << output->pipe)))
+			continue;
+
+		wb->output = output;
+		output->writeback = wb;
+		output->base.queue_capture = drm_output_queue_capture;
+		return;
+	}
+}
+
+/**
+ * Fail the captures still waiting, free the writeback buffers and give
+ * up the writeback connector
+ */
+static void
+drm_output_fini_writeback(struct drm_output *output)
+{
+	struct drm_writeback_buffer *buffer;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(output->writeback_buffers); i++) {
+		buffer = &output->writeback_buffers[i];
+		if (buffer->busy)
+			drm_writeback_buffer_complete(buffer, false);
+		if (buffer->fb)
+			drm_fb_unref(buffer->fb);
+		buffer->fb = NULL;
+	}
+
+	if (output->writeback)
+		output->writeback->output = NULL;
+	output->writeback = NULL;
+	output->base.queue_capture = NULL;
+}
+
 /**
  * Allocate a new, empty drm_output_state. This should not generally be used
  * in the repaint cycle; see drm_output_state_duplicate.
@@ -1566,6 +2047,7 @@ drm_output_state_duplicate(struct drm_output_state *src,
 		wl_list_init(&dst->link);
 
 	wl_list_init(&dst->plane_list);
+	dst->writeback = NULL;
 
 	wl_list_for_each(ps, &src->plane_list, link) {
 		/* Don't carry planes which are now disabled; these should be
@@ -1596,6 +2078,10 @@ drm_output_state_free(struct drm_output_state *state)
 	wl_list_for_each_safe(ps, next, &state->plane_list, link)
 		drm_plane_state_free(ps, false);
 
+	/* Never committed, so nothing will be written to it. */
+	if (state->writeback)
+		drm_writeback_buffer_complete(state->writeback, false);
+
 	wl_list_remove(&state->link);
 
 	free(state);
@@ -1621,6 +2107,7 @@ drm_output_get_disable_state(struct drm_pending_state *pending_state,
 						  pending_state,
 						  DRM_OUTPUT_STATE_CLEAR_PLANES);
 	output_state->dpms = WESTON_DPMS_OFF;
+	output_state->writeback_bound = false;
 
 	return output_state;
 }
@@ -1697,66 +2184,207 @@ drm_pending_state_get_output(struct drm_pending_state *pending_state,
 	return NULL;
 }
 
-static int drm_pending_state_apply_sync(struct drm_pending_state *state);
-static int drm_pending_state_test(struct drm_pending_state *state);
+static void
+drm_plane_cache_init(struct drm_plane_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < DRM_PLANE_CACHE_SIZE; i++)
+		wl_array_init(&cache->entries[i].key);
+	cache->clock = 0;
+}
+
+static void
+drm_plane_cache_release(struct drm_plane_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < DRM_PLANE_CACHE_SIZE; i++)
+		wl_array_release(&cache->entries[i].key);
+}
 
 /**
- * Mark a drm_output_state (the output's last state) as complete. This handles
- * any post-completion actions such as updating the repaint timer, disabling the
- * output, and finally freeing the state.
+ * Forget every outcome in a plane cache
+ *
+ * @param cache Cache to empty
  */
 static void
-drm_output_update_complete(struct drm_output *output, uint32_t flags,
-			   unsigned int sec, unsigned int usec)
+drm_plane_cache_clear(struct drm_plane_cache *cache)
 {
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
-	struct drm_plane_state *ps;
-	struct timespec ts;
+	int i;
 
-	/* Stop the pageflip timer instead of rearming it here */
-	if (output->pageflip_timer)
-		wl_event_source_timer_update(output->pageflip_timer, 0);
+	for (i = 0; i < DRM_PLANE_CACHE_SIZE; i++)
+		cache->entries[i].key.size = 0;
+}
 
-	wl_list_for_each(ps, &output->state_cur->plane_list, link)
-		ps->complete = true;
+static struct drm_plane_cache_entry *
+drm_plane_cache_find(struct drm_plane_cache *cache, struct wl_array *key)
+{
+	struct drm_plane_cache_entry *entry;
+	int i;
 
-	drm_output_state_free(output->state_last);
-	output->state_last = NULL;
+	if (key->size == 0)
+		return NULL;
 
-	if (output->destroy_pending) {
-		output->destroy_pending = 0;
-		output->disable_pending = 0;
-		output->dpms_off_pending = 0;
-		drm_output_destroy(&output->base);
-		return;
-	} else if (output->disable_pending) {
-		output->disable_pending = 0;
-		output->dpms_off_pending = 0;
-		weston_output_disable(&output->base);
-		return;
-	} else if (output->dpms_off_pending) {
-		struct drm_pending_state *pending = drm_pending_state_alloc(b);
-		output->dpms_off_pending = 0;
-		drm_output_get_disable_state(pending, output);
-		drm_pending_state_apply_sync(pending);
-		return;
-	} else if (output->state_cur->dpms == WESTON_DPMS_OFF &&
-	           output->base.repaint_status != REPAINT_AWAITING_COMPLETION) {
-		/* DPMS can happen to us either in the middle of a repaint
-		 * cycle (when we have painted fresh content, only to throw it
-		 * away for DPMS off), or at any other random point. If the
-		 * latter is true, then we cannot go through finish_frame,
-		 * because the repaint machinery does not expect this. */
-		return;
+	for (i = 0; i < DRM_PLANE_CACHE_SIZE; i++) {
+		entry = &cache->entries[i];
+		if (entry->key.size == key->size &&
+		    memcmp(entry->key.data, key->data, key->size) == 0)
+			return entry;
 	}
 
-	ts.tv_sec = sec;
-	ts.tv_nsec = usec * 1000;
-	weston_output_finish_frame(&output->base, &ts, flags);
+	return NULL;
+}
 
-	/* We can't call this from frame_notify, because the output's
-	 * repaint needed flag is cleared just after that */
-	if (output->recorder)
+/**
+ * Look up the outcome remembered for a key
+ *
+ * Every lookup advances the cache clock, which is what
+ * DRM_PLANE_CACHE_RETRY counts.
+ *
+ * @param cache Cache to search
+ * @param key Key to look up; an empty key never matches
+ * @returns The entry for key, or NULL if there is none
+ */
+static struct drm_plane_cache_entry *
+drm_plane_cache_lookup(struct drm_plane_cache *cache, struct wl_array *key)
+{
+	struct drm_plane_cache_entry *entry;
+
+	cache->clock++;
+
+	entry = drm_plane_cache_find(cache, key);
+	if (entry)
+		entry->used = cache->clock;
+
+	return entry;
+}
+
+/**
+ * Remember the outcome for a key
+ *
+ * Replaces the entry for the same key if there is one, else an unused
+ * entry, else the least recently used one.
+ *
+ * @param cache Cache to store into
+ * @param key Key to store; an empty key is not stored
+ * @param result Outcome to remember
+ */
+static void
+drm_plane_cache_store(struct drm_plane_cache *cache, struct wl_array *key,
+		      int result)
+{
+	struct drm_plane_cache_entry *entry, *e;
+	void *data;
+	int i;
+
+	if (key->size == 0)
+		return;
+
+	entry = drm_plane_cache_find(cache, key);
+	for (i = 0; !entry && i < DRM_PLANE_CACHE_SIZE; i++) {
+		e = &cache->entries[i];
+		if (e->key.size == 0)
+			entry = e;
+	}
+	if (!entry) {
+		entry = &cache->entries[0];
+		for (i = 1; i < DRM_PLANE_CACHE_SIZE; i++) {
+			e = &cache->entries[i];
+			if ((int32_t) (e->used - entry->used) < 0)
+				entry = e;
+		}
+	}
+
+	entry->key.size = 0;
+	data = wl_array_add(&entry->key, key->size);
+	if (!data)
+		return;
+	memcpy(data, key->data, key->size);
+
+	entry->result = result;
+	entry->stored = cache->clock;
+	entry->used = cache->clock;
+}
+
+/**
+ * Forget everything the plane caches of a backend learnt
+ *
+ * Called when the kernel refuses a commit, after which none of the
+ * earlier answers can be trusted.
+ *
+ * @param b DRM backend
+ */
+static void
+drm_backend_clear_plane_caches(struct drm_backend *b)
+{
+	struct drm_output *output;
+
+	drm_plane_cache_clear(&b->test_cache);
+	wl_list_for_each(output, &b->compositor->output_list, base.link)
+		drm_plane_cache_clear(&output->scene_cache);
+}
+
+static int drm_pending_state_apply_sync(struct drm_pending_state *state);
+static int drm_pending_state_test(struct drm_pending_state *state);
+
+/**
+ * Mark a drm_output_state (the output's last state) as complete. This handles
+ * any post-completion actions such as updating the repaint timer, disabling the
+ * output, and finally freeing the state.
+ */
+static void
+drm_output_update_complete(struct drm_output *output, uint32_t flags,
+			   unsigned int sec, unsigned int usec)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane_state *ps;
+	struct timespec ts;
+
+	/* Stop the pageflip timer instead of rearming it here */
+	if (output->pageflip_timer)
+		wl_event_source_timer_update(output->pageflip_timer, 0);
+
+	wl_list_for_each(ps, &output->state_cur->plane_list, link)
+		ps->complete = true;
+
+	drm_output_state_free(output->state_last);
+	output->state_last = NULL;
+
+	if (output->destroy_pending) {
+		output->destroy_pending = 0;
+		output->disable_pending = 0;
+		output->dpms_off_pending = 0;
+		drm_output_destroy(&output->base);
+		return;
+	} else if (output->disable_pending) {
+		output->disable_pending = 0;
+		output->dpms_off_pending = 0;
+		weston_output_disable(&output->base);
+		return;
+	} else if (output->dpms_off_pending) {
+		struct drm_pending_state *pending = drm_pending_state_alloc(b);
+		output->dpms_off_pending = 0;
+		drm_output_get_disable_state(pending, output);
+		drm_pending_state_apply_sync(pending);
+		return;
+	} else if (output->state_cur->dpms == WESTON_DPMS_OFF &&
+	           output->base.repaint_status != REPAINT_AWAITING_COMPLETION) {
+		/* DPMS can happen to us either in the middle of a repaint
+		 * cycle (when we have painted fresh content, only to throw it
+		 * away for DPMS off), or at any other random point. If the
+		 * latter is true, then we cannot go through finish_frame,
+		 * because the repaint machinery does not expect this. */
+		return;
+	}
+
+	ts.tv_sec = sec;
+	ts.tv_nsec = usec * 1000;
+	weston_output_finish_frame(&output->base, &ts, flags);
+
+	/* We can't call this from frame_notify, because the output's
+	 * repaint needed flag is cleared just after that */
+	if (output->recorder)
 		weston_output_schedule_repaint(&output->base);
 }
 
@@ -1998,8 +2626,15 @@ drm_output_render(struct drm_output_state *state, pixman_region32_t *damage)
 						   output->scanout_plane);
 	if (scanout_state->fb &&
 	    scanout_state->fb->type != BUFFER_GBM_SURFACE &&
-	    scanout_state->fb->type != BUFFER_PIXMAN_DUMB)
+	    scanout_state->fb->type != BUFFER_PIXMAN_DUMB) {
+		/* Captures run from the frame signal a renderer would
+		 * emit. They get the frame from writeback if this repaint
+		 * has a buffer for it; otherwise queue_capture fails them
+		 * rather than leaving them waiting for a rendered frame. */
+		pixman_region32_copy(&output->base.previous_damage, damage);
+		wl_signal_emit(&output->base.frame_signal, &output->base);
 		return;
+	}
 
 	if (
 #if defined(ENABLE_IMXG2D)
@@ -2123,9 +2758,11 @@ drm_output_apply_state_legacy(struct drm_output_state *state)
 
 	/* If disable_planes is set then assign_planes() wasn't
 	 * called for this render, so we could still have a stale
-	 * cursor plane set up.
+	 * cursor plane set up. The same goes for captures which
+	 * cannot include planes.
 	 */
-	if (output->base.disable_planes) {
+	if (output->base.disable_planes ||
+	    (output->base.capture_planes && !output->base.queue_capture)) {
 		output->cursor_view = NULL;
 		output->cursor_plane->base.x = INT32_MIN;
 		output->cursor_plane->base.y = INT32_MIN;
@@ -2308,6 +2945,21 @@ connector_add_prop(drmModeAtomicReq *req, struct drm_output *output,
 	return (ret <= 0) ? -1 : 0;
 }
 
+static int
+writeback_add_prop(drmModeAtomicReq *req, struct drm_writeback *wb,
+		   enum wdrm_connector_property prop, uint64_t val)
+{
+	struct drm_property_info *info = &wb->props[prop];
+	int ret;
+
+	if (info->prop_id == 0)
+		return -1;
+
+	ret = drmModeAtomicAddProperty(req, wb->connector_id,
+				       info->prop_id, val);
+	return (ret <= 0) ? -1 : 0;
+}
+
 static int
 plane_add_prop(drmModeAtomicReq *req, struct drm_plane *plane,
 	       enum wdrm_plane_property prop, uint64_t val)
@@ -2341,6 +2993,47 @@ drm_mode_ensure_blob(struct drm_backend *backend, struct drm_mode *mode)
 	return ret;
 }
 
+/**
+ * Add the writeback connector routing and job of an output state
+ *
+ * Routing the connector to the CRTC or away from it needs a modeset, so
+ * once captures wanted plane content it stays routed until the output is
+ * disabled, and each frame to write back just gets a framebuffer and an
+ * out-fence.
+ */
+static int
+drm_output_apply_writeback_atomic(struct drm_output_state *state,
+				  drmModeAtomicReq *req,
+				  uint32_t *flags)
+{
+	struct drm_output *output = state->output;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_writeback *wb = output->writeback;
+	int ret = 0;
+
+	if (!wb)
+		return 0;
+
+	if (b->state_invalid ||
+	    state->writeback_bound != output->state_cur->writeback_bound) {
+		ret |= writeback_add_prop(req, wb, WDRM_CONNECTOR_CRTC_ID,
+					  state->writeback_bound ?
+					  output->crtc_id : 0);
+		*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+
+	if (state->writeback) {
+		ret |= writeback_add_prop(req, wb,
+					  WDRM_CONNECTOR_WRITEBACK_FB_ID,
+					  state->writeback->fb->fb_id);
+		ret |= writeback_add_prop(req, wb,
+					  WDRM_CONNECTOR_WRITEBACK_OUT_FENCE_PTR,
+					  (uintptr_t) &state->writeback->fence_fd);
+	}
+
+	return ret;
+}
+
 static int
 drm_output_apply_state_atomic(struct drm_output_state *state,
 			      drmModeAtomicReq *req,
@@ -2377,6 +3070,12 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 		return ret;
 	}
 
+	ret = drm_output_apply_writeback_atomic(state, req, flags);
+	if (ret != 0) {
+		weston_log("couldn't set atomic writeback state\n");
+		return ret;
+	}
+
 	wl_list_for_each(plane_state, &state->plane_list, link) {
 		struct drm_plane *plane = plane_state->plane;
 
@@ -2421,6 +3120,7 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 	struct drm_backend *b = pending_state->backend;
 	struct drm_output_state *output_state, *tmp;
 	struct drm_plane *plane;
+	struct drm_writeback *wb;
 	drmModeAtomicReq *req = drmModeAtomicAlloc();
 	uint32_t flags = 0;
 	int ret = 0;
@@ -2518,6 +3218,21 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 			drm_property_info_free(infos, WDRM_CRTC__COUNT);
 		}
 
+		/* Writeback connectors of outputs in this commit are
+		 * routed by their output state; unroute the others. */
+		wl_list_for_each(wb, &b->writeback_list, link) {
+			if (wb->output &&
+			    drm_pending_state_get_output(pending_state,
+							 wb->output))
+				continue;
+
+			if (writeback_add_prop(req, wb,
+					       WDRM_CONNECTOR_CRTC_ID, 0) != 0)
+				ret = -1;
+			if (wb->output)
+				wb->output->state_cur->writeback_bound = false;
+		}
+
 		/* Disable all the planes; planes which are being used will
 		 * override this state in the output-state application. */
 		wl_list_for_each(plane, &b->plane_list, link) {
@@ -2552,14 +3267,25 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 
 	ret = drmModeAtomicCommit(b->drm.fd, req, flags, b);
 
-	if (mode == DRM_STATE_TEST_ONLY)
+	if (mode == DRM_STATE_TEST_ONLY) {
+		drmModeAtomicFree(req);
 		return ret;
+	}
 
 	if (ret != 0) {
 		weston_log("atomic: couldn't commit new state: %m\n");
+		/* Whatever the tests said, this did not work. */
+		drm_backend_clear_plane_caches(b);
 		goto out;
 	}
 
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		if (!output_state->writeback)
+			continue;
+		drm_writeback_buffer_submit(output_state->writeback);
+		output_state->writeback = NULL;
+	}
+
 	wl_list_for_each_safe(output_state, tmp, &pending_state->output_list,
 			      link)
 		drm_output_assign_state(output_state, mode);
@@ -2575,22 +3301,135 @@ out:
 }
 #endif
 
+#ifdef HAVE_DRM_ATOMIC
+/* What a TEST_ONLY commit depends on; see drm_pending_state_test_key(). */
+struct drm_test_key_output {
+	uint32_t crtc_id;
+	uint32_t dpms;
+	uint32_t writeback;
+	int32_t width, height;
+	uint32_t refresh;
+};
+
+struct drm_test_key_plane {
+	uint32_t plane_id;
+	uint32_t fb_id;
+	uint32_t format;
+	uint64_t modifier;
+	int32_t fb_width, fb_height;
+	uint32_t strides[4];
+	uint32_t offsets[4];
+	int32_t src_x, src_y;
+	uint32_t src_w, src_h;
+	int32_t dest_x, dest_y;
+	uint32_t dest_w, dest_h;
+};
+
 /**
- * Applies all of a pending_state asynchronously: the primary entry point for
- * applying KMS state to a device. Updates the state for all outputs in the
- * pending_state, as well as disabling any unclaimed outputs.
+ * Describes the plane configuration of a pending state: for each output,
+ * its CRTC and mode, then the framebuffer on each of its planes, its
+ * layout and where it is shown. Leaves key empty on allocation failure.
  *
- * Unconditionally takes ownership of pending_state, and clears state_invalid.
+ * The framebuffer ID is part of the key, as the kernel may accept one
+ * buffer and not another of the same layout, e.g. for its placement in
+ * memory. Clients cycle through a few buffers, so their frames still
+ * hit the cache.
+ */
+static void
+drm_pending_state_test_key(struct drm_pending_state *pending_state,
+			   struct wl_array *key)
+{
+	struct drm_output_state *output_state;
+	struct drm_plane_state *ps;
+	struct drm_test_key_output *ko;
+	struct drm_test_key_plane *kp;
+	struct weston_mode *mode;
+
+	key->size = 0;
+
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		mode = output_state->output->base.current_mode;
+
+		ko = wl_array_add(key, sizeof *ko);
+		if (!ko)
+			goto err;
+		memset(ko, 0, sizeof *ko);
+		ko->crtc_id = output_state->output->crtc_id;
+		ko->dpms = output_state->dpms;
+		if (output_state->writeback_bound)
+			ko->writeback =
+				output_state->output->writeback->connector_id;
+		ko->width = mode->width;
+		ko->height = mode->height;
+		ko->refresh = mode->refresh;
+
+		wl_list_for_each(ps, &output_state->plane_list, link) {
+			kp = wl_array_add(key, sizeof *kp);
+			if (!kp)
+				goto err;
+			memset(kp, 0, sizeof *kp);
+			kp->plane_id = ps->plane->plane_id;
+			if (ps->fb) {
+				kp->fb_id = ps->fb->fb_id;
+				kp->format = ps->fb->format->format;
+				kp->modifier = ps->fb->modifier;
+				kp->fb_width = ps->fb->width;
+				kp->fb_height = ps->fb->height;
+				memcpy(kp->strides, ps->fb->strides,
+				       sizeof kp->strides);
+				memcpy(kp->offsets, ps->fb->offsets,
+				       sizeof kp->offsets);
+			}
+			kp->src_x = ps->src_x;
+			kp->src_y = ps->src_y;
+			kp->src_w = ps->src_w;
+			kp->src_h = ps->src_h;
+			kp->dest_x = ps->dest_x;
+			kp->dest_y = ps->dest_y;
+			kp->dest_w = ps->dest_w;
+			kp->dest_h = ps->dest_h;
+		}
+	}
+
+	return;
+
+err:
+	key->size = 0;
+}
+#endif
+
+/**
+ * Tests whether a pending_state could be applied, without applying it.
+ *
+ * With atomic modesetting, the kernel's answer for a plane configuration
+ * is remembered, so that repaints of an unchanged scene do not ask again
+ * with a TEST_ONLY commit for every frame. Does not take ownership of
+ * pending_state.
  */
 static int
 drm_pending_state_test(struct drm_pending_state *pending_state)
 {
 #ifdef HAVE_DRM_ATOMIC
 	struct drm_backend *b = pending_state->backend;
+	struct drm_plane_cache_entry *entry;
+	int ret;
 
-	if (b->atomic_modeset)
-		return drm_pending_state_apply_atomic(pending_state,
-						      DRM_STATE_TEST_ONLY);
+	if (b->atomic_modeset) {
+		/* A full modeset is part of the test then. */
+		if (b->state_invalid)
+			return drm_pending_state_apply_atomic(pending_state,
+							      DRM_STATE_TEST_ONLY);
+
+		drm_pending_state_test_key(pending_state, &b->test_key);
+		entry = drm_plane_cache_lookup(&b->test_cache, &b->test_key);
+		if (entry)
+			return entry->result;
+
+		ret = drm_pending_state_apply_atomic(pending_state,
+						     DRM_STATE_TEST_ONLY);
+		drm_plane_cache_store(&b->test_cache, &b->test_key, ret);
+		return ret;
+	}
 #endif
 
 	/* We have no way to test state before application on the legacy
@@ -2598,6 +3437,13 @@ drm_pending_state_test(struct drm_pending_state *pending_state)
 	return 0;
 }
 
+/**
+ * Applies all of a pending_state asynchronously: the primary entry point for
+ * applying KMS state to a device. Updates the state for all outputs in the
+ * pending_state, as well as disabling any unclaimed outputs.
+ *
+ * Unconditionally takes ownership of pending_state, and clears state_invalid.
+ */
 static int
 drm_pending_state_apply(struct drm_pending_state *pending_state)
 {
@@ -2695,6 +3541,89 @@ drm_pending_state_apply_sync(struct drm_pending_state *pending_state)
 	return 0;
 }
 
+/**
+ * Route the writeback connector once captures want plane content, and
+ * attach a buffer to this repaint for the captures queued during it
+ *
+ * The connector stays routed after the captures end, so that a series of
+ * screenshots does not cost two modesets each; disabling the output
+ * unroutes it.
+ *
+ * Captures only read back what the frame damage covers, which is the
+ * renderer's part of the frame, so the damage is extended by what the
+ * hardware planes show now and showed in the last frame.
+ */
+static void
+drm_output_prepare_writeback(struct drm_output_state *state,
+			     pixman_region32_t *damage)
+{
+	struct drm_output *output = state->output;
+	struct weston_compositor *c = output->base.compositor;
+	pixman_region32_t planes;
+	struct weston_view *ev;
+
+	state->writeback_bound = output->base.queue_capture &&
+				 (output->base.capture_planes > 0 ||
+				  output->state_cur->writeback_bound);
+	if (!state->writeback_bound || output->base.capture_planes == 0) {
+		pixman_region32_clear(&output->writeback_planes);
+		return;
+	}
+
+	state->writeback = drm_output_get_writeback_buffer(output);
+	output->writeback_pending = state->writeback;
+	if (!state->writeback)
+		return;
+
+	pixman_region32_init(&planes);
+	wl_list_for_each(ev, &c->view_list, link) {
+		if (ev->plane == &c->primary_plane ||
+		    !(ev->output_mask & (1u << output->base.id)))
+			continue;
+		pixman_region32_union(&planes, &planes,
+				      &ev->transform.boundingbox);
+	}
+	pixman_region32_intersect(&planes, &planes, &output->base.region);
+
+	pixman_region32_union(damage, damage, &output->writeback_planes);
+	pixman_region32_union(damage, damage, &planes);
+	pixman_region32_copy(&output->writeback_planes, &planes);
+	pixman_region32_fini(&planes);
+}
+
+/**
+ * Test routing the writeback connector before the first frame needing it
+ *
+ * If the kernel refuses, captures of the output fall back to the
+ * renderer, with planes disabled.
+ */
+static void
+drm_output_check_writeback(struct drm_output_state *state)
+{
+	struct drm_output *output = state->output;
+	struct drm_writeback_buffer *buffer = state->writeback;
+	int ret;
+
+	if (!state->writeback_bound || output->state_cur->writeback_bound)
+		return;
+
+	/* A TEST_ONLY commit must not ask for an out-fence. */
+	state->writeback = NULL;
+	ret = drm_pending_state_test(state->pending_state);
+	state->writeback = buffer;
+	if (ret == 0)
+		return;
+
+	weston_log("Output %s: writeback connector %u refused, "
+		   "capturing without planes\n",
+		   output->base.name, output->writeback->connector_id);
+	output->base.queue_capture = NULL;
+	state->writeback_bound = false;
+	state->writeback = NULL;
+	if (buffer)
+		drm_writeback_buffer_complete(buffer, false);
+}
+
 static int
 drm_output_repaint(struct weston_output *output_base,
 		   pixman_region32_t *damage,
@@ -2706,6 +3635,13 @@ drm_output_repaint(struct weston_output *output_base,
 	struct drm_output_state *state = NULL;
 	struct drm_plane_state *scanout_state;
 
+	/* This frame was drawn by the renderer alone; planes are worth
+	 * trying again for the next one. */
+	if (output->planes_fallback) {
+		output->planes_fallback = false;
+		output_base->disable_planes--;
+	}
+
 	if (output->disable_pending || output->destroy_pending)
 		goto err;
 
@@ -2721,7 +3657,11 @@ drm_output_repaint(struct weston_output *output_base,
 						   DRM_OUTPUT_STATE_CLEAR_PLANES);
 	state->dpms = WESTON_DPMS_ON;
 
+	drm_output_prepare_writeback(state, damage);
 	drm_output_render(state, damage);
+	output->writeback_pending = NULL;
+	drm_output_check_writeback(state);
+
 	scanout_state = drm_output_state_get_plane(state,
 						   output->scanout_plane);
 	if (!scanout_state || !scanout_state->fb)
@@ -2914,9 +3854,47 @@ drm_repaint_flush(struct weston_compositor *compositor, void *repaint_data)
 {
 	struct drm_backend *b = to_drm_backend(compositor);
 	struct drm_pending_state *pending_state = repaint_data;
+	struct drm_output_state *output_state;
+	struct drm_output *output;
+	struct wl_array crtcs;
+	uint32_t *crtc_id;
+
+	/* Applying the state frees it, even when the kernel refuses it. */
+	wl_array_init(&crtcs);
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		crtc_id = wl_array_add(&crtcs, sizeof(*crtc_id));
+		if (crtc_id)
+			*crtc_id = output_state->output->crtc_id;
+	}
 
-	drm_pending_state_apply(pending_state);
 	b->repaint_data = NULL;
+	if (drm_pending_state_apply(pending_state) == 0) {
+		wl_array_release(&crtcs);
+		return;
+	}
+
+	/* Nothing will complete these frames, so finish them here and
+	 * have the renderer draw everything in the next ones, rather than
+	 * trying the planes the kernel just refused again. */
+	wl_array_for_each(crtc_id, &crtcs) {
+		output = drm_output_find_by_crtc(b, *crtc_id);
+		if (!output ||
+		    output->base.repaint_status != REPAINT_AWAITING_COMPLETION ||
+		    output->atomic_complete_pending)
+			continue;
+
+		weston_log("Output %s: commit failed, "
+			   "repainting without planes\n", output->base.name);
+		if (!output->planes_fallback) {
+			output->planes_fallback = true;
+			output->base.disable_planes++;
+		}
+		weston_output_damage(&output->base);
+		weston_output_finish_frame(&output->base, NULL,
+					   WP_PRESENTATION_FEEDBACK_INVALID);
+	}
+
+	wl_array_release(&crtcs);
 }
 
 /**
@@ -3047,19 +4025,40 @@ out:
 	return state;
 }
 
+static uint64_t
+cursor_image_hash(const uint32_t *pixels, int n)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int i;
+
+	/* FNV-1a, a word at a time */
+	for (i = 0; i < n; i++) {
+		hash ^= pixels[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
 /**
  * Update the image for the current cursor surface
  *
- * @param b DRM backend structure
- * @param bo GBM buffer object to write into
+ * Makes current_cursor point to a cursor BO holding the image of the
+ * view. An image already uploaded earlier is reused as it is; otherwise
+ * the least recently used BO not on screen is overwritten.
+ *
+ * @param output DRM output the cursor is on
  * @param ev View to use for cursor image
  */
 static void
-cursor_bo_update(struct drm_backend *b, struct gbm_bo *bo,
-		 struct weston_view *ev)
+cursor_bo_update(struct drm_output *output, struct weston_view *ev)
 {
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
 	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct drm_fb *on_screen = output->cursor_plane->state_cur->fb;
 	uint32_t buf[b->cursor_width * b->cursor_height];
+	struct drm_cursor_image *image, *victim = NULL;
+	uint64_t hash;
 	int32_t stride;
 	uint8_t *s;
 	int i;
@@ -3080,8 +4079,49 @@ cursor_bo_update(struct drm_backend *b, struct gbm_bo *bo,
 		       ev->surface->width * 4);
 	wl_shm_buffer_end_access(buffer->shm_buffer);
 
-	if (gbm_bo_write(bo, buf, sizeof buf) < 0)
+	hash = cursor_image_hash(buf, ARRAY_LENGTH(buf));
+	output->cursor_clock++;
+
+	for (i = 0; i < DRM_CURSOR_CACHE_SIZE; i++) {
+		image = &output->cursor_images[i];
+		if (image->pixels && image->hash == hash &&
+		    memcmp(image->pixels, buf, sizeof buf) == 0) {
+			image->last_used = output->cursor_clock;
+			output->current_cursor = i;
+			return;
+		}
+	}
+
+	for (i = 0; i < DRM_CURSOR_CACHE_SIZE; i++) {
+		image = &output->cursor_images[i];
+		if (image->fb == on_screen)
+			continue;
+		if (!image->pixels) {
+			victim = image;
+			break;
+		}
+		if (!victim ||
+		    (int32_t) (image->last_used - victim->last_used) < 0)
+			victim = image;
+	}
+	assert(victim);
+
+	output->current_cursor = victim - output->cursor_images;
+	victim->last_used = output->cursor_clock;
+
+	if (gbm_bo_write(victim->fb->bo, buf, sizeof buf) < 0) {
 		weston_log("failed update cursor: %m\n");
+		free(victim->pixels);
+		victim->pixels = NULL;
+		return;
+	}
+
+	if (!victim->pixels)
+		victim->pixels = malloc(sizeof buf);
+	if (victim->pixels) {
+		memcpy(victim->pixels, buf, sizeof buf);
+		victim->hash = hash;
+	}
 }
 
 static struct drm_plane_state *
@@ -3093,7 +4133,6 @@ drm_output_prepare_cursor_view(struct drm_output_state *output_state,
 	struct drm_plane *plane = output->cursor_plane;
 	struct drm_plane_state *plane_state;
 	struct wl_shm_buffer *shmbuf;
-	bool needs_update = false;
 
 	if (!plane)
 		return NULL;
@@ -3156,22 +4195,14 @@ drm_output_prepare_cursor_view(struct drm_output_state *output_state,
 	 * pretty unique here, in that they lie partway between a Weston plane
 	 * (direct scanout) and a renderer. */
 	if (ev != output->cursor_view ||
-	    pixman_region32_not_empty(&ev->surface->damage)) {
-		output->current_cursor++;
-		output->current_cursor =
-			output->current_cursor %
-				ARRAY_LENGTH(output->gbm_cursor_fb);
-		needs_update = true;
-	}
+	    pixman_region32_not_empty(&ev->surface->damage))
+		cursor_bo_update(output, ev);
 
 	output->cursor_view = ev;
 	plane_state->ev = ev;
 
 	plane_state->fb =
-		drm_fb_ref(output->gbm_cursor_fb[output->current_cursor]);
-
-	if (needs_update)
-		cursor_bo_update(b, plane_state->fb->bo, ev);
+		drm_fb_ref(output->cursor_images[output->current_cursor].fb);
 
 	return plane_state;
 
@@ -3204,7 +4235,7 @@ drm_output_set_cursor(struct drm_output_state *output_state)
 		return;
 	}
 
-	assert(state->fb == output->gbm_cursor_fb[output->current_cursor]);
+	assert(state->fb == output->cursor_images[output->current_cursor].fb);
 	assert(!plane->state_cur->output || plane->state_cur->output == output);
 
 	if (plane->state_cur->fb != state->fb) {
@@ -3394,6 +4425,123 @@ err:
 	return NULL;
 }
 
+/* What drm_output_propose_state() looks at, for the output and for
+ * each view on it; see drm_output_scene_key(). */
+struct drm_scene_key_output {
+	int32_t x, y, width, height;
+	int32_t mode_width, mode_height;
+	int sprites_are_broken;
+	int cursors_are_broken;
+};
+
+struct drm_scene_key_view {
+	struct weston_view *view;
+	pixman_box32_t bounds;
+	pixman_box32_t opaque;
+	int opaque_rects;
+	int32_t width, height;
+	uint32_t output_mask;
+	float alpha;
+	int matrix_type;
+	uint32_t buffer_type;
+	uint32_t format;
+	uint64_t modifier;
+	uint32_t buffer_transform;
+	int32_t buffer_scale;
+	wl_fixed_t src_x, src_y, src_width, src_height;
+};
+
+enum drm_scene_key_buffer_type {
+	DRM_SCENE_KEY_BUFFER_NONE = 0,
+	DRM_SCENE_KEY_BUFFER_SHM,
+	DRM_SCENE_KEY_BUFFER_DMABUF,
+	DRM_SCENE_KEY_BUFFER_OTHER,
+};
+
+/**
+ * Describe the scene of an output for its plane cache
+ *
+ * Lists the views on the output from top to bottom, with their position,
+ * size, opacity and buffer layout. The opaque region is described by its
+ * extents and rectangle count, which is enough to tell whether it covers
+ * the whole surface, as drm_view_is_opaque() does.
+ *
+ * @param output Output to describe
+ * @param key Array to fill, left empty on allocation failure
+ */
+static void
+drm_output_scene_key(struct drm_output *output, struct wl_array *key)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_buffer_viewport *vp;
+	struct drm_scene_key_output *ko;
+	struct drm_scene_key_view *kv;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct weston_buffer *buffer;
+	struct weston_view *ev;
+
+	key->size = 0;
+
+	ko = wl_array_add(key, sizeof *ko);
+	if (!ko)
+		goto err;
+	memset(ko, 0, sizeof *ko);
+	ko->x = output->base.x;
+	ko->y = output->base.y;
+	ko->width = output->base.width;
+	ko->height = output->base.height;
+	ko->mode_width = output->base.current_mode->width;
+	ko->mode_height = output->base.current_mode->height;
+	ko->sprites_are_broken = b->sprites_are_broken;
+	ko->cursors_are_broken = b->cursors_are_broken;
+
+	wl_list_for_each(ev, &output->base.compositor->view_list, link) {
+		if (!(ev->output_mask & (1u << output->base.id)))
+			continue;
+
+		kv = wl_array_add(key, sizeof *kv);
+		if (!kv)
+			goto err;
+		memset(kv, 0, sizeof *kv);
+
+		kv->view = ev;
+		kv->bounds = *pixman_region32_extents(&ev->transform.boundingbox);
+		kv->opaque = *pixman_region32_extents(&ev->surface->opaque);
+		kv->opaque_rects = pixman_region32_n_rects(&ev->surface->opaque);
+		kv->width = ev->surface->width;
+		kv->height = ev->surface->height;
+		kv->output_mask = ev->output_mask;
+		kv->alpha = ev->alpha;
+		kv->matrix_type = ev->transform.matrix.type;
+
+		vp = &ev->surface->buffer_viewport;
+		kv->buffer_transform = vp->buffer.transform;
+		kv->buffer_scale = vp->buffer.scale;
+		kv->src_x = vp->buffer.src_x;
+		kv->src_y = vp->buffer.src_y;
+		kv->src_width = vp->buffer.src_width;
+		kv->src_height = vp->buffer.src_height;
+
+		buffer = ev->surface->buffer_ref.buffer;
+		if (!buffer) {
+			kv->buffer_type = DRM_SCENE_KEY_BUFFER_NONE;
+		} else if (wl_shm_buffer_get(buffer->resource)) {
+			kv->buffer_type = DRM_SCENE_KEY_BUFFER_SHM;
+		} else if ((dmabuf = linux_dmabuf_buffer_get(buffer->resource))) {
+			kv->buffer_type = DRM_SCENE_KEY_BUFFER_DMABUF;
+			kv->format = dmabuf->attributes.format;
+			kv->modifier = dmabuf->attributes.modifier[0];
+		} else {
+			kv->buffer_type = DRM_SCENE_KEY_BUFFER_OTHER;
+		}
+	}
+
+	return;
+
+err:
+	key->size = 0;
+}
+
 static void
 drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 {
@@ -3404,10 +4552,23 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	struct drm_plane_state *plane_state;
 	struct weston_view *ev;
 	struct weston_plane *primary = &output_base->compositor->primary_plane;
+	struct drm_plane_cache *cache = &output->scene_cache;
+	struct drm_plane_cache_entry *scene;
+
+	/* Don't try to put everything on planes again for a scene where
+	 * that failed recently. */
+	drm_output_scene_key(output, &output->scene_key);
+	scene = drm_plane_cache_lookup(cache, &output->scene_key);
+	if (scene && scene->result < 0 &&
+	    cache->clock - scene->stored < DRM_PLANE_CACHE_RETRY) {
+		state = NULL;
+	} else {
+		state = drm_output_propose_state(output_base, pending_state,
+						 DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY);
+		drm_plane_cache_store(cache, &output->scene_key,
+				      state ? 0 : -1);
+	}
 
-
-	state = drm_output_propose_state(output_base, pending_state,
-					 DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY);
 	if (!state)
 		state = drm_output_propose_state(output_base, pending_state,
 						 DRM_OUTPUT_PROPOSE_STATE_MIXED);
@@ -3668,6 +4829,12 @@ init_kms_caps(struct drm_backend *b)
 		ret = drmSetClientCap(b->drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
 		b->atomic_modeset = ((ret == 0) && (cap == 1));
 	}
+
+	if (b->atomic_modeset) {
+		ret = drmSetClientCap(b->drm.fd,
+				      DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1);
+		b->writeback_connectors = (ret == 0);
+	}
 #endif
 	weston_log("DRM: %s atomic modesetting\n",
 		   b->atomic_modeset ? "supports" : "does not support");
@@ -4445,9 +5612,11 @@ static void drm_output_fini_cursor_egl(struct drm_output *output)
 {
 	unsigned int i;
 
-	for (i = 0; i < ARRAY_LENGTH(output->gbm_cursor_fb); i++) {
-		drm_fb_unref(output->gbm_cursor_fb[i]);
-		output->gbm_cursor_fb[i] = NULL;
+	for (i = 0; i < ARRAY_LENGTH(output->cursor_images); i++) {
+		drm_fb_unref(output->cursor_images[i].fb);
+		output->cursor_images[i].fb = NULL;
+		free(output->cursor_images[i].pixels);
+		output->cursor_images[i].pixels = NULL;
 	}
 }
 
@@ -4460,7 +5629,7 @@ drm_output_init_cursor_egl(struct drm_output *output, struct drm_backend *b)
 	if (!output->cursor_plane)
 		return 0;
 
-	for (i = 0; i < ARRAY_LENGTH(output->gbm_cursor_fb); i++) {
+	for (i = 0; i < ARRAY_LENGTH(output->cursor_images); i++) {
 		struct gbm_bo *bo;
 
 		bo = gbm_bo_create(b->gbm, b->cursor_width, b->cursor_height,
@@ -4469,9 +5638,9 @@ drm_output_init_cursor_egl(struct drm_output *output, struct drm_backend *b)
 		if (!bo)
 			goto err;
 
-		output->gbm_cursor_fb[i] =
+		output->cursor_images[i].fb =
 			drm_fb_get_from_bo(bo, b, false, BUFFER_CURSOR);
-		if (!output->gbm_cursor_fb[i]) {
+		if (!output->cursor_images[i].fb) {
 			gbm_bo_destroy(bo);
 			goto err;
 		}
@@ -4790,54 +5959,161 @@ edid_parse(struct drm_edid *edid, const uint8_t *data, size_t length)
 	if (data[0] != 0x00 || data[1] != 0xff)
 		return -1;
 
-	/* decode the PNP ID from three 5 bit words packed into 2 bytes
-	 * /--08--\/--09--\
-	 * 7654321076543210
-	 * |\---/\---/\---/
-	 * R  C1   C2   C3 */
-	edid->pnp_id[0] = 'A' + ((data[EDID_OFFSET_PNPID + 0] & 0x7c) / 4) - 1;
-	edid->pnp_id[1] = 'A' + ((data[EDID_OFFSET_PNPID + 0] & 0x3) * 8) + ((data[EDID_OFFSET_PNPID + 1] & 0xe0) / 32) - 1;
-	edid->pnp_id[2] = 'A' + (data[EDID_OFFSET_PNPID + 1] & 0x1f) - 1;
-	edid->pnp_id[3] = '\0';
+	/* decode the PNP ID from three 5 bit words packed into 2 bytes
+	 * /--08--\/--09--\
+	 * 7654321076543210
+	 * |\---/\---/\---/
+	 * R  C1   C2   C3 */
+	edid->pnp_id[0] = 'A' + ((data[EDID_OFFSET_PNPID + 0] & 0x7c) / 4) - 1;
+	edid->pnp_id[1] = 'A' + ((data[EDID_OFFSET_PNPID + 0] & 0x3) * 8) + ((data[EDID_OFFSET_PNPID + 1] & 0xe0) / 32) - 1;
+	edid->pnp_id[2] = 'A' + (data[EDID_OFFSET_PNPID + 1] & 0x1f) - 1;
+	edid->pnp_id[3] = '\0';
+
+	/* maybe there isn't a ASCII serial number descriptor, so use this instead */
+	serial_number = (uint32_t) data[EDID_OFFSET_SERIAL + 0];
+	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 1] * 0x100;
+	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 2] * 0x10000;
+	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 3] * 0x1000000;
+	if (serial_number > 0)
+		sprintf(edid->serial_number, "%lu", (unsigned long) serial_number);
+
+	/* parse EDID data */
+	for (i = EDID_OFFSET_DATA_BLOCKS;
+	     i <= EDID_OFFSET_LAST_BLOCK;
+	     i += 18) {
+		/* ignore pixel clock data */
+		if (data[i] != 0)
+			continue;
+		if (data[i+2] != 0)
+			continue;
+
+		/* any useful blocks? */
+		if (data[i+3] == EDID_DESCRIPTOR_DISPLAY_PRODUCT_NAME) {
+			edid_parse_string(&data[i+5],
+					  edid->monitor_name);
+		} else if (data[i+3] == EDID_DESCRIPTOR_DISPLAY_PRODUCT_SERIAL_NUMBER) {
+			edid_parse_string(&data[i+5],
+					  edid->serial_number);
+		} else if (data[i+3] == EDID_DESCRIPTOR_ALPHANUMERIC_DATA_STRING) {
+			edid_parse_string(&data[i+5],
+					  edid->eisa_id);
+		}
+	}
+	return 0;
+}
+
+/** Fetch and parse the EDID of a connector
+ *
+ * \param fd The DRM device fd.
+ * \param connector The connector whose EDID to read.
+ * \param edid[out] The parsed EDID.
+ * \return 0 on success, -1 if there is no usable EDID.
+ *
+ * Only uses the DRM fd, so it is safe to call from the prober thread.
+ */
+static int
+drm_probe_edid(int fd, drmModeConnector *connector, struct drm_edid *edid)
+{
+	drmModePropertyBlobPtr edid_blob;
+	drmModePropertyPtr prop;
+	uint32_t blob_id = 0;
+	int rc;
+	int i;
+
+	for (i = 0; i < connector->count_props && !blob_id; i++) {
+		prop = drmModeGetProperty(fd, connector->props[i]);
+		if (!prop)
+			continue;
+		if ((prop->flags & DRM_MODE_PROP_BLOB) &&
+		    strcmp(prop->name, "EDID") == 0)
+			blob_id = connector->prop_values[i];
+		drmModeFreeProperty(prop);
+	}
+	if (!blob_id)
+		return -1;
+
+	edid_blob = drmModeGetPropertyBlob(fd, blob_id);
+	if (!edid_blob)
+		return -1;
+
+	rc = edid_parse(edid, edid_blob->data, edid_blob->length);
+	drmModeFreePropertyBlob(edid_blob);
+
+	return rc;
+}
+
+static void
+drm_probe_destroy(struct drm_probe *probe)
+{
+	int i;
+
+	for (i = 0; i < probe->count_connectors; i++) {
+		if (probe->connectors[i].connector)
+			drmModeFreeConnector(probe->connectors[i].connector);
+	}
+	free(probe->connectors);
+	drmModeFreeResources(probe->resources);
+	free(probe);
+}
+
+/** Probe all connectors of a DRM device
+ *
+ * \param fd The DRM device fd.
+ * \return The connected connectors with their EDID, or NULL on failure.
+ *
+ * This is the slow part of output discovery. It does not touch the
+ * backend and does not log, so it can run on the prober thread.
+ */
+static struct drm_probe *
+drm_probe_create(int fd)
+{
+	struct drm_probe *probe;
+	struct drm_probe_connector *pc;
+	drmModeConnector *connector;
+	int i;
+
+	probe = zalloc(sizeof *probe);
+	if (!probe)
+		return NULL;
 
-	/* maybe there isn't a ASCII serial number descriptor, so use this instead */
-	serial_number = (uint32_t) data[EDID_OFFSET_SERIAL + 0];
-	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 1] * 0x100;
-	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 2] * 0x10000;
-	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 3] * 0x1000000;
-	if (serial_number > 0)
-		sprintf(edid->serial_number, "%lu", (unsigned long) serial_number);
+	probe->resources = drmModeGetResources(fd);
+	if (!probe->resources) {
+		free(probe);
+		return NULL;
+	}
 
-	/* parse EDID data */
-	for (i = EDID_OFFSET_DATA_BLOCKS;
-	     i <= EDID_OFFSET_LAST_BLOCK;
-	     i += 18) {
-		/* ignore pixel clock data */
-		if (data[i] != 0)
-			continue;
-		if (data[i+2] != 0)
+	probe->connectors = calloc(probe->resources->count_connectors,
+				   sizeof *probe->connectors);
+	if (probe->resources->count_connectors > 0 && !probe->connectors) {
+		drm_probe_destroy(probe);
+		return NULL;
+	}
+
+	for (i = 0; i < probe->resources->count_connectors; i++) {
+		connector = drmModeGetConnector(fd,
+						probe->resources->connectors[i]);
+		if (connector == NULL)
 			continue;
 
-		/* any useful blocks? */
-		if (data[i+3] == EDID_DESCRIPTOR_DISPLAY_PRODUCT_NAME) {
-			edid_parse_string(&data[i+5],
-					  edid->monitor_name);
-		} else if (data[i+3] == EDID_DESCRIPTOR_DISPLAY_PRODUCT_SERIAL_NUMBER) {
-			edid_parse_string(&data[i+5],
-					  edid->serial_number);
-		} else if (data[i+3] == EDID_DESCRIPTOR_ALPHANUMERIC_DATA_STRING) {
-			edid_parse_string(&data[i+5],
-					  edid->eisa_id);
+		if (connector->connection != DRM_MODE_CONNECTED ||
+		    connector->connector_type == DRM_MODE_CONNECTOR_WRITEBACK) {
+			drmModeFreeConnector(connector);
+			continue;
 		}
+
+		pc = &probe->connectors[probe->count_connectors++];
+		pc->connector_id = connector->connector_id;
+		pc->connector = connector;
+		pc->has_edid = drm_probe_edid(fd, connector, &pc->edid) == 0;
 	}
-	return 0;
+
+	return probe;
 }
 
-/** Parse monitor make, model and serial from EDID
+/** Set monitor make, model and serial from a probed EDID
  *
- * \param b The backend instance.
  * \param output The output whose \c drm_edid to fill in.
- * \param props The DRM connector properties to get the EDID from.
+ * \param edid The EDID found by the probe, or NULL if there was none.
  * \param make[out] The monitor make (PNP ID).
  * \param model[out] The monitor model (name).
  * \param serial_number[out] The monitor serial number.
@@ -4848,42 +6124,26 @@ edid_parse(struct drm_edid *edid, const uint8_t *data, size_t length)
  * \c drm_output is destroyed.
  */
 static void
-find_and_parse_output_edid(struct drm_backend *b, struct drm_output *output,
-			   drmModeObjectPropertiesPtr props,
-			   const char **make,
-			   const char **model,
-			   const char **serial_number)
+drm_output_set_edid(struct drm_output *output,
+		    const struct drm_edid *edid,
+		    const char **make,
+		    const char **model,
+		    const char **serial_number)
 {
-	drmModePropertyBlobPtr edid_blob = NULL;
-	uint32_t blob_id;
-	int rc;
-
-	blob_id =
-		drm_property_get_value(&output->props_conn[WDRM_CONNECTOR_EDID],
-				       props, 0);
-	if (!blob_id)
+	if (!edid)
 		return;
 
-	edid_blob = drmModeGetPropertyBlob(b->drm.fd, blob_id);
-	if (!edid_blob)
-		return;
-
-	rc = edid_parse(&output->edid,
-			edid_blob->data,
-			edid_blob->length);
-	if (!rc) {
-		weston_log("EDID data '%s', '%s', '%s'\n",
-			   output->edid.pnp_id,
-			   output->edid.monitor_name,
-			   output->edid.serial_number);
-		if (output->edid.pnp_id[0] != '\0')
-			*make = output->edid.pnp_id;
-		if (output->edid.monitor_name[0] != '\0')
-			*model = output->edid.monitor_name;
-		if (output->edid.serial_number[0] != '\0')
-			*serial_number = output->edid.serial_number;
-	}
-	drmModeFreePropertyBlob(edid_blob);
+	output->edid = *edid;
+	weston_log("EDID data '%s', '%s', '%s'\n",
+		   output->edid.pnp_id,
+		   output->edid.monitor_name,
+		   output->edid.serial_number);
+	if (output->edid.pnp_id[0] != '\0')
+		*make = output->edid.pnp_id;
+	if (output->edid.monitor_name[0] != '\0')
+		*model = output->edid.monitor_name;
+	if (output->edid.serial_number[0] != '\0')
+		*serial_number = output->edid.serial_number;
 }
 
 static int
@@ -5239,6 +6499,11 @@ drm_output_deinit(struct weston_output *base)
 		drm_output_fini_egl(output);
 #endif
 
+	if (output->planes_fallback) {
+		output->planes_fallback = false;
+		output->base.disable_planes--;
+	}
+
 	/* Since our planes are no longer in use anywhere, remove their base
 	 * weston_plane's link from the plane stacking list, unless we're
 	 * shutting down, in which case the plane has already been
@@ -5304,6 +6569,9 @@ drm_output_destroy(struct weston_output *base)
 	if (output->pageflip_timer)
 		wl_event_source_remove(output->pageflip_timer);
 
+	drm_output_fini_writeback(output);
+	pixman_region32_fini(&output->writeback_planes);
+
 	weston_output_release(&output->base);
 
 	drm_property_info_free(output->props_conn, WDRM_CONNECTOR__COUNT);
@@ -5317,6 +6585,9 @@ drm_output_destroy(struct weston_output *base)
 	assert(!output->state_last);
 	drm_output_state_free(output->state_cur);
 
+	drm_plane_cache_release(&output->scene_cache);
+	wl_array_release(&output->scene_key);
+
 	free(output);
 }
 
@@ -5373,6 +6644,10 @@ drm_backend_update_unused_outputs(struct drm_backend *b, drmModeRes *resources)
 		if (output && output->base.enabled)
 			continue;
 
+		/* Routed along with the output claiming them. */
+		if (drm_writeback_find(b, resources->connectors[i]))
+			continue;
+
 		connector_id = wl_array_add(&b->unused_connectors,
 					    sizeof(*connector_id));
 		*connector_id = resources->connectors[i];
@@ -5404,6 +6679,7 @@ drm_backend_update_unused_outputs(struct drm_backend *b, drmModeRes *resources)
  * @param b Weston backend structure
  * @param resources DRM resources for this device
  * @param connector DRM connector to use for this new output
+ * @param edid EDID found when probing the connector, or NULL
  * @param drm_device udev device pointer
  * @returns 0 on success, or -1 on failure
  */
@@ -5411,6 +6687,7 @@ static int
 create_output_for_connector(struct drm_backend *b,
 			    drmModeRes *resources,
 			    drmModeConnector *connector,
+			    const struct drm_edid *edid,
 			    struct udev_device *drm_device)
 {
 	struct drm_output *output;
@@ -5449,6 +6726,9 @@ create_output_for_connector(struct drm_backend *b,
 	output->base.destroy = drm_output_destroy;
 	output->base.disable = drm_output_disable;
 
+	pixman_region32_init(&output->writeback_planes);
+	drm_output_init_writeback(output);
+
 	origcrtc = drmModeGetCrtc(b->drm.fd, output->crtc_id);
 	if (origcrtc == NULL)
 		goto err_output;
@@ -5459,6 +6739,9 @@ create_output_for_connector(struct drm_backend *b,
 	output->destroy_pending = 0;
 	output->disable_pending = 0;
 
+	drm_plane_cache_init(&output->scene_cache);
+	wl_array_init(&output->scene_key);
+
 	props = drmModeObjectGetProperties(b->drm.fd, output->crtc_id,
 					   DRM_MODE_OBJECT_CRTC);
 	if (!props) {
@@ -5477,8 +6760,7 @@ create_output_for_connector(struct drm_backend *b,
 	}
 	drm_property_info_populate(b, connector_props, output->props_conn,
 				   WDRM_CONNECTOR__COUNT, props);
-	find_and_parse_output_edid(b, output, props,
-				   &make, &model, &serial_number);
+	drm_output_set_edid(output, edid, &make, &model, &serial_number);
 	output->base.make = (char *)make;
 	output->base.model = (char *)model;
 	output->base.serial_number = (char *)serial_number;
@@ -5532,40 +6814,165 @@ err_init:
 	return -1;
 }
 
-static int
-create_outputs(struct drm_backend *b, struct udev_device *drm_device)
+static bool
+drm_writeback_supports_xrgb8888(struct drm_backend *b, uint32_t blob_id)
+{
+	drmModePropertyBlobPtr blob;
+	const uint32_t *formats;
+	bool found = false;
+	uint32_t i;
+
+	if (!blob_id)
+		return false;
+
+	blob = drmModeGetPropertyBlob(b->drm.fd, blob_id);
+	if (!blob)
+		return false;
+
+	formats = blob->data;
+	for (i = 0; i < blob->length / sizeof(*formats); i++) {
+		if (formats[i] == DRM_FORMAT_XRGB8888) {
+			found = true;
+			break;
+		}
+	}
+	drmModeFreePropertyBlob(blob);
+
+	return found;
+}
+
+/**
+ * Find the writeback connectors of the device
+ *
+ * These are only listed once the client cap is set, which takes atomic
+ * modesetting. They are static, so this is only done at startup.
+ *
+ * @param b Weston backend structure
+ */
+static void
+create_writebacks(struct drm_backend *b)
 {
+	drmModeObjectProperties *props;
 	drmModeConnector *connector;
+	drmModeEncoder *encoder;
 	drmModeRes *resources;
+	struct drm_writeback *wb;
+	uint32_t blob_id;
 	int i;
 
+	if (!b->writeback_connectors)
+		return;
+
 	resources = drmModeGetResources(b->drm.fd);
-	if (!resources) {
+	if (!resources)
+		return;
+
+	for (i = 0; i < resources->count_connectors; i++) {
+		connector = drmModeGetConnector(b->drm.fd,
+						resources->connectors[i]);
+		if (!connector)
+			continue;
+
+		if (connector->connector_type != DRM_MODE_CONNECTOR_WRITEBACK ||
+		    connector->count_encoders < 1) {
+			drmModeFreeConnector(connector);
+			continue;
+		}
+
+		wb = zalloc(sizeof *wb);
+		if (!wb) {
+			drmModeFreeConnector(connector);
+			break;
+		}
+		wb->backend = b;
+		wb->connector_id = connector->connector_id;
+
+		encoder = drmModeGetEncoder(b->drm.fd, connector->encoders[0]);
+		if (encoder) {
+			wb->possible_crtcs = encoder->possible_crtcs;
+			drmModeFreeEncoder(encoder);
+		}
+		drmModeFreeConnector(connector);
+
+		props = drmModeObjectGetProperties(b->drm.fd, wb->connector_id,
+						   DRM_MODE_OBJECT_CONNECTOR);
+		if (!props) {
+			free(wb);
+			continue;
+		}
+		drm_property_info_populate(b, connector_props, wb->props,
+					   WDRM_CONNECTOR__COUNT, props);
+		blob_id = drm_property_get_value(
+			&wb->props[WDRM_CONNECTOR_WRITEBACK_PIXEL_FORMATS],
+			props, 0);
+		drmModeFreeObjectProperties(props);
+
+		if (!wb->possible_crtcs ||
+		    !wb->props[WDRM_CONNECTOR_WRITEBACK_FB_ID].prop_id ||
+		    !wb->props[WDRM_CONNECTOR_WRITEBACK_OUT_FENCE_PTR].prop_id ||
+		    !drm_writeback_supports_xrgb8888(b, blob_id)) {
+			weston_log("DRM: ignoring unusable writeback "
+				   "connector %u\n", wb->connector_id);
+			drm_property_info_free(wb->props,
+					       WDRM_CONNECTOR__COUNT);
+			free(wb);
+			continue;
+		}
+
+		weston_log("DRM: writeback connector %u, CRTC mask 0x%x\n",
+			   wb->connector_id, wb->possible_crtcs);
+		wl_list_insert(b->writeback_list.prev, &wb->link);
+	}
+
+	drmModeFreeResources(resources);
+}
+
+static void
+destroy_writebacks(struct drm_backend *b)
+{
+	struct drm_writeback *wb, *next;
+
+	wl_list_for_each_safe(wb, next, &b->writeback_list, link) {
+		if (wb->output)
+			drm_output_fini_writeback(wb->output);
+		wl_list_remove(&wb->link);
+		drm_property_info_free(wb->props, WDRM_CONNECTOR__COUNT);
+		free(wb);
+	}
+}
+
+static int
+create_outputs(struct drm_backend *b, struct udev_device *drm_device)
+{
+	struct drm_probe_connector *pc;
+	struct drm_probe *probe;
+	drmModeRes *resources;
+	int i;
+
+	probe = drm_probe_create(b->drm.fd);
+	if (!probe) {
 		weston_log("drmModeGetResources failed\n");
 		return -1;
 	}
+	resources = probe->resources;
 
 	b->min_width  = resources->min_width;
 	b->max_width  = resources->max_width;
 	b->min_height = resources->min_height;
 	b->max_height = resources->max_height;
 
-	for (i = 0; i < resources->count_connectors; i++) {
+	for (i = 0; i < probe->count_connectors; i++) {
 		int ret;
 
-		connector = drmModeGetConnector(b->drm.fd,
-						resources->connectors[i]);
-		if (connector == NULL)
-			continue;
-
-		if (connector->connection == DRM_MODE_CONNECTED) {
-			ret = create_output_for_connector(b, resources,
-							  connector, drm_device);
-			if (ret < 0)
-				weston_log("failed to create new connector\n");
-		} else {
-			drmModeFreeConnector(connector);
-		}
+		pc = &probe->connectors[i];
+		ret = create_output_for_connector(b, resources,
+						  pc->connector,
+						  pc->has_edid ?
+						  &pc->edid : NULL,
+						  drm_device);
+		pc->connector = NULL;
+		if (ret < 0)
+			weston_log("failed to create new connector\n");
 	}
 
 	drm_backend_update_unused_outputs(b, resources);
@@ -5574,69 +6981,56 @@ create_outputs(struct drm_backend *b, struct udev_device *drm_device)
 	    wl_list_empty(&b->compositor->pending_output_list))
 		weston_log("No currently active connector found.\n");
 
-	drmModeFreeResources(resources);
+	drm_probe_destroy(probe);
 
 	return 0;
 }
 
-static void
-update_outputs(struct drm_backend *b, struct udev_device *drm_device)
+static bool
+drm_probe_has_connector(struct drm_probe *probe, uint32_t connector_id)
 {
-	drmModeConnector *connector;
-	drmModeRes *resources;
-	struct drm_output *output, *next;
-	uint32_t *connected;
 	int i;
 
-	resources = drmModeGetResources(b->drm.fd);
-	if (!resources) {
-		weston_log("drmModeGetResources failed\n");
-		return;
-	}
-
-	connected = calloc(resources->count_connectors, sizeof(uint32_t));
-	if (!connected) {
-		drmModeFreeResources(resources);
-		return;
+	for (i = 0; i < probe->count_connectors; i++) {
+		if (probe->connectors[i].connector_id == connector_id)
+			return true;
 	}
 
-	/* collect new connects */
-	for (i = 0; i < resources->count_connectors; i++) {
-		uint32_t connector_id = resources->connectors[i];
-
-		connector = drmModeGetConnector(b->drm.fd, connector_id);
-		if (connector == NULL)
-			continue;
+	return false;
+}
 
-		if (connector->connection != DRM_MODE_CONNECTED) {
-			drmModeFreeConnector(connector);
-			continue;
-		}
+/** Bring outputs in line with a connector probe
+ *
+ * @param b Weston backend structure
+ * @param probe Connectors found connected; connectors used for new
+ * outputs are taken from it
+ * @param drm_device udev device pointer
+ */
+static void
+update_outputs(struct drm_backend *b, struct drm_probe *probe,
+	       struct udev_device *drm_device)
+{
+	struct drm_probe_connector *pc;
+	struct drm_output *output, *next;
+	int i;
 
-		connected[i] = connector_id;
+	/* collect new connects */
+	for (i = 0; i < probe->count_connectors; i++) {
+		pc = &probe->connectors[i];
 
-		if (drm_output_find_by_connector(b, connector_id)) {
-			drmModeFreeConnector(connector);
+		if (drm_output_find_by_connector(b, pc->connector_id))
 			continue;
-		}
 
-		create_output_for_connector(b, resources,
-					    connector, drm_device);
-		weston_log("connector %d connected\n", connector_id);
+		create_output_for_connector(b, probe->resources, pc->connector,
+					    pc->has_edid ? &pc->edid : NULL,
+					    drm_device);
+		pc->connector = NULL;
+		weston_log("connector %d connected\n", pc->connector_id);
 	}
 
 	wl_list_for_each_safe(output, next, &b->compositor->output_list,
 			      base.link) {
-		bool disconnected = true;
-
-		for (i = 0; i < resources->count_connectors; i++) {
-			if (connected[i] == output->connector_id) {
-				disconnected = false;
-				break;
-			}
-		}
-
-		if (!disconnected)
+		if (drm_probe_has_connector(probe, output->connector_id))
 			continue;
 
 		weston_log("connector %d disconnected\n", output->connector_id);
@@ -5645,26 +7039,189 @@ update_outputs(struct drm_backend *b, struct udev_device *drm_device)
 
 	wl_list_for_each_safe(output, next, &b->compositor->pending_output_list,
 			      base.link) {
-		bool disconnected = true;
-
-		for (i = 0; i < resources->count_connectors; i++) {
-			if (connected[i] == output->connector_id) {
-				disconnected = false;
-				break;
-			}
-		}
-
-		if (!disconnected)
+		if (drm_probe_has_connector(probe, output->connector_id))
 			continue;
 
 		weston_log("connector %d disconnected\n", output->connector_id);
 		drm_output_destroy(&output->base);
 	}
 
-	drm_backend_update_unused_outputs(b, resources);
+	drm_backend_update_unused_outputs(b, probe->resources);
+}
 
-	free(connected);
-	drmModeFreeResources(resources);
+static void
+drm_backend_probe_sync(struct drm_backend *b, struct udev_device *drm_device)
+{
+	struct drm_probe *probe;
+
+	probe = drm_probe_create(b->drm.fd);
+	if (!probe) {
+		weston_log("drmModeGetResources failed\n");
+		return;
+	}
+
+	update_outputs(b, probe, drm_device);
+	drm_probe_destroy(probe);
+}
+
+static void *
+drm_prober_thread(void *data)
+{
+	struct drm_prober *prober = data;
+	struct drm_probe *probe;
+	char c = 0;
+	ssize_t ret;
+
+	pthread_mutex_lock(&prober->mutex);
+	for (;;) {
+		while (!prober->pending && !prober->quit)
+			pthread_cond_wait(&prober->cond, &prober->mutex);
+		if (prober->quit)
+			break;
+		prober->pending = false;
+		pthread_mutex_unlock(&prober->mutex);
+
+		probe = drm_probe_create(prober->fd);
+
+		pthread_mutex_lock(&prober->mutex);
+		/* An unapplied older result is stale now. */
+		if (prober->result)
+			drm_probe_destroy(prober->result);
+		prober->result = probe;
+		pthread_mutex_unlock(&prober->mutex);
+
+		do {
+			ret = write(prober->writefd, &c, 1);
+		} while (ret < 0 && errno == EINTR);
+
+		pthread_mutex_lock(&prober->mutex);
+	}
+	pthread_mutex_unlock(&prober->mutex);
+
+	return NULL;
+}
+
+static int
+drm_prober_handler(int fd, uint32_t mask, void *data)
+{
+	struct drm_backend *b = data;
+	struct drm_prober *prober = b->prober;
+	struct drm_probe *probe;
+	char buf[16];
+
+	if (read(fd, buf, sizeof buf) < 0)
+		return 1;
+
+	pthread_mutex_lock(&prober->mutex);
+	probe = prober->result;
+	prober->result = NULL;
+	pthread_mutex_unlock(&prober->mutex);
+
+	/* Already applied along with an earlier wakeup. */
+	if (!probe)
+		return 1;
+
+	update_outputs(b, probe, prober->drm_device);
+	drm_probe_destroy(probe);
+
+	return 1;
+}
+
+/* Starts the hotplug prober thread. Returns NULL if that fails, and
+ * hotplug is then handled synchronously. */
+static struct drm_prober *
+drm_prober_create(struct drm_backend *b, struct udev_device *drm_device)
+{
+	struct drm_prober *prober;
+	struct wl_event_loop *loop;
+	int fds[2];
+
+	prober = zalloc(sizeof *prober);
+	if (!prober)
+		return NULL;
+
+	prober->fd = b->drm.fd;
+
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		goto err_free;
+	prober->readfd = fds[0];
+	prober->writefd = fds[1];
+
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+	prober->source = wl_event_loop_add_fd(loop, prober->readfd,
+					      WL_EVENT_READABLE,
+					      drm_prober_handler, b);
+	if (!prober->source)
+		goto err_pipe;
+
+	pthread_mutex_init(&prober->mutex, NULL);
+	pthread_cond_init(&prober->cond, NULL);
+
+	if (thread_create_masked(&prober->thread, drm_prober_thread,
+				 prober, 0) != 0)
+		goto err_mutex;
+
+	prober->drm_device = udev_device_ref(drm_device);
+
+	return prober;
+
+err_mutex:
+	pthread_cond_destroy(&prober->cond);
+	pthread_mutex_destroy(&prober->mutex);
+	wl_event_source_remove(prober->source);
+err_pipe:
+	close(prober->readfd);
+	close(prober->writefd);
+err_free:
+	weston_log("failed to start connector prober thread: %m\n");
+	free(prober);
+
+	return NULL;
+}
+
+static void
+drm_prober_destroy(struct drm_prober *prober)
+{
+	if (!prober)
+		return;
+
+	pthread_mutex_lock(&prober->mutex);
+	prober->quit = true;
+	pthread_cond_signal(&prober->cond);
+	pthread_mutex_unlock(&prober->mutex);
+	pthread_join(prober->thread, NULL);
+
+	if (prober->result)
+		drm_probe_destroy(prober->result);
+
+	pthread_cond_destroy(&prober->cond);
+	pthread_mutex_destroy(&prober->mutex);
+	wl_event_source_remove(prober->source);
+	close(prober->readfd);
+	close(prober->writefd);
+	udev_device_unref(prober->drm_device);
+	free(prober);
+}
+
+/* Probes connectors after a hotplug event, on the prober thread if
+ * there is one. */
+static void
+drm_backend_request_probe(struct drm_backend *b, struct udev_device *device)
+{
+	struct drm_prober *prober = b->prober;
+
+	if (!prober) {
+		drm_backend_probe_sync(b, device);
+		return;
+	}
+
+	udev_device_unref(prober->drm_device);
+	prober->drm_device = udev_device_ref(device);
+
+	pthread_mutex_lock(&prober->mutex);
+	prober->pending = true;
+	pthread_cond_signal(&prober->cond);
+	pthread_mutex_unlock(&prober->mutex);
 }
 
 static int
@@ -5693,7 +7250,7 @@ udev_drm_event(int fd, uint32_t mask, void *data)
 	event = udev_monitor_receive_device(b->udev_monitor);
 
 	if (udev_event_is_hotplug(b, event))
-		update_outputs(b, event);
+		drm_backend_request_probe(b, event);
 
 	udev_device_unref(event);
 
@@ -5716,6 +7273,9 @@ drm_destroy(struct weston_compositor *ec)
 	wl_event_source_remove(b->udev_drm_source);
 	wl_event_source_remove(b->drm_source);
 
+	/* Must be stopped before the DRM fd is closed. */
+	drm_prober_destroy(b->prober);
+
 	b->shutting_down = true;
 
 	destroy_sprites(b);
@@ -5725,6 +7285,8 @@ drm_destroy(struct weston_compositor *ec)
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
 
+	destroy_writebacks(b);
+
 	udev_unref(b->udev);
 
 	weston_launcher_destroy(ec->launcher);
@@ -5732,6 +7294,9 @@ drm_destroy(struct weston_compositor *ec)
 	wl_array_release(&b->unused_crtcs);
 	wl_array_release(&b->unused_connectors);
 
+	drm_plane_cache_release(&b->test_cache);
+	wl_array_release(&b->test_key);
+
 	close(b->drm.fd);
 	free(b);
 }
@@ -5749,6 +7314,8 @@ session_notify(struct wl_listener *listener, void *data)
 		weston_compositor_wake(compositor);
 		weston_compositor_damage_all(compositor);
 		b->state_invalid = true;
+		/* Someone else had the planes meanwhile. */
+		drm_backend_clear_plane_caches(b);
 		udev_input_enable(&b->input);
 	} else {
 		weston_log("deactivating session\n");
@@ -6168,6 +7735,8 @@ drm_backend_create(struct weston_compositor *compositor,
 	b->drm.fd = -1;
 	wl_array_init(&b->unused_crtcs);
 	wl_array_init(&b->unused_connectors);
+	drm_plane_cache_init(&b->test_cache);
+	wl_array_init(&b->test_key);
 
 	b->compositor = compositor;
 	b->use_pixman = config->use_pixman;
@@ -6249,6 +7818,9 @@ drm_backend_create(struct weston_compositor *compositor,
 	wl_list_init(&b->plane_list);
 	create_sprites(b);
 
+	wl_list_init(&b->writeback_list);
+	create_writebacks(b);
+
 	if (udev_input_init(&b->input,
 			    compositor, b->udev, seat_id,
 			    config->configure_device) < 0) {
@@ -6287,6 +7859,8 @@ drm_backend_create(struct weston_compositor *compositor,
 		goto err_udev_monitor;
 	}
 
+	b->prober = drm_prober_create(b, drm_device);
+
 	udev_device_unref(drm_device);
 
 	weston_compositor_add_debug_binding(compositor, KEY_O,
@@ -6319,6 +7893,7 @@ drm_backend_create(struct weston_compositor *compositor,
 	return b;
 
 err_udev_monitor:
+	drm_prober_destroy(b->prober);
 	wl_event_source_remove(b->udev_drm_source);
 	udev_monitor_unref(b->udev_monitor);
 err_drm_source:
@@ -6328,6 +7903,7 @@ err_udev_input:
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
 	destroy_sprites(b);
+	destroy_writebacks(b);
 err_udev_dev:
 	udev_device_unref(drm_device);
 err_launcher:
@@ -29,11 +29,15 @@
 #include "config.h"
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -45,6 +49,8 @@
 #include <libudev.h>
 
 #include "shared/helpers.h"
+#include "shared/string-helpers.h"
+#include "shared/thread-util.h"
 #include "compositor.h"
 #include "compositor-fbdev.h"
 #include "launcher-util.h"
@@ -93,6 +99,38 @@ struct fbdev_screeninfo {
 	unsigned int refresh_rate; /* Hertz */
 };
 
+#define FBDEV_MAX_PAGES 3
+
+/* One screen-sized page of the virtual frame buffer. */
+struct fbdev_page {
+	pixman_image_t *image;
+
+	/* Damage painted to the other pages since this one was last
+	 * painted, i.e. what it lacks compared to the shadow buffer. */
+	pixman_region32_t damage;
+};
+
+/* Waits for the vblank after each pan in a helper thread, so that the
+ * frame is finished with the time it actually reached the screen. */
+struct fbdev_vsync {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool quit;
+	bool pending;
+
+	int fd; /* dup of the frame buffer fd, owned by the thread */
+	clockid_t clock;
+
+	int readfd, writefd;
+	struct wl_event_source *source;
+};
+
+struct fbdev_vsync_event {
+	struct timespec ts;
+	int ok;
+};
+
 struct fbdev_output {
 	struct fbdev_backend *backend;
 	struct weston_output base;
@@ -105,8 +143,17 @@ struct fbdev_output {
 	struct fbdev_screeninfo fb_info;
 	void *fb; /* length is fb_info.buffer_length */
 
-	/* pixman details. */
-	pixman_image_t *hw_surface;
+	/* pixman details. With panning, the virtual frame buffer holds
+	 * n_pages pages and current_page is the one being scanned out.
+	 * Without it, n_pages is 1 and page 0 is painted in place. */
+	struct fbdev_page pages[FBDEV_MAX_PAGES];
+	int n_pages;
+	int current_page;
+	bool pages_invalid;
+	struct fb_var_screeninfo pan_info;
+	uint32_t orig_yres_virtual;
+
+	struct fbdev_vsync *vsync;
 	int fb_fd;
 #ifdef ENABLE_EGL
 	NativeDisplayType display;
@@ -143,29 +190,251 @@ fbdev_output_start_repaint_loop(struct weston_output *output)
 	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
+static void *
+fbdev_vsync_thread(void *data)
+{
+	struct fbdev_vsync *vsync = data;
+	struct fbdev_vsync_event event;
+	uint32_t crtc;
+	ssize_t ret;
+
+	pthread_mutex_lock(&vsync->mutex);
+	for (;;) {
+		while (!vsync->pending && !vsync->quit)
+			pthread_cond_wait(&vsync->cond, &vsync->mutex);
+		if (vsync->quit)
+			break;
+		pthread_mutex_unlock(&vsync->mutex);
+
+		crtc = 0;
+		event.ok = ioctl(vsync->fd, FBIO_WAITFORVSYNC, &crtc) == 0;
+		clock_gettime(vsync->clock, &event.ts);
+
+		do {
+			ret = write(vsync->writefd, &event, sizeof event);
+		} while (ret < 0 && errno == EINTR);
+
+		pthread_mutex_lock(&vsync->mutex);
+		vsync->pending = false;
+	}
+	pthread_mutex_unlock(&vsync->mutex);
+
+	return NULL;
+}
+
+static int
+fbdev_vsync_handler(int fd, uint32_t mask, void *data)
+{
+	struct fbdev_output *output = data;
+	struct fbdev_vsync_event event;
+	uint32_t flags = 0;
+
+	if (read(fd, &event, sizeof event) != sizeof event)
+		return 1;
+
+	if (event.ok)
+		flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC;
+	weston_output_finish_frame(&output->base, &event.ts, flags);
+
+	return 1;
+}
+
+static bool
+fbdev_vsync_wanted(void)
+{
+	char *env;
+	int value;
+
+	env = getenv("WESTON_FBDEV_VSYNC");
+	if (!env)
+		return true;
+
+	if (!safe_strtoint(env, &value)) {
+		weston_log("fbdev: invalid WESTON_FBDEV_VSYNC value '%s', "
+			   "ignoring\n", env);
+		return true;
+	}
+
+	return value != 0;
+}
+
+/* Starts the vblank helper if the driver implements FBIO_WAITFORVSYNC.
+ * Returns NULL if it does not, and frames are then finished on a timer. */
+static struct fbdev_vsync *
+fbdev_vsync_create(struct fbdev_output *output)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct fbdev_vsync *vsync;
+	struct wl_event_loop *loop;
+	uint32_t crtc = 0;
+	int fds[2];
+
+	if (!fbdev_vsync_wanted())
+		return NULL;
+
+	if (ioctl(output->fb_fd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+		weston_log("fbdev: FBIO_WAITFORVSYNC not supported, "
+			   "timing frames from the refresh rate\n");
+		return NULL;
+	}
+
+	vsync = zalloc(sizeof *vsync);
+	if (!vsync)
+		return NULL;
+
+	vsync->clock = ec->presentation_clock;
+	vsync->fd = fcntl(output->fb_fd, F_DUPFD_CLOEXEC, 0);
+	if (vsync->fd < 0)
+		goto err_free;
+
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		goto err_fd;
+	vsync->readfd = fds[0];
+	vsync->writefd = fds[1];
+
+	loop = wl_display_get_event_loop(ec->wl_display);
+	vsync->source = wl_event_loop_add_fd(loop, vsync->readfd,
+					     WL_EVENT_READABLE,
+					     fbdev_vsync_handler, output);
+	if (!vsync->source)
+		goto err_pipe;
+
+	pthread_mutex_init(&vsync->mutex, NULL);
+	pthread_cond_init(&vsync->cond, NULL);
+
+	if (thread_create_masked(&vsync->thread, fbdev_vsync_thread,
+				 vsync, 0) != 0)
+		goto err_mutex;
+
+	weston_log("fbdev: finishing frames on vblank\n");
+
+	return vsync;
+
+err_mutex:
+	pthread_cond_destroy(&vsync->cond);
+	pthread_mutex_destroy(&vsync->mutex);
+	wl_event_source_remove(vsync->source);
+err_pipe:
+	close(vsync->readfd);
+	close(vsync->writefd);
+err_fd:
+	close(vsync->fd);
+err_free:
+	weston_log("fbdev: failed to start vblank thread: %m\n");
+	free(vsync);
+
+	return NULL;
+}
+
+static void
+fbdev_vsync_destroy(struct fbdev_vsync *vsync)
+{
+	if (!vsync)
+		return;
+
+	pthread_mutex_lock(&vsync->mutex);
+	vsync->quit = true;
+	pthread_cond_signal(&vsync->cond);
+	pthread_mutex_unlock(&vsync->mutex);
+	pthread_join(vsync->thread, NULL);
+
+	pthread_cond_destroy(&vsync->cond);
+	pthread_mutex_destroy(&vsync->mutex);
+	wl_event_source_remove(vsync->source);
+	close(vsync->readfd);
+	close(vsync->writefd);
+	close(vsync->fd);
+	free(vsync);
+}
+
+/* Ends the frame just submitted: on the next vblank if the helper thread
+ * runs, otherwise after one refresh period. The refresh rate is given in
+ * mHz and the interval in ms. */
+static void
+fbdev_output_schedule_finish(struct fbdev_output *output)
+{
+	struct fbdev_vsync *vsync = output->vsync;
+
+	if (vsync) {
+		pthread_mutex_lock(&vsync->mutex);
+		vsync->pending = true;
+		pthread_cond_signal(&vsync->cond);
+		pthread_mutex_unlock(&vsync->mutex);
+		return;
+	}
+
+	wl_event_source_timer_update(output->finish_frame_timer,
+	                             1000000 / output->mode.refresh);
+}
+
+static int
+fbdev_output_pan(struct fbdev_output *output, int page)
+{
+	output->pan_info.xoffset = 0;
+	output->pan_info.yoffset = page * output->fb_info.y_resolution;
+
+	return ioctl(output->fb_fd, FBIOPAN_DISPLAY, &output->pan_info);
+}
+
 static int
 fbdev_output_repaint_pixman(struct weston_output *base, pixman_region32_t *damage)
 {
 	struct fbdev_output *output = to_fbdev_output(base);
 	struct weston_compositor *ec = output->base.compositor;
+	pixman_region32_t total_damage;
+	int next, i;
+
+	if (output->pages_invalid) {
+		for (i = 0; i < output->n_pages; i++)
+			pixman_region32_copy(&output->pages[i].damage,
+					     &output->base.region);
+		output->pages_invalid = false;
+	}
 
-	/* Repaint the damaged region onto the back buffer. */
-	pixman_renderer_output_set_buffer(base, output->hw_surface);
-	ec->renderer->repaint_output(base, damage);
+	/* Paint into the page that is not on screen, bringing it up to
+	 * date with the damage it missed while the others were shown. */
+	next = (output->current_page + 1) % output->n_pages;
+
+	pixman_region32_init(&total_damage);
+	pixman_region32_union(&total_damage, damage,
+			      &output->pages[next].damage);
+	for (i = 0; i < output->n_pages; i++) {
+		if (i == next)
+			continue;
+		pixman_region32_union(&output->pages[i].damage,
+				      &output->pages[i].damage, damage);
+	}
+	pixman_region32_fini(&output->pages[next].damage);
+	pixman_region32_init(&output->pages[next].damage);
+
+	pixman_renderer_output_set_buffer(base, output->pages[next].image);
+	ec->renderer->repaint_output(base, &total_damage);
+	pixman_region32_fini(&total_damage);
 
 	/* Update the damage region. */
 	pixman_region32_subtract(&ec->primary_plane.damage,
 	                         &ec->primary_plane.damage, damage);
 
-	/* Schedule the end of the frame. We do not sync this to the frame
-	 * buffer clock because users who want that should be using the DRM
-	 * compositor. FBIO_WAITFORVSYNC blocks and FB_ACTIVATE_VBL requires
-	 * panning, which is broken in most kernel drivers.
-	 *
-	 * Finish the frame synchronised to the specified refresh rate. The
-	 * refresh rate is given in mHz and the interval in ms. */
-	wl_event_source_timer_update(output->finish_frame_timer,
-	                             1000000 / output->mode.refresh);
+	if (output->n_pages > 1 && fbdev_output_pan(output, next) < 0) {
+		/* The driver accepted the virtual size but cannot pan after
+		 * all; keep drawing into the page on screen from now on. */
+		weston_log("fbdev: FBIOPAN_DISPLAY failed: %m, "
+			   "disabling page flipping\n");
+		if (output->current_page != 0)
+			fbdev_output_pan(output, 0);
+		for (i = 1; i < output->n_pages; i++) {
+			pixman_image_unref(output->pages[i].image);
+			output->pages[i].image = NULL;
+			pixman_region32_fini(&output->pages[i].damage);
+		}
+		output->n_pages = 1;
+		output->current_page = 0;
+		weston_output_damage(base);
+	} else {
+		output->current_page = next;
+	}
+
+	fbdev_output_schedule_finish(output);
 
 	return 0;
 }
@@ -183,8 +452,7 @@ fbdev_output_repaint(struct weston_output *base, pixman_region32_t *damage, void
 		/* Update the damage region. */
 		pixman_region32_subtract(&ec->primary_plane.damage,
 	                         &ec->primary_plane.damage, damage);
-		wl_event_source_timer_update(output->finish_frame_timer,
-                                     1000000 / output->mode.refresh);
+		fbdev_output_schedule_finish(output);
 	}
 
 	return 0;
@@ -382,6 +650,23 @@ fbdev_set_screen_info(int fd, struct fbdev_screeninfo *info)
 	return 1;
 }
 
+/* strcmp()-style return values. */
+static int
+compare_screen_info (const struct fbdev_screeninfo *a,
+                     const struct fbdev_screeninfo *b)
+{
+	if (a->x_resolution == b->x_resolution &&
+	    a->y_resolution == b->y_resolution &&
+	    a->width_mm == b->width_mm &&
+	    a->height_mm == b->height_mm &&
+	    a->bits_per_pixel == b->bits_per_pixel &&
+	    a->pixel_format == b->pixel_format &&
+	    a->refresh_rate == b->refresh_rate)
+		return 0;
+
+	return 1;
+}
+
 /* Returns an FD for the frame buffer device. */
 static int
 fbdev_frame_buffer_open(const char *fb_dev,
@@ -411,14 +696,119 @@ fbdev_frame_buffer_open(const char *fb_dev,
 	return fd;
 }
 
-/* Closes the FD on success or failure. */
+static int
+fbdev_pages_wanted(void)
+{
+	char *env;
+	int n = FBDEV_MAX_PAGES;
+
+	env = getenv("WESTON_FBDEV_PAGES");
+	if (env && (!safe_strtoint(env, &n) || n < 1)) {
+		weston_log("fbdev: invalid WESTON_FBDEV_PAGES value '%s', "
+			   "ignoring\n", env);
+		n = FBDEV_MAX_PAGES;
+	}
+	if (n > FBDEV_MAX_PAGES)
+		n = FBDEV_MAX_PAGES;
+
+	return n;
+}
+
+/* Puts back the virtual resolution found by
+ * fbdev_frame_buffer_setup_pages(), whether or not flipping ended up
+ * being used. */
+static void
+fbdev_frame_buffer_restore_pages(struct fbdev_output *output)
+{
+	struct fb_var_screeninfo varinfo;
+
+	if (output->orig_yres_virtual == 0)
+		return;
+
+	if (ioctl(output->fb_fd, FBIOGET_VSCREENINFO, &varinfo) < 0 ||
+	    varinfo.yres_virtual == output->orig_yres_virtual)
+		return;
+
+	varinfo.yres_virtual = output->orig_yres_virtual;
+	varinfo.xoffset = 0;
+	varinfo.yoffset = 0;
+	varinfo.activate = FB_ACTIVATE_NOW;
+	if (ioctl(output->fb_fd, FBIOPUT_VSCREENINFO, &varinfo) < 0)
+		weston_log("fbdev: failed to restore the virtual "
+			   "resolution: %s\n", strerror(errno));
+}
+
+/* Grows the virtual frame buffer to hold as many screen-sized pages as the
+ * driver allows, up to WESTON_FBDEV_PAGES. Returns the number of pages; 1
+ * means the driver cannot pan and the visible area is painted in place. */
+static int
+fbdev_frame_buffer_setup_pages(struct fbdev_output *output, int fd)
+{
+	struct fb_var_screeninfo varinfo;
+	struct fb_fix_screeninfo fixinfo;
+	struct fbdev_screeninfo info;
+	unsigned int yres = output->fb_info.y_resolution;
+	int n;
+
+	output->orig_yres_virtual = 0;
+	if (ioctl(fd, FBIOGET_FSCREENINFO, &fixinfo) < 0 ||
+	    ioctl(fd, FBIOGET_VSCREENINFO, &varinfo) < 0)
+		return 1;
+
+	output->orig_yres_virtual = varinfo.yres_virtual;
+
+	/* Each page must start on a line the driver can pan to. */
+	if (fixinfo.ypanstep == 0 || yres % fixinfo.ypanstep != 0)
+		return 1;
+
+	for (n = fbdev_pages_wanted(); n > 1; n--) {
+		if ((size_t)fixinfo.line_length * yres * n > fixinfo.smem_len)
+			continue;
+
+		varinfo.yres_virtual = yres * n;
+		varinfo.xoffset = 0;
+		varinfo.yoffset = 0;
+		varinfo.activate = FB_ACTIVATE_NOW;
+		if (ioctl(fd, FBIOPUT_VSCREENINFO, &varinfo) < 0 ||
+		    ioctl(fd, FBIOGET_VSCREENINFO, &varinfo) < 0)
+			continue;
+
+		/* The driver may have adjusted more than we asked for. */
+		if (varinfo.yres_virtual < yres * n ||
+		    fbdev_query_screen_info(fd, &info) < 0 ||
+		    compare_screen_info(&output->fb_info, &info) != 0 ||
+		    (size_t)info.line_length * yres * n > info.buffer_length)
+			break;
+
+		output->fb_info.buffer_length = info.buffer_length;
+		output->fb_info.line_length = info.line_length;
+		output->pan_info = varinfo;
+
+		return n;
+	}
+
+	/* Put back what we may have changed. */
+	fbdev_frame_buffer_restore_pages(output);
+
+	return 1;
+}
+
+/* Takes ownership of the FD on success. */
 static int
 fbdev_frame_buffer_map(struct fbdev_output *output, int fd)
 {
 	int retval = -1;
+	int i;
 
 	weston_log("Mapping fbdev frame buffer.\n");
 
+	output->fb_fd = fd;
+	output->n_pages = fbdev_frame_buffer_setup_pages(output, fd);
+	output->current_page = 0;
+	if (output->n_pages > 1)
+		weston_log("fbdev: flipping between %d pages\n",
+			   output->n_pages);
+
 	/* Map the frame buffer. Write-only mode, since we don't want to read
 	 * anything back (because it's slow). */
 	output->fb = mmap(NULL, output->fb_info.buffer_length,
@@ -427,33 +817,47 @@ fbdev_frame_buffer_map(struct fbdev_output *output, int fd)
 		weston_log("Failed to mmap frame buffer: %s\n",
 		           strerror(errno));
 		output->fb = NULL;
-		goto out_close;
+		goto out_restore;
 	}
 
-	/* Create a pixman image to wrap the memory mapped frame buffer. */
-	output->hw_surface =
-		pixman_image_create_bits(output->fb_info.pixel_format,
-		                         output->fb_info.x_resolution,
-		                         output->fb_info.y_resolution,
-		                         output->fb,
-		                         output->fb_info.line_length);
-	if (output->hw_surface == NULL) {
-		weston_log("Failed to create surface for frame buffer.\n");
-		goto out_unmap;
+	/* Create a pixman image to wrap each page of the memory mapped
+	 * frame buffer. */
+	for (i = 0; i < output->n_pages; i++) {
+		output->pages[i].image =
+			pixman_image_create_bits(output->fb_info.pixel_format,
+			                         output->fb_info.x_resolution,
+			                         output->fb_info.y_resolution,
+			                         (void *)((char *)output->fb +
+			                                  (size_t)i *
+			                                  output->fb_info.y_resolution *
+			                                  output->fb_info.line_length),
+			                         output->fb_info.line_length);
+		if (output->pages[i].image == NULL) {
+			weston_log("Failed to create surface for frame buffer.\n");
+			goto out_unmap;
+		}
+		pixman_region32_init(&output->pages[i].damage);
 	}
 
+	/* The pages start out with whatever the console left there. */
+	output->pages_invalid = true;
+
 	/* Success! */
-	retval = 0;
+	return 0;
 
 out_unmap:
-	if (retval != 0 && output->fb != NULL) {
-		munmap(output->fb, output->fb_info.buffer_length);
-		output->fb = NULL;
+	while (i--) {
+		pixman_image_unref(output->pages[i].image);
+		output->pages[i].image = NULL;
+		pixman_region32_fini(&output->pages[i].damage);
 	}
+	munmap(output->fb, output->fb_info.buffer_length);
+	output->fb = NULL;
 
-out_close:
-	if (fd >= 0)
-		close(fd);
+out_restore:
+	fbdev_frame_buffer_restore_pages(output);
+	output->n_pages = 0;
+	output->fb_fd = -1;
 
 	return retval;
 }
@@ -461,16 +865,24 @@ out_close:
 static void
 fbdev_frame_buffer_unmap(struct fbdev_output *output)
 {
+	int i;
+
 	if (!output->fb) {
-		assert(!output->hw_surface);
+		assert(output->n_pages == 0);
 		return;
 	}
 
 	weston_log("Unmapping fbdev frame buffer.\n");
 
-	if (output->hw_surface)
-		pixman_image_unref(output->hw_surface);
-	output->hw_surface = NULL;
+	for (i = 0; i < output->n_pages; i++) {
+		pixman_image_unref(output->pages[i].image);
+		output->pages[i].image = NULL;
+		pixman_region32_fini(&output->pages[i].damage);
+	}
+
+	/* Leave the console with the first page on screen. */
+	fbdev_frame_buffer_restore_pages(output);
+	output->n_pages = 0;
 
 	if (munmap(output->fb, output->fb_info.buffer_length) < 0)
 		weston_log("Failed to munmap frame buffer: %s\n",
@@ -501,7 +913,7 @@ fbdev_output_enable(struct weston_output *base)
 
 	if (backend->use_pixman) {
 		if (pixman_renderer_output_create(&output->base) < 0)
-			goto out_hw_surface;
+			goto out_unmap;
 #ifdef ENABLE_IMXG2D
 	} else if (backend->use_g2d) {
 		const char *g2d_device = output->device;
@@ -511,7 +923,7 @@ fbdev_output_enable(struct weston_output *base)
 		if (g2d_renderer->output_create(&output->base,
 					backend->compositor->wl_display, g2d_device) < 0) {
 			weston_log("g2d_renderer_output_create failed.\n");
-			goto out_hw_surface;
+			goto out_unmap;
 		}
 #endif
 #ifdef ENABLE_OPENGL
@@ -526,7 +938,7 @@ fbdev_output_enable(struct weston_output *base)
 						   gl_renderer->opaque_attribs,
 						   NULL, 0) < 0) {
 			weston_log("gl_renderer_output_create failed.\n");
-			goto out_hw_surface;
+			goto out_unmap;
 		}
 #endif
 	}
@@ -535,6 +947,9 @@ fbdev_output_enable(struct weston_output *base)
 	output->finish_frame_timer =
 		wl_event_loop_add_timer(loop, finish_frame_handler, output);
 
+	if (backend->use_pixman)
+		output->vsync = fbdev_vsync_create(output);
+
 	weston_log("fbdev output %d×%d px\n",
 	           output->mode.width, output->mode.height);
 	weston_log_continue(STAMP_SPACE "guessing %d Hz and 96 dpi\n",
@@ -542,9 +957,7 @@ fbdev_output_enable(struct weston_output *base)
 
 	return 0;
 
-out_hw_surface:
-	pixman_image_unref(output->hw_surface);
-	output->hw_surface = NULL;
+out_unmap:
 	fbdev_frame_buffer_unmap(output);
 
 	return -1;
@@ -558,6 +971,9 @@ fbdev_output_disable(struct weston_output *base)
 	if (!base->enabled)
 		return 0;
 
+	fbdev_vsync_destroy(output->vsync);
+	output->vsync = NULL;
+
 	wl_event_source_remove(output->finish_frame_timer);
 	output->finish_frame_timer = NULL;
 
@@ -589,13 +1005,14 @@ fbdev_output_create(struct fbdev_backend *backend,
 		weston_log("Creating frame buffer failed.\n");
 		goto out_free;
 	}
+	output->fb_fd = fb_fd;
 	if (backend->use_pixman) {
 		if (fbdev_frame_buffer_map(output, fb_fd) < 0) {
 			weston_log("Mapping frame buffer failed.\n");
+			close(fb_fd);
 			goto out_free;
 		}
 	}
-	output->fb_fd = fb_fd;
 
 	weston_output_init(&output->base, backend->compositor, "fbdev");
 
@@ -653,7 +1070,8 @@ fbdev_output_destroy(struct weston_output *base)
 		gl_renderer->output_destroy(base);
 #endif
 	}
-	close(output->fb_fd);
+	if (output->fb_fd >= 0)
+		close(output->fb_fd);
 	/* Remove the output. */
 	weston_output_release(&output->base);
 
@@ -662,23 +1080,6 @@ fbdev_output_destroy(struct weston_output *base)
 	return 0;
 }
 
-/* strcmp()-style return values. */
-static int
-compare_screen_info (const struct fbdev_screeninfo *a,
-                     const struct fbdev_screeninfo *b)
-{
-	if (a->x_resolution == b->x_resolution &&
-	    a->y_resolution == b->y_resolution &&
-	    a->width_mm == b->width_mm &&
-	    a->height_mm == b->height_mm &&
-	    a->bits_per_pixel == b->bits_per_pixel &&
-	    a->pixel_format == b->pixel_format &&
-	    a->refresh_rate == b->refresh_rate)
-		return 0;
-
-	return 1;
-}
-
 static int
 fbdev_output_reenable(struct fbdev_backend *backend,
                       struct weston_output *base)
@@ -721,10 +1122,15 @@ fbdev_output_reenable(struct fbdev_backend *backend,
 
 	/* Map the device if it has the same details as before. */
 	if (backend->use_pixman) {
+		if (output->fb_fd >= 0)
+			close(output->fb_fd);
 		if (fbdev_frame_buffer_map(output, fb_fd) < 0) {
 			weston_log("Mapping frame buffer failed.\n");
+			close(fb_fd);
 			goto err;
 		}
+	} else {
+		close(fb_fd);
 	}
 
 	return 0;
@@ -27,34 +27,51 @@
 #include "config.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 #include "compositor.h"
 #include "compositor-headless.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "pixman-renderer.h"
+#include "gl-renderer.h"
+#include "weston-egl-ext.h"
 #include "presentation-time-server-protocol.h"
 #include "windowed-output-api.h"
 
+static struct gl_renderer_interface *gl_renderer;
+
 struct headless_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
 
 	struct weston_seat fake_seat;
 	bool use_pixman;
+	bool use_gl;
+	int refresh;
+	bool unthrottled;
 };
 
 struct headless_output {
 	struct weston_output base;
 
 	struct weston_mode mode;
+	int frame_timer_fd;
 	struct wl_event_source *finish_frame_timer;
 	uint32_t *image_buf;
 	pixman_image_t *image;
+
+	/* Emulated vblank n happens at epoch + n * refresh period on
+	 * CLOCK_MONOTONIC, and n is the MSC it reports. */
+	struct timespec epoch;
+	uint64_t pending_msc;
 };
 
 static inline struct headless_output *
@@ -69,27 +86,113 @@ to_headless_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct headless_backend, base);
 }
 
+/* Unthrottled outputs advertise a 1 MHz refresh rate, so that the core
+ * schedules the next repaint as soon as a frame completes. */
+#define HEADLESS_UNTHROTTLED_REFRESH 1000000000
+
 static void
-headless_output_start_repaint_loop(struct weston_output *output)
+headless_output_vblank_time(struct headless_output *output, uint64_t msc,
+			    struct timespec *ts)
+{
+	int64_t refresh_nsec = millihz_to_nsec(output->mode.refresh);
+
+	timespec_add_nsec(ts, &output->epoch, msc * refresh_nsec);
+}
+
+/* The MSC of the last emulated vblank at or before the current time */
+static uint64_t
+headless_output_current_msc(struct headless_output *output)
 {
+	int64_t refresh_nsec = millihz_to_nsec(output->mode.refresh);
+	struct timespec now;
+	int64_t elapsed;
+
+	weston_compositor_read_presentation_clock(output->base.compositor,
+						  &now);
+	elapsed = timespec_sub_to_nsec(&now, &output->epoch);
+	if (elapsed < 0)
+		return 0;
+
+	return elapsed / refresh_nsec;
+}
+
+static void
+headless_output_start_repaint_loop(struct weston_output *output_base)
+{
+	struct headless_output *output = to_headless_output(output_base);
+	struct headless_backend *b = to_headless_backend(output_base->compositor);
 	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(output->compositor, &ts);
-	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+	if (b->unthrottled) {
+		weston_compositor_read_presentation_clock(b->compositor, &ts);
+	} else {
+		output->base.msc = MAX(output->base.msc,
+				       headless_output_current_msc(output));
+		headless_output_vblank_time(output, output->base.msc, &ts);
+	}
+
+	weston_output_finish_frame(&output->base, &ts,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
 static int
-finish_frame_handler(void *data)
+finish_frame_handler(int fd, uint32_t mask, void *data)
 {
 	struct headless_output *output = data;
+	struct headless_backend *b = to_headless_backend(output->base.compositor);
 	struct timespec ts;
+	uint64_t expirations;
+	uint32_t flags;
+
+	if (read(fd, &expirations, sizeof expirations) < 0 &&
+	    errno == EAGAIN)
+		return 1;
+
+	output->base.msc = output->pending_msc;
+
+	if (b->unthrottled) {
+		weston_compositor_read_presentation_clock(output->base.compositor,
+							  &ts);
+		flags = 0;
+	} else {
+		headless_output_vblank_time(output, output->base.msc, &ts);
+		flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC;
+	}
 
-	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-	weston_output_finish_frame(&output->base, &ts, 0);
+	weston_output_finish_frame(&output->base, &ts, flags);
 
 	return 1;
 }
 
+/* Arm the frame timer for the next emulated vblank, or to fire right
+ * away when running unthrottled. */
+static void
+headless_output_schedule_frame(struct headless_output *output)
+{
+	struct headless_backend *b = to_headless_backend(output->base.compositor);
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	uint64_t msc;
+
+	if (b->unthrottled) {
+		output->pending_msc = output->base.msc + 1;
+		weston_compositor_read_presentation_clock(output->base.compositor,
+							  &its.it_value);
+	} else {
+		msc = headless_output_current_msc(output) + 1;
+		output->pending_msc = MAX(msc, output->base.msc + 1);
+		headless_output_vblank_time(output, output->pending_msc,
+					    &its.it_value);
+	}
+
+	/* A zero it_value would disarm the timer */
+	if (timespec_is_zero(&its.it_value))
+		its.it_value.tv_nsec = 1;
+
+	if (timerfd_settime(output->frame_timer_fd, TFD_TIMER_ABSTIME,
+			    &its, NULL) < 0)
+		weston_log("headless: failed to arm frame timer: %m\n");
+}
+
 static int
 headless_output_repaint(struct weston_output *output_base,
 		       pixman_region32_t *damage,
@@ -103,7 +206,7 @@ headless_output_repaint(struct weston_output *output_base,
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	headless_output_schedule_frame(output);
 
 	return 0;
 }
@@ -118,11 +221,14 @@ headless_output_disable(struct weston_output *base)
 		return 0;
 
 	wl_event_source_remove(output->finish_frame_timer);
+	close(output->frame_timer_fd);
 
 	if (b->use_pixman) {
 		pixman_renderer_output_destroy(&output->base);
 		pixman_image_unref(output->image);
 		free(output->image_buf);
+	} else if (b->use_gl) {
+		gl_renderer->output_destroy(&output->base);
 	}
 
 	return 0;
@@ -146,9 +252,26 @@ headless_output_enable(struct weston_output *base)
 	struct headless_backend *b = to_headless_backend(base->compositor);
 	struct wl_event_loop *loop;
 
+	output->frame_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+						TFD_CLOEXEC | TFD_NONBLOCK);
+	if (output->frame_timer_fd < 0) {
+		weston_log("headless: failed to create frame timer: %m\n");
+		return -1;
+	}
+
 	loop = wl_display_get_event_loop(b->compositor->wl_display);
 	output->finish_frame_timer =
-		wl_event_loop_add_timer(loop, finish_frame_handler, output);
+		wl_event_loop_add_fd(loop, output->frame_timer_fd,
+				     WL_EVENT_READABLE, finish_frame_handler,
+				     output);
+	if (!output->finish_frame_timer) {
+		close(output->frame_timer_fd);
+		return -1;
+	}
+
+	weston_compositor_read_presentation_clock(b->compositor,
+						  &output->epoch);
+	output->base.msc = 0;
 
 	if (b->use_pixman) {
 		output->image_buf = malloc(output->base.current_mode->width *
@@ -167,6 +290,11 @@ headless_output_enable(struct weston_output *base)
 
 		pixman_renderer_output_set_buffer(&output->base,
 						  output->image);
+	} else if (b->use_gl) {
+		if (gl_renderer->output_pbuffer_create(&output->base,
+				output->base.current_mode->width,
+				output->base.current_mode->height) < 0)
+			goto err_malloc;
 	}
 
 	return 0;
@@ -176,6 +304,7 @@ err_renderer:
 	free(output->image_buf);
 err_malloc:
 	wl_event_source_remove(output->finish_frame_timer);
+	close(output->frame_timer_fd);
 
 	return -1;
 }
@@ -185,6 +314,7 @@ headless_output_set_size(struct weston_output *base,
 			 int width, int height)
 {
 	struct headless_output *output = to_headless_output(base);
+	struct headless_backend *b = to_headless_backend(base->compositor);
 	int output_width, output_height;
 
 	/* We can only be called once. */
@@ -200,7 +330,8 @@ headless_output_set_size(struct weston_output *base,
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = output_width;
 	output->mode.height = output_height;
-	output->mode.refresh = 60000;
+	output->mode.refresh =
+		b->unthrottled ? HEADLESS_UNTHROTTLED_REFRESH : b->refresh;
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
 	output->base.current_mode = &output->mode;
@@ -260,6 +391,23 @@ headless_destroy(struct weston_compositor *ec)
 	free(b);
 }
 
+static int
+init_gl_renderer(struct headless_backend *b)
+{
+	gl_renderer = weston_load_module("gl-renderer.so",
+					 "gl_renderer_interface");
+	if (!gl_renderer)
+		return -1;
+
+	/* There is no native display; the outputs render into
+	 * pbuffers that are only ever read back. */
+	return gl_renderer->display_create(b->compositor,
+					   EGL_PLATFORM_SURFACELESS_MESA,
+					   (void *) EGL_DEFAULT_DISPLAY, NULL,
+					   gl_renderer->pbuffer_attribs,
+					   NULL, 0);
+}
+
 static const struct weston_windowed_output_api api = {
 	headless_output_set_size,
 	headless_output_create,
@@ -279,18 +427,30 @@ headless_backend_create(struct weston_compositor *compositor,
 	b->compositor = compositor;
 	compositor->backend = &b->base;
 
-	if (weston_compositor_set_presentation_clock_software(compositor) < 0)
+	/* The emulated vblanks are timed with a CLOCK_MONOTONIC timerfd */
+	if (weston_compositor_set_presentation_clock(compositor,
+						     CLOCK_MONOTONIC) < 0)
 		goto err_free;
 
 	b->base.destroy = headless_destroy;
 	b->base.restore = headless_restore;
 
+	b->refresh = config->refresh;
+	b->unthrottled = config->unthrottled;
+
 	b->use_pixman = config->use_pixman;
+	b->use_gl = config->use_gl;
 	if (b->use_pixman) {
 		pixman_renderer_init(compositor);
+	} else if (b->use_gl) {
+		if (init_gl_renderer(b) < 0) {
+			weston_log("headless: failed to initialize GL renderer\n");
+			goto err_input;
+		}
 	}
 
-	if (!b->use_pixman && noop_renderer_init(compositor) < 0)
+	if (!b->use_pixman && !b->use_gl &&
+	    noop_renderer_init(compositor) < 0)
 		goto err_input;
 
 	ret = weston_plugin_api_register(compositor, WESTON_WINDOWED_OUTPUT_API_NAME,
@@ -332,6 +492,21 @@ weston_backend_init(struct weston_compositor *compositor,
 	config_init_to_defaults(&config);
 	memcpy(&config, config_base, config_base->struct_size);
 
+	if (config.refresh == 0)
+		config.refresh = 60000;
+
+	if (config.use_pixman && config.use_gl) {
+		weston_log("headless backend: use_pixman and use_gl "
+			   "are mutually exclusive\n");
+		return -1;
+	}
+
+	if (config.refresh < 0) {
+		weston_log("headless backend: invalid refresh rate %d mHz\n",
+			   config.refresh);
+		return -1;
+	}
+
 	b = headless_backend_create(compositor, &config);
 	if (b == NULL)
 		return -1;
@@ -34,13 +34,24 @@ extern "C" {
 
 #include "compositor.h"
 
-#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 2
+#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 4
 
 struct weston_headless_backend_config {
 	struct weston_backend_config base;
 
 	/** Whether to use the pixman renderer instead of the OpenGL ES renderer. */
 	int use_pixman;
+
+	/** Refresh rate of the outputs in mHz, 0 for the default of 60 Hz. */
+	int refresh;
+
+	/** Whether to complete frames as soon as they are repainted instead
+	 * of on the emulated vblanks, to measure throughput. */
+	int unthrottled;
+
+	/** Whether to use the OpenGL ES renderer on a surfaceless EGL
+	 * display instead of the no-op renderer. */
+	int use_gl;
 };
 
 #ifdef  __cplusplus
@@ -30,6 +30,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
 #include <linux/input.h>
 
 #if HAVE_FREERDP_VERSION_H
@@ -81,6 +85,8 @@
 #endif
 
 #include "shared/helpers.h"
+#include "shared/string-helpers.h"
+#include "shared/thread-util.h"
 #include "shared/timespec-util.h"
 #include "compositor.h"
 #include "compositor-rdp.h"
@@ -90,6 +96,13 @@
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
 
+/* NSCodec damage is encoded in horizontal bands, each band on its own
+ * encoder thread. RemoteFX frames are encoded as one message, see
+ * rdp_encode_group_band_height(). */
+#define RDP_ENCODE_BAND_HEIGHT 256
+#define RDP_MAX_ENCODE_THREADS 16
+#define RDP_DEFAULT_ENCODE_THREADS 4
+
 #if FREERDP_VERSION_MAJOR >= 2 && defined(PIXEL_FORMAT_BGRA32) && !defined(PIXEL_FORMAT_B8G8R8A8)
 	/* The RDP API is truly wonderful: the pixel format definition changed
 	 * from BGRA32 to B8G8R8A8, but some versions ship with a definition of
@@ -102,6 +115,23 @@
 
 struct rdp_output;
 
+/* Worker pool encoding the bands queued by the peers. Bands are taken
+ * in queue order; the thread finishing the last band of a job wakes up
+ * the compositor thread, which sends the job's bands in order. */
+struct rdp_encoder {
+	pthread_t *threads;
+	int n_threads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	bool quit;
+	struct wl_list bands;
+
+	int readfd, writefd;
+	struct wl_event_source *source;
+};
+
 struct rdp_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -115,6 +145,13 @@ struct rdp_backend {
 	char *rdp_key;
 	int tls_enabled;
 	int no_clients_resize;
+
+	struct rdp_encoder encoder;
+	struct wl_list encode_groups;
+
+	/* Scratch buffer for raw bitmap updates */
+	BYTE *raw_buffer;
+	size_t raw_buffer_size;
 };
 
 enum peer_item_flags {
@@ -138,15 +175,62 @@ struct rdp_output {
 	struct wl_list peers;
 };
 
+struct rdp_encode_group;
+
+/* One band of the output, or all of it for RemoteFX. Each band has its
+ * own codec contexts, so that the bands of a frame can be encoded in
+ * parallel. */
+struct rdp_encode_band {
+	struct rdp_encode_group *group;
+	pixman_region32_t damage;
+
+	RFX_CONTEXT *rfx_context;
+	NSC_CONTEXT *nsc_context;
+	RFX_RECT *rfx_rects;
+	int n_rfx_rects;
+	wStream *stream;
+
+	/* in rdp_encoder::bands while waiting for a thread */
+	struct wl_list link;
+};
+
+/* A group has at most one frame being encoded; damage arriving in the
+ * meantime is encoded as the next frame, so frames stay in order. */
+struct rdp_encode_job {
+	bool busy;
+	struct rdp_encode_band *bands;
+	int n_slots;
+	int n_bands;
+	int bands_done; /* protected by the encoder mutex */
+};
+
+/* Encoder state shared by the peers using the same codec at the same
+ * desktop size, so that a frame is encoded once and sent to all of
+ * them. */
+struct rdp_encode_group {
+	struct rdp_backend *backend;
+	bool use_rfx;
+	uint32_t width, height;
+
+	struct wl_list peers; /* RdpPeerContext::encode_link */
+	struct wl_list link; /* rdp_backend::encode_groups */
+
+	/* Damage not handed to the encoder yet */
+	pixman_region32_t pending_damage;
+	/* Damaged parts of the shadow surface, as of the job start */
+	pixman_image_t *snapshot;
+	struct rdp_encode_job job;
+};
+
 struct rdp_peer_context {
 	rdpContext _p;
 
 	struct rdp_backend *rdpBackend;
 	struct wl_event_source *events[MAX_FREERDP_FDS];
-	RFX_CONTEXT *rfx_context;
-	wStream *encode_stream;
-	RFX_RECT *rfx_rects;
-	NSC_CONTEXT *nsc_context;
+
+	/* NULL for peers receiving raw bitmap updates */
+	struct rdp_encode_group *encode_group;
+	struct wl_list encode_link;
 
 	struct rdp_peers_item item;
 };
@@ -164,103 +248,587 @@ to_rdp_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct rdp_backend, base);
 }
 
+static int
+rdp_encode_band_init(struct rdp_encode_band *band,
+		     struct rdp_encode_group *group)
+{
+	band->group = group;
+	pixman_region32_init(&band->damage);
+	wl_list_init(&band->link);
+
+#if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
+	band->rfx_context = rfx_context_new();
+#else
+	band->rfx_context = rfx_context_new(TRUE);
+#endif
+	if (!band->rfx_context)
+		goto out_error_rfx;
+
+	band->rfx_context->mode = RLGR3;
+	band->rfx_context->width = group->width;
+	band->rfx_context->height = group->height;
+	rfx_context_set_pixel_format(band->rfx_context, DEFAULT_PIXEL_FORMAT);
+
+	band->nsc_context = nsc_context_new();
+	if (!band->nsc_context)
+		goto out_error_nsc;
+
+	nsc_context_set_pixel_format(band->nsc_context, DEFAULT_PIXEL_FORMAT);
+
+	band->stream = Stream_New(NULL, 65536);
+	if (!band->stream)
+		goto out_error_stream;
+
+	return 0;
+
+out_error_stream:
+	nsc_context_free(band->nsc_context);
+out_error_nsc:
+	rfx_context_free(band->rfx_context);
+out_error_rfx:
+	pixman_region32_fini(&band->damage);
+	return -1;
+}
+
+static void
+rdp_encode_band_release(struct rdp_encode_band *band)
+{
+	Stream_Free(band->stream, TRUE);
+	nsc_context_free(band->nsc_context);
+	rfx_context_free(band->rfx_context);
+	free(band->rfx_rects);
+	pixman_region32_fini(&band->damage);
+}
+
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_encode_group_release_bands(struct rdp_encode_group *group)
 {
-	int width, height, nrects, i;
-	pixman_box32_t *region, *rects;
-	uint32_t *ptr;
+	int i;
+
+	for (i = 0; i < group->job.n_slots; i++)
+		rdp_encode_band_release(&group->job.bands[i]);
+	free(group->job.bands);
+	group->job.bands = NULL;
+	group->job.n_slots = 0;
+}
+
+/* Called from the encoder threads, only touches the band. */
+static void
+rdp_encode_band(struct rdp_encode_band *band, pixman_image_t *image,
+		bool use_rfx)
+{
+	pixman_box32_t *extents = pixman_region32_extents(&band->damage);
+	int stride = pixman_image_get_stride(image);
+	int width = extents->x2 - extents->x1;
+	int height = extents->y2 - extents->y1;
+	pixman_box32_t *rects;
 	RFX_RECT *rfxRect;
+	int nrects, i;
+	BYTE *ptr;
+
+	Stream_Clear(band->stream);
+	Stream_SetPosition(band->stream, 0);
+
+	ptr = (BYTE *)pixman_image_get_data(image) +
+		extents->y1 * stride + extents->x1 * 4;
+
+	if (!use_rfx) {
+		nsc_compose_message(band->nsc_context, band->stream, ptr,
+				    width, height, stride);
+		return;
+	}
+
+	rects = pixman_region32_rectangles(&band->damage, &nrects);
+	if (nrects > band->n_rfx_rects) {
+		rfxRect = realloc(band->rfx_rects, nrects * sizeof *rfxRect);
+		if (!rfxRect)
+			return;
+		band->rfx_rects = rfxRect;
+		band->n_rfx_rects = nrects;
+	}
+
+	for (i = 0; i < nrects; i++) {
+		rfxRect = &band->rfx_rects[i];
+
+		rfxRect->x = (rects[i].x1 - extents->x1);
+		rfxRect->y = (rects[i].y1 - extents->y1);
+		rfxRect->width = (rects[i].x2 - rects[i].x1);
+		rfxRect->height = (rects[i].y2 - rects[i].y1);
+	}
+
+	rfx_compose_message(band->rfx_context, band->stream,
+			    band->rfx_rects, nrects, ptr, width, height, stride);
+}
+
+static void
+rdp_peer_send_band(freerdp_peer *peer, struct rdp_encode_band *band,
+		   bool use_rfx)
+{
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	pixman_box32_t *extents = pixman_region32_extents(&band->damage);
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
-
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
+	/* The encoder gave up, most likely out of memory */
+	if (Stream_GetPosition(band->stream) == 0)
+		return;
 
 #ifdef HAVE_SKIP_COMPRESSION
 	cmd->skipCompression = TRUE;
 #else
 	memset(cmd, 0, sizeof(*cmd));
 #endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
+	cmd->destLeft = extents->x1;
+	cmd->destTop = extents->y1;
+	cmd->destRight = extents->x2;
+	cmd->destBottom = extents->y2;
 	cmd->bpp = 32;
-	cmd->codecID = peer->settings->RemoteFxCodecId;
-	cmd->width = width;
-	cmd->height = height;
+	cmd->codecID = use_rfx ? peer->settings->RemoteFxCodecId :
+				 peer->settings->NSCodecId;
+	cmd->width = extents->x2 - extents->x1;
+	cmd->height = extents->y2 - extents->y1;
 
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+	cmd->bitmapDataLength = Stream_GetPosition(band->stream);
+	cmd->bitmapData = Stream_Buffer(band->stream);
 
-	rects = pixman_region32_rectangles(damage, &nrects);
-	context->rfx_rects = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
+	update->SurfaceBits(update->context, cmd);
+}
 
-	for (i = 0; i < nrects; i++) {
-		region = &rects[i];
-		rfxRect = &context->rfx_rects[i];
+static void
+rdp_encode_group_start(struct rdp_encode_group *group);
+
+/* Sends the encoded bands of the finished job, top to bottom, to every
+ * peer of the group, and starts encoding whatever damage came in
+ * meanwhile. */
+static void
+rdp_encode_group_finish(struct rdp_encode_group *group)
+{
+	struct rdp_encode_job *job = &group->job;
+	RdpPeerContext *context;
+	int i;
+
+	wl_list_for_each(context, &group->peers, encode_link) {
+		if (!(context->item.flags & RDP_PEER_ACTIVATED) ||
+		    !(context->item.flags & RDP_PEER_OUTPUT_ENABLED))
+			continue;
 
-		rfxRect->x = (region->x1 - damage->extents.x1);
-		rfxRect->y = (region->y1 - damage->extents.y1);
-		rfxRect->width = (region->x2 - region->x1);
-		rfxRect->height = (region->y2 - region->y1);
+		for (i = 0; i < job->n_slots; i++)
+			if (pixman_region32_not_empty(&job->bands[i].damage))
+				rdp_peer_send_band(context->item.peer,
+						   &job->bands[i],
+						   group->use_rfx);
 	}
 
-	rfx_compose_message(context->rfx_context, context->encode_stream, context->rfx_rects, nrects,
-			(BYTE *)ptr, width, height,
-			pixman_image_get_stride(image)
-	);
+	job->busy = false;
 
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
+	if (pixman_region32_not_empty(&group->pending_damage))
+		rdp_encode_group_start(group);
+}
 
-	update->SurfaceBits(update->context, cmd);
+/* An NSCodec message is a plain bitmap, so each band can be sent as a
+ * surface bits command of its own. A RemoteFX message carries a frame
+ * with its tile set, and the frames of one context must follow each
+ * other, so a RemoteFX frame is encoded as a single message; the codec
+ * then encodes its tiles in parallel on its own thread pool, where
+ * FreeRDP has one. */
+static int
+rdp_encode_group_band_height(struct rdp_encode_group *group, int height)
+{
+	return group->use_rfx ? height : RDP_ENCODE_BAND_HEIGHT;
 }
 
+static int
+rdp_encode_group_prepare(struct rdp_encode_group *group,
+			 pixman_image_t *shadow)
+{
+	struct rdp_encode_job *job = &group->job;
+	int width = pixman_image_get_width(shadow);
+	int height = pixman_image_get_height(shadow);
+	int band_height = rdp_encode_group_band_height(group, height);
+	int n_slots = (height + band_height - 1) / band_height;
+	int i;
+
+	if (!group->snapshot ||
+	    pixman_image_get_width(group->snapshot) != width ||
+	    pixman_image_get_height(group->snapshot) != height) {
+		if (group->snapshot)
+			pixman_image_unref(group->snapshot);
+		group->snapshot =
+			pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+						 NULL, width * 4);
+		if (!group->snapshot)
+			return -1;
+	}
+
+	if (job->n_slots == n_slots)
+		return 0;
+
+	rdp_encode_group_release_bands(group);
+	job->bands = zalloc(n_slots * sizeof job->bands[0]);
+	if (!job->bands)
+		return -1;
+
+	for (i = 0; i < n_slots; i++) {
+		if (rdp_encode_band_init(&job->bands[i], group) < 0) {
+			job->n_slots = i;
+			rdp_encode_group_release_bands(group);
+			return -1;
+		}
+	}
+	job->n_slots = n_slots;
+
+	return 0;
+}
 
+/* Snapshots the pending damage and hands its bands to the encoder
+ * threads, or encodes them right away without threads. */
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_encode_group_start(struct rdp_encode_group *group)
 {
-	int width, height;
-	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_backend *b = group->backend;
+	struct rdp_encoder *encoder = &b->encoder;
+	struct rdp_encode_job *job = &group->job;
+	pixman_image_t *shadow;
+	struct rdp_encode_band *band;
+	int band_height;
+	int i;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	if (job->busy || !b->output ||
+	    !pixman_region32_not_empty(&group->pending_damage))
+		return;
 
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
+	shadow = b->output->shadow_surface;
+	if (rdp_encode_group_prepare(group, shadow) < 0) {
+		weston_log("rdp: out of memory encoding a frame\n");
+		return;
+	}
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd->skipCompression = TRUE;
-#else
-	memset(cmd, 0, sizeof(*cmd));
-#endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->NSCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
-
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			cmd->width,	cmd->height,
-			pixman_image_get_stride(image));
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
-	update->SurfaceBits(update->context, cmd);
+	pixman_image_set_clip_region32(group->snapshot,
+				       &group->pending_damage);
+	pixman_image_composite32(PIXMAN_OP_SRC, shadow, NULL,
+				 group->snapshot,
+				 0, 0, 0, 0, 0, 0,
+				 pixman_image_get_width(shadow),
+				 pixman_image_get_height(shadow));
+	pixman_image_set_clip_region32(group->snapshot, NULL);
+
+	band_height = rdp_encode_group_band_height(group,
+				pixman_image_get_height(shadow));
+	job->n_bands = 0;
+	job->bands_done = 0;
+	for (i = 0; i < job->n_slots; i++) {
+		band = &job->bands[i];
+		pixman_region32_intersect_rect(&band->damage,
+					       &group->pending_damage,
+					       0, i * band_height,
+					       pixman_image_get_width(shadow),
+					       band_height);
+		if (pixman_region32_not_empty(&band->damage))
+			job->n_bands++;
+	}
+
+	pixman_region32_fini(&group->pending_damage);
+	pixman_region32_init(&group->pending_damage);
+
+	if (job->n_bands == 0)
+		return;
+
+	job->busy = true;
+
+	if (encoder->n_threads == 0) {
+		for (i = 0; i < job->n_slots; i++)
+			if (pixman_region32_not_empty(&job->bands[i].damage))
+				rdp_encode_band(&job->bands[i],
+						group->snapshot, group->use_rfx);
+		rdp_encode_group_finish(group);
+		return;
+	}
+
+	pthread_mutex_lock(&encoder->mutex);
+	for (i = 0; i < job->n_slots; i++) {
+		band = &job->bands[i];
+		if (pixman_region32_not_empty(&band->damage))
+			wl_list_insert(encoder->bands.prev, &band->link);
+	}
+	pthread_cond_broadcast(&encoder->work_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+/* Waits for the job of a group, dropping the bands no thread took yet. */
+static void
+rdp_encode_group_cancel(struct rdp_encode_group *group)
+{
+	struct rdp_encoder *encoder = &group->backend->encoder;
+	struct rdp_encode_job *job = &group->job;
+	int i;
+
+	if (!job->busy || encoder->n_threads == 0) {
+		job->busy = false;
+		return;
+	}
+
+	pthread_mutex_lock(&encoder->mutex);
+	for (i = 0; i < job->n_slots; i++) {
+		if (!wl_list_empty(&job->bands[i].link)) {
+			wl_list_remove(&job->bands[i].link);
+			wl_list_init(&job->bands[i].link);
+			job->bands_done++;
+		}
+	}
+	while (job->bands_done < job->n_bands)
+		pthread_cond_wait(&encoder->done_cond, &encoder->mutex);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	job->busy = false;
+}
+
+static void
+rdp_encode_group_destroy(struct rdp_encode_group *group)
+{
+	rdp_encode_group_cancel(group);
+	rdp_encode_group_release_bands(group);
+	if (group->snapshot)
+		pixman_image_unref(group->snapshot);
+	pixman_region32_fini(&group->pending_damage);
+	wl_list_remove(&group->link);
+	free(group);
+}
+
+static void
+rdp_peer_leave_encode_group(RdpPeerContext *context)
+{
+	struct rdp_encode_group *group = context->encode_group;
+
+	if (!group)
+		return;
+
+	wl_list_remove(&context->encode_link);
+	context->encode_group = NULL;
+
+	if (wl_list_empty(&group->peers))
+		rdp_encode_group_destroy(group);
+}
+
+/* Puts a peer that was just activated in the group matching its codec
+ * settings. The codec contexts of the group start over, so the new
+ * peer gets the codec headers, and the next frame is a full one. */
+static int
+rdp_peer_join_encode_group(RdpPeerContext *context, int width, int height)
+{
+	struct rdp_backend *b = context->rdpBackend;
+	rdpSettings *settings = context->item.peer->settings;
+	struct rdp_encode_group *group;
+	bool use_rfx = settings->RemoteFxCodec;
+	int i;
+
+	rdp_peer_leave_encode_group(context);
+
+	if (!settings->RemoteFxCodec && !settings->NSCodec)
+		return 0;
+
+	wl_list_for_each(group, &b->encode_groups, link) {
+		if (group->use_rfx == use_rfx &&
+		    group->width == (uint32_t)width &&
+		    group->height == (uint32_t)height)
+			goto found;
+	}
+
+	group = zalloc(sizeof *group);
+	if (!group)
+		return -1;
+
+	group->backend = b;
+	group->use_rfx = use_rfx;
+	group->width = width;
+	group->height = height;
+	wl_list_init(&group->peers);
+	pixman_region32_init(&group->pending_damage);
+	wl_list_insert(b->encode_groups.prev, &group->link);
+
+found:
+	rdp_encode_group_cancel(group);
+	for (i = 0; i < group->job.n_slots; i++) {
+		RFX_RESET(group->job.bands[i].rfx_context, width, height);
+		NSC_RESET(group->job.bands[i].nsc_context, width, height);
+	}
+	pixman_region32_union_rect(&group->pending_damage,
+				   &group->pending_damage,
+				   0, 0, width, height);
+
+	wl_list_insert(&group->peers, &context->encode_link);
+	context->encode_group = group;
+
+	return 0;
+}
+
+static void *
+rdp_encoder_thread(void *data)
+{
+	struct rdp_encoder *encoder = data;
+	struct rdp_encode_band *band;
+	struct rdp_encode_group *group;
+	char c = 0;
+
+	pthread_mutex_lock(&encoder->mutex);
+	for (;;) {
+		while (!encoder->quit && wl_list_empty(&encoder->bands))
+			pthread_cond_wait(&encoder->work_cond, &encoder->mutex);
+
+		if (encoder->quit)
+			break;
+
+		band = container_of(encoder->bands.next,
+				    struct rdp_encode_band, link);
+		wl_list_remove(&band->link);
+		wl_list_init(&band->link);
+		group = band->group;
+		pthread_mutex_unlock(&encoder->mutex);
+
+		rdp_encode_band(band, group->snapshot, group->use_rfx);
+
+		pthread_mutex_lock(&encoder->mutex);
+		if (++group->job.bands_done == group->job.n_bands) {
+			pthread_cond_broadcast(&encoder->done_cond);
+			if (write(encoder->writefd, &c, 1) < 0)
+				weston_log("rdp: failed to signal an encoded frame\n");
+		}
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+static int
+rdp_encoder_activity(int fd, uint32_t mask, void *data)
+{
+	struct rdp_backend *b = data;
+	struct rdp_encoder *encoder = &b->encoder;
+	struct rdp_encode_group *group;
+	char buf[16];
+	bool done;
+
+	if (read(fd, buf, sizeof buf) < 0)
+		weston_log("rdp: failed to read encoder signal\n");
+
+	wl_list_for_each(group, &b->encode_groups, link) {
+		if (!group->job.busy)
+			continue;
+
+		pthread_mutex_lock(&encoder->mutex);
+		done = group->job.bands_done == group->job.n_bands;
+		pthread_mutex_unlock(&encoder->mutex);
+
+		if (done)
+			rdp_encode_group_finish(group);
+	}
+
+	return 1;
+}
+
+static int
+rdp_encoder_init(struct rdp_backend *b)
+{
+	struct rdp_encoder *encoder = &b->encoder;
+	struct wl_event_loop *loop;
+	char *env;
+	int fds[2];
+	int n, i;
+
+	wl_list_init(&encoder->bands);
+	wl_list_init(&b->encode_groups);
+
+	n = RDP_DEFAULT_ENCODE_THREADS;
+	env = getenv("WESTON_RDP_ENCODE_THREADS");
+	if (env && (!safe_strtoint(env, &n) || n < 0)) {
+		weston_log("RDP backend: invalid WESTON_RDP_ENCODE_THREADS "
+			   "value '%s', ignoring\n", env);
+		n = RDP_DEFAULT_ENCODE_THREADS;
+	}
+	if (n > RDP_MAX_ENCODE_THREADS)
+		n = RDP_MAX_ENCODE_THREADS;
+	if (!env && n > sysconf(_SC_NPROCESSORS_ONLN))
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0)
+		return 0;
+
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		weston_log("RDP backend: encoder pipe failed: %m\n");
+		return -1;
+	}
+	encoder->readfd = fds[0];
+	encoder->writefd = fds[1];
+
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+	encoder->source = wl_event_loop_add_fd(loop, encoder->readfd,
+					       WL_EVENT_READABLE,
+					       rdp_encoder_activity, b);
+	if (!encoder->source)
+		goto err_pipe;
+
+	encoder->threads = zalloc(n * sizeof encoder->threads[0]);
+	if (!encoder->threads)
+		goto err_source;
+
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->work_cond, NULL);
+	pthread_cond_init(&encoder->done_cond, NULL);
+
+	for (i = 0; i < n; i++) {
+		if (thread_create_masked(&encoder->threads[i],
+					 rdp_encoder_thread, encoder, 0) != 0)
+			break;
+	}
+
+	encoder->n_threads = i;
+	if (encoder->n_threads == 0) {
+		weston_log("RDP backend: failed to create encoder threads\n");
+		pthread_cond_destroy(&encoder->done_cond);
+		pthread_cond_destroy(&encoder->work_cond);
+		pthread_mutex_destroy(&encoder->mutex);
+		free(encoder->threads);
+		encoder->threads = NULL;
+		goto err_source;
+	}
+
+	weston_log("RDP backend: encoding on %d threads\n",
+		   encoder->n_threads);
+
+	return 0;
+
+err_source:
+	wl_event_source_remove(encoder->source);
+	encoder->source = NULL;
+err_pipe:
+	close(encoder->readfd);
+	close(encoder->writefd);
+	return -1;
+}
+
+static void
+rdp_encoder_fini(struct rdp_backend *b)
+{
+	struct rdp_encoder *encoder = &b->encoder;
+	int i;
+
+	if (encoder->n_threads == 0)
+		return;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->quit = true;
+	pthread_cond_broadcast(&encoder->work_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	for (i = 0; i < encoder->n_threads; i++)
+		pthread_join(encoder->threads[i], NULL);
+	free(encoder->threads);
+	encoder->n_threads = 0;
+
+	pthread_cond_destroy(&encoder->done_cond);
+	pthread_cond_destroy(&encoder->work_cond);
+	pthread_mutex_destroy(&encoder->mutex);
+
+	wl_event_source_remove(encoder->source);
+	close(encoder->readfd);
+	close(encoder->writefd);
 }
 
 static void
@@ -280,17 +848,44 @@ pixman_image_flipped_subrect(const pixman_box32_t *rect, pixman_image_t *img, BY
 static void
 rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_peer *peer)
 {
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_backend *b = context->rdpBackend;
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
 	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
 	pixman_box32_t *rect, subrect;
 	int nrects, i;
 	int heightIncrement, remainingHeight, top;
+	int width, height;
+	size_t size;
+	BYTE *buffer;
 
 	rect = pixman_region32_rectangles(region, &nrects);
 	if (!nrects)
 		return;
 
+	/* No slice is larger than the widest rect at the tallest slice
+	 * height, so size the scratch buffer once for the whole region. */
+	size = 0;
+	for (i = 0; i < nrects; i++) {
+		width = rect[i].x2 - rect[i].x1;
+		height = peer->settings->MultifragMaxRequestSize / (16 + width * 4);
+		if (height > rect[i].y2 - rect[i].y1)
+			height = rect[i].y2 - rect[i].y1;
+		if ((size_t)width * height * 4 > size)
+			size = (size_t)width * height * 4;
+	}
+
+	if (size > b->raw_buffer_size) {
+		buffer = realloc(b->raw_buffer, size);
+		if (!buffer) {
+			weston_log("rdp: out of memory sending raw bitmaps\n");
+			return;
+		}
+		b->raw_buffer = buffer;
+		b->raw_buffer_size = size;
+	}
+
 	marker->frameId++;
 	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
 	update->SurfaceFrameMarker(peer->context, marker);
@@ -317,7 +912,7 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 			   cmd->destTop = top;
 			   cmd->destBottom = top + cmd->height;
 			   cmd->bitmapDataLength = cmd->width * cmd->height * 4;
-			   cmd->bitmapData = (BYTE *)realloc(cmd->bitmapData, cmd->bitmapDataLength);
+			   cmd->bitmapData = b->raw_buffer;
 
 			   subrect.y1 = top;
 			   subrect.y2 = top + cmd->height;
@@ -331,6 +926,9 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 		}
 	}
 
+	/* The buffer belongs to the backend, not to the update */
+	cmd->bitmapData = NULL;
+
 	marker->frameAction = SURFACECMD_FRAMEACTION_END;
 	update->SurfaceFrameMarker(peer->context, marker);
 }
@@ -340,14 +938,17 @@ rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 {
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	struct rdp_output *output = context->rdpBackend->output;
-	rdpSettings *settings = peer->settings;
-
-	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
-	else
+	struct rdp_encode_group *group = context->encode_group;
+
+	/* Encoded once for the whole group; if a frame is being encoded,
+	 * the region goes out with the next one. */
+	if (group) {
+		pixman_region32_union(&group->pending_damage,
+				      &group->pending_damage, region);
+		rdp_encode_group_start(group);
+	} else {
 		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+	}
 }
 
 static void
@@ -365,19 +966,36 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
 {
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
+	struct rdp_backend *b = to_rdp_backend(ec);
 	struct rdp_peers_item *outputPeer;
+	RdpPeerContext *context;
+	struct rdp_encode_group *group;
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
 	if (pixman_region32_not_empty(damage)) {
+		/* Queue the damage of all groups first, so that each group
+		 * starts a single frame. */
 		wl_list_for_each(outputPeer, &output->peers, link) {
-			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
-			}
+			if (!(outputPeer->flags & RDP_PEER_ACTIVATED) ||
+			    !(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
+				continue;
+
+			context = (RdpPeerContext *)outputPeer->peer->context;
+			group = context->encode_group;
+			if (group)
+				pixman_region32_union(&group->pending_damage,
+						      &group->pending_damage,
+						      damage);
+			else
+				rdp_peer_refresh_raw(damage,
+						     output->shadow_surface,
+						     outputPeer->peer);
 		}
+
+		wl_list_for_each(group, &b->encode_groups, link)
+			rdp_encode_group_start(group);
 	}
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
@@ -605,8 +1223,20 @@ static void
 rdp_destroy(struct weston_compositor *ec)
 {
 	struct rdp_backend *b = to_rdp_backend(ec);
+	struct rdp_encode_group *group, *next;
+	RdpPeerContext *context, *cnext;
 	int i;
 
+	rdp_encoder_fini(b);
+	wl_list_for_each_safe(group, next, &b->encode_groups, link) {
+		wl_list_for_each_safe(context, cnext, &group->peers, encode_link) {
+			wl_list_remove(&context->encode_link);
+			wl_list_init(&context->encode_link);
+			context->encode_group = NULL;
+		}
+		rdp_encode_group_destroy(group);
+	}
+
 	weston_compositor_shutdown(ec);
 	for (i = 0; i < MAX_FREERDP_FDS; i++)
 		if (b->listener_events[i])
@@ -617,6 +1247,7 @@ rdp_destroy(struct weston_compositor *ec)
 	free(b->server_cert);
 	free(b->server_key);
 	free(b->rdp_key);
+	free(b->raw_buffer);
 	free(b);
 }
 
@@ -666,37 +1297,11 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	context->item.peer = client;
 	context->item.flags = RDP_PEER_OUTPUT_ENABLED;
 
-#if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
-	context->rfx_context = rfx_context_new();
-#else
-	context->rfx_context = rfx_context_new(TRUE);
-#endif
-	if (!context->rfx_context) {
-		FREERDP_CB_RETURN(FALSE);
-	}
-
-	context->rfx_context->mode = RLGR3;
-	context->rfx_context->width = client->settings->DesktopWidth;
-	context->rfx_context->height = client->settings->DesktopHeight;
-	rfx_context_set_pixel_format(context->rfx_context, DEFAULT_PIXEL_FORMAT);
-
-	context->nsc_context = nsc_context_new();
-	if (!context->nsc_context)
-		goto out_error_nsc;
-
-	nsc_context_set_pixel_format(context->nsc_context, DEFAULT_PIXEL_FORMAT);
-
-	context->encode_stream = Stream_New(NULL, 65536);
-	if (!context->encode_stream)
-		goto out_error_stream;
+	/* The codec contexts are shared with other peers and set up
+	 * once the peer is activated, see rdp_peer_join_encode_group(). */
+	wl_list_init(&context->encode_link);
 
 	FREERDP_CB_RETURN(TRUE);
-
-out_error_nsc:
-	rfx_context_free(context->rfx_context);
-out_error_stream:
-	nsc_context_free(context->nsc_context);
-	FREERDP_CB_RETURN(FALSE);
 }
 
 static void
@@ -719,10 +1324,7 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		 * but it would crash on reconnect */
 	}
 
-	Stream_Free(context->encode_stream, TRUE);
-	nsc_context_free(context->nsc_context);
-	rfx_context_free(context->rfx_context);
-	free(context->rfx_rects);
+	rdp_peer_leave_encode_group(context);
 }
 
 
@@ -945,11 +1547,18 @@ xf_peer_activate(freerdp_peer* client)
 	}
 
 	weston_output = &output->base;
-	RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
-	NSC_RESET(peerCtx->nsc_context, weston_output->width, weston_output->height);
+	if (rdp_peer_join_encode_group(peerCtx, weston_output->width,
+				       weston_output->height) < 0) {
+		weston_log("unable to set up the peer encoder\n");
+		return FALSE;
+	}
 
-	if (peersItem->flags & RDP_PEER_ACTIVATED)
+	/* The group of a reactivated peer has a full frame queued now */
+	if (peersItem->flags & RDP_PEER_ACTIVATED) {
+		if (peerCtx->encode_group)
+			rdp_encode_group_start(peerCtx->encode_group);
 		return TRUE;
+	}
 
 	/* when here it's the first reactivation, we need to setup a little more */
 	weston_log("kbd_layout:0x%x kbd_type:0x%x kbd_subType:0x%x kbd_functionKeys:0x%x\n",
@@ -1325,6 +1934,9 @@ rdp_backend_create(struct weston_compositor *compositor,
 	if (pixman_renderer_init(compositor) < 0)
 		goto err_compositor;
 
+	if (rdp_encoder_init(b) < 0)
+		goto err_compositor;
+
 	if (rdp_backend_create_output(compositor) < 0)
 		goto err_compositor;
 
@@ -1370,6 +1982,7 @@ err_listener:
 err_output:
 	weston_output_release(&b->output->base);
 err_compositor:
+	rdp_encoder_fini(b);
 	weston_compositor_shutdown(compositor);
 err_free_strings:
 	free(b->rdp_key);
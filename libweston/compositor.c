@@ -52,6 +52,7 @@
 #include <errno.h>
 
 #include "timeline.h"
+#include "repaint-profiler.h"
 
 #include "compositor.h"
 #include "viewporter-server-protocol.h"
@@ -66,6 +67,12 @@
 
 #define DEFAULT_REPAINT_WINDOW 16 /* milliseconds */
 
+/* The adaptive repaint window needs this many measured frames before it
+ * replaces repaint_msec, and covers the repaint timer resolution on top
+ * of the measured cost. */
+#define ADAPTIVE_REPAINT_MIN_SAMPLES 16
+#define ADAPTIVE_REPAINT_SLACK_NSEC 1000000
+
 static void
 weston_output_update_matrix(struct weston_output *output);
 
@@ -76,6 +83,15 @@ weston_output_transform_scale_init(struct weston_output *output,
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor);
 
+static void
+weston_compositor_invalidate_pick_index(struct weston_compositor *compositor);
+
+static void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor)
+{
+	compositor->layers_generation++;
+}
+
 static void weston_mode_switch_finish(struct weston_output *output,
 				      int mode_changed,
 				      int scale_changed)
@@ -1270,6 +1286,7 @@ weston_view_update_transform(struct weston_view *view)
 	view->transform.dirty = 0;
 
 	weston_view_damage_below(view);
+	weston_compositor_invalidate_pick_index(view->surface->compositor);
 
 	pixman_region32_fini(&view->transform.boundingbox);
 	pixman_region32_fini(&view->transform.opaque);
@@ -1728,40 +1745,272 @@ weston_compositor_get_time(struct timespec *time)
 	clock_gettime(CLOCK_REALTIME, time);
 }
 
+/* Smallest grid cell size of the pick index, as a power of two */
+#define PICK_INDEX_CELL_SHIFT 6
+/* The cell size grows until the grid has at most this many cells */
+#define PICK_INDEX_MAX_CELLS 16384
+/* Views spanning more cells than this are not binned but always tested */
+#define PICK_INDEX_MAX_VIEW_CELLS 64
+
+/** Spatial index of weston_compositor::view_list for input picking
+ *
+ * The bounding boxes of the views are binned into a uniform grid over
+ * their union. Each cell lists, in stacking order, the views whose
+ * bounding box overlaps it, so picking only tests the views of one
+ * cell plus the few views too large to bin. Views are referred to by
+ * their position in view_list, which keeps both lists sorted.
+ *
+ * The index is rebuilt lazily on the next pick after the view list is
+ * rebuilt, a view leaves it, or a bounding box changes.
+ */
+struct weston_pick_index {
+	bool dirty;
+
+	struct wl_array views;		/* struct weston_view *, top first */
+	struct wl_array large;		/* uint32_t index into views */
+
+	struct wl_array *cells;		/* uint32_t index into views */
+	int n_cells;
+	int32_t x, y;			/* grid origin, global coordinates */
+	int width, height;		/* in cells */
+	int shift;
+};
+
+static void
+weston_compositor_invalidate_pick_index(struct weston_compositor *compositor)
+{
+	if (compositor->pick_index)
+		compositor->pick_index->dirty = true;
+}
+
+static struct weston_pick_index *
+pick_index_create(void)
+{
+	struct weston_pick_index *index;
+
+	index = zalloc(sizeof *index);
+	if (!index)
+		return NULL;
+
+	index->dirty = true;
+	wl_array_init(&index->views);
+	wl_array_init(&index->large);
+
+	return index;
+}
+
+static void
+pick_index_destroy(struct weston_pick_index *index)
+{
+	int i;
+
+	if (!index)
+		return;
+
+	for (i = 0; i < index->n_cells; i++)
+		wl_array_release(&index->cells[i]);
+	free(index->cells);
+	wl_array_release(&index->large);
+	wl_array_release(&index->views);
+	free(index);
+}
+
+static bool
+pick_index_add(struct wl_array *array, uint32_t i)
+{
+	uint32_t *p;
+
+	p = wl_array_add(array, sizeof *p);
+	if (!p)
+		return false;
+
+	*p = i;
+	return true;
+}
+
+static bool
+pick_index_rebuild(struct weston_pick_index *index, struct wl_list *view_list)
+{
+	struct weston_view *view, **v;
+	struct wl_array *cells;
+	pixman_box32_t *box;
+	int32_t x1 = INT32_MAX, y1 = INT32_MAX;
+	int32_t x2 = INT32_MIN, y2 = INT32_MIN;
+	int cx1, cy1, cx2, cy2, cx, cy;
+	int n_cells, i;
+	uint32_t n;
+
+	index->views.size = 0;
+	index->large.size = 0;
+	for (i = 0; i < index->n_cells; i++)
+		index->cells[i].size = 0;
+
+	wl_list_for_each(view, view_list, link) {
+		if (!pixman_region32_not_empty(&view->transform.boundingbox))
+			continue;
+
+		box = pixman_region32_extents(&view->transform.boundingbox);
+		x1 = MIN(x1, box->x1);
+		y1 = MIN(y1, box->y1);
+		x2 = MAX(x2, box->x2);
+		y2 = MAX(y2, box->y2);
+	}
+
+	index->width = 0;
+	index->height = 0;
+	if (x1 >= x2 || y1 >= y2)
+		goto out;
+
+	index->x = x1;
+	index->y = y1;
+	index->shift = PICK_INDEX_CELL_SHIFT;
+	do {
+		index->width = (((int64_t)x2 - x1 - 1) >> index->shift) + 1;
+		index->height = (((int64_t)y2 - y1 - 1) >> index->shift) + 1;
+		index->shift++;
+	} while ((int64_t)index->width * index->height > PICK_INDEX_MAX_CELLS);
+	index->shift--;
+
+	n_cells = index->width * index->height;
+	if (n_cells > index->n_cells) {
+		cells = realloc(index->cells, n_cells * sizeof *cells);
+		if (!cells)
+			return false;
+
+		for (i = index->n_cells; i < n_cells; i++)
+			wl_array_init(&cells[i]);
+		index->cells = cells;
+		index->n_cells = n_cells;
+	}
+
+	n = 0;
+	wl_list_for_each(view, view_list, link) {
+		v = wl_array_add(&index->views, sizeof *v);
+		if (!v)
+			return false;
+		*v = view;
+
+		if (!pixman_region32_not_empty(&view->transform.boundingbox)) {
+			n++;
+			continue;
+		}
+
+		box = pixman_region32_extents(&view->transform.boundingbox);
+		cx1 = ((int64_t)box->x1 - index->x) >> index->shift;
+		cy1 = ((int64_t)box->y1 - index->y) >> index->shift;
+		cx2 = ((int64_t)box->x2 - 1 - index->x) >> index->shift;
+		cy2 = ((int64_t)box->y2 - 1 - index->y) >> index->shift;
+
+		if ((cx2 - cx1 + 1) * (cy2 - cy1 + 1) >
+		    PICK_INDEX_MAX_VIEW_CELLS) {
+			if (!pick_index_add(&index->large, n))
+				return false;
+		} else {
+			for (cy = cy1; cy <= cy2; cy++) {
+				cells = &index->cells[cy * index->width];
+				for (cx = cx1; cx <= cx2; cx++)
+					if (!pick_index_add(&cells[cx], n))
+						return false;
+			}
+		}
+
+		n++;
+	}
+
+out:
+	index->dirty = false;
+
+	return true;
+}
+
+static bool
+view_accepts_input_at(struct weston_view *view,
+		      wl_fixed_t x, wl_fixed_t y,
+		      wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	wl_fixed_t view_x, view_y;
+	int view_ix, view_iy;
+
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    wl_fixed_to_int(x),
+					    wl_fixed_to_int(y), NULL))
+		return false;
+
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
+
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
+static struct weston_view *
+pick_view_indexed(struct weston_pick_index *index,
+		  wl_fixed_t x, wl_fixed_t y,
+		  wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view **views = index->views.data;
+	uint32_t *cell = NULL, *large = index->large.data;
+	size_t n_cell = 0, n_large = index->large.size / sizeof *large;
+	size_t i = 0, j = 0;
+	int64_t cx, cy;
+	uint32_t n;
+
+	cx = ((int64_t)wl_fixed_to_int(x) - index->x) >> index->shift;
+	cy = ((int64_t)wl_fixed_to_int(y) - index->y) >> index->shift;
+	if (cx >= 0 && cx < index->width && cy >= 0 && cy < index->height) {
+		cell = index->cells[cy * index->width + cx].data;
+		n_cell = index->cells[cy * index->width + cx].size /
+			 sizeof *cell;
+	}
+
+	/* Merge the cell and the large views, both in stacking order */
+	while (i < n_cell || j < n_large) {
+		if (j == n_large || (i < n_cell && cell[i] < large[j]))
+			n = cell[i++];
+		else
+			n = large[j++];
+
+		if (view_accepts_input_at(views[n], x, y, vx, vy))
+			return views[n];
+	}
+
+	return NULL;
+}
+
 WL_EXPORT struct weston_view *
 weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
+	struct weston_pick_index *index = compositor->pick_index;
 	struct weston_view *view;
-	wl_fixed_t view_x, view_y;
-	int view_ix, view_iy;
-	int ix = wl_fixed_to_int(x);
-	int iy = wl_fixed_to_int(y);
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
-
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
-
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (index && (!index->dirty ||
+		      pick_index_rebuild(index, &compositor->view_list))) {
+		view = pick_view_indexed(index, x, y, vx, vy);
+		if (view)
+			return view;
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+		goto miss;
+	}
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (view_accepts_input_at(view, x, y, vx, vy))
+			return view;
 	}
 
+miss:
 	*vx = wl_fixed_from_int(-1000000);
 	*vy = wl_fixed_from_int(-1000000);
 	return NULL;
@@ -1794,6 +2043,8 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	weston_compositor_invalidate_pick_index(view->surface->compositor);
+	weston_compositor_view_list_dirty(view->surface->compositor);
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -1821,6 +2072,7 @@ weston_surface_unmap(struct weston_surface *surface)
 	struct weston_view *view;
 
 	surface->is_mapped = false;
+	weston_compositor_view_list_dirty(surface->compositor);
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
@@ -1849,6 +2101,8 @@ weston_view_destroy(struct weston_view *view)
 	}
 
 	wl_list_remove(&view->link);
+	weston_compositor_invalidate_pick_index(view->surface->compositor);
+	weston_compositor_view_list_dirty(view->surface->compositor);
 	weston_layer_entry_remove(&view->layer_link);
 
 	pixman_region32_fini(&view->clip);
@@ -2030,6 +2284,111 @@ weston_output_damage(struct weston_output *output)
 	weston_output_schedule_repaint(output);
 }
 
+/** Read back a rectangle of an output framebuffer asynchronously
+ *
+ * \param output The output to read from.
+ * \param format The pixel format wanted, one of the formats accepted by
+ * weston_renderer::read_pixels().
+ * \param x, y Top left corner of the rectangle, in top-down output
+ * framebuffer coordinates.
+ * \param width, height Size of the rectangle.
+ * \param done Called once with the pixels, see
+ * weston_read_pixels_done_func_t.
+ * \param data User data for \c done.
+ * \return 0 if \c done will be called, -1 if the read-back could not be
+ * started, in which case \c done is never called.
+ *
+ * The pixels are those of the last repaint of the output. Renderers
+ * implementing queue_read_pixels() deliver them one or more frames
+ * later, without waiting for the GPU; with the others the pixels are
+ * read synchronously and \c done is called before this returns.
+ * Read-backs of one output always complete in the order they were
+ * queued.
+ *
+ * Between weston_output_capture_begin() and weston_output_capture_end(),
+ * backends implementing weston_output::queue_capture read back from the
+ * display hardware instead, so the pixels include content on hardware
+ * planes. This has to be called from the frame signal then.
+ */
+WL_EXPORT int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done,
+				void *data)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_renderer *renderer = compositor->renderer;
+	int32_t stride = width * (PIXMAN_FORMAT_BPP(format) / 8);
+	uint8_t *pixels, *first;
+	int ret;
+
+	if (output->capture_planes && output->queue_capture &&
+	    output->queue_capture(output, format, x, y, width, height,
+				  done, data) == 0)
+		return 0;
+
+	if (renderer->queue_read_pixels)
+		return renderer->queue_read_pixels(output, format,
+						   x, y, width, height,
+						   done, data);
+
+	pixels = malloc(stride * height);
+	if (!pixels)
+		return -1;
+
+	if (renderer->read_pixels_strided) {
+		ret = renderer->read_pixels_strided(output, format, pixels,
+						    stride, x, y,
+						    width, height);
+		first = pixels;
+	} else if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP) {
+		ret = renderer->read_pixels(output, format, pixels, x,
+					    output->current_mode->height -
+					    y - height, width, height);
+		/* bottom row first */
+		first = pixels + (height - 1) * stride;
+		stride = -stride;
+	} else {
+		ret = renderer->read_pixels(output, format, pixels,
+					    x, y, width, height);
+		first = pixels;
+	}
+
+	if (ret == 0)
+		done(data, first, stride);
+	free(pixels);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/** Start capturing an output over several frames
+ *
+ * \param output The output about to be captured.
+ *
+ * Captures read back the rendered frame, which lacks whatever is shown on
+ * hardware planes. This tells the backend that the output is being
+ * captured: if it can read back frames as scanned out, planes stay in
+ * use, otherwise they are disabled until weston_output_capture_end().
+ */
+WL_EXPORT void
+weston_output_capture_begin(struct weston_output *output)
+{
+	output->capture_planes++;
+}
+
+/** Stop capturing an output
+ *
+ * \param output The output given to weston_output_capture_begin().
+ */
+WL_EXPORT void
+weston_output_capture_end(struct weston_output *output)
+{
+	assert(output->capture_planes > 0);
+	output->capture_planes--;
+}
+
 static void
 surface_flush_damage(struct weston_surface *surface)
 {
@@ -2099,6 +2458,12 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 	}
 
 	pixman_region32_fini(&clip);
+}
+
+static void
+compositor_flush_damage(struct weston_compositor *ec)
+{
+	struct weston_view *ev;
 
 	wl_list_for_each(ev, &ec->view_list, link)
 		ev->surface->touched = false;
@@ -2238,11 +2603,14 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	struct weston_view *view;
 	struct weston_layer *layer;
 
+	compositor->view_list_generation = compositor->layers_generation;
+
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_stash_subsurface_views(view->surface);
 
 	wl_list_init(&compositor->view_list);
+	weston_compositor_invalidate_pick_index(compositor);
 	wl_list_for_each(layer, &compositor->layer_list, link) {
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link) {
 			view_list_add(compositor, view);
@@ -2254,6 +2622,27 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 			surface_free_unused_subsurface_views(view->surface);
 }
 
+/** Bring the view list and the view transforms up to date
+ *
+ * The view list is only rebuilt if the layers, layer entries or
+ * sub-surface stacking changed since it was last built, so outputs
+ * repainted one after the other share the same list.
+ */
+static void
+weston_compositor_update_view_list(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+
+	if (compositor->view_list_generation !=
+	    compositor->layers_generation) {
+		weston_compositor_build_view_list(compositor);
+		return;
+	}
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		weston_view_update_transform(view);
+}
+
 static void
 weston_output_take_feedback_list(struct weston_output *output,
 				 struct weston_surface *surface)
@@ -2287,6 +2676,7 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	struct weston_animation *animation, *next;
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
+	struct weston_output_profile *profile;
 	pixman_region32_t output_damage;
 	int r;
 	uint32_t frame_time_msec;
@@ -2295,11 +2685,21 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		return 0;
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
+	profile = weston_repaint_profile_begin(output);
+
+	if (ec->adaptive_repaint) {
+		weston_compositor_read_presentation_clock(ec,
+					&output->repaint_cost.start);
+		output->repaint_cost.measuring = true;
+	}
 
 	/* Rebuild the surface list and update surface transforms up front. */
-	weston_compositor_build_view_list(ec);
+	weston_compositor_update_view_list(ec);
+	weston_repaint_profile_mark(profile,
+				    WESTON_REPAINT_PHASE_BUILD_VIEW_LIST);
 
-	if (output->assign_planes && !output->disable_planes) {
+	if (output->assign_planes && !output->disable_planes &&
+	    !(output->capture_planes && !output->queue_capture)) {
 		output->assign_planes(output, repaint_data);
 	} else {
 		wl_list_for_each(ev, &ec->view_list, link) {
@@ -2307,6 +2707,8 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 			ev->psf_flags = 0;
 		}
 	}
+	weston_repaint_profile_mark(profile,
+				    WESTON_REPAINT_PHASE_ASSIGN_PLANES);
 
 	wl_list_init(&frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
@@ -2323,6 +2725,11 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	}
 
 	compositor_accumulate_damage(ec);
+	weston_repaint_profile_mark(profile,
+				    WESTON_REPAINT_PHASE_ACCUMULATE_DAMAGE);
+	compositor_flush_damage(ec);
+	weston_repaint_profile_mark(profile,
+				    WESTON_REPAINT_PHASE_FLUSH_DAMAGE);
 
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
@@ -2334,6 +2741,7 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		weston_output_update_matrix(output);
 
 	r = output->repaint(output, &output_damage, repaint_data);
+	weston_repaint_profile_mark(profile, WESTON_REPAINT_PHASE_BACKEND);
 
 	pixman_region32_fini(&output_damage);
 
@@ -2356,6 +2764,7 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	}
 
 	TL_POINT("core_repaint_posted", TLP_OUTPUT(output), TLP_END);
+	weston_repaint_profile_end(profile);
 
 	return r;
 }
@@ -2450,6 +2859,101 @@ output_repaint_timer_arm(struct weston_compositor *compositor)
 	wl_event_source_timer_update(compositor->repaint_timer, msec_to_next);
 }
 
+static void
+weston_output_add_repaint_cost(struct weston_output *output,
+			       int64_t cost_nsec)
+{
+	unsigned int i = output->repaint_cost.count %
+			 WESTON_REPAINT_COST_SAMPLES;
+
+	if (cost_nsec < 0)
+		cost_nsec = 0;
+
+	if (output->repaint_cost.count == 0)
+		output->repaint_cost.ewma_nsec = cost_nsec;
+	else
+		output->repaint_cost.ewma_nsec +=
+			(cost_nsec - output->repaint_cost.ewma_nsec) / 8;
+
+	output->repaint_cost.usec[i] = MIN(cost_nsec / 1000, UINT32_MAX);
+
+	/* Once the history is full, only the slot index matters. */
+	if (++output->repaint_cost.count == 2 * WESTON_REPAINT_COST_SAMPLES)
+		output->repaint_cost.count = WESTON_REPAINT_COST_SAMPLES;
+}
+
+/* Close the cost measurement of the outputs repainted in this round; the
+ * measured time includes the backend flush, which may submit several
+ * outputs at once. */
+static void
+weston_compositor_finish_repaint_cost(struct weston_compositor *compositor,
+				      bool flushed)
+{
+	struct weston_output *output;
+	struct timespec now;
+
+	if (!compositor->adaptive_repaint)
+		return;
+
+	weston_compositor_read_presentation_clock(compositor, &now);
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (!output->repaint_cost.measuring)
+			continue;
+
+		output->repaint_cost.measuring = false;
+		if (flushed)
+			weston_output_add_repaint_cost(output,
+				timespec_sub_to_nsec(&now,
+					&output->repaint_cost.start));
+	}
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/** How long before the next vblank the repaint of an output has to start
+ *
+ * With the adaptive repaint window, this is the larger of a 95th
+ * percentile of the recent repaint cost and its moving average, plus the
+ * repaint timer slack, so that a sudden increase in cost is followed
+ * before enough slow frames have accumulated for the percentile. It
+ * never exceeds one refresh period. Until enough frames have been
+ * measured, or in the static mode, it is repaint_msec.
+ */
+static int64_t
+weston_output_repaint_window_nsec(struct weston_output *output,
+				  int32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	uint32_t sorted[WESTON_REPAINT_COST_SAMPLES];
+	unsigned int n = MIN(output->repaint_cost.count,
+			     WESTON_REPAINT_COST_SAMPLES);
+	int64_t window;
+
+	if (!compositor->adaptive_repaint ||
+	    n < ADAPTIVE_REPAINT_MIN_SAMPLES)
+		return (int64_t)compositor->repaint_msec * 1000000;
+
+	memcpy(sorted, output->repaint_cost.usec, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], compare_uint32);
+
+	window = (int64_t)sorted[(n * 95 + 99) / 100 - 1] * 1000;
+	window = MAX(window, output->repaint_cost.ewma_nsec);
+	window += ADAPTIVE_REPAINT_SLACK_NSEC;
+
+	if (refresh_nsec > 0 && window > refresh_nsec)
+		window = refresh_nsec;
+
+	return window;
+}
+
 static int
 output_repaint_timer_handler(void *data)
 {
@@ -2480,6 +2984,8 @@ output_repaint_timer_handler(void *data)
 						        repaint_data);
 	}
 
+	weston_compositor_finish_repaint_cost(compositor, ret == 0);
+
 	output_repaint_timer_arm(compositor);
 
 	return 0;
@@ -2501,6 +3007,8 @@ weston_output_finish_frame(struct weston_output *output,
 	assert(output->repaint_status == REPAINT_AWAITING_COMPLETION);
 	assert(stamp || (presented_flags & WP_PRESENTATION_FEEDBACK_INVALID));
 
+	weston_repaint_profile_presented(output, presented_flags);
+
 	weston_compositor_read_presentation_clock(compositor, &now);
 
 	/* If we haven't been supplied any timestamp at all, we don't have a
@@ -2520,8 +3028,9 @@ weston_output_finish_frame(struct weston_output *output,
 	output->frame_time = *stamp;
 
 	timespec_add_nsec(&output->next_repaint, stamp, refresh_nsec);
-	timespec_add_msec(&output->next_repaint, &output->next_repaint,
-			  -compositor->repaint_msec);
+	timespec_add_nsec(&output->next_repaint, &output->next_repaint,
+			  -weston_output_repaint_window_nsec(output,
+							     refresh_nsec));
 	msec_rel = timespec_sub_to_msec(&output->next_repaint, &now);
 
 	if (msec_rel < -1000 || msec_rel > 1000) {
@@ -2569,11 +3078,15 @@ weston_layer_entry_insert(struct weston_layer_entry *list,
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	weston_compositor_view_list_dirty(entry->layer->compositor);
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		weston_compositor_view_list_dirty(entry->layer->compositor);
+
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2611,6 +3124,7 @@ weston_layer_set_position(struct weston_layer *layer,
 	struct weston_layer *below;
 
 	wl_list_remove(&layer->link);
+	weston_compositor_view_list_dirty(layer->compositor);
 
 	/* layer_list is ordered from top to bottom, the last layer being the
 	 * background with the smallest position value */
@@ -2635,6 +3149,7 @@ weston_layer_unset_position(struct weston_layer *layer)
 {
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
+	weston_compositor_view_list_dirty(layer->compositor);
 }
 
 WL_EXPORT void
@@ -2852,6 +3367,8 @@ weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
 
+	weston_compositor_view_list_dirty(surface->compositor);
+
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
@@ -3525,6 +4042,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		weston_compositor_view_list_dirty(surface->compositor);
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -3862,6 +4380,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	weston_compositor_view_list_dirty(sub->surface->compositor);
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -3928,6 +4447,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	weston_compositor_view_list_dirty(parent->compositor);
 }
 
 static void
@@ -4036,6 +4556,7 @@ weston_subsurface_create_for_parent(struct weston_surface *parent)
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	weston_compositor_view_list_dirty(parent->compositor);
 
 	return sub;
 }
@@ -5296,6 +5817,16 @@ timeline_key_binding_handler(struct weston_keyboard *keyboard,
 		weston_timeline_open(compositor);
 }
 
+static void
+profiler_key_binding_handler(struct weston_keyboard *keyboard,
+			     const struct timespec *time, uint32_t key,
+			     void *data)
+{
+	struct weston_compositor *compositor = data;
+
+	weston_repaint_profiler_toggle(compositor->profiler);
+}
+
 /** Create the compositor.
  *
  * This functions creates and initializes a compositor instance.
@@ -5360,6 +5891,14 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	if (weston_input_init(ec) != 0)
 		goto fail;
 
+	ec->pick_index = pick_index_create();
+	if (!ec->pick_index)
+		goto fail;
+
+	ec->profiler = weston_repaint_profiler_create(ec);
+	if (!ec->profiler)
+		goto fail;
+
 	wl_list_init(&ec->view_list);
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
@@ -5397,10 +5936,13 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	weston_compositor_add_debug_binding(ec, KEY_T,
 					    timeline_key_binding_handler, ec);
+	weston_compositor_add_debug_binding(ec, KEY_P,
+					    profiler_key_binding_handler, ec);
 
 	return ec;
 
 fail:
+	pick_index_destroy(ec->pick_index);
 	free(ec);
 	return NULL;
 }
@@ -5500,6 +6042,21 @@ weston_compositor_set_presentation_clock_software(
 	return -1;
 }
 
+/** Advertise the repaint profiler to clients
+ *
+ * \param compositor The compositor instance.
+ * \return 0 on success, -1 on failure.
+ *
+ * The weston_repaint_profiler global lets any client read the repaint
+ * timings and start recording them, so it is only created when the user
+ * asks for debugging interfaces.
+ */
+WL_EXPORT int
+weston_compositor_expose_repaint_profiler(struct weston_compositor *compositor)
+{
+	return weston_repaint_profiler_expose(compositor->profiler);
+}
+
 /** Read the current time from the Presentation clock
  *
  * \param compositor
@@ -5678,6 +6235,9 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 
 	weston_plugin_api_destroy_list(compositor);
 
+	pick_index_destroy(compositor->pick_index);
+	weston_repaint_profiler_destroy(compositor->profiler);
+
 	free(compositor);
 }
 
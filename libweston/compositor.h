@@ -147,6 +147,20 @@ enum dpms_enum {
 	WESTON_DPMS_OFF
 };
 
+#define WESTON_REPAINT_COST_SAMPLES 64
+
+/** Receives the pixels of a weston_output_read_pixels_async() request.
+ *
+ * \param data The user data given when the read-back was queued.
+ * \param pixels The first (top) row of the requested rectangle, or
+ * NULL if the read-back failed. Only valid during the call.
+ * \param stride Distance in bytes from one row to the next one
+ * below it. May be negative.
+ */
+typedef void (*weston_read_pixels_done_func_t)(void *data,
+					       const void *pixels,
+					       int32_t stride);
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -188,6 +202,17 @@ struct weston_output {
 	 *  next repaint should be run */
 	struct timespec next_repaint;
 
+	/** Recent cost of repainting this output, from the start of
+	 *  weston_output_repaint() until the backend has flushed the
+	 *  frame; only tracked with weston_compositor::adaptive_repaint */
+	struct {
+		struct timespec start;
+		bool measuring;
+		int64_t ewma_nsec;
+		uint32_t usec[WESTON_REPAINT_COST_SAMPLES];
+		unsigned int count;
+	} repaint_cost;
+
 	struct weston_output_zoom zoom;
 	int dirty;
 	struct wl_signal frame_signal;
@@ -196,6 +221,9 @@ struct weston_output {
 	struct timespec frame_time; /* presentation timestamp */
 	uint64_t msc;        /* media stream counter */
 	int disable_planes;
+	/** Captures under way which want frames as scanned out, see
+	 *  weston_output_capture_begin() */
+	int capture_planes;
 	int destroying;
 	struct wl_list feedback_list;
 
@@ -239,6 +267,18 @@ struct weston_output {
 
 	int (*enable)(struct weston_output *output);
 	int (*disable)(struct weston_output *output);
+
+	/** Reads back the frame being repainted as it is scanned out,
+	 * content on hardware planes included; only called while
+	 * capture_planes is non-zero, from the frame signal. Same
+	 * contract as weston_output_read_pixels_async(). Set by the
+	 * backend when it can, may be NULL. */
+	int (*queue_capture)(struct weston_output *output,
+			     pixman_format_code_t format,
+			     uint32_t x, uint32_t y,
+			     uint32_t width, uint32_t height,
+			     weston_read_pixels_done_func_t done,
+			     void *data);
 };
 
 enum weston_pointer_motion_mask {
@@ -763,6 +803,25 @@ struct weston_renderer {
 	void (*query_dmabuf_modifiers)(struct weston_compositor *ec,
 				int format, uint64_t **modifiers,
 				int *num_modifiers);
+
+	/** Like read_pixels(), but x and y are top-down output
+	 * framebuffer coordinates and the rows are written top row
+	 * first with the given stride, so the result can land directly
+	 * in a client buffer. Optional, may be NULL. */
+	int (*read_pixels_strided)(struct weston_output *output,
+				   pixman_format_code_t format, void *pixels,
+				   int32_t stride,
+				   uint32_t x, uint32_t y,
+				   uint32_t width, uint32_t height);
+
+	/** See weston_output_read_pixels_async(). Optional, may be
+	 * NULL. */
+	int (*queue_read_pixels)(struct weston_output *output,
+				 pixman_format_code_t format,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height,
+				 weston_read_pixels_done_func_t done,
+				 void *data);
 };
 
 enum weston_capability {
@@ -897,6 +956,12 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;	/* struct weston_layer::link */
 	struct wl_list view_list;	/* struct weston_view::link */
+	struct weston_pick_index *pick_index; /* of view_list, for picking */
+	/* view_list is rebuilt when it is older than the layer list, layer
+	 * entries or sub-surface stacking it derives from */
+	uint32_t layers_generation;
+	uint32_t view_list_generation;
+	struct weston_repaint_profiler *profiler;
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -940,6 +1005,9 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	/* Derive each output's repaint window from its measured repaint
+	 * cost instead of using repaint_msec. */
+	bool adaptive_repaint;
 
 	unsigned int activate_serial;
 
@@ -1457,6 +1525,17 @@ void
 weston_output_schedule_repaint(struct weston_output *output);
 void
 weston_output_damage(struct weston_output *output);
+int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done,
+				void *data);
+void
+weston_output_capture_begin(struct weston_output *output);
+void
+weston_output_capture_end(struct weston_output *output);
 void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
 void
@@ -1707,6 +1786,8 @@ weston_compositor_set_presentation_clock(struct weston_compositor *compositor,
 int
 weston_compositor_set_presentation_clock_software(
 					struct weston_compositor *compositor);
+int
+weston_compositor_expose_repaint_profiler(struct weston_compositor *compositor);
 void
 weston_compositor_read_presentation_clock(
 			const struct weston_compositor *compositor,
@@ -1811,6 +1892,13 @@ typedef void (*weston_screenshooter_done_func_t)(void *data,
 int
 weston_screenshooter_shoot(struct weston_output *output, struct weston_buffer *buffer,
 			   weston_screenshooter_done_func_t done, void *data);
+int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  struct weston_buffer *buffer,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  weston_screenshooter_done_func_t done,
+				  void *data);
 struct weston_recorder *
 weston_recorder_start(struct weston_output *output, const char *filename);
 void
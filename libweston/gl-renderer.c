@@ -57,6 +57,7 @@
 
 #include "shared/helpers.h"
 #include "shared/platform.h"
+#include "shared/string-helpers.h"
 #include "shared/timespec-util.h"
 #include "weston-egl-ext.h"
 
@@ -107,6 +108,11 @@ struct gl_output_state {
 
 	/* struct timeline_render_point::link */
 	struct wl_list timeline_render_point_list;
+
+	/* struct gl_readback::link, oldest first */
+	struct wl_list readbacks;
+	struct wl_event_source *readback_timer;
+	bool destroying; /* no new read-backs while set */
 };
 
 enum buffer_type {
@@ -164,6 +170,9 @@ struct gl_surface_state {
 	int num_textures;
 	bool needs_full_upload;
 	pixman_region32_t texture_damage;
+	/* Part of surface->damage already uploaded through a pixel
+	 * buffer when the surface was committed. */
+	pixman_region32_t uploaded_damage;
 
 	/* These are only used by SHM surfaces to detect when we need
 	 * to do a full upload to specify a new internal texture
@@ -188,16 +197,103 @@ struct gl_surface_state {
 
 	struct weston_surface *surface;
 
+	/* Small wl_shm surfaces live in an atlas instead of textures[0]. */
+	struct gl_atlas_slot *atlas_slot;
+
 	struct wl_listener surface_destroy_listener;
+	struct wl_listener surface_commit_listener;
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* Texture pages that small wl_shm surfaces are packed into. Each page
+ * is divided into shelves, rows of slots of about the same height. */
+#define GL_ATLAS_PAGE_SIZE 1024
+#define GL_ATLAS_MAX_PAGES 4
+#define GL_ATLAS_DEFAULT_MAX_SIZE 128
+
+struct gl_atlas {
+	struct wl_list link; /* gl_renderer::atlases */
+	GLuint texture;
+	int width, height;
+	struct wl_list shelves; /* gl_atlas_shelf::link, by y */
+};
+
+struct gl_atlas_shelf {
+	struct wl_list link;
+	struct wl_list slots; /* gl_atlas_slot::link, by x */
+	int y, height;
+};
+
+/* The slot surrounds the surface with a one texel gutter repeating its
+ * edges, so that linear filtering never reads the neighbouring slots. */
+struct gl_atlas_slot {
+	struct gl_atlas *atlas;
+	struct gl_atlas_shelf *shelf;
+	struct wl_list link;
+	int x, y, width, height;
+};
+
+/* Pixel-unpack buffers that wl_shm damage is staged through. */
+#define GL_UPLOAD_PBO_COUNT 4
+
+struct gl_upload_pbo {
+	GLuint buffer;
+	size_t size;
+};
+
+/* Idle pixel-pack buffers kept around for the next read-backs. */
+#define GL_READBACK_POOL_SIZE 8
+
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+
+/* A read-back queued into a pixel-pack buffer. It is mapped once its
+ * fence signals, or without a fence at the next repaint of the output,
+ * when the GPU has long finished it. */
+struct gl_readback {
+	struct wl_list link; /* gl_output_state::readbacks or
+			      * gl_renderer::readback_pool */
+	struct weston_output *output;
+	GLuint pbo;
+	uint32_t width, height;
+	weston_read_pixels_done_func_t done;
+	void *data;
+	int fence_fd;
+	struct wl_event_source *fence_source;
+};
+
+/* Indices are GLushort, so a batch can address this many vertices. */
+#define GL_BATCH_MAX_VERTICES 65536
+
+/* How many batches back a draw may be moved to join one with the same
+ * state, provided it overlaps none of the batches it skips. */
+#define GL_BATCH_SEARCH_DEPTH 16
+
+/* Triangles sharing all GL state, drawn with one glDrawElements(). */
+struct gl_batch {
+	struct gl_shader *shader;
+	GLenum target;
+	GLuint textures[3];
+	int num_textures;
+	GLint filter;
+	bool blend;
+	GLfloat color[4];
+	GLfloat alpha;
+
+	pixman_box32_t extents; /* in global coordinates */
+	struct wl_array vertices; /* position and texcoord, 4 GLfloats */
+	struct wl_array indices; /* GLushort, triangles */
+};
+
 struct gl_renderer {
 	struct weston_renderer base;
 	int fragment_shader_debug;
 	int fan_debug;
+	int draw_stats;
 	struct weston_binding *fragment_binding;
 	struct weston_binding *fan_binding;
+	struct weston_binding *draw_stats_binding;
 
 	EGLDisplay egl_display;
 	EGLContext egl_context;
@@ -210,6 +306,18 @@ struct gl_renderer {
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
 
+	/* Batches of the output being repainted; the array keeps
+	 * the allocations of previous frames around. */
+	struct wl_array batches;
+	int n_batches;
+	GLuint batch_vbo;
+	GLuint batch_ibo;
+
+	struct {
+		unsigned int draws;
+		unsigned int state_changes;
+	} frame_stats;
+
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
 	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
@@ -217,6 +325,21 @@ struct gl_renderer {
 	PFNEGLCREATEPLATFORMWINDOWSURFACEEXTPROC create_platform_window;
 
 	int has_unpack_subimage;
+	int has_pack_subimage;
+
+	int has_pbo;
+	PFNGLMAPBUFFERRANGEEXTPROC map_buffer_range;
+	PFNGLUNMAPBUFFEROESPROC unmap_buffer;
+	struct gl_upload_pbo upload_pbos[GL_UPLOAD_PBO_COUNT];
+	int upload_pbo_next;
+
+	int has_async_readback;
+	struct wl_list readback_pool;
+	int readback_pool_size;
+
+	struct wl_list atlases;
+	int atlas_max_size; /* largest side of atlased surfaces, or 0 */
+	int atlas_page_size;
 
 	PFNEGLBINDWAYLANDDISPLAYWL bind_display;
 	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
@@ -657,7 +780,7 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	struct gl_surface_state *gs = get_surface_state(ev->surface);
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v, inv_width, inv_height;
+	GLfloat *v, inv_width, inv_height, tex_x, tex_y;
 	unsigned int *vtxcnt, nvtx = 0;
 	pixman_box32_t *rects, *surf_rects;
 	pixman_box32_t *raw_rects;
@@ -680,8 +803,17 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	v = wl_array_add(&gr->vertices, nrects * nsurf * 8 * 4 * sizeof *v);
 	vtxcnt = wl_array_add(&gr->vtxcnt, nrects * nsurf * sizeof *vtxcnt);
 
-	inv_width = 1.0 / gs->pitch;
-        inv_height = 1.0 / gs->height;
+	if (gs->atlas_slot) {
+		inv_width = 1.0 / gs->atlas_slot->atlas->width;
+		inv_height = 1.0 / gs->atlas_slot->atlas->height;
+		tex_x = gs->atlas_slot->x + 1;
+		tex_y = gs->atlas_slot->y + 1;
+	} else {
+		inv_width = 1.0 / gs->pitch;
+		inv_height = 1.0 / gs->height;
+		tex_x = 0;
+		tex_y = 0;
+	}
 
 	for (i = 0; i < nrects; i++) {
 		pixman_box32_t *rect = &rects[i];
@@ -720,11 +852,12 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 				weston_surface_to_buffer_float(ev->surface,
 							       sx, sy,
 							       &bx, &by);
-				*(v++) = bx * inv_width;
+				*(v++) = (tex_x + bx) * inv_width;
 				if (gs->y_inverted) {
-					*(v++) = by * inv_height;
+					*(v++) = (tex_y + by) * inv_height;
 				} else {
-					*(v++) = (gs->height - by) * inv_height;
+					*(v++) = (tex_y + gs->height - by) *
+						 inv_height;
 				}
 			}
 
@@ -810,6 +943,7 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 
 	for (i = 0, first = 0; i < nfans; i++) {
 		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
+		gr->frame_stats.draws++;
 		if (gr->fan_debug)
 			triangle_fan_debug(ev, first, vtxcnt[i]);
 		first += vtxcnt[i];
@@ -822,6 +956,167 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 	gr->vtxcnt.size = 0;
 }
 
+static bool
+gl_batch_state_equal(const struct gl_batch *a, const struct gl_batch *b)
+{
+	int i;
+
+	if (a->shader != b->shader || a->target != b->target ||
+	    a->num_textures != b->num_textures || a->filter != b->filter ||
+	    a->blend != b->blend || a->alpha != b->alpha ||
+	    memcmp(a->color, b->color, sizeof a->color) != 0)
+		return false;
+
+	for (i = 0; i < a->num_textures; i++)
+		if (a->textures[i] != b->textures[i])
+			return false;
+
+	return true;
+}
+
+static bool
+boxes_intersect(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 &&
+	       a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+static unsigned int
+gl_batch_vertex_count(const struct gl_batch *batch)
+{
+	return batch->vertices.size / (4 * sizeof(GLfloat));
+}
+
+/* Finds the batch to append nverts vertices with the state of 'key'
+ * to, covering 'extents'. Batches are drawn in order, so joining an
+ * earlier batch moves the draw below every batch after it; that is
+ * only done if the draw overlaps none of them.
+ */
+static struct gl_batch *
+gl_batch_get(struct gl_renderer *gr, const struct gl_batch *key,
+	     const pixman_box32_t *extents, unsigned int nverts)
+{
+	struct gl_batch *batches = gr->batches.data;
+	struct gl_batch *batch;
+	int i;
+
+	for (i = gr->n_batches - 1;
+	     i >= 0 && i >= gr->n_batches - GL_BATCH_SEARCH_DEPTH; i--) {
+		batch = &batches[i];
+
+		if (gl_batch_state_equal(batch, key) &&
+		    gl_batch_vertex_count(batch) + nverts <=
+		    GL_BATCH_MAX_VERTICES) {
+			batch->extents.x1 = MIN(batch->extents.x1, extents->x1);
+			batch->extents.y1 = MIN(batch->extents.y1, extents->y1);
+			batch->extents.x2 = MAX(batch->extents.x2, extents->x2);
+			batch->extents.y2 = MAX(batch->extents.y2, extents->y2);
+			return batch;
+		}
+
+		if (boxes_intersect(&batch->extents, extents))
+			break;
+	}
+
+	if ((size_t) gr->n_batches * sizeof *batch >= gr->batches.size) {
+		batch = wl_array_add(&gr->batches, sizeof *batch);
+		if (!batch)
+			return NULL;
+		wl_array_init(&batch->vertices);
+		wl_array_init(&batch->indices);
+	}
+
+	batch = &((struct gl_batch *) gr->batches.data)[gr->n_batches++];
+	batch->shader = key->shader;
+	batch->target = key->target;
+	memcpy(batch->textures, key->textures, sizeof batch->textures);
+	batch->num_textures = key->num_textures;
+	batch->filter = key->filter;
+	batch->blend = key->blend;
+	memcpy(batch->color, key->color, sizeof batch->color);
+	batch->alpha = key->alpha;
+	batch->extents = *extents;
+	batch->vertices.size = 0;
+	batch->indices.size = 0;
+
+	return batch;
+}
+
+/* Like repaint_region(), but queues the triangles for
+ * gl_renderer_flush_batches() instead of drawing them. */
+static void
+batch_region(struct weston_view *ev, struct gl_shader *shader,
+	     GLint filter, bool blend,
+	     pixman_region32_t *region, pixman_region32_t *surf_region)
+{
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_renderer *gr = get_renderer(ev->surface->compositor);
+	struct gl_batch key, *batch = NULL;
+	pixman_box32_t extents;
+	unsigned int *vtxcnt, base;
+	GLfloat *v, *dst;
+	GLushort *index;
+	int i, k, first, nfans, nverts;
+
+	nfans = texture_region(ev, region, surf_region);
+	v = gr->vertices.data;
+	vtxcnt = gr->vtxcnt.data;
+
+	nverts = 0;
+	for (i = 0; i < nfans; i++)
+		nverts += vtxcnt[i];
+	if (nverts == 0)
+		goto out;
+
+	/* Truncation can go either way, so widen by a pixel. */
+	extents.x1 = extents.x2 = v[0];
+	extents.y1 = extents.y2 = v[1];
+	for (i = 0; i < nverts; i++) {
+		extents.x1 = MIN(extents.x1, (int32_t) v[i * 4] - 1);
+		extents.y1 = MIN(extents.y1, (int32_t) v[i * 4 + 1] - 1);
+		extents.x2 = MAX(extents.x2, (int32_t) v[i * 4] + 1);
+		extents.y2 = MAX(extents.y2, (int32_t) v[i * 4 + 1] + 1);
+	}
+
+	key.shader = shader;
+	key.target = gs->target;
+	memcpy(key.textures, gs->textures, sizeof key.textures);
+	key.num_textures = gs->num_textures;
+	key.filter = filter;
+	key.blend = blend;
+	memcpy(key.color, gs->color, sizeof key.color);
+	key.alpha = ev->alpha;
+
+	/* The fans of one region never overlap each other, so they may
+	 * be spread over several batches when one fills up. */
+	for (i = 0, first = 0; i < nfans; first += vtxcnt[i], i++) {
+		if (!batch || gl_batch_vertex_count(batch) + vtxcnt[i] >
+			      GL_BATCH_MAX_VERTICES)
+			batch = gl_batch_get(gr, &key, &extents, vtxcnt[i]);
+		if (!batch)
+			break;
+
+		base = gl_batch_vertex_count(batch);
+		dst = wl_array_add(&batch->vertices,
+				   vtxcnt[i] * 4 * sizeof *dst);
+		index = wl_array_add(&batch->indices,
+				     (vtxcnt[i] - 2) * 3 * sizeof *index);
+		if (!dst || !index)
+			break;
+
+		memcpy(dst, &v[first * 4], vtxcnt[i] * 4 * sizeof *dst);
+		for (k = 1; k < (int) vtxcnt[i] - 1; k++) {
+			*index++ = base;
+			*index++ = base + k;
+			*index++ = base + k + 1;
+		}
+	}
+
+out:
+	gr->vertices.size = 0;
+	gr->vtxcnt.size = 0;
+}
+
 static int
 use_output(struct weston_output *output)
 {
@@ -867,6 +1162,7 @@ use_shader(struct gl_renderer *gr, struct gl_shader *shader)
 		return;
 	glUseProgram(shader->program);
 	gr->current_shader = shader;
+	gr->frame_stats.state_changes++;
 }
 
 static void
@@ -887,6 +1183,122 @@ shader_uniforms(struct gl_shader *shader,
 		glUniform1i(shader->tex_uniforms[i], i);
 }
 
+/* Uploads the batches queued by batch_region() into the vertex and
+ * index buffers and draws each of them with one call, changing only
+ * the state that differs from the previous batch. */
+static void
+gl_renderer_flush_batches(struct gl_renderer *gr,
+			  struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_batch *batches = gr->batches.data;
+	struct gl_batch *batch, *prev = NULL;
+	size_t vertex_size = 0, index_size = 0;
+	size_t vertex_offset, index_offset;
+	int i, j;
+
+	if (gr->n_batches == 0)
+		return;
+
+	for (i = 0; i < gr->n_batches; i++) {
+		vertex_size += batches[i].vertices.size;
+		index_size += batches[i].indices.size;
+	}
+
+	if (!gr->batch_vbo)
+		glGenBuffers(1, &gr->batch_vbo);
+	if (!gr->batch_ibo)
+		glGenBuffers(1, &gr->batch_ibo);
+
+	/* Respecifying the stores every frame lets the driver orphan
+	 * the ones the previous frame may still be drawing from. */
+	glBindBuffer(GL_ARRAY_BUFFER, gr->batch_vbo);
+	glBufferData(GL_ARRAY_BUFFER, vertex_size, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gr->batch_ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_size, NULL,
+		     GL_STREAM_DRAW);
+
+	vertex_offset = index_offset = 0;
+	for (i = 0; i < gr->n_batches; i++) {
+		batch = &batches[i];
+		glBufferSubData(GL_ARRAY_BUFFER, vertex_offset,
+				batch->vertices.size, batch->vertices.data);
+		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, index_offset,
+				batch->indices.size, batch->indices.data);
+		vertex_offset += batch->vertices.size;
+		index_offset += batch->indices.size;
+	}
+
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	vertex_offset = index_offset = 0;
+	for (i = 0; i < gr->n_batches; i++) {
+		batch = &batches[i];
+
+		if (!prev || prev->shader != batch->shader) {
+			use_shader(gr, batch->shader);
+			glUniformMatrix4fv(batch->shader->proj_uniform,
+					   1, GL_FALSE, go->output_matrix.d);
+			for (j = 0; j < batch->num_textures; j++)
+				glUniform1i(batch->shader->tex_uniforms[j], j);
+		}
+		glUniform4fv(batch->shader->color_uniform, 1, batch->color);
+		glUniform1f(batch->shader->alpha_uniform, batch->alpha);
+
+		if (!prev || prev->blend != batch->blend) {
+			if (batch->blend)
+				glEnable(GL_BLEND);
+			else
+				glDisable(GL_BLEND);
+			gr->frame_stats.state_changes++;
+		}
+
+		for (j = 0; j < batch->num_textures; j++) {
+			if (prev && j < prev->num_textures &&
+			    prev->target == batch->target &&
+			    prev->textures[j] == batch->textures[j] &&
+			    prev->filter == batch->filter)
+				continue;
+
+			glActiveTexture(GL_TEXTURE0 + j);
+			glBindTexture(batch->target, batch->textures[j]);
+			glTexParameteri(batch->target, GL_TEXTURE_MIN_FILTER,
+					batch->filter);
+			glTexParameteri(batch->target, GL_TEXTURE_MAG_FILTER,
+					batch->filter);
+			gr->frame_stats.state_changes++;
+		}
+
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+				      4 * sizeof(GLfloat),
+				      (void *) (uintptr_t) vertex_offset);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+				      4 * sizeof(GLfloat),
+				      (void *) (uintptr_t) (vertex_offset +
+						2 * sizeof(GLfloat)));
+		glDrawElements(GL_TRIANGLES,
+			       batch->indices.size / sizeof(GLushort),
+			       GL_UNSIGNED_SHORT,
+			       (void *) (uintptr_t) index_offset);
+		gr->frame_stats.draws++;
+
+		vertex_offset += batch->vertices.size;
+		index_offset += batch->indices.size;
+		prev = batch;
+	}
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	/* The other draws use client-side arrays. */
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	gr->n_batches = 0;
+}
+
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
 	  pixman_region32_t *damage) /* in global coordinates */
@@ -900,7 +1312,9 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	pixman_region32_t surface_opaque;
 	/* non-opaque region in surface coordinates: */
 	pixman_region32_t surface_blend;
+	struct gl_shader *shader;
 	GLint filter;
+	bool batched;
 	int i;
 
 	/* In case of a runtime switch of renderers, we may not have received
@@ -919,25 +1333,33 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 
 	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
+	/* The fan debugging draws each fan as it goes. */
+	batched = !gr->fan_debug;
+
 	if (gr->fan_debug) {
 		use_shader(gr, &gr->solid_shader);
 		shader_uniforms(&gr->solid_shader, ev, output);
 	}
 
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, ev, output);
-
 	if (ev->transform.enabled || output->zoom.active ||
 	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
 		filter = GL_LINEAR;
 	else
 		filter = GL_NEAREST;
 
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
+	if (!batched) {
+		use_shader(gr, gs->shader);
+		shader_uniforms(gs->shader, ev, output);
+
+		for (i = 0; i < gs->num_textures; i++) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(gs->target, gs->textures[i]);
+			glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER,
+					filter);
+			glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER,
+					filter);
+			gr->frame_stats.state_changes++;
+		}
 	}
 
 	/* blended region is whole surface minus opaque region: */
@@ -959,28 +1381,45 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
 
 	if (pixman_region32_not_empty(&surface_opaque)) {
+		shader = gs->shader;
 		if (gs->shader == &gr->texture_shader_rgba) {
 			/* Special case for RGBA textures with possibly
 			 * bad data in alpha channel: use the shader
 			 * that forces texture alpha = 1.0.
 			 * Xwayland surfaces need this.
 			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, ev, output);
+			shader = &gr->texture_shader_rgbx;
 		}
 
-		if (ev->alpha < 1.0)
-			glEnable(GL_BLEND);
-		else
-			glDisable(GL_BLEND);
+		if (batched) {
+			batch_region(ev, shader, filter, ev->alpha < 1.0,
+				     &repaint, &surface_opaque);
+		} else {
+			if (shader != gs->shader) {
+				use_shader(gr, shader);
+				shader_uniforms(shader, ev, output);
+			}
 
-		repaint_region(ev, &repaint, &surface_opaque);
+			if (ev->alpha < 1.0)
+				glEnable(GL_BLEND);
+			else
+				glDisable(GL_BLEND);
+			gr->frame_stats.state_changes++;
+
+			repaint_region(ev, &repaint, &surface_opaque);
+		}
 	}
 
 	if (pixman_region32_not_empty(&surface_blend)) {
-		use_shader(gr, gs->shader);
-		glEnable(GL_BLEND);
-		repaint_region(ev, &repaint, &surface_blend);
+		if (batched) {
+			batch_region(ev, gs->shader, filter, true,
+				     &repaint, &surface_blend);
+		} else {
+			use_shader(gr, gs->shader);
+			glEnable(GL_BLEND);
+			gr->frame_stats.state_changes++;
+			repaint_region(ev, &repaint, &surface_blend);
+		}
 	}
 
 	pixman_region32_fini(&surface_blend);
@@ -999,6 +1438,8 @@ repaint_views(struct weston_output *output, pixman_region32_t *damage)
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
 			draw_view(view, output, damage);
+
+	gl_renderer_flush_batches(get_renderer(compositor), output);
 }
 
 static void
@@ -1229,6 +1670,211 @@ output_rotate_damage(struct weston_output *output,
 	go->border_damage[go->buffer_damage_index] = border_status;
 }
 
+static void
+gl_readback_release(struct gl_renderer *gr, struct gl_readback *rb)
+{
+	wl_list_remove(&rb->link);
+
+	if (rb->fence_source)
+		wl_event_source_remove(rb->fence_source);
+	if (rb->fence_fd >= 0)
+		close(rb->fence_fd);
+	rb->fence_source = NULL;
+	rb->fence_fd = -1;
+
+	if (gr->readback_pool_size < GL_READBACK_POOL_SIZE) {
+		wl_list_insert(&gr->readback_pool, &rb->link);
+		gr->readback_pool_size++;
+		return;
+	}
+
+	glDeleteBuffers(1, &rb->pbo);
+	free(rb);
+}
+
+static void
+gl_readback_finish(struct gl_renderer *gr, struct gl_readback *rb)
+{
+	int32_t stride = rb->width * 4;
+	const uint8_t *map;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, rb->pbo);
+	map = gr->map_buffer_range(GL_PIXEL_PACK_BUFFER_NV, 0,
+				   stride * rb->height, GL_MAP_READ_BIT_EXT);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+
+	/* The callback may read pixels itself, so nothing stays bound
+	 * to the pack target while it runs. GL rows go bottom-up. */
+	if (map)
+		rb->done(rb->data, map + (rb->height - 1) * stride, -stride);
+	else
+		rb->done(rb->data, NULL, 0);
+
+	if (map) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, rb->pbo);
+		gr->unmap_buffer(GL_PIXEL_PACK_BUFFER_NV);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+	}
+
+	gl_readback_release(gr, rb);
+}
+
+/* Completes the read-backs of the output up to and including \c last.
+ * Read-backs queued by the callbacks meanwhile are left pending. */
+static void
+gl_output_finish_readbacks(struct weston_output *output,
+			   struct gl_readback *last)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_readback *rb;
+	bool was_last;
+
+	do {
+		rb = container_of(go->readbacks.next,
+				  struct gl_readback, link);
+		was_last = rb == last;
+		gl_readback_finish(gr, rb);
+	} while (!was_last);
+}
+
+static void
+gl_output_finish_all_readbacks(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+
+	if (wl_list_empty(&go->readbacks))
+		return;
+
+	gl_output_finish_readbacks(output,
+				   container_of(go->readbacks.prev,
+						struct gl_readback, link));
+}
+
+static int
+gl_readback_fence_handler(int fd, uint32_t mask, void *data)
+{
+	struct gl_readback *rb = data;
+
+	/* Without a current context the mapping fails and the callbacks
+	 * get NULL. */
+	use_output(rb->output);
+	gl_output_finish_readbacks(rb->output, rb);
+
+	return 0;
+}
+
+static int
+gl_readback_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+
+	use_output(output);
+	gl_output_finish_all_readbacks(output);
+
+	return 0;
+}
+
+static int
+gl_renderer_queue_read_pixels(struct weston_output *output,
+			      pixman_format_code_t format,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_read_pixels_done_func_t done,
+			      void *data)
+{
+	static const EGLint attribs[] = { EGL_NONE };
+	struct weston_compositor *ec = output->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_output_state *go = get_output_state(output);
+	struct wl_event_loop *loop;
+	struct gl_readback *rb;
+	EGLSyncKHR sync;
+	GLenum gl_format;
+	int refresh;
+
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		gl_format = GL_BGRA_EXT;
+		break;
+	case PIXMAN_a8b8g8r8:
+		gl_format = GL_RGBA;
+		break;
+	default:
+		return -1;
+	}
+
+	if (width == 0 || height == 0 || go->destroying ||
+	    use_output(output) < 0)
+		return -1;
+
+	if (!wl_list_empty(&gr->readback_pool)) {
+		rb = container_of(gr->readback_pool.next,
+				  struct gl_readback, link);
+		wl_list_remove(&rb->link);
+		gr->readback_pool_size--;
+	} else {
+		rb = zalloc(sizeof *rb);
+		if (rb == NULL)
+			return -1;
+		glGenBuffers(1, &rb->pbo);
+	}
+
+	rb->output = output;
+	rb->width = width;
+	rb->height = height;
+	rb->done = done;
+	rb->data = data;
+	rb->fence_fd = -1;
+	rb->fence_source = NULL;
+
+	/* GL framebuffer rows go bottom-up. */
+	y = output->current_mode->height - y - height;
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, rb->pbo);
+	glBufferData(GL_PIXEL_PACK_BUFFER_NV, width * height * 4, NULL,
+		     gr->gl_version >= GR_GL_VERSION(3, 0) ?
+		     GL_STREAM_READ : GL_STREAM_DRAW);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+
+	loop = wl_display_get_event_loop(ec->wl_display);
+
+	if (gr->has_native_fence_sync) {
+		sync = gr->create_sync(gr->egl_display,
+				       EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+		if (sync != EGL_NO_SYNC_KHR) {
+			/* The fence only gets its fd once flushed. */
+			glFlush();
+			rb->fence_fd = gr->dup_native_fence_fd(gr->egl_display,
+							       sync);
+			gr->destroy_sync(gr->egl_display, sync);
+		}
+	}
+
+	if (rb->fence_fd >= 0)
+		rb->fence_source =
+			wl_event_loop_add_fd(loop, rb->fence_fd,
+					     WL_EVENT_READABLE,
+					     gl_readback_fence_handler, rb);
+
+	/* Without a fence, make sure the read-back completes even if the
+	 * output does not repaint again soon. */
+	if (!rb->fence_source) {
+		refresh = output->current_mode->refresh;
+		wl_event_source_timer_update(go->readback_timer,
+					     refresh > 0 ?
+					     2000000 / refresh + 1 : 33);
+	}
+
+	wl_list_insert(go->readbacks.prev, &rb->link);
+
+	return 0;
+}
+
 /* NOTE: We now allow falling back to ARGB gl visuals when XRGB is
  * unavailable, so we're assuming the background has no transparency
  * and that everything with a blend, like drop shadows, will have something
@@ -1256,6 +1902,13 @@ gl_renderer_repaint_output(struct weston_output *output,
 	if (use_output(output) < 0)
 		return;
 
+	/* Whatever was read back during the previous frame is done by
+	 * now. */
+	gl_output_finish_all_readbacks(output);
+
+	gr->frame_stats.draws = 0;
+	gr->frame_stats.state_changes = 0;
+
 	begin_render_sync = timeline_create_render_sync(gr);
 
 	/* Calculate the viewport */
@@ -1303,6 +1956,12 @@ gl_renderer_repaint_output(struct weston_output *output,
 
 	draw_output_borders(output, border_damage);
 
+	if (gr->draw_stats)
+		weston_log("GL renderer: output %s: %u draw calls, "
+			   "%u state changes\n", output->name,
+			   gr->frame_stats.draws,
+			   gr->frame_stats.state_changes);
+
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
 
@@ -1372,40 +2031,323 @@ gl_renderer_read_pixels(struct weston_output *output,
 	GLenum gl_format;
 	struct gl_output_state *go = get_output_state(output);
 
-	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
-	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		gl_format = GL_BGRA_EXT;
+		break;
+	case PIXMAN_a8b8g8r8:
+		gl_format = GL_RGBA;
+		break;
+	default:
+		return -1;
+	}
+
+	if (use_output(output) < 0)
+		return -1;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format,
+		     GL_UNSIGNED_BYTE, pixels);
+
+	return 0;
+}
+
+static void
+swap_rows(uint8_t *a, uint8_t *b, int bytes)
+{
+	uint8_t tmp[1024];
+	int n;
+
+	while (bytes > 0) {
+		n = MIN(bytes, (int) sizeof tmp);
+		memcpy(tmp, a, n);
+		memcpy(a, b, n);
+		memcpy(b, tmp, n);
+		a += n;
+		b += n;
+		bytes -= n;
+	}
+}
+
+static int
+gl_renderer_read_pixels_strided(struct weston_output *output,
+				pixman_format_code_t format, void *pixels,
+				int32_t stride,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	uint8_t *top, *bottom;
+	GLenum gl_format;
+	uint32_t i;
+
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		gl_format = GL_BGRA_EXT;
+		break;
+	case PIXMAN_a8b8g8r8:
+		gl_format = GL_RGBA;
+		break;
+	default:
+		return -1;
+	}
+
+	if (stride < 0 || (uint32_t) stride < width * 4)
+		return -1;
+
+	if (use_output(output) < 0)
+		return -1;
+
+	/* GL framebuffer rows go bottom-up. */
+	y = output->current_mode->height - y - height;
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+	if ((uint32_t) stride != width * 4 && !gr->has_pack_subimage) {
+		/* Without a pack row length, read one row at a time
+		 * straight into place. */
+		for (i = 0; i < height; i++)
+			glReadPixels(x, y + height - 1 - i, width, 1,
+				     gl_format, GL_UNSIGNED_BYTE,
+				     (uint8_t *) pixels + i * stride);
+		return 0;
+	}
+
+	if ((uint32_t) stride != width * 4)
+		glPixelStorei(GL_PACK_ROW_LENGTH_NV, stride / 4);
+	glReadPixels(x, y, width, height, gl_format,
+		     GL_UNSIGNED_BYTE, pixels);
+	if ((uint32_t) stride != width * 4)
+		glPixelStorei(GL_PACK_ROW_LENGTH_NV, 0);
+
+	top = pixels;
+	bottom = top + (height - 1) * stride;
+	while (top < bottom) {
+		swap_rows(top, bottom, width * 4);
+		top += stride;
+		bottom -= stride;
+	}
+
+	return 0;
+}
+
+static GLenum gl_format_from_internal(GLenum internal_format)
+{
+	switch (internal_format) {
+	case GL_R8_EXT:
+		return GL_RED_EXT;
+	case GL_RG8_EXT:
+		return GL_RG_EXT;
+	default:
+		return internal_format;
+	}
+}
+
+static bool
+surface_texture_used(struct weston_surface *surface)
+{
+	struct weston_view *view;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (view->plane == &surface->compositor->primary_plane)
+			return true;
+	}
+
+	return false;
+}
+
+static int
+gl_format_texel_size(GLenum internal_format, GLenum pixel_type)
+{
+	if (pixel_type == GL_UNSIGNED_SHORT_5_6_5)
+		return 2;
+
+	switch (internal_format) {
+	case GL_R8_EXT:
+	case GL_LUMINANCE:
+		return 1;
+	case GL_RG8_EXT:
+	case GL_LUMINANCE_ALPHA:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+/* Converts a box in buffer coordinates to texels of plane j, rounding
+ * outwards on subsampled planes. Returns false if nothing is left. */
+static bool
+plane_box(struct gl_surface_state *gs, int height, int j,
+	  pixman_box32_t in, pixman_box32_t *out)
+{
+	out->x1 = MAX(in.x1 / gs->hsub[j], 0);
+	out->y1 = MAX(in.y1 / gs->vsub[j], 0);
+	out->x2 = MIN((in.x2 + gs->hsub[j] - 1) / gs->hsub[j],
+		      gs->pitch / gs->hsub[j]);
+	out->y2 = MIN((in.y2 + gs->vsub[j] - 1) / gs->vsub[j],
+		      height / gs->vsub[j]);
+
+	return out->x1 < out->x2 && out->y1 < out->y2;
+}
+
+/* Rows are padded to the default GL_UNPACK_ALIGNMENT of 4. */
+static size_t
+staged_row_bytes(const pixman_box32_t *box, int texel_size)
+{
+	return ((size_t) (box->x2 - box->x1) * texel_size + 3) & ~(size_t) 3;
+}
+
+static pixman_box32_t
+upload_box(struct weston_surface *surface, pixman_box32_t *rectangles,
+	   int i)
+{
+	struct gl_surface_state *gs = get_surface_state(surface);
+	pixman_box32_t full;
+
+	if (!rectangles) {
+		full.x1 = 0;
+		full.y1 = 0;
+		full.x2 = gs->pitch;
+		full.y2 = gs->buffer_ref.buffer->height;
+		return full;
+	}
+
+	return weston_surface_to_buffer_rect(surface, rectangles[i]);
+}
+
+/* Copies the texture damage of a wl_shm buffer into the next pixel
+ * buffer of the ring and starts the texture uploads from there, so
+ * the GL driver can transfer it asynchronously and the client buffer
+ * is no longer needed once this returns. Everything is uploaded if a
+ * full upload is pending. Returns false if nothing was staged, in
+ * which case the damage is left for gl_renderer_flush_damage().
+ */
+static bool
+gl_renderer_upload_pbo(struct weston_surface *surface)
+{
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
+	struct weston_buffer *buffer = gs->buffer_ref.buffer;
+	struct gl_upload_pbo *pbo;
+	pixman_box32_t *rectangles = NULL;
+	pixman_box32_t r, b;
+	int texel_size[3], src_stride[3];
+	size_t size, offset, row_bytes;
+	const uint8_t *data, *src;
+	uint8_t *map;
+	int i, j, n = 1, y;
+
+	if (!gs->needs_full_upload)
+		rectangles = pixman_region32_rectangles(&gs->texture_damage,
+							&n);
+
+	size = 0;
+	for (j = 0; j < gs->num_textures; j++) {
+		texel_size[j] = gl_format_texel_size(gs->gl_format[j],
+						     gs->gl_pixel_type);
+		src_stride[j] = (gs->pitch / gs->hsub[j]) * texel_size[j];
+	}
+	for (i = 0; i < n; i++) {
+		r = upload_box(surface, rectangles, i);
+		for (j = 0; j < gs->num_textures; j++) {
+			if (plane_box(gs, buffer->height, j, r, &b))
+				size += staged_row_bytes(&b, texel_size[j]) *
+					(b.y2 - b.y1);
+		}
+	}
+	if (size == 0)
+		return false;
+
+	pbo = &gr->upload_pbos[gr->upload_pbo_next];
+	gr->upload_pbo_next = (gr->upload_pbo_next + 1) % GL_UPLOAD_PBO_COUNT;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, pbo->buffer);
+	if (pbo->size < size) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER_NV, size, NULL,
+			     GL_STREAM_DRAW);
+		pbo->size = size;
+	}
+
+	/* Invalidating lets the driver hand out fresh storage instead
+	 * of waiting for a transfer still reading the old contents. */
+	map = gr->map_buffer_range(GL_PIXEL_UNPACK_BUFFER_NV, 0, size,
+				   GL_MAP_WRITE_BIT_EXT |
+				   GL_MAP_INVALIDATE_BUFFER_BIT_EXT);
+	if (!map) {
+		pbo->size = 0;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+		return false;
+	}
+
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	offset = 0;
+	for (i = 0; i < n; i++) {
+		r = upload_box(surface, rectangles, i);
+		for (j = 0; j < gs->num_textures; j++) {
+			if (!plane_box(gs, buffer->height, j, r, &b))
+				continue;
+
+			row_bytes = staged_row_bytes(&b, texel_size[j]);
+			src = data + gs->offset[j] +
+			      (size_t) b.y1 * src_stride[j] +
+			      (size_t) b.x1 * texel_size[j];
+			for (y = b.y1; y < b.y2; y++) {
+				memcpy(map + offset, src,
+				       (b.x2 - b.x1) * texel_size[j]);
+				src += src_stride[j];
+				offset += row_bytes;
+			}
+		}
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
 
-	switch (format) {
-	case PIXMAN_a8r8g8b8:
-		gl_format = GL_BGRA_EXT;
-		break;
-	case PIXMAN_a8b8g8r8:
-		gl_format = GL_RGBA;
-		break;
-	default:
-		return -1;
+	if (!gr->unmap_buffer(GL_PIXEL_UNPACK_BUFFER_NV)) {
+		/* The buffer store got corrupted, try again at repaint. */
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+		return false;
 	}
 
-	if (use_output(output) < 0)
-		return -1;
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	offset = 0;
+	for (i = 0; i < n; i++) {
+		r = upload_box(surface, rectangles, i);
+		for (j = 0; j < gs->num_textures; j++) {
+			if (!plane_box(gs, buffer->height, j, r, &b))
+				continue;
 
-	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glReadPixels(x, y, width, height, gl_format,
-		     GL_UNSIGNED_BYTE, pixels);
+			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+			if (gs->needs_full_upload)
+				glTexImage2D(GL_TEXTURE_2D, 0,
+					     gs->gl_format[j],
+					     b.x2 - b.x1, b.y2 - b.y1, 0,
+					     gl_format_from_internal(gs->gl_format[j]),
+					     gs->gl_pixel_type,
+					     (void *) (uintptr_t) offset);
+			else
+				glTexSubImage2D(GL_TEXTURE_2D, 0,
+						b.x1, b.y1,
+						b.x2 - b.x1, b.y2 - b.y1,
+						gl_format_from_internal(gs->gl_format[j]),
+						gs->gl_pixel_type,
+						(void *) (uintptr_t) offset);
+
+			offset += staged_row_bytes(&b, texel_size[j]) *
+				  (b.y2 - b.y1);
+		}
+	}
 
-	return 0;
-}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
 
-static GLenum gl_format_from_internal(GLenum internal_format)
-{
-	switch (internal_format) {
-	case GL_R8_EXT:
-		return GL_RED_EXT;
-	case GL_RG8_EXT:
-		return GL_RG_EXT;
-	default:
-		return internal_format;
-	}
+	return true;
 }
 
 static void
@@ -1414,14 +2356,21 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
 	struct weston_buffer *buffer = gs->buffer_ref.buffer;
-	struct weston_view *view;
-	bool texture_used;
+	pixman_region32_t damage;
 	pixman_box32_t *rectangles;
 	uint8_t *data;
 	int i, j, n;
 
+	/* Skip what was uploaded when the surface was committed, but
+	 * keep any damage added since, e.g. by weston_surface_damage(). */
+	pixman_region32_init(&damage);
+	pixman_region32_subtract(&damage, &surface->damage,
+				 &gs->uploaded_damage);
 	pixman_region32_union(&gs->texture_damage,
-			      &gs->texture_damage, &surface->damage);
+			      &gs->texture_damage, &damage);
+	pixman_region32_fini(&damage);
+	pixman_region32_fini(&gs->uploaded_damage);
+	pixman_region32_init(&gs->uploaded_damage);
 
 	if (!buffer)
 		return;
@@ -1431,14 +2380,7 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	 * hold the reference to the buffer, in case the surface
 	 * migrates back to the primary plane.
 	 */
-	texture_used = false;
-	wl_list_for_each(view, &surface->views, surface_link) {
-		if (view->plane == &surface->compositor->primary_plane) {
-			texture_used = true;
-			break;
-		}
-	}
-	if (!texture_used)
+	if (!surface_texture_used(surface))
 		return;
 
 	if (!pixman_region32_not_empty(&gs->texture_damage) &&
@@ -1447,6 +2389,13 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 
 	data = wl_shm_buffer_get_data(buffer->shm_buffer);
 
+	if (gs->atlas_slot) {
+		wl_shm_buffer_begin_access(buffer->shm_buffer);
+		gl_atlas_upload(surface, data);
+		wl_shm_buffer_end_access(buffer->shm_buffer);
+		goto done;
+	}
+
 	if (!gr->has_unpack_subimage) {
 		wl_shm_buffer_begin_access(buffer->shm_buffer);
 		for (j = 0; j < gs->num_textures; j++) {
@@ -1521,11 +2470,306 @@ done:
 	weston_buffer_reference(&gs->buffer_ref, NULL);
 }
 
+static struct gl_atlas *
+gl_atlas_create(struct gl_renderer *gr)
+{
+	struct gl_atlas *atlas;
+
+	atlas = zalloc(sizeof *atlas);
+	if (!atlas)
+		return NULL;
+
+	atlas->width = gr->atlas_page_size;
+	atlas->height = gr->atlas_page_size;
+	wl_list_init(&atlas->shelves);
+
+	glGenTextures(1, &atlas->texture);
+	glBindTexture(GL_TEXTURE_2D, atlas->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
+		     atlas->width, atlas->height, 0,
+		     GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	wl_list_insert(gr->atlases.prev, &atlas->link);
+
+	return atlas;
+}
+
+static void
+gl_atlas_destroy(struct gl_atlas *atlas)
+{
+	struct gl_atlas_shelf *shelf, *next;
+
+	wl_list_for_each_safe(shelf, next, &atlas->shelves, link)
+		free(shelf);
+
+	glDeleteTextures(1, &atlas->texture);
+	wl_list_remove(&atlas->link);
+	free(atlas);
+}
+
+/* First fit along the shelf. Returns the list position to insert the
+ * slot at, or NULL if the shelf is full. */
+static struct wl_list *
+gl_atlas_shelf_find(struct gl_atlas *atlas, struct gl_atlas_shelf *shelf,
+		    int width, int *x)
+{
+	struct gl_atlas_slot *slot;
+	struct wl_list *prev = &shelf->slots;
+	int end = 0;
+
+	wl_list_for_each(slot, &shelf->slots, link) {
+		if (slot->x - end >= width)
+			break;
+		end = slot->x + slot->width;
+		prev = &slot->link;
+	}
+
+	if (&slot->link == &shelf->slots && atlas->width - end < width)
+		return NULL;
+
+	*x = end;
+	return prev;
+}
+
+/* Opens a shelf in the lowest vertical gap that is tall enough. */
+static struct gl_atlas_shelf *
+gl_atlas_add_shelf(struct gl_atlas *atlas, int height)
+{
+	struct gl_atlas_shelf *shelf, *new_shelf;
+	struct wl_list *prev = &atlas->shelves;
+	int end = 0;
+
+	wl_list_for_each(shelf, &atlas->shelves, link) {
+		if (shelf->y - end >= height)
+			break;
+		end = shelf->y + shelf->height;
+		prev = &shelf->link;
+	}
+
+	if (&shelf->link == &atlas->shelves && atlas->height - end < height)
+		return NULL;
+
+	new_shelf = zalloc(sizeof *new_shelf);
+	if (!new_shelf)
+		return NULL;
+
+	new_shelf->y = end;
+	new_shelf->height = height;
+	wl_list_init(&new_shelf->slots);
+	wl_list_insert(prev, &new_shelf->link);
+
+	return new_shelf;
+}
+
+static struct gl_atlas_slot *
+gl_atlas_slot_create(struct gl_renderer *gr, int width, int height)
+{
+	struct gl_atlas *atlas;
+	struct gl_atlas_shelf *shelf;
+	struct gl_atlas_slot *slot;
+	struct wl_list *pos = NULL;
+	int x, n_pages = 0;
+
+	/* the gutter */
+	width += 2;
+	height += 2;
+
+	if (width > gr->atlas_page_size || height > gr->atlas_page_size)
+		return NULL;
+
+	/* Shelves up to half again as tall as the slot may take it. */
+	wl_list_for_each(atlas, &gr->atlases, link) {
+		wl_list_for_each(shelf, &atlas->shelves, link) {
+			if (shelf->height < height ||
+			    shelf->height > height + height / 2)
+				continue;
+
+			pos = gl_atlas_shelf_find(atlas, shelf, width, &x);
+			if (pos)
+				goto found;
+		}
+		n_pages++;
+	}
+
+	wl_list_for_each(atlas, &gr->atlases, link) {
+		shelf = gl_atlas_add_shelf(atlas, height);
+		if (shelf)
+			goto add;
+	}
+
+	if (n_pages >= GL_ATLAS_MAX_PAGES)
+		return NULL;
+
+	atlas = gl_atlas_create(gr);
+	if (!atlas)
+		return NULL;
+	shelf = gl_atlas_add_shelf(atlas, height);
+	if (!shelf) {
+		gl_atlas_destroy(atlas);
+		return NULL;
+	}
+
+add:
+	pos = &shelf->slots;
+	x = 0;
+found:
+	slot = zalloc(sizeof *slot);
+	if (!slot) {
+		if (wl_list_empty(&shelf->slots)) {
+			wl_list_remove(&shelf->link);
+			free(shelf);
+		}
+		return NULL;
+	}
+
+	slot->atlas = atlas;
+	slot->shelf = shelf;
+	slot->x = x;
+	slot->y = shelf->y;
+	slot->width = width;
+	slot->height = height;
+	wl_list_insert(pos, &slot->link);
+
+	return slot;
+}
+
+/* Empty shelves are closed, and so are empty pages but the first. */
+static void
+gl_atlas_slot_destroy(struct gl_renderer *gr, struct gl_atlas_slot *slot)
+{
+	struct gl_atlas *atlas = slot->atlas;
+	struct gl_atlas_shelf *shelf = slot->shelf;
+
+	wl_list_remove(&slot->link);
+	free(slot);
+
+	if (!wl_list_empty(&shelf->slots))
+		return;
+
+	wl_list_remove(&shelf->link);
+	free(shelf);
+
+	if (wl_list_empty(&atlas->shelves) && &atlas->link != gr->atlases.next)
+		gl_atlas_destroy(atlas);
+}
+
+static void
+surface_release_textures(struct gl_surface_state *gs)
+{
+	struct gl_renderer *gr = get_renderer(gs->surface->compositor);
+
+	if (gs->atlas_slot) {
+		gl_atlas_slot_destroy(gr, gs->atlas_slot);
+		gs->atlas_slot = NULL;
+	} else {
+		glDeleteTextures(gs->num_textures, gs->textures);
+	}
+
+	gs->num_textures = 0;
+}
+
+/* Uploads texture damage, or everything if a full upload is pending,
+ * into the atlas slot of the surface, refreshing the gutter where the
+ * damage touches an edge. */
+static void
+gl_atlas_upload(struct weston_surface *surface, const uint8_t *data)
+{
+	struct gl_surface_state *gs = get_surface_state(surface);
+	struct gl_atlas_slot *slot = gs->atlas_slot;
+	pixman_box32_t *rectangles, full, r;
+	struct {
+		int src, len, dst;
+	} xs[3], ys[3];
+	int i, a, b, n, nx, ny;
+
+	full.x1 = 0;
+	full.y1 = 0;
+	full.x2 = gs->pitch;
+	full.y2 = gs->height;
+
+	if (gs->needs_full_upload) {
+		rectangles = &full;
+		n = 1;
+	} else {
+		rectangles = pixman_region32_rectangles(&gs->texture_damage,
+							&n);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, slot->atlas->texture);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
+
+	for (i = 0; i < n; i++) {
+		if (gs->needs_full_upload)
+			r = full;
+		else
+			r = weston_surface_to_buffer_rect(surface,
+							  rectangles[i]);
+
+		r.x1 = MAX(r.x1, 0);
+		r.y1 = MAX(r.y1, 0);
+		r.x2 = MIN(r.x2, gs->pitch);
+		r.y2 = MIN(r.y2, gs->height);
+		if (r.x1 >= r.x2 || r.y1 >= r.y2)
+			continue;
+
+		nx = 0;
+		xs[nx].src = r.x1;
+		xs[nx].len = r.x2 - r.x1;
+		xs[nx++].dst = r.x1 + 1;
+		if (r.x1 == 0) {
+			xs[nx].src = 0;
+			xs[nx].len = 1;
+			xs[nx++].dst = 0;
+		}
+		if (r.x2 == gs->pitch) {
+			xs[nx].src = gs->pitch - 1;
+			xs[nx].len = 1;
+			xs[nx++].dst = gs->pitch + 1;
+		}
+
+		ny = 0;
+		ys[ny].src = r.y1;
+		ys[ny].len = r.y2 - r.y1;
+		ys[ny++].dst = r.y1 + 1;
+		if (r.y1 == 0) {
+			ys[ny].src = 0;
+			ys[ny].len = 1;
+			ys[ny++].dst = 0;
+		}
+		if (r.y2 == gs->height) {
+			ys[ny].src = gs->height - 1;
+			ys[ny].len = 1;
+			ys[ny++].dst = gs->height + 1;
+		}
+
+		for (a = 0; a < nx; a++) {
+			for (b = 0; b < ny; b++) {
+				glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT,
+					      xs[a].src);
+				glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT,
+					      ys[b].src);
+				glTexSubImage2D(GL_TEXTURE_2D, 0,
+						slot->x + xs[a].dst,
+						slot->y + ys[b].dst,
+						xs[a].len, ys[b].len,
+						GL_BGRA_EXT, GL_UNSIGNED_BYTE,
+						data);
+			}
+		}
+	}
+}
+
 static void
 ensure_textures(struct gl_surface_state *gs, int num_textures)
 {
 	int i;
 
+	if (gs->atlas_slot)
+		surface_release_textures(gs);
+
 	if (num_textures <= gs->num_textures)
 		return;
 
@@ -1548,6 +2792,7 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 	struct weston_compositor *ec = es->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
 	struct gl_surface_state *gs = get_surface_state(es);
+	struct gl_atlas_slot *slot;
 	GLenum gl_format[3] = {0, 0, 0};
 	GLenum gl_pixel_type;
 	int pitch;
@@ -1664,7 +2909,20 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 
 		gs->surface = es;
 
-		ensure_textures(gs, num_planes);
+		slot = NULL;
+		if (num_planes == 1 && gl_format[0] == GL_BGRA_EXT &&
+		    pitch <= gr->atlas_max_size &&
+		    buffer->height <= gr->atlas_max_size)
+			slot = gl_atlas_slot_create(gr, pitch, buffer->height);
+
+		if (slot) {
+			surface_release_textures(gs);
+			gs->atlas_slot = slot;
+			gs->textures[0] = slot->atlas->texture;
+			gs->num_textures = 1;
+		} else {
+			ensure_textures(gs, num_planes);
+		}
 	}
 }
 
@@ -2322,8 +3580,7 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 			gs->images[i] = NULL;
 		}
 		gs->num_images = 0;
-		glDeleteTextures(gs->num_textures, gs->textures);
-		gs->num_textures = 0;
+		surface_release_textures(gs);
 		gs->buffer_type = BUFFER_TYPE_NULL;
 		gs->y_inverted = 1;
 		return;
@@ -2426,6 +3683,8 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	const GLenum gl_format = GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
+	struct gl_atlas_slot *slot;
+	GLfloat texcoords[4 * 2];
 	int cw, ch;
 	GLuint fbo;
 	GLuint tex;
@@ -2492,7 +3751,19 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	glEnableVertexAttribArray(0);
 
 	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	memcpy(texcoords, verts, sizeof texcoords);
+	slot = gs->atlas_slot;
+	if (slot) {
+		for (i = 0; i < 4; i++) {
+			texcoords[i * 2] = (slot->x + 1 +
+					    verts[i * 2] * gs->pitch) /
+					   slot->atlas->width;
+			texcoords[i * 2 + 1] = (slot->y + 1 +
+						verts[i * 2 + 1] * gs->height) /
+					       slot->atlas->height;
+		}
+	}
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
 	glEnableVertexAttribArray(1);
 
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
@@ -2516,17 +3787,19 @@ surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 	int i;
 
 	wl_list_remove(&gs->surface_destroy_listener.link);
+	wl_list_remove(&gs->surface_commit_listener.link);
 	wl_list_remove(&gs->renderer_destroy_listener.link);
 
-	gs->surface->renderer_state = NULL;
+	surface_release_textures(gs);
 
-	glDeleteTextures(gs->num_textures, gs->textures);
+	gs->surface->renderer_state = NULL;
 
 	for (i = 0; i < gs->num_images; i++)
 		egl_image_unref(gs->images[i]);
 
 	weston_buffer_reference(&gs->buffer_ref, NULL);
 	pixman_region32_fini(&gs->texture_damage);
+	pixman_region32_fini(&gs->uploaded_damage);
 	free(gs);
 }
 
@@ -2544,6 +3817,44 @@ surface_state_handle_surface_destroy(struct wl_listener *listener, void *data)
 	surface_state_destroy(gs, gr);
 }
 
+static void
+surface_state_handle_surface_commit(struct wl_listener *listener, void *data)
+{
+	struct gl_surface_state *gs;
+	struct weston_surface *surface = data;
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+
+	gs = container_of(listener, struct gl_surface_state,
+			  surface_commit_listener);
+
+	/* Every commit brings new buffer damage, forget what the
+	 * previous one uploaded. */
+	pixman_region32_fini(&gs->uploaded_damage);
+	pixman_region32_init(&gs->uploaded_damage);
+
+	/* Atlas slots are small, they are uploaded at repaint. */
+	if (!gr->has_pbo || !gs->buffer_ref.buffer || gs->atlas_slot ||
+	    gs->buffer_type != BUFFER_TYPE_SHM || gs->num_textures == 0 ||
+	    !surface_texture_used(surface))
+		return;
+
+	pixman_region32_union(&gs->texture_damage,
+			      &gs->texture_damage, &surface->damage);
+	if (!pixman_region32_not_empty(&gs->texture_damage) &&
+	    !gs->needs_full_upload)
+		return;
+
+	if (!gl_renderer_upload_pbo(surface))
+		return;
+
+	pixman_region32_fini(&gs->texture_damage);
+	pixman_region32_init(&gs->texture_damage);
+	gs->needs_full_upload = false;
+	pixman_region32_copy(&gs->uploaded_damage, &surface->damage);
+
+	weston_buffer_reference(&gs->buffer_ref, NULL);
+}
+
 static void
 surface_state_handle_renderer_destroy(struct wl_listener *listener, void *data)
 {
@@ -2578,6 +3889,7 @@ gl_renderer_create_surface(struct weston_surface *surface)
 	gs->surface = surface;
 
 	pixman_region32_init(&gs->texture_damage);
+	pixman_region32_init(&gs->uploaded_damage);
 	surface->renderer_state = gs;
 
 	gs->surface_destroy_listener.notify =
@@ -2585,6 +3897,11 @@ gl_renderer_create_surface(struct weston_surface *surface)
 	wl_signal_add(&surface->destroy_signal,
 		      &gs->surface_destroy_listener);
 
+	gs->surface_commit_listener.notify =
+		surface_state_handle_surface_commit;
+	wl_signal_add(&surface->commit_signal,
+		      &gs->surface_commit_listener);
+
 	gs->renderer_destroy_listener.notify =
 		surface_state_handle_renderer_destroy;
 	wl_signal_add(&gr->destroy_signal,
@@ -3012,6 +4329,7 @@ static int
 gl_renderer_output_create(struct weston_output *output,
 			  EGLSurface surface)
 {
+	struct wl_event_loop *loop;
 	struct gl_output_state *go;
 	int i;
 
@@ -3026,6 +4344,18 @@ gl_renderer_output_create(struct weston_output *output,
 
 	wl_list_init(&go->timeline_render_point_list);
 
+	loop = wl_display_get_event_loop(output->compositor->wl_display);
+	wl_list_init(&go->readbacks);
+	go->readback_timer = wl_event_loop_add_timer(loop,
+						     gl_readback_timer_handler,
+						     output);
+	if (go->readback_timer == NULL) {
+		for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
+			pixman_region32_fini(&go->buffer_damage[i]);
+		free(go);
+		return -1;
+	}
+
 	output->renderer_state = go;
 
 	return 0;
@@ -3061,6 +4391,36 @@ gl_renderer_output_window_create(struct weston_output *output,
 	return ret;
 }
 
+static int
+gl_renderer_output_pbuffer_create(struct weston_output *output,
+				  int width, int height)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	EGLSurface egl_surface;
+	int ret;
+
+	const EGLint pbuffer_attribs[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
+
+	egl_surface = eglCreatePbufferSurface(gr->egl_display,
+					      gr->egl_config,
+					      pbuffer_attribs);
+	if (egl_surface == EGL_NO_SURFACE) {
+		weston_log("failed to create egl pbuffer surface\n");
+		gl_renderer_print_egl_error_state();
+		return -1;
+	}
+
+	ret = gl_renderer_output_create(output, egl_surface);
+	if (ret < 0)
+		eglDestroySurface(gr->egl_display, egl_surface);
+
+	return ret;
+}
+
 static void
 gl_renderer_output_destroy(struct weston_output *output)
 {
@@ -3072,6 +4432,14 @@ gl_renderer_output_destroy(struct weston_output *output)
 	for (i = 0; i < 2; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
+	/* Callbacks may try to read the output again; refuse those so
+	 * nothing is left pending on the dying surface. */
+	go->destroying = true;
+	use_output(output);
+	gl_output_finish_all_readbacks(output);
+	assert(wl_list_empty(&go->readbacks));
+	wl_event_source_remove(go->readback_timer);
+
 	eglMakeCurrent(gr->egl_display,
 		       EGL_NO_SURFACE, EGL_NO_SURFACE,
 		       EGL_NO_CONTEXT);
@@ -3099,9 +4467,31 @@ gl_renderer_destroy(struct weston_compositor *ec)
 {
 	struct gl_renderer *gr = get_renderer(ec);
 	struct dmabuf_image *image, *next;
+	struct gl_atlas *atlas, *next_atlas;
+	struct gl_readback *rb, *next_rb;
+	struct gl_batch *batches;
+	int i;
 
 	wl_signal_emit(&gr->destroy_signal, gr);
 
+	if (gr->has_pbo) {
+		for (i = 0; i < GL_UPLOAD_PBO_COUNT; i++)
+			glDeleteBuffers(1, &gr->upload_pbos[i].buffer);
+	}
+
+	wl_list_for_each_safe(atlas, next_atlas, &gr->atlases, link)
+		gl_atlas_destroy(atlas);
+
+	wl_list_for_each_safe(rb, next_rb, &gr->readback_pool, link) {
+		glDeleteBuffers(1, &rb->pbo);
+		free(rb);
+	}
+
+	if (gr->batch_vbo)
+		glDeleteBuffers(1, &gr->batch_vbo);
+	if (gr->batch_ibo)
+		glDeleteBuffers(1, &gr->batch_ibo);
+
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
@@ -3126,10 +4516,19 @@ gl_renderer_destroy(struct weston_compositor *ec)
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
 
+	batches = gr->batches.data;
+	for (i = 0; i < (int) (gr->batches.size / sizeof *batches); i++) {
+		wl_array_release(&batches[i].vertices);
+		wl_array_release(&batches[i].indices);
+	}
+	wl_array_release(&gr->batches);
+
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
 	if (gr->fan_binding)
 		weston_binding_destroy(gr->fan_binding);
+	if (gr->draw_stats_binding)
+		weston_binding_destroy(gr->draw_stats_binding);
 
 	free(gr);
 }
@@ -3266,6 +4665,16 @@ static const EGLint gl_renderer_opaque_attribs[] = {
 	EGL_NONE
 };
 
+static const EGLint gl_renderer_pbuffer_attribs[] = {
+	EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+	EGL_RED_SIZE, 1,
+	EGL_GREEN_SIZE, 1,
+	EGL_BLUE_SIZE, 1,
+	EGL_ALPHA_SIZE, 0,
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+	EGL_NONE
+};
+
 static const EGLint gl_renderer_alpha_attribs[] = {
 	EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
 	EGL_RED_SIZE, 1,
@@ -3349,6 +4758,8 @@ platform_to_extension(EGLenum platform)
 		return "wayland";
 	case EGL_PLATFORM_X11_KHR:
 		return "x11";
+	case EGL_PLATFORM_SURFACELESS_MESA:
+		return "surfaceless";
 	default:
 		assert(0 && "bad EGL platform enum");
 	}
@@ -3426,6 +4837,7 @@ gl_renderer_display_create(struct weston_compositor *ec, EGLenum platform,
 		return -1;
 
 	gr->base.read_pixels = gl_renderer_read_pixels;
+	gr->base.read_pixels_strided = gl_renderer_read_pixels_strided;
 	gr->base.repaint_output = gl_renderer_repaint_output;
 	gr->base.flush_damage = gl_renderer_flush_damage;
 	gr->base.attach = gl_renderer_attach;
@@ -3486,6 +4898,8 @@ gl_renderer_display_create(struct weston_compositor *ec, EGLenum platform,
 		goto fail_with_error;
 
 	wl_list_init(&gr->dmabuf_images);
+	wl_list_init(&gr->atlases);
+	wl_list_init(&gr->readback_pool);
 	if (gr->has_dmabuf_import) {
 		gr->base.import_dmabuf = gl_renderer_import_dmabuf;
 		gr->base.query_dmabuf_formats =
@@ -3607,6 +5021,40 @@ fan_debug_repaint_binding(struct weston_keyboard *keyboard,
 	weston_compositor_damage_all(compositor);
 }
 
+static void
+draw_stats_binding(struct weston_keyboard *keyboard,
+		   const struct timespec *time, uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct gl_renderer *gr = get_renderer(compositor);
+
+	gr->draw_stats = !gr->draw_stats;
+	weston_compositor_damage_all(compositor);
+}
+
+static void
+gl_renderer_setup_atlas(struct gl_renderer *gr)
+{
+	const char *env;
+	int32_t n = GL_ATLAS_DEFAULT_MAX_SIZE;
+	GLint max_texture_size;
+
+	env = getenv("WESTON_GL_ATLAS_MAX_SIZE");
+	if (env && (!safe_strtoint(env, &n) || n < 0)) {
+		weston_log("GL renderer: invalid WESTON_GL_ATLAS_MAX_SIZE "
+			   "value '%s', ignoring\n", env);
+		n = GL_ATLAS_DEFAULT_MAX_SIZE;
+	}
+
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+	gr->atlas_page_size = MIN(GL_ATLAS_PAGE_SIZE, max_texture_size);
+
+	/* Leave room for the gutter and a few slots per page. */
+	gr->atlas_max_size = MIN(n, gr->atlas_page_size / 4 - 2);
+	if (gr->atlas_max_size < 0)
+		gr->atlas_max_size = 0;
+}
+
 static uint32_t
 get_gl_version(void)
 {
@@ -3630,6 +5078,7 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	const char *extensions;
 	EGLConfig context_config;
 	EGLBoolean ret;
+	int i;
 
 	EGLint context_attribs[] = {
 		EGL_CONTEXT_CLIENT_VERSION, 0,
@@ -3705,10 +5154,44 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	    weston_check_egl_extension(extensions, "GL_EXT_unpack_subimage"))
 		gr->has_unpack_subimage = 1;
 
+	if (gr->gl_version >= GR_GL_VERSION(3, 0) ||
+	    weston_check_egl_extension(extensions, "GL_NV_pack_subimage"))
+		gr->has_pack_subimage = 1;
+
 	if (gr->gl_version >= GR_GL_VERSION(3, 0) ||
 	    weston_check_egl_extension(extensions, "GL_EXT_texture_rg"))
 		gr->has_gl_texture_rg = 1;
 
+	if (gr->gl_version >= GR_GL_VERSION(3, 0)) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer =
+			(void *) eglGetProcAddress("glUnmapBuffer");
+	} else if (weston_check_egl_extension(extensions, "GL_NV_pixel_buffer_object") &&
+		   weston_check_egl_extension(extensions, "GL_EXT_map_buffer_range") &&
+		   weston_check_egl_extension(extensions, "GL_OES_mapbuffer")) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRangeEXT");
+		gr->unmap_buffer =
+			(void *) eglGetProcAddress("glUnmapBufferOES");
+	}
+	if (gr->has_unpack_subimage)
+		gl_renderer_setup_atlas(gr);
+
+	if (gr->has_unpack_subimage &&
+	    gr->map_buffer_range && gr->unmap_buffer) {
+		for (i = 0; i < GL_UPLOAD_PBO_COUNT; i++)
+			glGenBuffers(1, &gr->upload_pbos[i].buffer);
+		gr->has_pbo = 1;
+	}
+
+	/* The extensions map_buffer_range comes with on GLES 2 include
+	 * pixel-pack buffers. */
+	if (gr->map_buffer_range && gr->unmap_buffer) {
+		gr->has_async_readback = 1;
+		gr->base.queue_read_pixels = gl_renderer_queue_read_pixels;
+	}
+
 	if (weston_check_egl_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
@@ -3725,6 +5208,10 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		weston_compositor_add_debug_binding(ec, KEY_F,
 						    fan_debug_repaint_binding,
 						    ec);
+	gr->draw_stats_binding =
+		weston_compositor_add_debug_binding(ec, KEY_B,
+						    draw_stats_binding,
+						    ec);
 
 	gr->output_destroy_listener.notify = output_handle_destroy;
 	wl_signal_add(&ec->output_destroyed_signal,
@@ -3735,6 +5222,18 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload through pixel buffers: %s\n",
+			    gr->has_pbo ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "asynchronous read-back: %s\n",
+			    gr->has_async_readback ?
+			    (gr->has_native_fence_sync ? "yes, fenced" : "yes") :
+			    "no");
+	if (gr->atlas_max_size > 0)
+		weston_log_continue(STAMP_SPACE "wl_shm texture atlas: "
+				    "up to %dx%d\n", gr->atlas_max_size,
+				    gr->atlas_max_size);
+	else
+		weston_log_continue(STAMP_SPACE "wl_shm texture atlas: no\n");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
 
@@ -3745,10 +5244,12 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 WL_EXPORT struct gl_renderer_interface gl_renderer_interface = {
 	.opaque_attribs = gl_renderer_opaque_attribs,
 	.alpha_attribs = gl_renderer_alpha_attribs,
+	.pbuffer_attribs = gl_renderer_pbuffer_attribs,
 
 	.display_create = gl_renderer_display_create,
 	.display = gl_renderer_display,
 	.output_window_create = gl_renderer_output_window_create,
+	.output_pbuffer_create = gl_renderer_output_pbuffer_create,
 	.output_destroy = gl_renderer_output_destroy,
 	.output_surface = gl_renderer_output_surface,
 	.output_set_border = gl_renderer_output_set_border,
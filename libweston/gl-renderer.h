@@ -59,6 +59,7 @@ enum gl_renderer_border_side {
 struct gl_renderer_interface {
 	const EGLint *opaque_attribs;
 	const EGLint *alpha_attribs;
+	const EGLint *pbuffer_attribs;
 
 	int (*display_create)(struct weston_compositor *ec,
 			      EGLenum platform,
@@ -77,6 +78,12 @@ struct gl_renderer_interface {
 				    const EGLint *visual_id,
 				    const int n_ids);
 
+	/* Creates an off-screen output rendering into a pbuffer of the
+	 * given size, for backends without a native window. The display
+	 * must have been created with pbuffer_attribs. */
+	int (*output_pbuffer_create)(struct weston_output *output,
+				     int width, int height);
+
 	void (*output_destroy)(struct weston_output *output);
 
 	EGLSurface (*output_surface)(struct weston_output *output);
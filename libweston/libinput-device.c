@@ -38,12 +38,14 @@
 
 #include "compositor.h"
 #include "libinput-device.h"
+#include "libinput-seat.h"
 #include "shared/helpers.h"
 #include "shared/timespec-util.h"
 
 void
 evdev_led_update(struct evdev_device *device, enum weston_led weston_leds)
 {
+	struct udev_seat *seat = (struct udev_seat *) device->seat;
 	enum libinput_led leds = 0;
 
 	if (weston_leds & LED_NUM_LOCK)
@@ -53,7 +55,9 @@ evdev_led_update(struct evdev_device *device, enum weston_led weston_leds)
 	if (weston_leds & LED_SCROLL_LOCK)
 		leds |= LIBINPUT_LED_SCROLL_LOCK;
 
+	udev_input_lock(seat->input);
 	libinput_device_led_update(device->device, leds);
+	udev_input_unlock(seat->input);
 }
 
 static void
@@ -534,6 +538,8 @@ void
 evdev_device_set_output(struct evdev_device *device,
 			struct weston_output *output)
 {
+	struct udev_seat *seat = (struct udev_seat *) device->seat;
+
 	if (device->output_destroy_listener.notify) {
 		wl_list_remove(&device->output_destroy_listener.link);
 		device->output_destroy_listener.notify = NULL;
@@ -543,7 +549,11 @@ evdev_device_set_output(struct evdev_device *device,
 	device->output_destroy_listener.notify = notify_output_destroy;
 	wl_signal_add(&output->destroy_signal,
 		      &device->output_destroy_listener);
+
+	/* Output hotplug reaches us outside of event processing. */
+	udev_input_lock(seat->input);
 	evdev_device_set_calibration(device);
+	udev_input_unlock(seat->input);
 }
 
 struct evdev_device *
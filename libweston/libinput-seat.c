@@ -26,11 +26,17 @@
 
 #include "config.h"
 
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
 #include <libinput.h>
 #include <libudev.h>
 
@@ -39,6 +45,8 @@
 #include "libinput-seat.h"
 #include "libinput-device.h"
 #include "shared/helpers.h"
+#include "shared/string-helpers.h"
+#include "shared/thread-util.h"
 
 static void
 process_events(struct udev_input *input);
@@ -46,6 +54,397 @@ static struct udev_seat *
 udev_seat_create(struct udev_input *input, const char *seat_name);
 static void
 udev_seat_destroy(struct udev_seat *seat);
+static void
+process_event(struct libinput_event *event);
+
+/* Must be a power of two. */
+#define UDEV_INPUT_QUEUE_SIZE 1024
+
+enum udev_input_owner {
+	UDEV_INPUT_OWNER_NONE,
+	UDEV_INPUT_OWNER_COMPOSITOR,
+	UDEV_INPUT_OWNER_THREAD,
+};
+
+/* With WESTON_LIBINPUT_THREAD=1, libinput is dispatched on a thread of its
+ * own so the kernel queues are drained while the compositor thread is busy.
+ * The events, which carry their kernel timestamps, are handed over through a
+ * single-producer single-consumer ring and an eventfd.
+ *
+ * libinput is not thread-safe, so every call into it is made with the
+ * libinput lock held. The compositor thread may take it recursively. Devices
+ * the input thread opens or closes on hotplug are passed to the compositor
+ * thread, which owns the launcher, while the input thread waits. */
+struct udev_input_thread {
+	struct udev_input *input;
+	pthread_t thread;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* Protected by mutex. */
+	enum udev_input_owner owner;
+	int depth;
+	struct {
+		bool pending;
+		const char *path;	/* NULL to close fd */
+		int flags;
+		int fd;
+	} request;
+
+	bool quit;
+	/* Changed by the compositor thread with the libinput lock held. */
+	bool active;
+	/* Set by the input thread when the ring is full. */
+	bool stalled;
+
+	int wake_fd;		/* compositor thread -> input thread */
+	int event_fd;		/* input thread -> compositor thread */
+	struct wl_event_source *source;
+
+	uint32_t head;		/* written by the input thread */
+	uint32_t tail;		/* written by the compositor thread */
+	struct libinput_event *queue[UDEV_INPUT_QUEUE_SIZE];
+};
+
+static void
+udev_input_thread_notify(int fd)
+{
+	uint64_t value = 1;
+	ssize_t ret;
+
+	do {
+		ret = write(fd, &value, sizeof value);
+	} while (ret < 0 && errno == EINTR);
+}
+
+/* Opens or closes a device on behalf of the input thread. Called on the
+ * compositor thread with the mutex held. */
+static void
+udev_input_thread_serve(struct udev_input_thread *t)
+{
+	struct weston_launcher *launcher = t->input->compositor->launcher;
+
+	if (!t->request.pending)
+		return;
+
+	if (t->request.path)
+		t->request.fd = weston_launcher_open(launcher,
+						     t->request.path,
+						     t->request.flags);
+	else
+		weston_launcher_close(launcher, t->request.fd);
+
+	t->request.pending = false;
+	pthread_cond_broadcast(&t->cond);
+}
+
+/* Called on the input thread, from libinput, with the libinput lock held. */
+static int
+udev_input_thread_call(struct udev_input_thread *t,
+		       const char *path, int flags, int fd)
+{
+	pthread_mutex_lock(&t->mutex);
+	t->request.path = path;
+	t->request.flags = flags;
+	t->request.fd = fd;
+	t->request.pending = true;
+	pthread_cond_broadcast(&t->cond);
+	udev_input_thread_notify(t->event_fd);
+
+	while (t->request.pending &&
+	       !__atomic_load_n(&t->quit, __ATOMIC_ACQUIRE))
+		pthread_cond_wait(&t->cond, &t->mutex);
+
+	/* On shutdown the request is abandoned. */
+	if (t->request.pending) {
+		t->request.pending = false;
+		fd = -1;
+	} else {
+		fd = t->request.fd;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return fd;
+}
+
+static void
+udev_input_thread_acquire(struct udev_input_thread *t,
+			  enum udev_input_owner self)
+{
+	pthread_mutex_lock(&t->mutex);
+	while (t->owner != UDEV_INPUT_OWNER_NONE && t->owner != self) {
+		/* The input thread may be waiting for us to open a device. */
+		if (self == UDEV_INPUT_OWNER_COMPOSITOR && t->request.pending)
+			udev_input_thread_serve(t);
+		else
+			pthread_cond_wait(&t->cond, &t->mutex);
+	}
+	t->owner = self;
+	t->depth++;
+	pthread_mutex_unlock(&t->mutex);
+}
+
+static void
+udev_input_thread_release(struct udev_input_thread *t)
+{
+	pthread_mutex_lock(&t->mutex);
+	assert(t->depth > 0);
+	if (--t->depth == 0) {
+		t->owner = UDEV_INPUT_OWNER_NONE;
+		pthread_cond_broadcast(&t->cond);
+	}
+	pthread_mutex_unlock(&t->mutex);
+}
+
+/** Take the libinput lock on the compositor thread
+ *
+ * \param input The udev input.
+ *
+ * Calls into libinput made outside of event processing must hold it while
+ * the input thread runs. It may be taken recursively, and is a no-op when
+ * libinput is dispatched from the compositor thread.
+ */
+void
+udev_input_lock(struct udev_input *input)
+{
+	if (input->thread)
+		udev_input_thread_acquire(input->thread,
+					  UDEV_INPUT_OWNER_COMPOSITOR);
+}
+
+/** Release the libinput lock taken with udev_input_lock()
+ *
+ * \param input The udev input.
+ */
+void
+udev_input_unlock(struct udev_input *input)
+{
+	if (input->thread)
+		udev_input_thread_release(input->thread);
+}
+
+/* Moves events from libinput into the ring. Called on the input thread with
+ * the libinput lock held. Returns the number of events queued. */
+static int
+udev_input_thread_drain(struct udev_input_thread *t)
+{
+	struct libinput_event *event;
+	uint32_t head = t->head;
+	uint32_t tail;
+	int count = 0;
+
+	for (;;) {
+		tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+		if (head - tail == UDEV_INPUT_QUEUE_SIZE) {
+			/* Ask to be woken once the compositor thread caught
+			 * up, unless it just did. */
+			__atomic_store_n(&t->stalled, true, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&t->tail, __ATOMIC_SEQ_CST) == tail)
+				break;
+			continue;
+		}
+
+		event = libinput_get_event(t->input->libinput);
+		if (!event)
+			break;
+
+		t->queue[head % UDEV_INPUT_QUEUE_SIZE] = event;
+		__atomic_store_n(&t->head, ++head, __ATOMIC_RELEASE);
+		count++;
+	}
+
+	return count;
+}
+
+static void *
+udev_input_thread(void *data)
+{
+	struct udev_input_thread *t = data;
+	struct libinput *libinput = t->input->libinput;
+	struct pollfd fds[2];
+	uint64_t value;
+	nfds_t nfds;
+	int queued;
+
+	fds[0].fd = t->wake_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = libinput_get_fd(libinput);
+	fds[1].events = POLLIN;
+
+	while (!__atomic_load_n(&t->quit, __ATOMIC_ACQUIRE)) {
+		/* Only watch libinput while the seat is enabled. */
+		nfds = __atomic_load_n(&t->active, __ATOMIC_ACQUIRE) ? 2 : 1;
+		if (poll(fds, nfds, -1) < 0)
+			continue;
+
+		if (fds[0].revents & POLLIN) {
+			while (read(t->wake_fd, &value, sizeof value) < 0 &&
+			       errno == EINTR)
+				;
+		}
+
+		queued = 0;
+		udev_input_thread_acquire(t, UDEV_INPUT_OWNER_THREAD);
+		if (__atomic_load_n(&t->active, __ATOMIC_ACQUIRE)) {
+			if (libinput_dispatch(libinput) != 0)
+				weston_log("libinput: Failed to dispatch "
+					   "libinput\n");
+			queued = udev_input_thread_drain(t);
+		}
+		udev_input_thread_release(t);
+
+		if (queued > 0)
+			udev_input_thread_notify(t->event_fd);
+	}
+
+	return NULL;
+}
+
+/* Processes what the input thread queued, taking the libinput lock for each
+ * event so the input thread can keep draining the kernel meanwhile. */
+static void
+process_queued_events(struct udev_input *input)
+{
+	struct udev_input_thread *t = input->thread;
+	struct libinput_event *event;
+	uint32_t tail = t->tail;
+	uint32_t head;
+
+	head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		event = t->queue[tail % UDEV_INPUT_QUEUE_SIZE];
+
+		udev_input_lock(input);
+		process_event(event);
+		libinput_event_destroy(event);
+		udev_input_unlock(input);
+
+		__atomic_store_n(&t->tail, ++tail, __ATOMIC_SEQ_CST);
+	}
+
+	if (__atomic_exchange_n(&t->stalled, false, __ATOMIC_SEQ_CST))
+		udev_input_thread_notify(t->wake_fd);
+}
+
+static int
+udev_input_thread_handler(int fd, uint32_t mask, void *data)
+{
+	struct udev_input *input = data;
+	struct udev_input_thread *t = input->thread;
+	uint64_t value;
+
+	if (read(fd, &value, sizeof value) != sizeof value)
+		return 1;
+
+	pthread_mutex_lock(&t->mutex);
+	udev_input_thread_serve(t);
+	pthread_mutex_unlock(&t->mutex);
+
+	process_queued_events(input);
+
+	return 1;
+}
+
+static bool
+udev_input_thread_wanted(void)
+{
+	char *env;
+	int value;
+
+	env = getenv("WESTON_LIBINPUT_THREAD");
+	if (!env)
+		return false;
+
+	if (!safe_strtoint(env, &value)) {
+		weston_log("libinput: invalid WESTON_LIBINPUT_THREAD value "
+			   "'%s', ignoring\n", env);
+		return false;
+	}
+
+	return value != 0;
+}
+
+/* Starts the input thread if asked for. It stays idle until the seat is
+ * enabled. Returns NULL if libinput is dispatched from the compositor
+ * thread. */
+static struct udev_input_thread *
+udev_input_thread_create(struct udev_input *input)
+{
+	struct wl_event_loop *loop;
+	struct udev_input_thread *t;
+
+	if (!udev_input_thread_wanted())
+		return NULL;
+
+	t = zalloc(sizeof *t);
+	if (!t)
+		goto err;
+
+	t->input = input;
+	t->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (t->wake_fd < 0)
+		goto err_free;
+
+	t->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (t->event_fd < 0)
+		goto err_wake;
+
+	loop = wl_display_get_event_loop(input->compositor->wl_display);
+	t->source = wl_event_loop_add_fd(loop, t->event_fd, WL_EVENT_READABLE,
+					 udev_input_thread_handler, input);
+	if (!t->source)
+		goto err_event;
+
+	pthread_mutex_init(&t->mutex, NULL);
+	pthread_cond_init(&t->cond, NULL);
+
+	if (thread_create_masked(&t->thread, udev_input_thread, t, 0) != 0)
+		goto err_mutex;
+
+	weston_log("libinput: dispatching input on a separate thread\n");
+
+	return t;
+
+err_mutex:
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->mutex);
+	wl_event_source_remove(t->source);
+err_event:
+	close(t->event_fd);
+err_wake:
+	close(t->wake_fd);
+err_free:
+	free(t);
+err:
+	weston_log("libinput: failed to start input thread: %m\n");
+
+	return NULL;
+}
+
+static void
+udev_input_thread_destroy(struct udev_input_thread *t)
+{
+	struct libinput_event *event;
+
+	pthread_mutex_lock(&t->mutex);
+	__atomic_store_n(&t->quit, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->mutex);
+	udev_input_thread_notify(t->wake_fd);
+	pthread_join(t->thread, NULL);
+
+	while (t->tail != t->head) {
+		event = t->queue[t->tail++ % UDEV_INPUT_QUEUE_SIZE];
+		libinput_event_destroy(event);
+	}
+
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->mutex);
+	wl_event_source_remove(t->source);
+	close(t->event_fd);
+	close(t->wake_fd);
+	free(t);
+}
 
 static struct udev_seat *
 get_udev_seat(struct udev_input *input, struct libinput_device *device)
@@ -134,11 +533,18 @@ udev_input_disable(struct udev_input *input)
 	if (input->suspended)
 		return;
 
-	wl_event_source_remove(input->libinput_source);
-	input->libinput_source = NULL;
+	udev_input_lock(input);
+	if (input->thread) {
+		__atomic_store_n(&input->thread->active, false,
+				 __ATOMIC_RELEASE);
+	} else {
+		wl_event_source_remove(input->libinput_source);
+		input->libinput_source = NULL;
+	}
 	libinput_suspend(input->libinput);
 	process_events(input);
 	input->suspended = 1;
+	udev_input_unlock(input);
 }
 
 static int
@@ -178,10 +584,18 @@ process_events(struct udev_input *input)
 {
 	struct libinput_event *event;
 
+	udev_input_lock(input);
+
+	/* What the input thread queued precedes what is left in libinput. */
+	if (input->thread)
+		process_queued_events(input);
+
 	while ((event = libinput_get_event(input->libinput))) {
 		process_event(event);
 		libinput_event_destroy(event);
 	}
+
+	udev_input_unlock(input);
 }
 
 static int
@@ -207,8 +621,12 @@ static int
 open_restricted(const char *path, int flags, void *user_data)
 {
 	struct udev_input *input = user_data;
+	struct udev_input_thread *t = input->thread;
 	struct weston_launcher *launcher = input->compositor->launcher;
 
+	if (t && pthread_equal(pthread_self(), t->thread))
+		return udev_input_thread_call(t, path, flags, -1);
+
 	return weston_launcher_open(launcher, path, flags);
 }
 
@@ -216,8 +634,14 @@ static void
 close_restricted(int fd, void *user_data)
 {
 	struct udev_input *input = user_data;
+	struct udev_input_thread *t = input->thread;
 	struct weston_launcher *launcher = input->compositor->launcher;
 
+	if (t && pthread_equal(pthread_self(), t->thread)) {
+		udev_input_thread_call(t, NULL, 0, fd);
+		return;
+	}
+
 	weston_launcher_close(launcher, fd);
 }
 
@@ -235,24 +659,36 @@ udev_input_enable(struct udev_input *input)
 	struct udev_seat *seat;
 	int devices_found = 0;
 
-	loop = wl_display_get_event_loop(c->wl_display);
-	fd = libinput_get_fd(input->libinput);
-	input->libinput_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     libinput_source_dispatch, input);
-	if (!input->libinput_source) {
-		return -1;
+	if (!input->thread) {
+		loop = wl_display_get_event_loop(c->wl_display);
+		fd = libinput_get_fd(input->libinput);
+		input->libinput_source =
+			wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+					     libinput_source_dispatch, input);
+		if (!input->libinput_source) {
+			return -1;
+		}
 	}
 
+	udev_input_lock(input);
 	if (input->suspended) {
 		if (libinput_resume(input->libinput) != 0) {
-			wl_event_source_remove(input->libinput_source);
-			input->libinput_source = NULL;
+			udev_input_unlock(input);
+			if (input->libinput_source) {
+				wl_event_source_remove(input->libinput_source);
+				input->libinput_source = NULL;
+			}
 			return -1;
 		}
 		input->suspended = 0;
 		process_events(input);
 	}
+	if (input->thread) {
+		__atomic_store_n(&input->thread->active, true,
+				 __ATOMIC_RELEASE);
+		udev_input_thread_notify(input->thread->wake_fd);
+	}
+	udev_input_unlock(input);
 
 	wl_list_for_each(seat, &input->compositor->seat_list, base.link) {
 		evdev_notify_keyboard_focus(&seat->base, &seat->devices_list);
@@ -331,6 +767,8 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 
 	process_events(input);
 
+	input->thread = udev_input_thread_create(input);
+
 	return udev_input_enable(input);
 }
 
@@ -339,6 +777,10 @@ udev_input_destroy(struct udev_input *input)
 {
 	struct udev_seat *seat, *next;
 
+	if (input->thread) {
+		udev_input_thread_destroy(input->thread);
+		input->thread = NULL;
+	}
 	if (input->libinput_source)
 		wl_event_source_remove(input->libinput_source);
 	wl_list_for_each_safe(seat, next, &input->compositor->seat_list, base.link)
@@ -386,6 +828,7 @@ udev_seat_create(struct udev_input *input, const char *seat_name)
 		return NULL;
 
 	weston_seat_init(&seat->base, c, seat_name);
+	seat->input = input;
 	seat->base.led_update = udev_seat_led_update;
 
 	seat->output_create_listener.notify = notify_output_create;
@@ -28,12 +28,20 @@
 #include "config.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "pixman-renderer.h"
 #include "shared/helpers.h"
+#include "shared/string-helpers.h"
+#include "shared/thread-util.h"
+#include "yuv-convert.h"
 
 #include <linux/input.h>
 
@@ -41,19 +49,115 @@ struct pixman_output_state {
 	void *shadow_buffer;
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
+
+	/* Pixels composited and pixels damaged in the last frame */
+	uint64_t painted_pixels;
+	uint64_t damaged_pixels;
+};
+
+/* RGB copy of the YUV shm buffers attached to a surface. Only the
+ * damaged part of each new buffer is converted, in flush_damage, after
+ * which the buffer is released; the cache is what gets composited.
+ */
+struct pixman_yuv_cache {
+	pixman_image_t *image;
+	bool needs_full;
+};
+
+/* A view resampled for an output, because it is scaled or transformed,
+ * kept in output coordinates so that it can be copied 1:1 for as long as
+ * the view's transformation does not change. Parts are resampled when
+ * first painted and again only after buffer damage.
+ */
+struct pixman_view_cache {
+	struct wl_list surface_link;	/* pixman_surface_state::view_caches */
+	struct wl_list renderer_link;	/* pixman_renderer::view_caches */
+	struct pixman_renderer *renderer;
+	struct weston_view *view;
+	struct weston_output *output;
+	struct wl_listener view_destroy_listener;
+
+	/* What the cache was resampled with. The transformation maps
+	 * cache pixels to buffer pixels. */
+	pixman_transform_t transform;
+	struct pixman_f_transform inverse;
+	bool have_inverse;
+	pixman_box32_t box;		/* in output coordinates */
+	int source_width, source_height;
+	bool scissor_enabled;
+	pixman_region32_t scissor;
+
+	/* Same parameters as in the previous frame: transformations
+	 * changing every frame are not worth caching. */
+	bool stable;
+
+	pixman_image_t *image;		/* allocated on first use */
+	pixman_region32_t valid;	/* in cache coordinates */
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color; /* of a solid fill image */
 	struct weston_buffer_reference buffer_ref;
+	struct pixman_yuv_cache yuv;
+	struct wl_list view_caches;
 
 	struct wl_listener buffer_destroy_listener;
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* Bands are never made shorter than this, so that small damage
+ * does not wake up the whole pool. */
+#define PIXMAN_BAND_MIN_HEIGHT 32
+
+/* Worker pool compositing horizontal bands of the output damage in
+ * parallel, enabled with WESTON_PIXMAN_THREADS=<n>. The compositor
+ * thread paints bands too and only returns once all of them are done.
+ */
+struct pixman_band_pool {
+	pthread_t *threads;
+	int n_threads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	bool quit;
+
+	/* The job being painted, valid while next_band < n_bands */
+	struct weston_output *output;
+	struct wl_array *visible_views;
+	int y1, y2;
+	int band_height;
+	int n_bands;
+	int next_band;
+	int bands_done;
+	uint64_t painted_pixels;
+};
+
+/* Destination of a repaint pass: the shadow image as a whole, or one
+ * band of it when painting on the band pool.
+ */
+struct pixman_render_target {
+	pixman_image_t *image;
+	pixman_region32_t *band; /* in output coordinates, NULL for all */
+	pixman_image_t *debug_color;
+	/* Images are not thread safe, so each band uses its own
+	 * source images instead of the surface state's. */
+	bool private_sources;
+
+	uint64_t painted_pixels;
+};
+
+/* A view and the part of it not hidden by opaque content above,
+ * in global coordinates. */
+struct pixman_visible_view {
+	struct weston_view *view;
+	pixman_region32_t visible;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -61,9 +165,23 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	bool overdraw_debug;
+	struct weston_binding *overdraw_binding;
+
+	struct pixman_band_pool band_pool;
+
+	/* All view caches, and the lock for their valid regions,
+	 * which bands painted in parallel update. */
+	struct wl_list view_caches;
+	pthread_mutex_t view_cache_mutex;
+
 	struct wl_signal destroy_signal;
 };
 
+static const pixman_color_t debug_red = {
+	0x3fff, 0x0000, 0x0000, 0x3fff
+};
+
 static inline struct pixman_output_state *
 get_output_state(struct weston_output *output)
 {
@@ -134,6 +252,41 @@ pixman_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static int
+pixman_renderer_read_pixels_strided(struct weston_output *output,
+				    pixman_format_code_t format, void *pixels,
+				    int32_t stride,
+				    uint32_t x, uint32_t y,
+				    uint32_t width, uint32_t height)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_image_t *out_buf;
+
+	if (!po->hw_buffer) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	out_buf = pixman_image_create_bits(format, width, height,
+					   pixels, stride);
+	if (!out_buf)
+		return -1;
+
+	/* hw_buffer is stored top-down, so this is a plain copy. */
+	pixman_image_composite32(PIXMAN_OP_SRC,
+				 po->hw_buffer, /* src */
+				 NULL /* mask */,
+				 out_buf, /* dest */
+				 x, y, /* src_x, src_y */
+				 0, 0, /* mask_x, mask_y */
+				 0, 0, /* dest_x, dest_y */
+				 width, height);
+
+	pixman_image_unref(out_buf);
+
+	return 0;
+}
+
 static void
 region_global_to_output(struct weston_output *output, pixman_region32_t *region)
 {
@@ -245,13 +398,82 @@ composite_whole(pixman_op_t op,
 				 dest_width, dest_height);
 }
 
-static void
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *boxes;
+	uint64_t area = 0;
+	int n_box, i;
+
+	boxes = pixman_region32_rectangles(region, &n_box);
+	for (i = 0; i < n_box; i++)
+		area += (uint64_t)(boxes[i].x2 - boxes[i].x1) *
+			(boxes[i].y2 - boxes[i].y1);
+
+	return area;
+}
+
+/** Find the destination pixels a source box can reach
+ *
+ * \param inverse The source to destination transformation.
+ * \param box The source box.
+ * \param footprint The destination box, grown by the filter footprint.
+ * \return False if the box cannot be mapped, e.g. with a perspective
+ * transformation moving it behind the viewer.
+ */
+static bool
+source_box_footprint(const struct pixman_f_transform *inverse,
+		     const pixman_box32_t *box,
+		     pixman_box32_t *footprint)
+{
+	const double corners[4][2] = {
+		{ box->x1, box->y1 }, { box->x2, box->y1 },
+		{ box->x1, box->y2 }, { box->x2, box->y2 },
+	};
+	double x1 = HUGE_VAL, y1 = HUGE_VAL;
+	double x2 = -HUGE_VAL, y2 = -HUGE_VAL;
+	struct pixman_f_vector v;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		v.v[0] = corners[i][0];
+		v.v[1] = corners[i][1];
+		v.v[2] = 1.0;
+		pixman_f_transform_point_3d(inverse, &v);
+		if (!(v.v[2] > 0.0))
+			return false;
+
+		x1 = MIN(x1, v.v[0] / v.v[2]);
+		y1 = MIN(y1, v.v[1] / v.v[2]);
+		x2 = MAX(x2, v.v[0] / v.v[2]);
+		y2 = MAX(y2, v.v[1] / v.v[2]);
+	}
+
+	/* Bilinear filtering reaches a pixel further out on each side */
+	footprint->x1 = floor(x1) - 2;
+	footprint->y1 = floor(y1) - 2;
+	footprint->x2 = ceil(x2) + 2;
+	footprint->y2 = ceil(y2) + 2;
+
+	return true;
+}
+
+/** Composite the source clipped to a region of it
+ *
+ * Each box of the source clip is composited only into its own
+ * destination footprint rather than the whole destination, so the cost
+ * stays proportional to the painted area whatever the number of boxes.
+ *
+ * \return The number of destination pixels composited.
+ */
+static uint64_t
 composite_clipped(pixman_image_t *src,
 		  pixman_image_t *mask,
 		  pixman_image_t *dest,
 		  const pixman_transform_t *transform,
 		  pixman_filter_t filter,
-		  pixman_region32_t *src_clip)
+		  pixman_region32_t *src_clip,
+		  pixman_region32_t *dest_clip)
 {
 	int n_box;
 	pixman_box32_t *boxes;
@@ -261,6 +483,10 @@ composite_clipped(pixman_image_t *src,
 	int bitspp;
 	pixman_format_code_t src_format;
 	void *src_data;
+	struct pixman_f_transform forward, inverse;
+	bool have_inverse;
+	pixman_region32_t painted;
+	uint64_t painted_pixels = 0;
 	int i;
 
 	/* Hardcoded to use PIXMAN_OP_OVER, because sampling outside of
@@ -277,12 +503,28 @@ composite_clipped(pixman_image_t *src,
 
 	assert(src_format);
 
-	/* This would be massive overdraw, except when n_box is 1. */
+	pixman_f_transform_from_pixman_transform(&forward, transform);
+	have_inverse = pixman_f_transform_invert(&inverse, &forward);
+
 	boxes = pixman_region32_rectangles(src_clip, &n_box);
 	for (i = 0; i < n_box; i++) {
 		uint8_t *ptr = src_data;
 		pixman_image_t *boximg;
 		pixman_transform_t adj = *transform;
+		pixman_box32_t fp = { 0, 0, dest_width, dest_height };
+
+		/* Pixels outside of the footprint would sample only
+		 * outside of the box, and OVER with (0,0,0,0) is a no-op,
+		 * so skipping them does not change the result. */
+		if (have_inverse &&
+		    source_box_footprint(&inverse, &boxes[i], &fp)) {
+			fp.x1 = MAX(fp.x1, 0);
+			fp.y1 = MAX(fp.y1, 0);
+			fp.x2 = MIN(fp.x2, dest_width);
+			fp.y2 = MIN(fp.y2, dest_height);
+			if (fp.x1 >= fp.x2 || fp.y1 >= fp.y2)
+				continue;
+		}
 
 		ptr += boxes[i].y1 * src_stride;
 		ptr += boxes[i].x1 * bitspp / 8;
@@ -298,51 +540,343 @@ composite_clipped(pixman_image_t *src,
 
 		pixman_image_set_filter(boximg, filter, NULL, 0);
 		pixman_image_composite32(PIXMAN_OP_OVER, boximg, mask, dest,
-					 0, 0, /* src_x, src_y */
-					 0, 0, /* mask_x, mask_y */
-					 0, 0, /* dest_x, dest_y */
-					 dest_width, dest_height);
+					 fp.x1, fp.y1, /* src_x, src_y */
+					 fp.x1, fp.y1, /* mask_x, mask_y */
+					 fp.x1, fp.y1, /* dest_x, dest_y */
+					 fp.x2 - fp.x1, fp.y2 - fp.y1);
 
 		pixman_image_unref(boximg);
+
+		pixman_region32_init_rect(&painted, fp.x1, fp.y1,
+					  fp.x2 - fp.x1, fp.y2 - fp.y1);
+		pixman_region32_intersect(&painted, &painted, dest_clip);
+		painted_pixels += region_area(&painted);
+		pixman_region32_fini(&painted);
+	}
+
+	return painted_pixels;
+}
+
+static pixman_image_t *
+surface_image_for_target(struct pixman_surface_state *ps,
+			 struct pixman_render_target *target)
+{
+	void *data;
+
+	if (!target->private_sources)
+		return pixman_image_ref(ps->image);
+
+	data = pixman_image_get_data(ps->image);
+	if (!data)
+		return pixman_image_create_solid_fill(&ps->color);
+
+	return pixman_image_create_bits_no_clear(
+				pixman_image_get_format(ps->image),
+				pixman_image_get_width(ps->image),
+				pixman_image_get_height(ps->image),
+				data, pixman_image_get_stride(ps->image));
+}
+
+static void
+view_cache_destroy(struct pixman_view_cache *cache)
+{
+	wl_list_remove(&cache->surface_link);
+	wl_list_remove(&cache->renderer_link);
+	wl_list_remove(&cache->view_destroy_listener.link);
+
+	if (cache->image)
+		pixman_image_unref(cache->image);
+	pixman_region32_fini(&cache->valid);
+	pixman_region32_fini(&cache->scissor);
+	free(cache);
+}
+
+static void
+view_cache_handle_view_destroy(struct wl_listener *listener, void *data)
+{
+	struct pixman_view_cache *cache;
+
+	cache = container_of(listener, struct pixman_view_cache,
+			     view_destroy_listener);
+
+	view_cache_destroy(cache);
+}
+
+static struct pixman_view_cache *
+view_cache_find(struct pixman_surface_state *ps, struct weston_view *view,
+		struct weston_output *output)
+{
+	struct pixman_view_cache *cache;
+
+	wl_list_for_each(cache, &ps->view_caches, surface_link)
+		if (cache->view == view && cache->output == output)
+			return cache;
+
+	return NULL;
+}
+
+static struct pixman_view_cache *
+view_cache_create(struct pixman_surface_state *ps, struct weston_view *view,
+		  struct weston_output *output)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_view_cache *cache;
+
+	cache = zalloc(sizeof *cache);
+	if (!cache)
+		return NULL;
+
+	cache->renderer = pr;
+	cache->view = view;
+	cache->output = output;
+	pixman_region32_init(&cache->valid);
+	pixman_region32_init(&cache->scissor);
+
+	cache->view_destroy_listener.notify = view_cache_handle_view_destroy;
+	wl_signal_add(&view->destroy_signal, &cache->view_destroy_listener);
+	wl_list_insert(&ps->view_caches, &cache->surface_link);
+	wl_list_insert(&pr->view_caches, &cache->renderer_link);
+
+	return cache;
+}
+
+/** Check a view's cache against its current transformation
+ *
+ * Called on the compositor thread before painting, so that painting
+ * itself, possibly in bands, never creates or resets caches.
+ */
+static void
+view_cache_prepare(struct weston_view *ev, struct weston_output *output)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_surface_state *ps = get_surface_state(ev->surface);
+	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
+	struct pixman_view_cache *cache = view_cache_find(ps, ev, output);
+	struct pixman_f_transform forward;
+	pixman_transform_t transform, origin;
+	pixman_region32_t region;
+	pixman_box32_t box;
+	bool scissor_enabled = ev->geometry.scissor_enabled;
+
+	/* Only views that get resampled benefit from a cache */
+	if (!ps->image || !pixman_image_get_data(ps->image) ||
+	    (!ev->transform.enabled &&
+	     output->current_scale == vp->buffer.scale)) {
+		if (cache)
+			view_cache_destroy(cache);
+		return;
+	}
+
+	pixman_region32_init(&region);
+	pixman_region32_copy(&region, &ev->transform.boundingbox);
+	region_global_to_output(output, &region);
+	box = *pixman_region32_extents(&region);
+	pixman_region32_fini(&region);
+
+	box.x1 = MAX(box.x1, 0);
+	box.y1 = MAX(box.y1, 0);
+	box.x2 = MIN(box.x2, pixman_image_get_width(po->shadow_image));
+	box.y2 = MIN(box.y2, pixman_image_get_height(po->shadow_image));
+	if (box.x1 >= box.x2 || box.y1 >= box.y2) {
+		if (cache)
+			view_cache_destroy(cache);
+		return;
+	}
+
+	pixman_renderer_compute_transform(&transform, ev, output);
+	pixman_transform_init_translate(&origin,
+					pixman_int_to_fixed(box.x1),
+					pixman_int_to_fixed(box.y1));
+	pixman_transform_multiply(&transform, &transform, &origin);
+
+	if (!cache) {
+		cache = view_cache_create(ps, ev, output);
+		if (!cache)
+			return;
+	} else if (memcmp(&cache->transform, &transform,
+			  sizeof transform) == 0 &&
+		   cache->box.x1 == box.x1 && cache->box.y1 == box.y1 &&
+		   cache->box.x2 == box.x2 && cache->box.y2 == box.y2 &&
+		   cache->source_width == pixman_image_get_width(ps->image) &&
+		   cache->source_height == pixman_image_get_height(ps->image) &&
+		   cache->scissor_enabled == scissor_enabled &&
+		   (!scissor_enabled ||
+		    pixman_region32_equal(&cache->scissor,
+					  &ev->geometry.scissor))) {
+		cache->stable = true;
+		return;
+	}
+
+	if (cache->image &&
+	    (cache->box.x2 - cache->box.x1 != box.x2 - box.x1 ||
+	     cache->box.y2 - cache->box.y1 != box.y2 - box.y1)) {
+		pixman_image_unref(cache->image);
+		cache->image = NULL;
 	}
 
-	if (n_box > 1) {
-		static bool warned = false;
+	cache->transform = transform;
+	pixman_f_transform_from_pixman_transform(&forward, &transform);
+	cache->have_inverse = pixman_f_transform_invert(&cache->inverse,
+							&forward);
+	cache->box = box;
+	cache->source_width = pixman_image_get_width(ps->image);
+	cache->source_height = pixman_image_get_height(ps->image);
+	cache->scissor_enabled = scissor_enabled;
+	if (scissor_enabled)
+		pixman_region32_copy(&cache->scissor, &ev->geometry.scissor);
+
+	pixman_region32_fini(&cache->valid);
+	pixman_region32_init(&cache->valid);
+	cache->stable = false;
+}
+
+/* Forget the cached pixels that new buffer damage can reach. */
+static void
+view_cache_damage(struct pixman_surface_state *ps,
+		  struct weston_surface *surface)
+{
+	struct pixman_view_cache *cache;
+	pixman_box32_t *rects, box, fp;
+	pixman_region32_t stale;
+	int i, n;
+
+	rects = pixman_region32_rectangles(&surface->damage, &n);
+	if (n == 0)
+		return;
+
+	wl_list_for_each(cache, &ps->view_caches, surface_link) {
+		pixman_region32_init(&stale);
+		for (i = 0; i < n; i++) {
+			box = weston_surface_to_buffer_rect(surface, rects[i]);
+			if (!cache->have_inverse ||
+			    !source_box_footprint(&cache->inverse, &box, &fp)) {
+				pixman_region32_fini(&cache->valid);
+				pixman_region32_init(&cache->valid);
+				break;
+			}
+			pixman_region32_union_rect(&stale, &stale,
+						   fp.x1, fp.y1,
+						   fp.x2 - fp.x1,
+						   fp.y2 - fp.y1);
+		}
+		pixman_region32_subtract(&cache->valid, &cache->valid,
+					 &stale);
+		pixman_region32_fini(&stale);
+	}
+}
+
+/** Resample what is missing from a view cache for a repaint
+ *
+ * \return An image on the cache pixels, to be composited 1:1 at the
+ * cache box, or NULL if the cache cannot be allocated.
+ */
+static pixman_image_t *
+view_cache_update(struct pixman_view_cache *cache,
+		  struct pixman_render_target *target,
+		  pixman_image_t *src, pixman_filter_t filter,
+		  pixman_region32_t *source_clip,
+		  pixman_region32_t *repaint_output)
+{
+	static const pixman_color_t transparent = { 0, 0, 0, 0 };
+	pthread_mutex_t *mutex = &cache->renderer->view_cache_mutex;
+	int width = cache->box.x2 - cache->box.x1;
+	int height = cache->box.y2 - cache->box.y1;
+	pixman_region32_t missing;
+	pixman_box32_t *boxes;
+	pixman_image_t *dest;
+	int n_box;
 
-		if (!warned)
-			weston_log("Pixman-renderer warning: %dx overdraw\n",
-				   n_box);
-		warned = true;
+	pixman_region32_init(&missing);
+	pixman_region32_copy(&missing, repaint_output);
+	pixman_region32_translate(&missing, -cache->box.x1, -cache->box.y1);
+	pixman_region32_intersect_rect(&missing, &missing, 0, 0, width, height);
+
+	pthread_mutex_lock(mutex);
+	if (!cache->image)
+		cache->image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+							width, height,
+							NULL, 0);
+	pixman_region32_subtract(&missing, &missing, &cache->valid);
+	pthread_mutex_unlock(mutex);
+
+	if (!cache->image) {
+		pixman_region32_fini(&missing);
+		return NULL;
 	}
+
+	/* Bands may resample disjoint parts of the cache in parallel,
+	 * each through its own image for its own clip. */
+	dest = pixman_image_create_bits_no_clear(PIXMAN_a8r8g8b8,
+				width, height,
+				pixman_image_get_data(cache->image),
+				pixman_image_get_stride(cache->image));
+
+	if (pixman_region32_not_empty(&missing)) {
+		pixman_image_set_clip_region32(dest, &missing);
+
+		if (source_clip) {
+			boxes = pixman_region32_rectangles(&missing, &n_box);
+			pixman_image_fill_boxes(PIXMAN_OP_CLEAR, dest,
+						&transparent, n_box, boxes);
+			target->painted_pixels +=
+				composite_clipped(src, NULL, dest,
+						  &cache->transform, filter,
+						  source_clip, &missing);
+		} else {
+			composite_whole(PIXMAN_OP_SRC, src, NULL, dest,
+					&cache->transform, filter);
+			target->painted_pixels += region_area(&missing);
+		}
+
+		pixman_image_set_clip_region32(dest, NULL);
+
+		pthread_mutex_lock(mutex);
+		pixman_region32_union(&cache->valid, &cache->valid, &missing);
+		pthread_mutex_unlock(mutex);
+	}
+
+	pixman_region32_fini(&missing);
+
+	return dest;
 }
 
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
  * \param output The output being painted.
+ * \param target The image to paint into.
  * \param repaint_output The region to be painted in output coordinates.
+ *                       It is clipped to the target band, if any.
  * \param source_clip The region of the source image to use, in source image
  *                    coordinates. If NULL, use the whole source image.
  * \param pixman_op Compositing operator, either SRC or OVER.
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       struct pixman_render_target *target,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
 {
-	struct pixman_renderer *pr =
-		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
+	struct pixman_view_cache *cache;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
+	pixman_image_t *src_image;
+	pixman_image_t *cache_image;
 	pixman_image_t *mask_image;
 	pixman_color_t mask = { 0, };
 
+	if (target->band) {
+		pixman_region32_intersect(repaint_output, repaint_output,
+					  target->band);
+		if (!pixman_region32_not_empty(repaint_output))
+			return;
+	}
+
 	/* Clip rendering to the damaged output region */
-	pixman_image_set_clip_region32(po->shadow_image, repaint_output);
+	pixman_image_set_clip_region32(target->image, repaint_output);
 
 	pixman_renderer_compute_transform(&transform, ev, output);
 
@@ -351,9 +885,29 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	else
 		filter = PIXMAN_FILTER_NEAREST;
 
+	src_image = surface_image_for_target(ps, target);
+
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
 
+	/* Resampled views are painted from their cache, brought up to
+	 * date first, with a plain copy. */
+	cache = view_cache_find(ps, ev, output);
+	if (cache && cache->stable) {
+		cache_image = view_cache_update(cache, target, src_image,
+						filter, source_clip,
+						repaint_output);
+		if (cache_image) {
+			pixman_image_unref(src_image);
+			src_image = cache_image;
+			pixman_transform_init_translate(&transform,
+				pixman_int_to_fixed(-cache->box.x1),
+				pixman_int_to_fixed(-cache->box.y1));
+			filter = PIXMAN_FILTER_NEAREST;
+			source_clip = NULL;
+		}
+	}
+
 	if (ev->alpha < 1.0) {
 		mask.alpha = 0xffff * ev->alpha;
 		mask_image = pixman_image_create_solid_fill(&mask);
@@ -361,12 +915,16 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		mask_image = NULL;
 	}
 
-	if (source_clip)
-		composite_clipped(ps->image, mask_image, po->shadow_image,
-				  &transform, filter, source_clip);
-	else
-		composite_whole(pixman_op, ps->image, mask_image,
-				po->shadow_image, &transform, filter);
+	if (source_clip) {
+		target->painted_pixels +=
+			composite_clipped(src_image, mask_image,
+					  target->image, &transform, filter,
+					  source_clip, repaint_output);
+	} else {
+		composite_whole(pixman_op, src_image, mask_image,
+				target->image, &transform, filter);
+		target->painted_pixels += region_area(repaint_output);
+	}
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
@@ -374,22 +932,25 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
-	if (pr->repaint_debug)
+	pixman_image_unref(src_image);
+
+	if (target->debug_color)
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 target->debug_color, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 target->image, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (target->image), /* width */
+					 pixman_image_get_height (target->image) /* height */);
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+	pixman_image_set_clip_region32 (target->image, NULL);
 }
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     struct pixman_render_target *target,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -417,8 +978,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 							  view);
 			region_global_to_output(output, &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, target, &repaint_output,
+				       NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -428,7 +989,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 						  &surface_blend, view);
 		region_global_to_output(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, output, target, &repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
@@ -439,6 +1000,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 struct pixman_render_target *target,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -464,7 +1026,7 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_copy(&repaint_output, repaint_global);
 	region_global_to_output(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, output, target, &repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
@@ -474,24 +1036,9 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+	  struct pixman_render_target *target,
+	  pixman_region32_t *repaint) /* in global coordinates */
 {
-	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	/* repaint bounding region in global coordinates: */
-	pixman_region32_t repaint;
-
-	/* No buffer attached */
-	if (!ps->image)
-		return;
-
-	pixman_region32_init(&repaint);
-	pixman_region32_intersect(&repaint,
-				  &ev->transform.boundingbox, damage);
-	pixman_region32_subtract(&repaint, &repaint, &ev->clip);
-
-	if (!pixman_region32_not_empty(&repaint))
-		goto out;
-
 	if (view_transformation_is_translation(ev)) {
 		/* The simple case: The surface regions opaque, non-opaque,
 		 * etc. are convertible to global coordinate space.
@@ -500,7 +1047,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, target, repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -509,21 +1056,302 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, target, repaint);
 	}
+}
 
-out:
-	pixman_region32_fini(&repaint);
+/** Add the area a view hides to the occluded region
+ *
+ * The core computes weston_view::transform.opaque only for views that
+ * are merely translated. For scaling and 90 degree rotations, which map
+ * boxes to boxes, the opaque region is mapped here, shrunk to the
+ * pixels not touched by filtering at its edges.
+ */
+static void
+view_add_occlusion(struct weston_view *view, pixman_region32_t *occluded)
+{
+	const struct weston_matrix *m = &view->transform.matrix;
+	pixman_region32_t surf_opaque;
+	pixman_region32_t opaque;
+	pixman_box32_t *boxes;
+	pixman_box32_t box;
+	float x1, y1, x2, y2;
+	int n_box, i;
+
+	if (view_transformation_is_translation(view)) {
+		pixman_region32_union(occluded, occluded,
+				      &view->transform.opaque);
+		return;
+	}
+
+	if (view->alpha < 1.0)
+		return;
+
+	/* No perspective, and no rotation other than multiples of 90° */
+	if (m->d[3] != 0.0f || m->d[7] != 0.0f || m->d[15] != 1.0f)
+		return;
+	if (!(m->d[1] == 0.0f && m->d[4] == 0.0f) &&
+	    !(m->d[0] == 0.0f && m->d[5] == 0.0f))
+		return;
+
+	pixman_region32_init(&surf_opaque);
+	pixman_region32_copy(&surf_opaque, &view->surface->opaque);
+	if (view->geometry.scissor_enabled)
+		pixman_region32_intersect(&surf_opaque, &surf_opaque,
+					  &view->geometry.scissor);
+
+	pixman_region32_init(&opaque);
+	boxes = pixman_region32_rectangles(&surf_opaque, &n_box);
+	for (i = 0; i < n_box; i++) {
+		weston_view_to_global_float(view, boxes[i].x1, boxes[i].y1,
+					    &x1, &y1);
+		weston_view_to_global_float(view, boxes[i].x2, boxes[i].y2,
+					    &x2, &y2);
+
+		box.x1 = ceilf(MIN(x1, x2)) + 1;
+		box.y1 = ceilf(MIN(y1, y2)) + 1;
+		box.x2 = floorf(MAX(x1, x2)) - 1;
+		box.y2 = floorf(MAX(y1, y2)) - 1;
+
+		if (box.x1 < box.x2 && box.y1 < box.y2)
+			pixman_region32_union_rect(&opaque, &opaque,
+						   box.x1, box.y1,
+						   box.x2 - box.x1,
+						   box.y2 - box.y1);
+	}
+
+	pixman_region32_intersect(&opaque, &opaque,
+				  &view->transform.boundingbox);
+	pixman_region32_union(occluded, occluded, &opaque);
+
+	pixman_region32_fini(&opaque);
+	pixman_region32_fini(&surf_opaque);
 }
+
+/* Front to back, find the part of each view that is damaged and not
+ * hidden by opaque content above it, whether that is on the primary
+ * plane or on another plane (the view's clip). This is done once per
+ * repaint on the compositor thread, all bands paint from the same list. */
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+compute_visible_views(struct weston_output *output,
+		      pixman_region32_t *damage,
+		      struct wl_array *visible_views)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_view *view;
+	struct pixman_surface_state *ps;
+	struct pixman_visible_view *vv;
+	pixman_region32_t occluded;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	pixman_region32_init(&occluded);
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (view->plane != &compositor->primary_plane)
+			continue;
+
+		/* No buffer attached */
+		ps = get_surface_state(view->surface);
+		if (!ps->image)
+			continue;
+
+		vv = wl_array_add(visible_views, sizeof *vv);
+		if (!vv) {
+			weston_log("Pixman renderer: out of memory, "
+				   "output not fully painted\n");
+			break;
+		}
+
+		vv->view = view;
+		pixman_region32_init(&vv->visible);
+		pixman_region32_intersect(&vv->visible,
+					  &view->transform.boundingbox,
+					  damage);
+		pixman_region32_subtract(&vv->visible, &vv->visible,
+					 &view->clip);
+		pixman_region32_subtract(&vv->visible, &vv->visible,
+					 &occluded);
+
+		pixman_region32_union(&occluded, &occluded, &view->clip);
+		view_add_occlusion(view, &occluded);
+	}
+
+	pixman_region32_fini(&occluded);
+}
+
+static void
+release_visible_views(struct wl_array *visible_views)
+{
+	struct pixman_visible_view *vv;
+
+	wl_array_for_each(vv, visible_views)
+		pixman_region32_fini(&vv->visible);
+	wl_array_release(visible_views);
+}
+
+/* Back to front, paint what is visible. The list is only read, so bands
+ * can share it. */
+static void
+repaint_surfaces(struct weston_output *output,
+		 struct pixman_render_target *target,
+		 struct wl_array *visible_views)
+{
+	struct pixman_visible_view *vv;
+	int i;
+
+	for (i = (int)(visible_views->size / sizeof *vv) - 1; i >= 0; i--) {
+		vv = (struct pixman_visible_view *)visible_views->data + i;
+		if (pixman_region32_not_empty(&vv->visible))
+			draw_view(vv->view, output, target, &vv->visible);
+	}
+}
+
+static uint64_t
+repaint_band(struct pixman_band_pool *pool, int band)
+{
+	struct weston_output *output = pool->output;
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_render_target target;
+	pixman_region32_t band_region;
+	int width = pixman_image_get_width(po->shadow_image);
+	int y1, y2;
+
+	y1 = pool->y1 + band * pool->band_height;
+	y2 = MIN(y1 + pool->band_height, pool->y2);
+	pixman_region32_init_rect(&band_region, 0, y1, width, y2 - y1);
+
+	/* A private image on the same pixels, so that each band has its
+	 * own clip region. */
+	target.image = pixman_image_create_bits_no_clear(
+				pixman_image_get_format(po->shadow_image),
+				width,
+				pixman_image_get_height(po->shadow_image),
+				po->shadow_buffer,
+				pixman_image_get_stride(po->shadow_image));
+	target.band = &band_region;
+	target.debug_color = NULL;
+	if (pr->repaint_debug)
+		target.debug_color = pixman_image_create_solid_fill(&debug_red);
+	target.private_sources = true;
+	target.painted_pixels = 0;
+
+	repaint_surfaces(output, &target, pool->visible_views);
+
+	if (target.debug_color)
+		pixman_image_unref(target.debug_color);
+	pixman_image_unref(target.image);
+	pixman_region32_fini(&band_region);
+
+	return target.painted_pixels;
+}
+
+static void *
+band_worker_thread(void *data)
+{
+	struct pixman_band_pool *pool = data;
+	uint64_t painted;
+	int band;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (!pool->quit) {
+		if (pool->next_band >= pool->n_bands) {
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+			continue;
+		}
+
+		band = pool->next_band++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		painted = repaint_band(pool, band);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->painted_pixels += painted;
+		if (++pool->bands_done == pool->n_bands)
+			pthread_cond_signal(&pool->done_cond);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/* Split the damage into bands and paint them on the pool. Returns
+ * false without painting anything when the damage is too small to be
+ * worth splitting.
+ */
+static bool
+repaint_surfaces_banded(struct weston_output *output,
+			pixman_region32_t *damage,
+			struct wl_array *visible_views,
+			uint64_t *painted_pixels)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_band_pool *pool = &get_renderer(compositor)->band_pool;
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t output_damage;
+	pixman_box32_t *extents;
+	uint64_t painted;
+	int y1, y2, n_bands, band_height, band;
+
+	if (pool->n_threads == 0)
+		return false;
+
+	pixman_region32_init(&output_damage);
+	pixman_region32_copy(&output_damage, damage);
+	region_global_to_output(output, &output_damage);
+	extents = pixman_region32_extents(&output_damage);
+	y1 = MAX(extents->y1, 0);
+	y2 = MIN(extents->y2, pixman_image_get_height(po->shadow_image));
+	pixman_region32_fini(&output_damage);
+
+	n_bands = MIN(pool->n_threads + 1,
+		      (y2 - y1) / PIXMAN_BAND_MIN_HEIGHT);
+	if (n_bands < 2)
+		return false;
+
+	band_height = (y2 - y1 + n_bands - 1) / n_bands;
+	n_bands = (y2 - y1 + band_height - 1) / band_height;
+
+	/* Surface states, created lazily, were looked up on this thread
+	 * when listing the visible views. */
+	pthread_mutex_lock(&pool->mutex);
+
+	pool->output = output;
+	pool->visible_views = visible_views;
+	pool->y1 = y1;
+	pool->y2 = y2;
+	pool->band_height = band_height;
+	pool->n_bands = n_bands;
+	pool->next_band = 0;
+	pool->bands_done = 0;
+	pool->painted_pixels = 0;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	/* Paint bands here as well rather than idling until done */
+	while (pool->next_band < pool->n_bands) {
+		band = pool->next_band++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		painted = repaint_band(pool, band);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->painted_pixels += painted;
+		pool->bands_done++;
+	}
+
+	while (pool->bands_done < pool->n_bands)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pool->n_bands = 0;
+	pool->next_band = 0;
+	pool->output = NULL;
+	pool->visible_views = NULL;
+	*painted_pixels = pool->painted_pixels;
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return true;
 }
 
 static void
@@ -557,24 +1385,152 @@ static void
 pixman_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_renderer *pr = get_renderer(compositor);
 	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_render_target target;
+	struct weston_view *view;
+	struct wl_array visible_views;
+	pixman_region32_t damage;
 
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
+	wl_list_for_each(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane)
+			view_cache_prepare(view, output);
+
+	wl_array_init(&visible_views);
+	compute_visible_views(output, output_damage, &visible_views);
+
+	if (!repaint_surfaces_banded(output, output_damage, &visible_views,
+				     &po->painted_pixels)) {
+		target.image = po->shadow_image;
+		target.band = NULL;
+		target.debug_color = pr->repaint_debug ? pr->debug_color : NULL;
+		target.private_sources = false;
+		target.painted_pixels = 0;
+
+		repaint_surfaces(output, &target, &visible_views);
+		po->painted_pixels = target.painted_pixels;
+	}
+	release_visible_views(&visible_views);
 	copy_to_hw_buffer(output, output_damage);
 
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, output_damage);
+	region_global_to_output(output, &damage);
+	po->damaged_pixels = region_area(&damage);
+	pixman_region32_fini(&damage);
+
+	if (pr->overdraw_debug && po->damaged_pixels > 0)
+		weston_log("Pixman renderer: output %s composited %" PRIu64
+			   " pixels for %" PRIu64 " damaged, %.2fx overdraw\n",
+			   output->name, po->painted_pixels,
+			   po->damaged_pixels,
+			   (double)po->painted_pixels / po->damaged_pixels);
+
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
 
 	/* Actual flip should be done by caller */
 }
 
+static enum yuv_layout
+yuv_layout_from_shm_format(uint32_t format)
+{
+	switch (format) {
+	case WL_SHM_FORMAT_NV12:
+		return YUV_LAYOUT_NV12;
+	case WL_SHM_FORMAT_YUYV:
+		return YUV_LAYOUT_YUYV;
+	case WL_SHM_FORMAT_YUV420:
+	default:
+		return YUV_LAYOUT_YUV420;
+	}
+}
+
+/* libwayland only checks that stride * height bytes of a shm buffer fit
+ * in its pool, and does not expose the pool size, so nothing past those
+ * bytes may be read. That is also why the planar YUV420 and NV12, whose
+ * chroma planes come after them, are not accepted from wl_shm. */
+static bool
+yuv_shm_buffer_fits(struct wl_shm_buffer *shm_buffer)
+{
+	int32_t width = wl_shm_buffer_get_width(shm_buffer);
+	int32_t height = wl_shm_buffer_get_height(shm_buffer);
+	int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+	size_t size;
+
+	size = yuv_buffer_size(yuv_layout_from_shm_format(
+					wl_shm_buffer_get_format(shm_buffer)),
+			       width, height, stride);
+
+	return size > 0 && size <= (size_t)stride * height;
+}
+
+/* Converts a box of a YUV shm buffer, in buffer coordinates, into the
+ * same box of the x8r8g8b8 cache image. */
+static void
+yuv_cache_convert(pixman_image_t *image, struct wl_shm_buffer *shm_buffer,
+		  const pixman_box32_t *box)
+{
+	struct yuv_buffer src = {
+		.layout = yuv_layout_from_shm_format(
+				wl_shm_buffer_get_format(shm_buffer)),
+		.data = wl_shm_buffer_get_data(shm_buffer),
+		.width = wl_shm_buffer_get_width(shm_buffer),
+		.height = wl_shm_buffer_get_height(shm_buffer),
+		.stride = wl_shm_buffer_get_stride(shm_buffer),
+	};
+
+	yuv_convert(&src, pixman_image_get_data(image),
+		    pixman_image_get_stride(image) / 4,
+		    box->x1, box->y1, box->x2, box->y2, true);
+}
+
+static void
+yuv_cache_release(struct pixman_yuv_cache *yuv)
+{
+	if (yuv->image)
+		pixman_image_unref(yuv->image);
+	yuv->image = NULL;
+}
+
 static void
 pixman_renderer_flush_damage(struct weston_surface *surface)
 {
-	/* No-op for pixman renderer */
+	struct pixman_surface_state *ps = get_surface_state(surface);
+	struct weston_buffer *buffer = ps->buffer_ref.buffer;
+	pixman_box32_t *rects, box;
+	int i, n;
+
+	view_cache_damage(ps, surface);
+
+	/* Other buffers are composited straight from shm. */
+	if (!ps->yuv.image || !buffer)
+		return;
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	if (ps->yuv.needs_full) {
+		box.x1 = 0;
+		box.y1 = 0;
+		box.x2 = buffer->width;
+		box.y2 = buffer->height;
+		yuv_cache_convert(ps->yuv.image, buffer->shm_buffer, &box);
+	} else {
+		rects = pixman_region32_rectangles(&surface->damage, &n);
+		for (i = 0; i < n; i++) {
+			box = weston_surface_to_buffer_rect(surface, rects[i]);
+			yuv_cache_convert(ps->yuv.image, buffer->shm_buffer,
+					  &box);
+		}
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+	ps->yuv.needs_full = false;
+
+	/* The cache holds all we need, let the client reuse the buffer. */
+	weston_buffer_reference(&ps->buffer_ref, NULL);
 }
 
 static void
@@ -599,6 +1555,7 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	struct pixman_surface_state *ps = get_surface_state(es);
 	struct wl_shm_buffer *shm_buffer;
 	pixman_format_code_t pixman_format;
+	bool yuv = false;
 
 	weston_buffer_reference(&ps->buffer_ref, buffer);
 
@@ -612,14 +1569,17 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		ps->image = NULL;
 	}
 
-	if (!buffer)
+	if (!buffer) {
+		yuv_cache_release(&ps->yuv);
 		return;
+	}
 
 	shm_buffer = wl_shm_buffer_get(buffer->resource);
 
 	if (! shm_buffer) {
 		weston_log("Pixman renderer supports only SHM buffers\n");
 		weston_buffer_reference(&ps->buffer_ref, NULL);
+		yuv_cache_release(&ps->yuv);
 		return;
 	}
 
@@ -633,9 +1593,14 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	case WL_SHM_FORMAT_RGB565:
 		pixman_format = PIXMAN_r5g6b5;
 		break;
+	case WL_SHM_FORMAT_YUYV:
+		pixman_format = PIXMAN_x8r8g8b8;
+		yuv = true;
+		break;
 	default:
 		weston_log("Unsupported SHM buffer format\n");
 		weston_buffer_reference(&ps->buffer_ref, NULL);
+		yuv_cache_release(&ps->yuv);
 		return;
 	break;
 	}
@@ -644,6 +1609,39 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	buffer->width = wl_shm_buffer_get_width(shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(shm_buffer);
 
+	if (yuv && !yuv_shm_buffer_fits(shm_buffer)) {
+		weston_log("YUV shm buffer too small for its size and "
+			   "format\n");
+		weston_buffer_reference(&ps->buffer_ref, NULL);
+		yuv_cache_release(&ps->yuv);
+		return;
+	}
+
+	if (yuv) {
+		/* Converted in flush_damage. The cache keeps the previous
+		 * content, so a new buffer of the same size only needs its
+		 * damage converted. */
+		if (!ps->yuv.image ||
+		    pixman_image_get_width(ps->yuv.image) != buffer->width ||
+		    pixman_image_get_height(ps->yuv.image) != buffer->height) {
+			yuv_cache_release(&ps->yuv);
+			ps->yuv.image = pixman_image_create_bits(pixman_format,
+					buffer->width, buffer->height, NULL, 0);
+			if (!ps->yuv.image) {
+				weston_log("Failed to allocate YUV conversion "
+					   "buffer\n");
+				weston_buffer_reference(&ps->buffer_ref, NULL);
+				return;
+			}
+			ps->yuv.needs_full = true;
+		}
+
+		ps->image = pixman_image_ref(ps->yuv.image);
+		return;
+	}
+
+	yuv_cache_release(&ps->yuv);
+
 	ps->image = pixman_image_create_bits(pixman_format,
 		buffer->width, buffer->height,
 		wl_shm_buffer_get_data(shm_buffer),
@@ -658,6 +1656,11 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 static void
 pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 {
+	struct pixman_view_cache *cache, *next;
+
+	wl_list_for_each_safe(cache, next, &ps->view_caches, surface_link)
+		view_cache_destroy(cache);
+
 	wl_list_remove(&ps->surface_destroy_listener.link);
 	wl_list_remove(&ps->renderer_destroy_listener.link);
 	if (ps->buffer_destroy_listener.notify) {
@@ -671,6 +1674,7 @@ pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	yuv_cache_release(&ps->yuv);
 	weston_buffer_reference(&ps->buffer_ref, NULL);
 	free(ps);
 }
@@ -710,6 +1714,7 @@ pixman_renderer_create_surface(struct weston_surface *surface)
 	surface->renderer_state = ps;
 
 	ps->surface = surface;
+	wl_list_init(&ps->view_caches);
 
 	ps->surface_destroy_listener.notify =
 		surface_state_handle_surface_destroy;
@@ -735,6 +1740,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -744,13 +1750,78 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	ps->image = pixman_image_create_solid_fill(&color);
 }
 
+static void
+band_pool_init(struct pixman_band_pool *pool)
+{
+	const char *env;
+	int32_t n = 0;
+	int i;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	env = getenv("WESTON_PIXMAN_THREADS");
+	if (!env)
+		return;
+
+	if (!safe_strtoint(env, &n) || n < 0) {
+		weston_log("Pixman renderer: invalid WESTON_PIXMAN_THREADS "
+			   "value '%s', ignoring\n", env);
+		return;
+	}
+
+	if (n == 0)
+		return;
+
+	pool->threads = zalloc(n * sizeof pool->threads[0]);
+	if (!pool->threads)
+		return;
+
+	/* SIGBUS stays deliverable, it protects the shm buffer accesses. */
+	for (i = 0; i < n; i++) {
+		if (thread_create_masked(&pool->threads[i], band_worker_thread,
+					 pool, SIGBUS) != 0) {
+			weston_log("Pixman renderer: failed to create "
+				   "band worker thread\n");
+			break;
+		}
+	}
+	pool->n_threads = i;
+
+	weston_log("Pixman renderer: compositing in up to %d bands\n",
+		   pool->n_threads + 1);
+}
+
+static void
+band_pool_fini(struct pixman_band_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->n_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+}
+
 static void
 pixman_renderer_destroy(struct weston_compositor *ec)
 {
 	struct pixman_renderer *pr = get_renderer(ec);
 
+	band_pool_fini(&pr->band_pool);
 	wl_signal_emit(&pr->destroy_signal, pr);
+	pthread_mutex_destroy(&pr->view_cache_mutex);
 	weston_binding_destroy(pr->debug_binding);
+	weston_binding_destroy(pr->overdraw_binding);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -785,6 +1856,10 @@ pixman_renderer_surface_copy_content(struct weston_surface *surface,
 	if (!ps->image)
 		return -1;
 
+	/* Bring a YUV cache up to date with the attached buffer. */
+	if (ps->yuv.image)
+		pixman_renderer_flush_damage(surface);
+
 	out_buf = pixman_image_create_bits(format, width, height,
 					   target, width * bytespp);
 
@@ -803,6 +1878,16 @@ pixman_renderer_surface_copy_content(struct weston_surface *surface,
 	return 0;
 }
 
+static void
+overdraw_debug_binding(struct weston_keyboard *keyboard,
+		       const struct timespec *time, uint32_t key, void *data)
+{
+	struct weston_compositor *ec = data;
+	struct pixman_renderer *pr = get_renderer(ec);
+
+	pr->overdraw_debug = !pr->overdraw_debug;
+}
+
 static void
 debug_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	      uint32_t key, void *data)
@@ -813,11 +1898,7 @@ debug_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color = pixman_image_create_solid_fill(&debug_red);
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -836,6 +1917,8 @@ pixman_renderer_init(struct weston_compositor *ec)
 	renderer->repaint_debug = 0;
 	renderer->debug_color = NULL;
 	renderer->base.read_pixels = pixman_renderer_read_pixels;
+	renderer->base.read_pixels_strided =
+		pixman_renderer_read_pixels_strided;
 	renderer->base.repaint_output = pixman_renderer_repaint_output;
 	renderer->base.flush_damage = pixman_renderer_flush_damage;
 	renderer->base.attach = pixman_renderer_attach;
@@ -853,14 +1936,44 @@ pixman_renderer_init(struct weston_compositor *ec)
 	renderer->debug_binding =
 		weston_compositor_add_debug_binding(ec, KEY_R,
 						    debug_binding, ec);
+	renderer->overdraw_binding =
+		weston_compositor_add_debug_binding(ec, KEY_D,
+						    overdraw_debug_binding,
+						    ec);
 
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUYV);
 
 	wl_signal_init(&renderer->destroy_signal);
 
+	band_pool_init(&renderer->band_pool);
+
+	wl_list_init(&renderer->view_caches);
+	pthread_mutex_init(&renderer->view_cache_mutex, NULL);
+
 	return 0;
 }
 
+/** Get the pixel counts of the last frame of an output
+ *
+ * \param output The output.
+ * \param painted_pixels Set to the number of pixels composited.
+ * \param damaged_pixels Set to the number of pixels damaged.
+ *
+ * Their ratio is the overdraw of the frame, which the debug key binding
+ * D also logs.
+ */
+WL_EXPORT void
+pixman_renderer_output_get_overdraw(struct weston_output *output,
+				    uint64_t *painted_pixels,
+				    uint64_t *damaged_pixels)
+{
+	struct pixman_output_state *po = get_output_state(output);
+
+	*painted_pixels = po->painted_pixels;
+	*damaged_pixels = po->damaged_pixels;
+}
+
 WL_EXPORT void
 pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *buffer)
 {
@@ -916,6 +2029,12 @@ WL_EXPORT void
 pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_view_cache *cache, *next;
+
+	wl_list_for_each_safe(cache, next, &pr->view_caches, renderer_link)
+		if (cache->output == output)
+			view_cache_destroy(cache);
 
 	pixman_image_unref(po->shadow_image);
 
@@ -38,3 +38,8 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 
 void
 pixman_renderer_output_destroy(struct weston_output *output);
+
+void
+pixman_renderer_output_get_overdraw(struct weston_output *output,
+				    uint64_t *painted_pixels,
+				    uint64_t *damaged_pixels);
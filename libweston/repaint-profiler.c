@@ -0,0 +1,623 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compositor.h"
+#include "repaint-profiler.h"
+#include "weston-repaint-profiler-server-protocol.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "shared/zalloc.h"
+
+/* Number of most recent frames the statistics are computed over.
+ * Must be a power of two. */
+#define PROFILE_WINDOW 512
+
+struct profile_window {
+	uint32_t wall_usec[PROFILE_WINDOW];
+	uint32_t cpu_usec[PROFILE_WINDOW];
+	uint32_t recorded;
+};
+
+struct profile_stamp {
+	struct timespec wall;
+	struct timespec cpu;
+};
+
+struct phase_stats {
+	uint32_t samples;
+	uint32_t wall_p50, wall_p99, wall_max;
+	uint32_t cpu_p50, cpu_p99, cpu_max;
+};
+
+struct weston_output_profile {
+	struct weston_repaint_profiler *profiler;
+	struct weston_output *output;
+	struct wl_list link; /* weston_repaint_profiler::profile_list */
+
+	struct profile_window phases[WESTON_REPAINT_PHASE_COUNT];
+
+	struct profile_stamp begin;
+	struct profile_stamp mark;
+
+	/* renderer time spent inside the backend repaint hook */
+	int64_t nested_wall_nsec;
+	int64_t nested_cpu_nsec;
+
+	struct timespec repaint_end;
+	bool awaiting_present;
+};
+
+struct weston_repaint_profiler {
+	struct weston_compositor *compositor;
+	struct wl_global *global; /* only created on request */
+	struct wl_list profile_list;
+	struct wl_list resource_list;
+	struct wl_list recording_list; /* resources that started recording */
+	struct wl_listener output_destroyed_listener;
+
+	bool key_enabled;
+
+	/* output currently inside weston_output_repaint() */
+	struct weston_output_profile *current;
+
+	void (*renderer_repaint_output)(struct weston_output *output,
+					pixman_region32_t *output_damage);
+};
+
+static const char *const phase_names[WESTON_REPAINT_PHASE_COUNT] = {
+	[WESTON_REPAINT_PHASE_BUILD_VIEW_LIST] = "build_view_list",
+	[WESTON_REPAINT_PHASE_ASSIGN_PLANES] = "assign_planes",
+	[WESTON_REPAINT_PHASE_ACCUMULATE_DAMAGE] = "accumulate_damage",
+	[WESTON_REPAINT_PHASE_FLUSH_DAMAGE] = "flush_damage",
+	[WESTON_REPAINT_PHASE_RENDERER] = "renderer",
+	[WESTON_REPAINT_PHASE_BACKEND] = "backend",
+	[WESTON_REPAINT_PHASE_PRESENT] = "present",
+	[WESTON_REPAINT_PHASE_TOTAL] = "total",
+};
+
+static void
+profile_stamp_read(struct profile_stamp *stamp)
+{
+	clock_gettime(CLOCK_MONOTONIC, &stamp->wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stamp->cpu);
+}
+
+static uint32_t
+nsec_to_usec_clamped(int64_t nsec)
+{
+	if (nsec <= 0)
+		return 0;
+	if (nsec / 1000 > UINT32_MAX)
+		return UINT32_MAX;
+	return nsec / 1000;
+}
+
+static void
+profile_window_add(struct profile_window *window,
+		   int64_t wall_nsec, int64_t cpu_nsec)
+{
+	unsigned int i = window->recorded % PROFILE_WINDOW;
+
+	window->wall_usec[i] = nsec_to_usec_clamped(wall_nsec);
+	window->cpu_usec[i] = nsec_to_usec_clamped(cpu_nsec);
+
+	/* Once the window is full, only the slot index matters. */
+	if (++window->recorded == 2 * PROFILE_WINDOW)
+		window->recorded = PROFILE_WINDOW;
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of a sorted array of n > 0 samples. */
+static uint32_t
+percentile(const uint32_t *sorted, uint32_t n, uint32_t pct)
+{
+	uint32_t rank = (n * pct + 99) / 100;
+
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void
+profile_window_stats(const struct profile_window *window,
+		     struct phase_stats *stats)
+{
+	uint32_t sorted[PROFILE_WINDOW];
+	uint32_t n = MIN(window->recorded, PROFILE_WINDOW);
+
+	memset(stats, 0, sizeof *stats);
+	stats->samples = n;
+	if (n == 0)
+		return;
+
+	memcpy(sorted, window->wall_usec, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], compare_uint32);
+	stats->wall_p50 = percentile(sorted, n, 50);
+	stats->wall_p99 = percentile(sorted, n, 99);
+	stats->wall_max = sorted[n - 1];
+
+	memcpy(sorted, window->cpu_usec, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], compare_uint32);
+	stats->cpu_p50 = percentile(sorted, n, 50);
+	stats->cpu_p99 = percentile(sorted, n, 99);
+	stats->cpu_max = sorted[n - 1];
+}
+
+static void
+profile_record(struct weston_output_profile *profile,
+	       enum weston_repaint_phase phase,
+	       const struct profile_stamp *from,
+	       const struct profile_stamp *to)
+{
+	profile_window_add(&profile->phases[phase],
+			   timespec_sub_to_nsec(&to->wall, &from->wall),
+			   timespec_sub_to_nsec(&to->cpu, &from->cpu));
+}
+
+static bool
+profiler_active(struct weston_repaint_profiler *profiler)
+{
+	return profiler->key_enabled ||
+	       !wl_list_empty(&profiler->recording_list);
+}
+
+static struct weston_output_profile *
+profiler_find_profile(struct weston_repaint_profiler *profiler,
+		      struct weston_output *output)
+{
+	struct weston_output_profile *profile;
+
+	wl_list_for_each(profile, &profiler->profile_list, link)
+		if (profile->output == output)
+			return profile;
+
+	return NULL;
+}
+
+static void
+output_profile_destroy(struct weston_output_profile *profile)
+{
+	if (profile->profiler->current == profile)
+		profile->profiler->current = NULL;
+
+	wl_list_remove(&profile->link);
+	free(profile);
+}
+
+/* Interposed on weston_renderer::repaint_output, which the backends call
+ * from within their repaint hook, to split renderer time from backend
+ * time. */
+static void
+profiled_repaint_output(struct weston_output *output,
+			pixman_region32_t *output_damage)
+{
+	struct weston_repaint_profiler *profiler = output->compositor->profiler;
+	struct weston_output_profile *profile = profiler->current;
+	struct profile_stamp start, end;
+
+	if (!profile || profile->output != output) {
+		profiler->renderer_repaint_output(output, output_damage);
+		return;
+	}
+
+	profile_stamp_read(&start);
+	profiler->renderer_repaint_output(output, output_damage);
+	profile_stamp_read(&end);
+
+	profile_record(profile, WESTON_REPAINT_PHASE_RENDERER, &start, &end);
+	profile->nested_wall_nsec +=
+		timespec_sub_to_nsec(&end.wall, &start.wall);
+	profile->nested_cpu_nsec +=
+		timespec_sub_to_nsec(&end.cpu, &start.cpu);
+}
+
+struct weston_output_profile *
+weston_repaint_profile_begin(struct weston_output *output)
+{
+	struct weston_repaint_profiler *profiler = output->compositor->profiler;
+	struct weston_renderer *renderer = output->compositor->renderer;
+	struct weston_output_profile *profile;
+
+	if (!profiler || !profiler_active(profiler))
+		return NULL;
+
+	profile = profiler_find_profile(profiler, output);
+	if (!profile) {
+		profile = zalloc(sizeof *profile);
+		if (!profile)
+			return NULL;
+
+		profile->profiler = profiler;
+		profile->output = output;
+		wl_list_insert(&profiler->profile_list, &profile->link);
+	}
+
+	/* The renderer may be replaced at runtime, e.g. when the DRM
+	 * backend switches between GL and pixman. */
+	if (renderer->repaint_output != profiled_repaint_output) {
+		profiler->renderer_repaint_output = renderer->repaint_output;
+		renderer->repaint_output = profiled_repaint_output;
+	}
+
+	profile_stamp_read(&profile->begin);
+	profile->mark = profile->begin;
+	profile->nested_wall_nsec = 0;
+	profile->nested_cpu_nsec = 0;
+	profiler->current = profile;
+
+	return profile;
+}
+
+void
+weston_repaint_profile_mark(struct weston_output_profile *profile,
+			    enum weston_repaint_phase phase)
+{
+	struct profile_stamp now;
+	int64_t wall_nsec, cpu_nsec;
+
+	if (!profile)
+		return;
+
+	profile_stamp_read(&now);
+	wall_nsec = timespec_sub_to_nsec(&now.wall, &profile->mark.wall);
+	cpu_nsec = timespec_sub_to_nsec(&now.cpu, &profile->mark.cpu);
+
+	if (phase == WESTON_REPAINT_PHASE_BACKEND) {
+		wall_nsec -= profile->nested_wall_nsec;
+		cpu_nsec -= profile->nested_cpu_nsec;
+		profile->nested_wall_nsec = 0;
+		profile->nested_cpu_nsec = 0;
+	}
+
+	profile_window_add(&profile->phases[phase], wall_nsec, cpu_nsec);
+	profile->mark = now;
+}
+
+void
+weston_repaint_profile_end(struct weston_output_profile *profile)
+{
+	struct profile_stamp now;
+
+	if (!profile)
+		return;
+
+	profile_stamp_read(&now);
+	profile_record(profile, WESTON_REPAINT_PHASE_TOTAL,
+		       &profile->begin, &now);
+
+	profile->repaint_end = now.wall;
+	profile->awaiting_present = true;
+	profile->profiler->current = NULL;
+}
+
+void
+weston_repaint_profile_presented(struct weston_output *output,
+				 uint32_t presented_flags)
+{
+	struct weston_repaint_profiler *profiler = output->compositor->profiler;
+	struct weston_output_profile *profile;
+	struct timespec now;
+
+	if (!profiler)
+		return;
+
+	profile = profiler_find_profile(profiler, output);
+	if (!profile || !profile->awaiting_present)
+		return;
+
+	profile->awaiting_present = false;
+
+	/* Restarting the repaint loop does not present anything. */
+	if (presented_flags & WP_PRESENTATION_FEEDBACK_INVALID)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	profile_window_add(&profile->phases[WESTON_REPAINT_PHASE_PRESENT],
+			   timespec_sub_to_nsec(&now, &profile->repaint_end),
+			   0);
+}
+
+static void
+profiler_dump(struct weston_repaint_profiler *profiler)
+{
+	struct weston_output_profile *profile;
+	struct phase_stats stats;
+	int i;
+
+	if (wl_list_empty(&profiler->profile_list)) {
+		weston_log("Repaint profile: no frames recorded\n");
+		return;
+	}
+
+	wl_list_for_each(profile, &profiler->profile_list, link) {
+		weston_log("Repaint profile for output %s, in usec:\n",
+			   profile->output->name);
+		weston_log_continue(STAMP_SPACE "%-18s %7s %7s %7s %7s "
+				    "%7s %7s %7s\n", "phase", "frames",
+				    "wall50", "wall99", "wallmax",
+				    "cpu50", "cpu99", "cpumax");
+
+		for (i = 0; i < WESTON_REPAINT_PHASE_COUNT; i++) {
+			profile_window_stats(&profile->phases[i], &stats);
+			if (stats.samples == 0)
+				continue;
+
+			weston_log_continue(STAMP_SPACE "%-18s %7u %7u %7u "
+					    "%7u %7u %7u %7u\n",
+					    phase_names[i], stats.samples,
+					    stats.wall_p50, stats.wall_p99,
+					    stats.wall_max, stats.cpu_p50,
+					    stats.cpu_p99, stats.cpu_max);
+		}
+	}
+}
+
+void
+weston_repaint_profiler_toggle(struct weston_repaint_profiler *profiler)
+{
+	profiler->key_enabled = !profiler->key_enabled;
+
+	if (profiler->key_enabled) {
+		weston_log("Repaint profiling started\n");
+		return;
+	}
+
+	profiler_dump(profiler);
+	weston_log("Repaint profiling stopped\n");
+}
+
+static void
+profiler_handle_destroy(struct wl_client *client,
+			struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+profiler_handle_get_stats(struct wl_client *client,
+			  struct wl_resource *resource,
+			  uint32_t id,
+			  struct wl_resource *output_resource)
+{
+	struct weston_repaint_profiler *profiler =
+		wl_resource_get_user_data(resource);
+	struct weston_output *output =
+		weston_output_from_resource(output_resource);
+	struct weston_output_profile *profile;
+	struct wl_resource *stats_resource;
+	struct phase_stats stats;
+	int i;
+
+	stats_resource = wl_resource_create(client,
+					    &weston_repaint_stats_interface,
+					    wl_resource_get_version(resource),
+					    id);
+	if (!stats_resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	profile = profiler ? profiler_find_profile(profiler, output) : NULL;
+	for (i = 0; profile && i < WESTON_REPAINT_PHASE_COUNT; i++) {
+		profile_window_stats(&profile->phases[i], &stats);
+		if (stats.samples == 0)
+			continue;
+
+		weston_repaint_stats_send_phase(stats_resource, i,
+						stats.samples,
+						stats.wall_p50,
+						stats.wall_p99,
+						stats.wall_max,
+						stats.cpu_p50,
+						stats.cpu_p99,
+						stats.cpu_max);
+	}
+
+	weston_repaint_stats_send_done(stats_resource);
+	wl_resource_destroy(stats_resource);
+}
+
+static void
+profiler_handle_reset(struct wl_client *client,
+		      struct wl_resource *resource,
+		      struct wl_resource *output_resource)
+{
+	struct weston_repaint_profiler *profiler =
+		wl_resource_get_user_data(resource);
+	struct weston_output *output =
+		weston_output_from_resource(output_resource);
+	struct weston_output_profile *profile;
+	int i;
+
+	if (!profiler)
+		return;
+
+	profile = profiler_find_profile(profiler, output);
+	if (!profile)
+		return;
+
+	for (i = 0; i < WESTON_REPAINT_PHASE_COUNT; i++)
+		profile->phases[i].recorded = 0;
+}
+
+/* A resource is linked into recording_list while it records, and into
+ * resource_list otherwise. */
+static void
+profiler_handle_start(struct wl_client *client,
+		      struct wl_resource *resource)
+{
+	struct weston_repaint_profiler *profiler =
+		wl_resource_get_user_data(resource);
+
+	if (!profiler)
+		return;
+
+	wl_list_remove(wl_resource_get_link(resource));
+	wl_list_insert(&profiler->recording_list,
+		       wl_resource_get_link(resource));
+}
+
+static void
+profiler_handle_stop(struct wl_client *client,
+		     struct wl_resource *resource)
+{
+	struct weston_repaint_profiler *profiler =
+		wl_resource_get_user_data(resource);
+
+	if (!profiler)
+		return;
+
+	wl_list_remove(wl_resource_get_link(resource));
+	wl_list_insert(&profiler->resource_list,
+		       wl_resource_get_link(resource));
+}
+
+static const struct weston_repaint_profiler_interface profiler_implementation = {
+	profiler_handle_destroy,
+	profiler_handle_get_stats,
+	profiler_handle_reset,
+	profiler_handle_start,
+	profiler_handle_stop,
+};
+
+static void
+profiler_resource_destroyed(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+bind_repaint_profiler(struct wl_client *client,
+		      void *data, uint32_t version, uint32_t id)
+{
+	struct weston_repaint_profiler *profiler = data;
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &weston_repaint_profiler_interface,
+				      version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &profiler_implementation,
+				       profiler, profiler_resource_destroyed);
+	wl_list_insert(&profiler->resource_list,
+		       wl_resource_get_link(resource));
+}
+
+static void
+profiler_output_destroyed(struct wl_listener *listener, void *data)
+{
+	struct weston_repaint_profiler *profiler =
+		container_of(listener, struct weston_repaint_profiler,
+			     output_destroyed_listener);
+	struct weston_output_profile *profile;
+
+	profile = profiler_find_profile(profiler, data);
+	if (profile)
+		output_profile_destroy(profile);
+}
+
+struct weston_repaint_profiler *
+weston_repaint_profiler_create(struct weston_compositor *compositor)
+{
+	struct weston_repaint_profiler *profiler;
+
+	profiler = zalloc(sizeof *profiler);
+	if (!profiler)
+		return NULL;
+
+	profiler->compositor = compositor;
+	wl_list_init(&profiler->profile_list);
+	wl_list_init(&profiler->resource_list);
+	wl_list_init(&profiler->recording_list);
+
+	profiler->output_destroyed_listener.notify = profiler_output_destroyed;
+	wl_signal_add(&compositor->output_destroyed_signal,
+		      &profiler->output_destroyed_listener);
+
+	return profiler;
+}
+
+/* Advertises the weston_repaint_profiler global. Any client can then
+ * read the timings, so this is left to the user to ask for. */
+int
+weston_repaint_profiler_expose(struct weston_repaint_profiler *profiler)
+{
+	if (profiler->global)
+		return 0;
+
+	profiler->global = wl_global_create(profiler->compositor->wl_display,
+					    &weston_repaint_profiler_interface,
+					    1, profiler,
+					    bind_repaint_profiler);
+	if (!profiler->global)
+		return -1;
+
+	return 0;
+}
+
+/* Called after the backend, and with it the renderer and the outputs,
+ * is gone; the interposed renderer hook is not restored. */
+void
+weston_repaint_profiler_destroy(struct weston_repaint_profiler *profiler)
+{
+	struct weston_output_profile *profile, *tmp;
+	struct wl_resource *resource, *next;
+
+	wl_list_for_each_safe(profile, tmp, &profiler->profile_list, link)
+		output_profile_destroy(profile);
+
+	/* Clients may outlive us until the display is destroyed. */
+	wl_list_insert_list(&profiler->resource_list,
+			    &profiler->recording_list);
+	wl_resource_for_each_safe(resource, next, &profiler->resource_list) {
+		wl_resource_set_user_data(resource, NULL);
+		wl_resource_set_destructor(resource, NULL);
+		wl_list_remove(wl_resource_get_link(resource));
+		wl_list_init(wl_resource_get_link(resource));
+	}
+
+	wl_list_remove(&profiler->output_destroyed_listener.link);
+	if (profiler->global)
+		wl_global_destroy(profiler->global);
+	free(profiler);
+}
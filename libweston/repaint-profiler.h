@@ -0,0 +1,76 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_REPAINT_PROFILER_H
+#define WESTON_REPAINT_PROFILER_H
+
+#include <stdint.h>
+
+struct weston_compositor;
+struct weston_output;
+struct weston_repaint_profiler;
+struct weston_output_profile;
+
+/* Keep in sync with weston_repaint_profiler.phase */
+enum weston_repaint_phase {
+	WESTON_REPAINT_PHASE_BUILD_VIEW_LIST = 0,
+	WESTON_REPAINT_PHASE_ASSIGN_PLANES,
+	WESTON_REPAINT_PHASE_ACCUMULATE_DAMAGE,
+	WESTON_REPAINT_PHASE_FLUSH_DAMAGE,
+	WESTON_REPAINT_PHASE_RENDERER,
+	WESTON_REPAINT_PHASE_BACKEND,
+	WESTON_REPAINT_PHASE_PRESENT,
+	WESTON_REPAINT_PHASE_TOTAL,
+	WESTON_REPAINT_PHASE_COUNT
+};
+
+struct weston_repaint_profiler *
+weston_repaint_profiler_create(struct weston_compositor *compositor);
+
+void
+weston_repaint_profiler_destroy(struct weston_repaint_profiler *profiler);
+
+int
+weston_repaint_profiler_expose(struct weston_repaint_profiler *profiler);
+
+void
+weston_repaint_profiler_toggle(struct weston_repaint_profiler *profiler);
+
+/* Returns NULL when profiling is off; the other calls accept NULL. */
+struct weston_output_profile *
+weston_repaint_profile_begin(struct weston_output *output);
+
+void
+weston_repaint_profile_mark(struct weston_output_profile *profile,
+			    enum weston_repaint_phase phase);
+
+void
+weston_repaint_profile_end(struct weston_output_profile *profile);
+
+void
+weston_repaint_profile_presented(struct weston_output *output,
+				 uint32_t presented_flags);
+
+#endif /* WESTON_REPAINT_PROFILER_H */
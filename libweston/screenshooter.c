@@ -32,41 +32,33 @@
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <sys/uio.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "compositor.h"
 #include "shared/helpers.h"
+#include "shared/thread-util.h"
 #include "shared/timespec-util.h"
 
 #include "wcap/wcap-decode.h"
 
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
-	struct weston_buffer *buffer;
+	struct weston_buffer *buffer; /* NULL once destroyed */
+	struct wl_listener buffer_destroy_listener;
+	struct weston_output *output;
+	int32_t x, y, width, height;
 	weston_screenshooter_done_func_t done;
 	void *data;
 };
 
-static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	uint8_t *end;
-
-	end = dst + height * stride;
-	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
-}
-
-static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
-}
-
 static void
 copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 {
@@ -84,30 +76,140 @@ copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 	}
 }
 
-static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+static bool
+format_is_rgba(pixman_format_code_t format)
+{
+	return format == PIXMAN_a8b8g8r8 || format == PIXMAN_x8b8g8r8;
+}
+
+/* Reads the region straight into the client buffer. */
+static int
+screenshooter_read_direct(struct weston_output *output,
+			  struct screenshooter_frame_listener *l,
+			  uint8_t *d, int32_t stride)
 {
-	uint8_t *end;
+	struct weston_compositor *compositor = output->compositor;
+	pixman_format_code_t format = PIXMAN_a8r8g8b8;
+	int32_t row_bytes = l->width * 4;
+	int i;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
+	if (format_is_rgba(compositor->read_format))
+		format = PIXMAN_a8b8g8r8;
+
+	if (compositor->renderer->read_pixels_strided(output, format, d,
+						      stride, l->x, l->y,
+						      l->width, l->height) < 0)
+		return -1;
+
+	if (format == PIXMAN_a8b8g8r8)
+		for (i = 0; i < l->height; i++)
+			copy_row_swap_RB(d + i * stride, d + i * stride,
+					 row_bytes);
+
+	return 0;
+}
+
+/* For renderers without read_pixels_strided(): read into a temporary
+ * and copy it row by row. */
+static int
+screenshooter_read_copy(struct weston_output *output,
+			struct screenshooter_frame_listener *l,
+			uint8_t *d, int32_t stride)
+{
+	struct weston_compositor *compositor = output->compositor;
+	int32_t row_bytes = l->width * 4;
+	uint8_t *pixels, *s;
+	int32_t src_stride;
+	uint32_t y = l->y;
+	int i;
+
+	pixels = malloc(row_bytes * l->height);
+	if (pixels == NULL)
+		return -1;
+
+	src_stride = row_bytes;
+	s = pixels;
+	if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP) {
+		y = output->current_mode->height - l->y - l->height;
+		s = pixels + row_bytes * (l->height - 1);
+		src_stride = -row_bytes;
+	}
+
+	compositor->renderer->read_pixels(output,
+			     compositor->read_format, pixels,
+			     l->x, y, l->width, l->height);
+
+	for (i = 0; i < l->height; i++) {
+		if (format_is_rgba(compositor->read_format))
+			copy_row_swap_RB(d, s, row_bytes);
+		else
+			memcpy(d, s, row_bytes);
+		d += stride;
+		s += src_stride;
 	}
+
+	free(pixels);
+
+	return 0;
 }
 
 static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
+screenshooter_frame_listener_destroy(struct screenshooter_frame_listener *l,
+				     enum weston_screenshooter_outcome outcome)
 {
-	uint8_t *end;
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	else
+		outcome = WESTON_SCREENSHOOTER_BAD_BUFFER;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
+	l->done(l->data, outcome);
+	free(l);
+}
+
+static void
+screenshooter_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
+
+	l->buffer = NULL;
+}
+
+/* Receives the rows from an asynchronous read-back, which may come
+ * after the client destroyed the buffer. */
+static void
+screenshooter_read_done(void *data, const void *pixels, int32_t src_stride)
+{
+	struct screenshooter_frame_listener *l = data;
+	struct weston_output *output = l->output;
+	int32_t row_bytes = l->width * 4;
+	const uint8_t *s = pixels;
+	int32_t stride;
+	uint8_t *d;
+	int i;
+
+	if (pixels == NULL || l->buffer == NULL) {
+		screenshooter_frame_listener_destroy(l,
+				WESTON_SCREENSHOOTER_NO_MEMORY);
+		return;
+	}
+
+	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
+	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
+
+	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
+	for (i = 0; i < l->height; i++) {
+		if (format_is_rgba(output->compositor->read_format))
+			copy_row_swap_RB(d, (void *) s, row_bytes);
+		else
+			memcpy(d, s, row_bytes);
+		d += stride;
+		s += src_stride;
 	}
+	wl_shm_buffer_end_access(l->buffer->shm_buffer);
+
+	screenshooter_frame_listener_destroy(l, WESTON_SCREENSHOOTER_SUCCESS);
 }
 
 static void
@@ -119,61 +221,82 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
 	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	uint8_t *d;
+	int ret;
 
-	output->disable_planes--;
 	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
 
-	if (pixels == NULL) {
-		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
-		free(l);
+	if (l->buffer == NULL) {
+		weston_output_capture_end(output);
+		screenshooter_frame_listener_destroy(l,
+				WESTON_SCREENSHOOTER_BAD_BUFFER);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
+	/* Renderers that can read back without stalling, and backends
+	 * reading back the frame as scanned out, deliver the pixels a
+	 * frame or so later. */
+	if (compositor->renderer->queue_read_pixels || output->queue_capture) {
+		l->output = output;
+		ret = weston_output_read_pixels_async(output,
+						      compositor->read_format,
+						      l->x, l->y,
+						      l->width, l->height,
+						      screenshooter_read_done,
+						      l);
+		weston_output_capture_end(output);
+		if (ret < 0)
+			screenshooter_frame_listener_destroy(l,
+					WESTON_SCREENSHOOTER_NO_MEMORY);
+		return;
+	}
 
-	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
+	weston_output_capture_end(output);
 
+	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
 	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
 
 	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
-
-	switch (compositor->read_format) {
-	case PIXMAN_a8r8g8b8:
-	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
-		break;
-	case PIXMAN_x8b8g8r8:
-	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
-		break;
-	default:
-		break;
-	}
-
+	if (compositor->renderer->read_pixels_strided)
+		ret = screenshooter_read_direct(output, l, d, stride);
+	else
+		ret = screenshooter_read_copy(output, l, d, stride);
 	wl_shm_buffer_end_access(l->buffer->shm_buffer);
 
-	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
-	free(l);
+	screenshooter_frame_listener_destroy(l, ret < 0 ?
+					     WESTON_SCREENSHOOTER_NO_MEMORY :
+					     WESTON_SCREENSHOOTER_SUCCESS);
 }
 
 WL_EXPORT int
 weston_screenshooter_shoot(struct weston_output *output,
 			   struct weston_buffer *buffer,
 			   weston_screenshooter_done_func_t done, void *data)
+{
+	return weston_screenshooter_shoot_region(output, buffer, 0, 0,
+						 output->current_mode->width,
+						 output->current_mode->height,
+						 done, data);
+}
+
+/** Capture a rectangle of an output into a client buffer
+ *
+ * \param output The output to capture.
+ * \param buffer An ARGB8888 or XRGB8888 shm buffer, at least width by
+ * height pixels; the rectangle lands in its top left corner.
+ * \param x, y, width, height The rectangle, in output framebuffer
+ * coordinates.
+ *
+ * Only the requested rectangle is read back from the renderer, and
+ * renderers that support it write it directly into the buffer.
+ */
+WL_EXPORT int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  struct weston_buffer *buffer,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  weston_screenshooter_done_func_t done,
+				  void *data)
 {
 	struct screenshooter_frame_listener *l;
 
@@ -186,8 +309,11 @@ weston_screenshooter_shoot(struct weston_output *output,
 	buffer->width = wl_shm_buffer_get_width(buffer->shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(buffer->shm_buffer);
 
-	if (buffer->width < output->current_mode->width ||
-	    buffer->height < output->current_mode->height) {
+	if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+	    width > output->current_mode->width - x ||
+	    height > output->current_mode->height - y ||
+	    buffer->width < width || buffer->height < height ||
+	    wl_shm_buffer_get_stride(buffer->shm_buffer) < width * 4) {
 		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
 		return -1;
 	}
@@ -199,24 +325,69 @@ weston_screenshooter_shoot(struct weston_output *output,
 	}
 
 	l->buffer = buffer;
+	l->x = x;
+	l->y = y;
+	l->width = width;
+	l->height = height;
 	l->done = done;
 	l->data = data;
 	l->listener.notify = screenshooter_frame_notify;
 	wl_signal_add(&output->frame_signal, &l->listener);
-	output->disable_planes++;
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
+	weston_output_capture_begin(output);
 	weston_output_schedule_repaint(output);
 
 	return 0;
 }
 
+/* Frames being read back or waiting for the encoder thread. When the
+ * queue is full, the damage of a frame is carried over to the next one
+ * instead, so the compositor never waits for the encoder. */
+#define RECORDER_QUEUE_LENGTH 3
+
+struct recorder_frame {
+	struct weston_recorder *recorder;
+	uint32_t msecs;
+	int n_rects;
+	pixman_box32_t *rects;
+	/* top-down rows of each rect, one rect after the other */
+	uint32_t *pixels;
+
+	/* read-back state, only touched by the compositor thread */
+	int pending;
+	int n_read;
+	uint32_t *next;
+	bool failed;
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
+	int width, height;
 	int fd;
 	struct wl_listener frame_listener;
 	int count, destroying;
+
+	/* frames whose read-backs are still in flight; they follow the
+	 * queued ones in the ring */
+	int reading;
+	bool detached;
+
+	/* damage not yet recorded because the queue was full */
+	pixman_region32_t backlog;
+	int coalesced;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool quit;
+	struct recorder_frame queue[RECORDER_QUEUE_LENGTH];
+	int queue_head, queue_count;
+	uint32_t total;
+
+	/* owned by the encoder thread */
+	uint32_t *frame;
+	uint32_t *outbuf;
 };
 
 static uint32_t *
@@ -250,9 +421,287 @@ component_delta(uint32_t next, uint32_t prev)
 	return (dr << 16) | (dg << 8) | (db << 0);
 }
 
+struct rle_state {
+	uint32_t *p;
+	uint32_t prev;
+	int run;
+};
+
+static inline void
+rle_push(struct rle_state *rle, uint32_t delta)
+{
+	if (rle->run == 0 || delta == rle->prev) {
+		rle->run++;
+	} else {
+		rle->p = output_run(rle->p, rle->prev, rle->run);
+		rle->run = 1;
+	}
+	rle->prev = delta;
+}
+
+/* Extends the current run by n pixels that all have the given delta. */
+static inline void
+rle_push_span(struct rle_state *rle, uint32_t delta, int n)
+{
+	if (rle->run != 0 && delta != rle->prev) {
+		rle->p = output_run(rle->p, rle->prev, rle->run);
+		rle->run = 0;
+	}
+	rle->run += n;
+	rle->prev = delta;
+}
+
+/* Delta-encodes one row against the previous frame and updates the
+ * previous frame. The per-channel delta is a byte-wise subtraction with
+ * the X channel cleared, so it vectorizes directly; runs of unchanged
+ * pixels are skipped four at a time without touching the frame. */
+#if defined(__SSE2__)
+static void
+encode_row(struct rle_state *rle, const uint32_t *s, uint32_t *d, int width)
+{
+	const __m128i mask = _mm_set1_epi32(0x00ffffff);
+	uint32_t deltas[4];
+	__m128i next, prev, delta;
+	int k = 0, l;
+
+	for (; k + 4 <= width; k += 4) {
+		next = _mm_loadu_si128((const __m128i *)(s + k));
+		prev = _mm_loadu_si128((const __m128i *)(d + k));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(next, prev)) == 0xffff) {
+			rle_push_span(rle, 0, 4);
+			continue;
+		}
+
+		_mm_storeu_si128((__m128i *)(d + k), next);
+		delta = _mm_and_si128(_mm_sub_epi8(next, prev), mask);
+
+		if (rle->run != 0 &&
+		    _mm_movemask_epi8(_mm_cmpeq_epi32(delta,
+				_mm_set1_epi32(rle->prev))) == 0xffff) {
+			rle->run += 4;
+			continue;
+		}
+
+		_mm_storeu_si128((__m128i *)deltas, delta);
+		for (l = 0; l < 4; l++)
+			rle_push(rle, deltas[l]);
+	}
+
+	for (; k < width; k++) {
+		rle_push(rle, component_delta(s[k], d[k]));
+		d[k] = s[k];
+	}
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static void
+encode_row(struct rle_state *rle, const uint32_t *s, uint32_t *d, int width)
+{
+	const uint32x4_t mask = vdupq_n_u32(0x00ffffff);
+	uint32_t deltas[4];
+	uint32x4_t next, prev, delta, eq;
+	int k = 0, l;
+
+	for (; k + 4 <= width; k += 4) {
+		next = vld1q_u32(s + k);
+		prev = vld1q_u32(d + k);
+
+		eq = vceqq_u32(next, prev);
+		if (vminvq_u32(eq) == UINT32_MAX) {
+			rle_push_span(rle, 0, 4);
+			continue;
+		}
+
+		vst1q_u32(d + k, next);
+		delta = vandq_u32(vreinterpretq_u32_u8(
+				vsubq_u8(vreinterpretq_u8_u32(next),
+					 vreinterpretq_u8_u32(prev))), mask);
+
+		if (rle->run != 0 &&
+		    vminvq_u32(vceqq_u32(delta,
+				vdupq_n_u32(rle->prev))) == UINT32_MAX) {
+			rle->run += 4;
+			continue;
+		}
+
+		vst1q_u32(deltas, delta);
+		for (l = 0; l < 4; l++)
+			rle_push(rle, deltas[l]);
+	}
+
+	for (; k < width; k++) {
+		rle_push(rle, component_delta(s[k], d[k]));
+		d[k] = s[k];
+	}
+}
+#else
+static void
+encode_row(struct rle_state *rle, const uint32_t *s, uint32_t *d, int width)
+{
+	int k;
+
+	for (k = 0; k < width; k++) {
+		rle_push(rle, component_delta(s[k], d[k]));
+		d[k] = s[k];
+	}
+}
+#endif
+
+static void
+recorder_encode_frame(struct weston_recorder *recorder,
+		      struct recorder_frame *frame)
+{
+	pixman_box32_t *r = frame->rects;
+	const uint32_t *pixels = frame->pixels;
+	struct rle_state rle;
+	int i, j, width, height, y;
+	const uint32_t *s;
+	struct {
+		uint32_t msecs;
+		uint32_t nrects;
+	} header;
+	struct iovec v[2];
+	uint32_t total = 0;
+
+	header.msecs = frame->msecs;
+	header.nrects = frame->n_rects;
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = r;
+	v[1].iov_len = frame->n_rects * sizeof *r;
+	total += writev(recorder->fd, v, 2);
+
+	for (i = 0; i < frame->n_rects; i++) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+
+		rle.p = recorder->outbuf;
+		rle.prev = 0;
+		rle.run = 0;
+
+		/* Rows are stored bottom-up, as wcap-decode expects. */
+		for (j = 0; j < height; j++) {
+			s = pixels + width * (height - j - 1);
+			y = r[i].y2 - j - 1;
+
+			encode_row(&rle, s,
+				   recorder->frame + recorder->width * y +
+				   r[i].x1, width);
+		}
+
+		rle.p = output_run(rle.p, rle.prev, rle.run);
+
+		total += write(recorder->fd, recorder->outbuf,
+			       (rle.p - recorder->outbuf) * 4);
+		pixels += width * height;
+	}
+
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->total += total;
+	pthread_mutex_unlock(&recorder->mutex);
+}
+
+static void *
+recorder_thread(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct recorder_frame *frame;
+
+	pthread_mutex_lock(&recorder->mutex);
+	while (1) {
+		while (recorder->queue_count == 0 && !recorder->quit)
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+
+		/* Drain the queue before quitting. */
+		if (recorder->queue_count == 0)
+			break;
+
+		frame = &recorder->queue[recorder->queue_head];
+		pthread_mutex_unlock(&recorder->mutex);
+
+		/* Frames whose read-back failed carry no rects. */
+		if (frame->n_rects > 0)
+			recorder_encode_frame(recorder, frame);
+		free(frame->rects);
+		frame->rects = NULL;
+
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->queue_head =
+			(recorder->queue_head + 1) % RECORDER_QUEUE_LENGTH;
+		recorder->queue_count--;
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return NULL;
+}
+
 static void
 weston_recorder_destroy(struct weston_recorder *recorder);
 
+static void
+weston_recorder_finish(struct weston_recorder *recorder);
+
+/* Drops a reference to the read-backs of a frame, queueing the frame
+ * for the encoder once all of them have completed. */
+static void
+recorder_frame_unref(struct recorder_frame *frame)
+{
+	struct weston_recorder *recorder = frame->recorder;
+	pixman_box32_t *r = frame->rects;
+	int i;
+
+	if (--frame->pending > 0)
+		return;
+
+	/* Frames complete in order, so this one is next in the ring.
+	 * A failed one is queued anyway, empty, and its damage is
+	 * recorded with the next frame. */
+	if (frame->failed) {
+		for (i = 0; i < frame->n_rects; i++)
+			pixman_region32_union_rect(&recorder->backlog,
+						   &recorder->backlog,
+						   r[i].x1, r[i].y1,
+						   r[i].x2 - r[i].x1,
+						   r[i].y2 - r[i].y1);
+		frame->n_rects = 0;
+	} else {
+		recorder->count++;
+	}
+
+	recorder->reading--;
+
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->queue_count++;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	if (recorder->detached && recorder->reading == 0)
+		weston_recorder_finish(recorder);
+}
+
+static void
+recorder_read_done(void *data, const void *pixels, int32_t stride)
+{
+	struct recorder_frame *frame = data;
+	pixman_box32_t *r = &frame->rects[frame->n_read++];
+	int width = r->x2 - r->x1;
+	int height = r->y2 - r->y1;
+	const uint8_t *s = pixels;
+	int i;
+
+	if (pixels == NULL) {
+		frame->failed = true;
+	} else if (!frame->failed) {
+		for (i = 0; i < height; i++) {
+			memcpy(frame->next, s, width * 4);
+			frame->next += width;
+			s += stride;
+		}
+	}
+
+	recorder_frame_unref(frame);
+}
+
 static void
 weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 {
@@ -260,25 +709,11 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = timespec_to_msec(&output->frame_time);
+	struct recorder_frame *frame;
 	pixman_box32_t *r;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	int i, n, slot;
+	bool full;
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -290,75 +725,63 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 				 &damage, &transformed_damage);
 	pixman_region32_fini(&damage);
 
+	pixman_region32_union(&transformed_damage, &transformed_damage,
+			      &recorder->backlog);
+
 	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
+	if (n == 0)
+		goto out;
+
+	pthread_mutex_lock(&recorder->mutex);
+	full = recorder->queue_count + recorder->reading ==
+	       RECORDER_QUEUE_LENGTH;
+	slot = (recorder->queue_head + recorder->queue_count +
+		recorder->reading) % RECORDER_QUEUE_LENGTH;
+	pthread_mutex_unlock(&recorder->mutex);
+
+	if (full) {
+		pixman_region32_copy(&recorder->backlog, &transformed_damage);
+		recorder->coalesced++;
+		goto out;
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
-
+	/* The slot is not visible to the encoder thread until queued. */
+	frame = &recorder->queue[slot];
+	frame->rects = malloc(n * sizeof *r);
+	if (!frame->rects) {
+		pixman_region32_copy(&recorder->backlog, &transformed_damage);
+		goto out;
+	}
+	memcpy(frame->rects, r, n * sizeof *r);
+	frame->n_rects = n;
+	frame->msecs = timespec_to_msec(&output->frame_time);
+	frame->recorder = recorder;
+	frame->n_read = 0;
+	frame->next = frame->pixels;
+	frame->failed = false;
+
+	pixman_region32_clear(&recorder->backlog);
+	recorder->reading++;
+
+	/* The loop holds a reference, since renderers without
+	 * asynchronous read-back complete each rect right away. */
+	frame->pending = 1;
 	for (i = 0; i < n; i++) {
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip)
-			y_orig = output->current_mode->height - r[i].y2;
-		else
-			y_orig = r[i].y1;
-
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
+		frame->pending++;
+		if (weston_output_read_pixels_async(output,
+				compositor->read_format,
+				r[i].x1, r[i].y1,
+				r[i].x2 - r[i].x1, r[i].y2 - r[i].y1,
+				recorder_read_done, frame) < 0) {
+			frame->pending--;
+			frame->failed = true;
+			break;
 		}
-
-		p = output_run(p, prev, run);
-
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
-
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
 	}
+	recorder_frame_unref(frame);
 
+out:
 	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
 
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
@@ -367,11 +790,17 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 static void
 weston_recorder_free(struct weston_recorder *recorder)
 {
+	int i;
+
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
-	free(recorder->rect);
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		free(recorder->queue[i].pixels);
+		free(recorder->queue[i].rects);
+	}
+	pixman_region32_fini(&recorder->backlog);
+	free(recorder->outbuf);
 	free(recorder->frame);
 	free(recorder);
 }
@@ -381,11 +810,8 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
-	int stride, size;
+	int i, size;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -393,20 +819,24 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		return NULL;
 	}
 
-	stride = output->current_mode->width;
-	size = stride * 4 * output->current_mode->height;
-	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
+	recorder->width = output->current_mode->width;
+	recorder->height = output->current_mode->height;
 	recorder->output = output;
+	recorder->fd = -1;
+	pixman_region32_init(&recorder->backlog);
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	size = recorder->width * 4 * recorder->height;
+	recorder->frame = zalloc(size);
+	/* An RLE word never covers less than one pixel. */
+	recorder->outbuf = malloc(size);
+	if ((recorder->frame == NULL) || (recorder->outbuf == NULL)) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		recorder->queue[i].pixels = malloc(size);
+		if (recorder->queue[i].pixels == NULL) {
 			weston_log("%s: out of memory\n", __func__);
 			goto err_recorder;
 		}
@@ -435,28 +865,65 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		goto err_recorder;
 	}
 
-	header.width = output->current_mode->width;
-	header.height = output->current_mode->height;
+	header.width = recorder->width;
+	header.height = recorder->height;
 	recorder->total += write(recorder->fd, &header, sizeof header);
 
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+
+	if (thread_create_masked(&recorder->thread, recorder_thread,
+				 recorder, 0) != 0) {
+		weston_log("failed to create recorder thread\n");
+		pthread_cond_destroy(&recorder->cond);
+		pthread_mutex_destroy(&recorder->mutex);
+		goto err_recorder;
+	}
+
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
-	output->disable_planes++;
+	weston_output_capture_begin(output);
 	weston_output_damage(output);
 
 	return recorder;
 
 err_recorder:
+	if (recorder->fd >= 0)
+		close(recorder->fd);
 	weston_recorder_free(recorder);
 	return NULL;
 }
 
+/* Stops capturing; the recorder goes away once the frames still being
+ * read back are queued. */
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
+	weston_output_capture_end(recorder->output);
+
+	recorder->detached = true;
+	if (recorder->reading == 0)
+		weston_recorder_finish(recorder);
+}
+
+static void
+weston_recorder_finish(struct weston_recorder *recorder)
+{
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->quit = true;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	pthread_join(recorder->thread, NULL);
+
+	weston_log("recorder stopped, total file size %dM, %d frames, "
+		   "%d coalesced into later ones\n",
+		   recorder->total / (1024 * 1024), recorder->count,
+		   recorder->coalesced);
+
+	pthread_cond_destroy(&recorder->cond);
+	pthread_mutex_destroy(&recorder->mutex);
 	close(recorder->fd);
-	recorder->output->disable_planes--;
 	weston_recorder_free(recorder);
 }
 
@@ -481,8 +948,7 @@ weston_recorder_start(struct weston_output *output, const char *filename)
 WL_EXPORT void
 weston_recorder_stop(struct weston_recorder *recorder)
 {
-	weston_log("stopping recorder, total file size %dM, %d frames\n",
-		   recorder->total / (1024 * 1024), recorder->count);
+	weston_log("stopping recorder\n");
 
 	recorder->destroying = 1;
 	weston_output_schedule_repaint(recorder->output);
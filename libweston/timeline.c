@@ -27,30 +27,129 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "timeline.h"
 #include "compositor.h"
 #include "file-util.h"
+#include "shared/helpers.h"
+#include "shared/string-helpers.h"
+#include "shared/timeline-ring.h"
+
+#define TIMELINE_RING_DEFAULT_MB 16
+#define TIMELINE_RING_MAX_MB 1024
+#define TIMELINE_RING_MAX_NAMES 64
+
+struct timeline_ring_name {
+	const char *name;
+	uint32_t id;
+	unsigned series;
+};
+
+struct timeline_ring {
+	struct weston_timeline_ring_header *header;
+	struct weston_timeline_record *records;
+	size_t map_size;
+	struct timeline_ring_name names[TIMELINE_RING_MAX_NAMES];
+	int n_names;
+};
 
 struct timeline_log {
 	clock_t clk_id;
 	FILE *file;
+	struct timeline_ring *ring;
 	unsigned series;
 	struct wl_listener compositor_destroy_listener;
 };
 
 WL_EXPORT int weston_timeline_enabled_;
-static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, 0 };
+static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, NULL, 0 };
+
+/* WESTON_TIMELINE_BINARY selects the binary ring sink; its value is the
+ * ring size in MiB, at most 1 GiB. Returns 0 for the JSON sink. */
+static size_t
+timeline_ring_size_from_env(void)
+{
+	const char *env = getenv("WESTON_TIMELINE_BINARY");
+	int32_t mb;
+
+	if (!env)
+		return 0;
+
+	if (!safe_strtoint(env, &mb) || mb <= 0)
+		mb = TIMELINE_RING_DEFAULT_MB;
+	else if (mb > TIMELINE_RING_MAX_MB)
+		mb = TIMELINE_RING_MAX_MB;
+
+	return (size_t)mb << 20;
+}
+
+static int
+timeline_ring_open(FILE *file, size_t size)
+{
+	struct timeline_ring *ring;
+	uint64_t capacity;
+	void *map;
+
+	capacity = (size - sizeof(*ring->header)) /
+		   sizeof(struct weston_timeline_record);
+	size = sizeof(*ring->header) +
+	       capacity * sizeof(struct weston_timeline_record);
+
+	if (ftruncate(fileno(file), size) < 0)
+		return -1;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fileno(file), 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	ring = zalloc(sizeof *ring);
+	if (!ring) {
+		munmap(map, size);
+		return -1;
+	}
+
+	ring->header = map;
+	ring->records = (struct weston_timeline_record *)(ring->header + 1);
+	ring->map_size = size;
+
+	memcpy(ring->header->magic, WESTON_TIMELINE_RING_MAGIC,
+	       sizeof(WESTON_TIMELINE_RING_MAGIC));
+	ring->header->version = WESTON_TIMELINE_RING_VERSION;
+	ring->header->record_size = sizeof(struct weston_timeline_record);
+	ring->header->capacity = capacity;
+	ring->header->head = 0;
+	ring->header->clock_id = timeline_.clk_id;
+
+	timeline_.ring = ring;
+
+	return 0;
+}
+
+static void
+timeline_ring_close(void)
+{
+	struct timeline_ring *ring = timeline_.ring;
+
+	msync(ring->header, ring->map_size, MS_ASYNC);
+	munmap(ring->header, ring->map_size);
+	free(ring);
+	timeline_.ring = NULL;
+}
 
 static int
 weston_timeline_do_open(void)
 {
 	const char *prefix = "weston-timeline-";
-	const char *suffix = ".log";
+	size_t ring_size = timeline_ring_size_from_env();
+	const char *suffix = ring_size ? ".bin" : ".log";
 	char fname[1000];
 
 	timeline_.file = file_create_dated(prefix, suffix,
@@ -71,6 +170,21 @@ weston_timeline_do_open(void)
 		return -1;
 	}
 
+	if (ring_size) {
+		int ret = timeline_ring_open(timeline_.file, ring_size);
+		int err = errno;
+
+		/* The mapping keeps the file alive. */
+		fclose(timeline_.file);
+		timeline_.file = NULL;
+
+		if (ret < 0) {
+			weston_log("Cannot map timeline ring '%s': %s\n",
+				   fname, strerror(err));
+			return -1;
+		}
+	}
+
 	weston_log("Opened timeline file '%s'\n", fname);
 
 	return 0;
@@ -111,8 +225,12 @@ weston_timeline_close(void)
 
 	wl_list_remove(&timeline_.compositor_destroy_listener.link);
 
-	fclose(timeline_.file);
-	timeline_.file = NULL;
+	if (timeline_.ring) {
+		timeline_ring_close();
+	} else {
+		fclose(timeline_.file);
+		timeline_.file = NULL;
+	}
 	weston_log("Timeline log file closed.\n");
 }
 
@@ -252,6 +370,200 @@ static const type_func type_dispatch[] = {
 	[TLT_GPU] = emit_gpu_timestamp,
 };
 
+/* Reserve n consecutive records and return the position of the first. */
+static uint64_t
+timeline_ring_reserve(struct timeline_ring *ring, unsigned n)
+{
+	uint64_t capacity = ring->header->capacity;
+	uint64_t head;
+
+	head = __atomic_fetch_add(&ring->header->head, n, __ATOMIC_RELAXED);
+
+	/* Wrapping starts overwriting the oldest definitions, so begin a
+	 * new series to have every object described again on next use. */
+	if (head / capacity != (head + n) / capacity) {
+		if (++timeline_.series == 0)
+			++timeline_.series;
+	}
+
+	return head;
+}
+
+static void
+timeline_ring_publish(struct timeline_ring *ring, uint64_t pos,
+		      const struct weston_timeline_record *rec)
+{
+	struct weston_timeline_record *slot =
+		&ring->records[pos % ring->header->capacity];
+
+	slot->type = WESTON_TIMELINE_RECORD_INVALID;
+	memcpy((char *)slot + sizeof(slot->type),
+	       (const char *)rec + sizeof(rec->type),
+	       sizeof(*rec) - sizeof(rec->type));
+	__atomic_store_n(&slot->type, rec->type, __ATOMIC_RELEASE);
+}
+
+static void
+timeline_ring_emit_def(struct timeline_ring *ring, uint16_t type,
+		       uint32_t id, uint32_t main_surface, const char *text)
+{
+	struct weston_timeline_record rec;
+	size_t len = text ? strlen(text) : 0;
+	size_t done, chunk;
+	unsigned n = 1;
+	uint64_t pos;
+
+	if (len > WESTON_TIMELINE_DEF_INLINE_TEXT)
+		n += (len - WESTON_TIMELINE_DEF_INLINE_TEXT +
+		      WESTON_TIMELINE_TEXT_CHUNK - 1) /
+		     WESTON_TIMELINE_TEXT_CHUNK;
+	pos = timeline_ring_reserve(ring, n);
+
+	memset(&rec, 0, sizeof rec);
+	rec.type = type;
+	rec.flags = text ? 0 : WESTON_TIMELINE_DEF_NULL_TEXT;
+	rec.id = id;
+	rec.u.def.main_surface = main_surface;
+	rec.u.def.len = len;
+	chunk = MIN(len, WESTON_TIMELINE_DEF_INLINE_TEXT);
+	if (chunk)
+		memcpy(rec.u.def.text, text, chunk);
+	timeline_ring_publish(ring, pos++, &rec);
+
+	for (done = chunk; done < len; done += chunk) {
+		memset(&rec, 0, sizeof rec);
+		rec.type = WESTON_TIMELINE_RECORD_TEXT;
+		rec.id = id;
+		chunk = MIN(len - done, WESTON_TIMELINE_TEXT_CHUNK);
+		memcpy(rec.u.text, text + done, chunk);
+		timeline_ring_publish(ring, pos++, &rec);
+	}
+}
+
+/* Point names are string literals, so the pointer usually matches. */
+static uint32_t
+timeline_ring_name_id(struct timeline_ring *ring, const char *name)
+{
+	struct timeline_ring_name *n = NULL;
+	int i;
+
+	for (i = 0; i < ring->n_names; i++) {
+		if (ring->names[i].name == name ||
+		    strcmp(ring->names[i].name, name) == 0) {
+			n = &ring->names[i];
+			break;
+		}
+	}
+
+	if (!n) {
+		if (ring->n_names == TIMELINE_RING_MAX_NAMES)
+			return 0;
+
+		n = &ring->names[ring->n_names++];
+		n->name = name;
+		n->series = 0;
+	}
+
+	if (n->series != timeline_.series) {
+		n->series = timeline_.series;
+		n->id = timeline_new_id();
+		timeline_ring_emit_def(ring, WESTON_TIMELINE_RECORD_NAME,
+				       n->id, 0, name);
+	}
+
+	return n->id;
+}
+
+static uint32_t
+timeline_ring_output_id(struct timeline_ring *ring, struct weston_output *o)
+{
+	struct timeline_emit_context ctx = { .series = timeline_.series };
+
+	if (check_series(&ctx, &o->timeline))
+		timeline_ring_emit_def(ring, WESTON_TIMELINE_RECORD_OUTPUT,
+				       o->timeline.id, 0, o->name);
+
+	return o->timeline.id;
+}
+
+static uint32_t
+timeline_ring_surface_id(struct timeline_ring *ring,
+			 struct weston_surface *s)
+{
+	struct timeline_emit_context ctx = { .series = timeline_.series };
+	struct weston_surface *mains;
+	uint32_t main_id = 0;
+	char d[512];
+
+	if (!check_series(&ctx, &s->timeline))
+		return s->timeline.id;
+
+	mains = weston_surface_get_main_surface(s);
+	if (mains != s)
+		main_id = timeline_ring_surface_id(ring, mains);
+
+	if (!s->get_label || s->get_label(s, d, sizeof(d)) < 0)
+		d[0] = '\0';
+
+	timeline_ring_emit_def(ring, WESTON_TIMELINE_RECORD_SURFACE,
+			       s->timeline.id, main_id, d[0] ? d : NULL);
+
+	return s->timeline.id;
+}
+
+/* No allocation, formatting or syscalls once all objects are described;
+ * a point is a single 64 byte store into the mapping. */
+static void
+timeline_ring_point(const char *name, const struct timespec *ts,
+		    va_list argp)
+{
+	struct timeline_ring *ring = timeline_.ring;
+	struct weston_timeline_record rec;
+	const struct timespec *t;
+	enum timeline_type otype;
+	void *obj;
+
+	memset(&rec, 0, sizeof rec);
+	rec.type = WESTON_TIMELINE_RECORD_POINT;
+	rec.id = timeline_ring_name_id(ring, name);
+	rec.u.point.sec = ts->tv_sec;
+	rec.u.point.nsec = ts->tv_nsec;
+
+	while (1) {
+		otype = va_arg(argp, enum timeline_type);
+		if (otype == TLT_END)
+			break;
+
+		obj = va_arg(argp, void *);
+		switch (otype) {
+		case TLT_OUTPUT:
+			rec.flags |= WESTON_TIMELINE_POINT_OUTPUT;
+			rec.u.point.output = timeline_ring_output_id(ring, obj);
+			break;
+		case TLT_SURFACE:
+			rec.flags |= WESTON_TIMELINE_POINT_SURFACE;
+			rec.u.point.surface = timeline_ring_surface_id(ring, obj);
+			break;
+		case TLT_VBLANK:
+			t = obj;
+			rec.flags |= WESTON_TIMELINE_POINT_VBLANK;
+			rec.u.point.vblank_sec = t->tv_sec;
+			rec.u.point.vblank_nsec = t->tv_nsec;
+			break;
+		case TLT_GPU:
+			t = obj;
+			rec.flags |= WESTON_TIMELINE_POINT_GPU;
+			rec.u.point.gpu_sec = t->tv_sec;
+			rec.u.point.gpu_nsec = t->tv_nsec;
+			break;
+		default:
+			break;
+		}
+	}
+
+	timeline_ring_publish(ring, timeline_ring_reserve(ring, 1), &rec);
+}
+
 WL_EXPORT void
 weston_timeline_point(const char *name, ...)
 {
@@ -264,6 +576,13 @@ weston_timeline_point(const char *name, ...)
 
 	clock_gettime(timeline_.clk_id, &ts);
 
+	if (timeline_.ring) {
+		va_start(argp, name);
+		timeline_ring_point(name, &ts, argp);
+		va_end(argp);
+		return;
+	}
+
 	ctx.out = timeline_.file;
 	ctx.cur = fmemopen(buf, sizeof(buf), "w");
 	ctx.series = timeline_.series;
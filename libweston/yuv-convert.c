@@ -0,0 +1,390 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "shared/helpers.h"
+#include "yuv-convert.h"
+
+/* BT.601 limited range YUV to RGB, with the coefficients of the GL
+ * renderer's shaders. Coefficients are scaled by 8192 and applied to
+ * inputs scaled by 64, leaving 3 fractional bits: this is what the SIMD
+ * paths compute with 16-bit multiplies, so all paths agree exactly.
+ */
+#define YUV_COEF_Y	9539	/* 1.16438356 */
+#define YUV_COEF_RV	13075	/* 1.59602678 */
+#define YUV_COEF_GU	3209	/* 0.39176229 */
+#define YUV_COEF_GV	6660	/* 0.81296764 */
+#define YUV_COEF_BU	16525	/* 2.01723214 */
+
+static inline int32_t
+yuv_mul(int32_t value, int32_t coef)
+{
+	return (value * 64 * coef) >> 16;
+}
+
+static inline uint32_t
+yuv_clamp(int32_t value)
+{
+	value = (value + 4) >> 3;
+
+	return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static inline uint32_t
+yuv_to_xrgb(int32_t y, int32_t u, int32_t v)
+{
+	int32_t yy = yuv_mul(y - 16, YUV_COEF_Y);
+
+	u -= 128;
+	v -= 128;
+
+	return 0xff000000 |
+	       yuv_clamp(yy + yuv_mul(v, YUV_COEF_RV)) << 16 |
+	       yuv_clamp(yy - yuv_mul(u, YUV_COEF_GU) -
+			 yuv_mul(v, YUV_COEF_GV)) << 8 |
+	       yuv_clamp(yy + yuv_mul(u, YUV_COEF_BU));
+}
+
+/* The vector loops below convert 8 pixels at a time starting at an even
+ * x and return where they stopped; the caller finishes the row with
+ * yuv_to_xrgb(). Chroma is duplicated for both pixels of a pair. */
+#if defined(__SSE2__)
+static inline void
+yuv8_store_xrgb(uint32_t *dst, __m128i y, __m128i u, __m128i v)
+{
+	const __m128i round = _mm_set1_epi16(4);
+	__m128i yy, r, g, b, bg, rx;
+
+	y = _mm_slli_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)), 6);
+	u = _mm_slli_epi16(_mm_sub_epi16(u, _mm_set1_epi16(128)), 6);
+	v = _mm_slli_epi16(_mm_sub_epi16(v, _mm_set1_epi16(128)), 6);
+
+	yy = _mm_mulhi_epi16(y, _mm_set1_epi16(YUV_COEF_Y));
+	r = _mm_add_epi16(yy, _mm_mulhi_epi16(v, _mm_set1_epi16(YUV_COEF_RV)));
+	g = _mm_sub_epi16(yy, _mm_mulhi_epi16(u, _mm_set1_epi16(YUV_COEF_GU)));
+	g = _mm_sub_epi16(g, _mm_mulhi_epi16(v, _mm_set1_epi16(YUV_COEF_GV)));
+	b = _mm_add_epi16(yy, _mm_mulhi_epi16(u, _mm_set1_epi16(YUV_COEF_BU)));
+
+	r = _mm_srai_epi16(_mm_add_epi16(r, round), 3);
+	g = _mm_srai_epi16(_mm_add_epi16(g, round), 3);
+	b = _mm_srai_epi16(_mm_add_epi16(b, round), 3);
+	r = _mm_packus_epi16(r, r);
+	g = _mm_packus_epi16(g, g);
+	b = _mm_packus_epi16(b, b);
+
+	bg = _mm_unpacklo_epi8(b, g);
+	rx = _mm_unpacklo_epi8(r, _mm_set1_epi8(-1));
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(bg, rx));
+	_mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(bg, rx));
+}
+
+/* Splits 16-bit u0 v0 u1 v1 u2 v2 u3 v3 into per-pixel u and v. */
+static inline void
+yuv8_split_chroma(__m128i c, __m128i *u, __m128i *v)
+{
+	*u = _mm_and_si128(c, _mm_set1_epi32(0xffff));
+	*u = _mm_or_si128(*u, _mm_slli_epi32(*u, 16));
+	*v = _mm_srli_epi32(c, 16);
+	*v = _mm_or_si128(*v, _mm_slli_epi32(*v, 16));
+}
+
+static int
+yuv_row_planar_simd(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+		    const uint8_t *v, int x, int x2)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i cu, cv;
+	uint32_t c;
+
+	for (; x + 8 <= x2; x += 8) {
+		memcpy(&c, u + x / 2, sizeof c);
+		cu = _mm_unpacklo_epi8(_mm_cvtsi32_si128(c), zero);
+		memcpy(&c, v + x / 2, sizeof c);
+		cv = _mm_unpacklo_epi8(_mm_cvtsi32_si128(c), zero);
+
+		yuv8_store_xrgb(dst + x,
+				_mm_unpacklo_epi8(_mm_loadl_epi64(
+					(const __m128i *)(y + x)), zero),
+				_mm_unpacklo_epi16(cu, cu),
+				_mm_unpacklo_epi16(cv, cv));
+	}
+
+	return x;
+}
+
+static int
+yuv_row_nv12_simd(uint32_t *dst, const uint8_t *y, const uint8_t *uv,
+		  int x, int x2)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i cu, cv;
+
+	for (; x + 8 <= x2; x += 8) {
+		yuv8_split_chroma(_mm_unpacklo_epi8(_mm_loadl_epi64(
+					(const __m128i *)(uv + x)), zero),
+				  &cu, &cv);
+		yuv8_store_xrgb(dst + x,
+				_mm_unpacklo_epi8(_mm_loadl_epi64(
+					(const __m128i *)(y + x)), zero),
+				cu, cv);
+	}
+
+	return x;
+}
+
+static int
+yuv_row_yuyv_simd(uint32_t *dst, const uint8_t *yuyv, int x, int x2)
+{
+	__m128i p, cu, cv;
+
+	for (; x + 8 <= x2; x += 8) {
+		p = _mm_loadu_si128((const __m128i *)(yuyv + 2 * x));
+		yuv8_split_chroma(_mm_srli_epi16(p, 8), &cu, &cv);
+		yuv8_store_xrgb(dst + x,
+				_mm_and_si128(p, _mm_set1_epi16(0xff)),
+				cu, cv);
+	}
+
+	return x;
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static inline void
+yuv8_store_xrgb(uint32_t *dst, uint8x8_t y, uint8x8_t u, uint8x8_t v)
+{
+	int16x8_t sy, su, sv, yy, r, g, b;
+	uint8x8x4_t px;
+
+	/* vqdmulh doubles the product, so scale the inputs by 32 */
+	sy = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y)),
+				   vdupq_n_s16(16)), 5);
+	su = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u)),
+				   vdupq_n_s16(128)), 5);
+	sv = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v)),
+				   vdupq_n_s16(128)), 5);
+
+	yy = vqdmulhq_s16(sy, vdupq_n_s16(YUV_COEF_Y));
+	r = vaddq_s16(yy, vqdmulhq_s16(sv, vdupq_n_s16(YUV_COEF_RV)));
+	g = vsubq_s16(yy, vqdmulhq_s16(su, vdupq_n_s16(YUV_COEF_GU)));
+	g = vsubq_s16(g, vqdmulhq_s16(sv, vdupq_n_s16(YUV_COEF_GV)));
+	b = vaddq_s16(yy, vqdmulhq_s16(su, vdupq_n_s16(YUV_COEF_BU)));
+
+	px.val[0] = vqmovun_s16(vrshrq_n_s16(b, 3));
+	px.val[1] = vqmovun_s16(vrshrq_n_s16(g, 3));
+	px.val[2] = vqmovun_s16(vrshrq_n_s16(r, 3));
+	px.val[3] = vdup_n_u8(0xff);
+	vst4_u8((uint8_t *)dst, px);
+}
+
+static int
+yuv_row_planar_simd(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+		    const uint8_t *v, int x, int x2)
+{
+	uint8x8_t cu, cv;
+	uint32_t c;
+
+	for (; x + 8 <= x2; x += 8) {
+		memcpy(&c, u + x / 2, sizeof c);
+		cu = vreinterpret_u8_u32(vdup_n_u32(c));
+		memcpy(&c, v + x / 2, sizeof c);
+		cv = vreinterpret_u8_u32(vdup_n_u32(c));
+
+		yuv8_store_xrgb(dst + x, vld1_u8(y + x),
+				vzip1_u8(cu, cu), vzip1_u8(cv, cv));
+	}
+
+	return x;
+}
+
+static int
+yuv_row_nv12_simd(uint32_t *dst, const uint8_t *y, const uint8_t *uv,
+		  int x, int x2)
+{
+	uint8x8_t c, cu, cv;
+
+	for (; x + 8 <= x2; x += 8) {
+		c = vld1_u8(uv + x);
+		cu = vuzp1_u8(c, c);
+		cv = vuzp2_u8(c, c);
+
+		yuv8_store_xrgb(dst + x, vld1_u8(y + x),
+				vzip1_u8(cu, cu), vzip1_u8(cv, cv));
+	}
+
+	return x;
+}
+
+static int
+yuv_row_yuyv_simd(uint32_t *dst, const uint8_t *yuyv, int x, int x2)
+{
+	uint8x8x2_t p;
+	uint8x8_t cu, cv;
+
+	for (; x + 8 <= x2; x += 8) {
+		p = vld2_u8(yuyv + 2 * x);
+		cu = vuzp1_u8(p.val[1], p.val[1]);
+		cv = vuzp2_u8(p.val[1], p.val[1]);
+
+		yuv8_store_xrgb(dst + x, p.val[0],
+				vzip1_u8(cu, cu), vzip1_u8(cv, cv));
+	}
+
+	return x;
+}
+#else
+static int
+yuv_row_planar_simd(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+		    const uint8_t *v, int x, int x2)
+{
+	return x;
+}
+
+static int
+yuv_row_nv12_simd(uint32_t *dst, const uint8_t *y, const uint8_t *uv,
+		  int x, int x2)
+{
+	return x;
+}
+
+static int
+yuv_row_yuyv_simd(uint32_t *dst, const uint8_t *yuyv, int x, int x2)
+{
+	return x;
+}
+#endif
+
+/* Returns how many bytes yuv_convert() may read from a buffer of the
+ * given layout and size, or 0 if the stride cannot hold a row of the
+ * given width. */
+size_t
+yuv_buffer_size(enum yuv_layout layout, int32_t width, int32_t height,
+		int32_t stride)
+{
+	uint64_t luma, chroma_rows, size;
+
+	if (width <= 0 || height <= 0 || stride <= 0)
+		return 0;
+
+	/* Odd sizes still share chroma by pairs, see yuv_convert(). */
+	luma = (uint64_t)stride * height;
+	chroma_rows = MAX(height / 2, 1);
+
+	switch (layout) {
+	case YUV_LAYOUT_YUV420:
+		if ((int64_t)stride / 2 < ((int64_t)width + 1) / 2)
+			return 0;
+		size = luma + (uint64_t)(stride / 2) * (height / 2) +
+		       (uint64_t)(stride / 2) * chroma_rows;
+		break;
+	case YUV_LAYOUT_NV12:
+		if ((int64_t)stride < (((int64_t)width + 1) & ~1))
+			return 0;
+		size = luma + (uint64_t)stride * chroma_rows;
+		break;
+	case YUV_LAYOUT_YUYV:
+		if ((int64_t)stride < 4 * (((int64_t)width + 1) / 2))
+			return 0;
+		size = luma;
+		break;
+	default:
+		return 0;
+	}
+
+	if (size > SIZE_MAX)
+		return 0;
+
+	return size;
+}
+
+/* Converts a box of a YUV buffer, in buffer coordinates, into the same
+ * box of an x8r8g8b8 destination of dst_stride pixels per row. The box is
+ * clipped to the buffer and widened to whole chroma pairs. Without simd,
+ * only the C path is used, which gives the same results. */
+void
+yuv_convert(const struct yuv_buffer *src, uint32_t *pixels, int dst_stride,
+	    int x1, int y1, int x2, int y2, bool simd)
+{
+	size_t stride = src->stride;
+	const uint8_t *u_plane, *v_plane, *row, *u, *v;
+	uint32_t *dst;
+	int x, y, cy, max_cy;
+
+	/* Chroma is shared by pixel pairs, so convert whole pairs. */
+	x1 = MAX(x1, 0) & ~1;
+	x2 = MIN((MIN(x2, src->width) + 1) & ~1, src->width);
+	y1 = MAX(y1, 0);
+	y2 = MIN(y2, src->height);
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	max_cy = MAX(src->height / 2, 1) - 1;
+	u_plane = src->data + stride * src->height;
+	v_plane = u_plane + (stride / 2) * (src->height / 2);
+
+	for (y = y1; y < y2; y++) {
+		dst = pixels + (size_t)y * dst_stride;
+		row = src->data + (size_t)y * stride;
+		cy = MIN(y / 2, max_cy);
+		x = x1;
+
+		switch (src->layout) {
+		case YUV_LAYOUT_YUV420:
+			u = u_plane + cy * (stride / 2);
+			v = v_plane + cy * (stride / 2);
+			if (simd)
+				x = yuv_row_planar_simd(dst, row, u, v, x, x2);
+			for (; x < x2; x++)
+				dst[x] = yuv_to_xrgb(row[x], u[x / 2], v[x / 2]);
+			break;
+		case YUV_LAYOUT_NV12:
+			u = u_plane + cy * stride;
+			if (simd)
+				x = yuv_row_nv12_simd(dst, row, u, x, x2);
+			for (; x < x2; x++)
+				dst[x] = yuv_to_xrgb(row[x], u[x & ~1],
+						     u[x | 1]);
+			break;
+		case YUV_LAYOUT_YUYV:
+			if (simd)
+				x = yuv_row_yuyv_simd(dst, row, x, x2);
+			for (; x < x2; x++)
+				dst[x] = yuv_to_xrgb(row[2 * x],
+						     row[4 * (x / 2) + 1],
+						     row[4 * (x / 2) + 3]);
+			break;
+		default:
+			return;
+		}
+	}
+}
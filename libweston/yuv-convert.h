@@ -0,0 +1,57 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_YUV_CONVERT_H
+#define WESTON_YUV_CONVERT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Plane layouts of the YUV shm formats, the way gl_renderer_attach_shm()
+ * reads them. Chroma is subsampled by pixel pairs in all of them. */
+enum yuv_layout {
+	YUV_LAYOUT_YUV420,	/* Y plane, then U and V planes at half stride */
+	YUV_LAYOUT_NV12,	/* Y plane, then one interleaved UV plane */
+	YUV_LAYOUT_YUYV,	/* packed Y0 U Y1 V */
+};
+
+struct yuv_buffer {
+	enum yuv_layout layout;
+	const uint8_t *data;
+	int32_t width;
+	int32_t height;
+	int32_t stride;		/* of the Y plane, in bytes */
+};
+
+size_t
+yuv_buffer_size(enum yuv_layout layout, int32_t width, int32_t height,
+		int32_t stride);
+
+void
+yuv_convert(const struct yuv_buffer *src, uint32_t *pixels, int dst_stride,
+	    int x1, int y1, int x2, int y2, bool simd);
+
+#endif /* WESTON_YUV_CONVERT_H */
@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_THREAD_UTIL_H
+#define WESTON_THREAD_UTIL_H
+
+#include <pthread.h>
+#include <signal.h>
+
+/* Create a thread with signals blocked
+ *
+ * Signals are for the compositor thread to handle, so the new thread
+ * starts with every signal blocked except keep_signal, which is 0 if all
+ * are to be blocked. The signal mask of the calling thread is unchanged.
+ *
+ * \return 0 on success, an error number as pthread_create() otherwise
+ */
+static inline int
+thread_create_masked(pthread_t *thread, void *(*func)(void *), void *data,
+		     int keep_signal)
+{
+	sigset_t set, old_set;
+	int ret;
+
+	sigfillset(&set);
+	if (keep_signal)
+		sigdelset(&set, keep_signal);
+
+	pthread_sigmask(SIG_BLOCK, &set, &old_set);
+	ret = pthread_create(thread, NULL, func, data);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+	return ret;
+}
+
+#endif /* WESTON_THREAD_UTIL_H */
@@ -0,0 +1,107 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_RING_H
+#define WESTON_TIMELINE_RING_H
+
+#include <stdint.h>
+
+/* On-disk layout of the binary timeline log.
+ *
+ * The file is a header followed by a ring of fixed-size records. The
+ * compositor maps it and writes records in place; "head" counts all
+ * records ever written, so the valid records are the last
+ * min(head, capacity) ones, and record n lives in slot n % capacity.
+ *
+ * Objects and point names are described by definition records the first
+ * time they are referenced, and again after the ring wraps, so a reader
+ * starting at the oldest surviving record only loses the points that
+ * refer to definitions that were overwritten.
+ */
+
+#define WESTON_TIMELINE_RING_MAGIC "WTLRING"
+#define WESTON_TIMELINE_RING_VERSION 1
+
+struct weston_timeline_ring_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;
+	uint64_t head;
+	uint32_t clock_id;
+	uint32_t reserved[7];
+};
+
+enum weston_timeline_record_type {
+	WESTON_TIMELINE_RECORD_INVALID = 0,
+	WESTON_TIMELINE_RECORD_POINT,
+	WESTON_TIMELINE_RECORD_NAME,
+	WESTON_TIMELINE_RECORD_OUTPUT,
+	WESTON_TIMELINE_RECORD_SURFACE,
+	/* continues the text of the preceding definition record */
+	WESTON_TIMELINE_RECORD_TEXT,
+};
+
+/* weston_timeline_record::flags for points */
+#define WESTON_TIMELINE_POINT_OUTPUT	(1 << 0)
+#define WESTON_TIMELINE_POINT_SURFACE	(1 << 1)
+#define WESTON_TIMELINE_POINT_VBLANK	(1 << 2)
+#define WESTON_TIMELINE_POINT_GPU	(1 << 3)
+
+/* weston_timeline_record::flags for definitions */
+#define WESTON_TIMELINE_DEF_NULL_TEXT	(1 << 0)
+
+#define WESTON_TIMELINE_DEF_INLINE_TEXT 48
+#define WESTON_TIMELINE_TEXT_CHUNK 56
+
+/* 64 bytes. "type" is stored last, so a record with a valid type is
+ * complete. "id" is the point name id for points and the object or name
+ * id for definitions. */
+struct weston_timeline_record {
+	uint16_t type;
+	uint16_t flags;
+	uint32_t id;
+	union {
+		struct {
+			int64_t sec;
+			uint32_t nsec;
+			uint32_t output;
+			uint32_t surface;
+			uint32_t vblank_nsec;
+			int64_t vblank_sec;
+			int64_t gpu_sec;
+			uint32_t gpu_nsec;
+			uint32_t reserved[3];
+		} point;
+		struct {
+			uint32_t main_surface;
+			uint32_t len;
+			char text[WESTON_TIMELINE_DEF_INLINE_TEXT];
+		} def;
+		char text[WESTON_TIMELINE_TEXT_CHUNK];
+	} u;
+};
+
+#endif /* WESTON_TIMELINE_RING_H */
@@ -235,3 +235,47 @@ TEST(test_presentation_feedback_simple)
 
 	feedback_destroy(fb);
 }
+
+static struct feedback *
+commit_with_feedback(struct client *client)
+{
+	struct feedback *fb;
+
+	wl_surface_attach(client->surface->wl_surface,
+			  client->surface->buffer->proxy, 0, 0);
+	fb = feedback_create(client, client->surface->wl_surface);
+	wl_surface_damage(client->surface->wl_surface, 0, 0, 100, 100);
+	wl_surface_commit(client->surface->wl_surface);
+
+	client_roundtrip(client);
+
+	feedback_wait(fb);
+
+	return fb;
+}
+
+TEST(test_presentation_feedback_monotonic)
+{
+	struct client *client;
+	struct feedback *first, *second;
+
+	client = create_client_and_test_surface(100, 50, 123, 77);
+	assert(client);
+
+	first = commit_with_feedback(client);
+	second = commit_with_feedback(client);
+
+	printf("%s feedback:", __func__);
+	feedback_print(first);
+	printf(", ");
+	feedback_print(second);
+	printf("\n");
+
+	assert(first->result == FB_PRESENTED);
+	assert(second->result == FB_PRESENTED);
+	assert(second->seq > first->seq);
+	assert(timespec_sub_to_nsec(&second->time, &first->time) > 0);
+
+	feedback_destroy(first);
+	feedback_destroy(second);
+}
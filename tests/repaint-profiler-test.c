@@ -0,0 +1,170 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "weston-test-client-helper.h"
+#include "weston-repaint-profiler-client-protocol.h"
+
+/* The profiler global is only advertised with --debug. */
+char *server_parameters = "--debug";
+
+struct stats {
+	uint32_t samples;
+	int done;
+};
+
+static void
+stats_handle_phase(void *data, struct weston_repaint_stats *stats,
+		   uint32_t phase, uint32_t samples,
+		   uint32_t wall_p50, uint32_t wall_p99, uint32_t wall_max,
+		   uint32_t cpu_p50, uint32_t cpu_p99, uint32_t cpu_max)
+{
+	struct stats *s = data;
+
+	assert(phase <= WESTON_REPAINT_PROFILER_PHASE_TOTAL);
+	assert(samples > 0);
+	assert(wall_p50 <= wall_p99 && wall_p99 <= wall_max);
+	assert(cpu_p50 <= cpu_p99 && cpu_p99 <= cpu_max);
+
+	if (phase == WESTON_REPAINT_PROFILER_PHASE_TOTAL)
+		s->samples = samples;
+}
+
+static void
+stats_handle_done(void *data, struct weston_repaint_stats *stats)
+{
+	struct stats *s = data;
+
+	s->done = 1;
+}
+
+static const struct weston_repaint_stats_listener stats_listener = {
+	stats_handle_phase,
+	stats_handle_done,
+};
+
+static struct weston_repaint_profiler *
+get_profiler(struct client *client)
+{
+	struct global *g;
+	struct global *global_profiler = NULL;
+	struct weston_repaint_profiler *profiler;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface,
+			   weston_repaint_profiler_interface.name))
+			continue;
+
+		assert(!global_profiler && "multiple profiler objects");
+		global_profiler = g;
+	}
+
+	assert(global_profiler && "no profiler found");
+	assert(global_profiler->version == 1);
+
+	profiler = wl_registry_bind(client->wl_registry,
+				    global_profiler->name,
+				    &weston_repaint_profiler_interface, 1);
+	assert(profiler);
+
+	return profiler;
+}
+
+/* Returns the number of whole repaints recorded for the client's output. */
+static uint32_t
+get_total_samples(struct client *client,
+		  struct weston_repaint_profiler *profiler)
+{
+	struct weston_repaint_stats *stats;
+	struct stats s = { 0, 0 };
+
+	stats = weston_repaint_profiler_get_stats(profiler,
+						  client->output->wl_output);
+	weston_repaint_stats_add_listener(stats, &stats_listener, &s);
+	client_roundtrip(client);
+	assert(s.done);
+
+	/* The compositor destroyed its side after done. */
+	weston_repaint_stats_destroy(stats);
+
+	return s.samples;
+}
+
+static struct client *
+setup(struct weston_repaint_profiler **profiler)
+{
+	struct client *client;
+
+	client = create_client_and_test_surface(100, 100, 50, 50);
+	assert(client);
+
+	*profiler = get_profiler(client);
+	weston_repaint_profiler_reset(*profiler, client->output->wl_output);
+	client_roundtrip(client);
+
+	return client;
+}
+
+TEST(binding_does_not_record)
+{
+	struct weston_repaint_profiler *profiler;
+	struct client *client = setup(&profiler);
+
+	move_client(client, 110, 110);
+	move_client(client, 120, 120);
+	assert(get_total_samples(client, profiler) == 0);
+
+	weston_repaint_profiler_destroy(profiler);
+}
+
+TEST(start_and_stop_recording)
+{
+	struct weston_repaint_profiler *profiler;
+	struct client *client = setup(&profiler);
+	uint32_t samples;
+
+	weston_repaint_profiler_start(profiler);
+	move_client(client, 110, 110);
+	move_client(client, 120, 120);
+	samples = get_total_samples(client, profiler);
+	assert(samples >= 2);
+
+	weston_repaint_profiler_stop(profiler);
+	client_roundtrip(client);
+	samples = get_total_samples(client, profiler);
+	move_client(client, 130, 130);
+	move_client(client, 140, 140);
+	assert(get_total_samples(client, profiler) == samples);
+
+	weston_repaint_profiler_reset(profiler, client->output->wl_output);
+	assert(get_total_samples(client, profiler) == 0);
+
+	weston_repaint_profiler_destroy(profiler);
+}
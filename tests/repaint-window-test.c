@@ -0,0 +1,170 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#include "compositor.h"
+#include "compositor/weston.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* Runs with adaptive-repaint-window enabled on the headless backend's
+ * 30 Hz vblank clock, see repaint-window-test.ini. The output is kept
+ * repainting, first at its natural cost and then with SLOW_COST_NSEC
+ * added to every repaint. Only how the window moves is checked, not how
+ * long repaints take on this machine: it starts at the static
+ * repaint-window, and after the slow frames it has grown past the window
+ * of the fast ones, to at least the added cost. The sleep only makes
+ * that a lower bound for the cost, so a loaded machine cannot fail it. */
+
+#define PHASE_FRAMES 32
+#define SLOW_COST_NSEC 15000000
+
+struct repaint_window_test {
+	struct weston_compositor *compositor;
+	struct weston_output *output;
+	int (*repaint)(struct weston_output *output,
+		       pixman_region32_t *damage, void *repaint_data);
+	struct weston_animation animation;
+	int frame;
+	int64_t cost_nsec;
+	int64_t fast_window_nsec;
+};
+
+static struct repaint_window_test test;
+
+static int
+slow_output_repaint(struct weston_output *output,
+		    pixman_region32_t *damage, void *repaint_data)
+{
+	struct timespec ts;
+
+	if (test.cost_nsec > 0) {
+		timespec_from_nsec(&ts, test.cost_nsec);
+		while (nanosleep(&ts, &ts) < 0)
+			;
+	}
+
+	return test.repaint(output, damage, repaint_data);
+}
+
+/* The repaint window the frame just painted was scheduled with, from the
+ * previous weston_output_finish_frame() */
+static int64_t
+current_window_nsec(struct weston_output *output)
+{
+	struct timespec vblank;
+
+	timespec_add_nsec(&vblank, &output->frame_time,
+			  millihz_to_nsec(output->current_mode->refresh));
+
+	return timespec_sub_to_nsec(&vblank, &output->next_repaint);
+}
+
+static void
+finish_test(void)
+{
+	wl_list_remove(&test.animation.link);
+	wl_list_init(&test.animation.link);
+	test.output->repaint = test.repaint;
+
+	wl_display_terminate(test.compositor->wl_display);
+}
+
+static void
+repaint_window_frame(struct weston_animation *animation,
+		     struct weston_output *output,
+		     const struct timespec *time)
+{
+	int64_t static_nsec = (int64_t)test.compositor->repaint_msec * 1000000;
+	int64_t window;
+
+	test.frame++;
+	window = current_window_nsec(output);
+
+	/* Too few samples yet to adapt */
+	if (test.frame == 2)
+		assert(window == static_nsec);
+
+	if (test.frame == PHASE_FRAMES) {
+		fprintf(stderr, "window after fast frames: %lld ns\n",
+			(long long)window);
+		assert(window > 0);
+
+		test.fast_window_nsec = window;
+		test.cost_nsec = SLOW_COST_NSEC;
+	}
+
+	if (test.frame == 2 * PHASE_FRAMES) {
+		fprintf(stderr, "window after slow frames: %lld ns\n",
+			(long long)window);
+		assert(window > test.fast_window_nsec);
+		assert(window >= SLOW_COST_NSEC);
+
+		finish_test();
+		return;
+	}
+
+	weston_output_schedule_repaint(output);
+}
+
+static void
+repaint_window_start(void *data)
+{
+	struct weston_compositor *compositor = data;
+
+	assert(compositor->adaptive_repaint);
+	assert(!wl_list_empty(&compositor->output_list));
+
+	test.compositor = compositor;
+	test.output = container_of(compositor->output_list.next,
+				   struct weston_output, link);
+
+	test.repaint = test.output->repaint;
+	test.output->repaint = slow_output_repaint;
+
+	test.animation.frame = repaint_window_frame;
+	wl_list_insert(&test.output->animation_list, &test.animation.link);
+
+	weston_output_schedule_repaint(test.output);
+}
+
+WL_EXPORT int
+wet_module_init(struct weston_compositor *compositor,
+		int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
+	wl_event_loop_add_idle(loop, repaint_window_start, compositor);
+
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright © 2016 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "weston-test-client-helper.h"
+
+/* The GL renderer uploads shm buffers through pixel buffer objects
+ * when the surface is committed, all of it on the first commit and
+ * only the damaged rectangles after that. */
+char *server_parameters = "--use-gl --width=320 --height=240"
+	" --shell=weston-test-desktop-shell.so";
+
+#define SURFACE_X 40
+#define SURFACE_Y 30
+#define SURFACE_W 97
+#define SURFACE_H 61
+
+static const uint32_t red = 0xffff0000;
+static const uint32_t green = 0xff00ff00;
+
+static void
+fill_rect(struct buffer *buf, int x, int y, int w, int h, uint32_t color)
+{
+	uint32_t *pixels = pixman_image_get_data(buf->image);
+	int stride = pixman_image_get_stride(buf->image) / 4;
+	int i, j;
+
+	for (j = y; j < y + h; j++)
+		for (i = x; i < x + w; i++)
+			pixels[j * stride + i] = color;
+}
+
+/* The surface is at SURFACE_X, SURFACE_Y on an opaque output. Pixels
+ * inside the rectangle must be inside_color, the rest of the surface
+ * outside_color. */
+static bool
+check_surface_pixels(struct buffer *shot, int x, int y, int w, int h,
+		     uint32_t inside_color, uint32_t outside_color)
+{
+	uint32_t *pixels = pixman_image_get_data(shot->image);
+	int stride = pixman_image_get_stride(shot->image) / 4;
+	uint32_t pixel, expected;
+	bool inside;
+	int i, j;
+
+	for (j = 0; j < SURFACE_H; j++) {
+		for (i = 0; i < SURFACE_W; i++) {
+			inside = i >= x && i < x + w && j >= y && j < y + h;
+			expected = inside ? inside_color : outside_color;
+			pixel = pixels[(SURFACE_Y + j) * stride +
+				       SURFACE_X + i];
+			if ((pixel & 0xffffff) != (expected & 0xffffff)) {
+				fprintf(stderr, "surface pixel %d,%d is "
+					"0x%08x, expected 0x%08x\n",
+					i, j, pixel, expected);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static void
+commit_and_wait(struct client *client, struct buffer *buf,
+		int x, int y, int w, int h)
+{
+	struct wl_surface *surface = client->surface->wl_surface;
+	int frame;
+
+	wl_surface_attach(surface, buf->proxy, 0, 0);
+	wl_surface_damage(surface, x, y, w, h);
+	frame_callback_set(surface, &frame);
+	wl_surface_commit(surface);
+	frame_callback_wait(client, &frame);
+}
+
+TEST(shm_full_then_partial_upload)
+{
+	struct client *client;
+	struct buffer *buf[2];
+	struct buffer *shot;
+
+	client = create_client_and_test_surface(SURFACE_X, SURFACE_Y,
+						16, 16);
+
+	/* Everything is uploaded when the buffer size changes. */
+	buf[0] = create_shm_buffer_a8r8g8b8(client, SURFACE_W, SURFACE_H);
+	fill_rect(buf[0], 0, 0, SURFACE_W, SURFACE_H, red);
+	commit_and_wait(client, buf[0], 0, 0, SURFACE_W, SURFACE_H);
+
+	shot = capture_screenshot_of_output(client);
+	assert(check_surface_pixels(shot, 0, 0, 0, 0, green, red));
+	buffer_destroy(shot);
+
+	/* Only the damage of the second buffer goes to the texture, at
+	 * an offset that is not aligned in the buffer rows. */
+	buf[1] = create_shm_buffer_a8r8g8b8(client, SURFACE_W, SURFACE_H);
+	fill_rect(buf[1], 0, 0, SURFACE_W, SURFACE_H, red);
+	fill_rect(buf[1], 13, 7, 29, 21, green);
+	commit_and_wait(client, buf[1], 13, 7, 29, 21);
+
+	shot = capture_screenshot_of_output(client);
+	assert(check_surface_pixels(shot, 13, 7, 29, 21, green, red));
+	buffer_destroy(shot);
+
+	/* Two rectangles, one touching the right and bottom buffer
+	 * edges, the other clearing the previous one. */
+	fill_rect(buf[0], 0, 0, SURFACE_W, SURFACE_H, red);
+	fill_rect(buf[0], 60, 40, SURFACE_W - 60, SURFACE_H - 40, green);
+	wl_surface_damage(client->surface->wl_surface, 13, 7, 29, 21);
+	commit_and_wait(client, buf[0], 60, 40,
+			SURFACE_W - 60, SURFACE_H - 40);
+
+	shot = capture_screenshot_of_output(client);
+	assert(check_surface_pixels(shot, 60, 40, SURFACE_W - 60,
+				    SURFACE_H - 40, green, red));
+	buffer_destroy(shot);
+
+	buffer_destroy(buf[0]);
+	buffer_destroy(buf[1]);
+}
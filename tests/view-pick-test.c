@@ -0,0 +1,127 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include "shared/timespec-util.h"
+#include "weston-test-client-helper.h"
+
+/* Large enough for views to span many cells and fall outside the
+ * first ones; the pointer is clamped to the output. */
+char *server_parameters = "--width=1024 --height=640";
+
+/* The compositor picks views through a grid of 64 pixel cells, with
+ * views spanning more than 64 cells kept in a separate list. These
+ * tests check that pointer focus follows the view stacking through it. */
+
+static const struct timespec t0 = { .tv_sec = 0, .tv_nsec = 100000000 };
+
+/* Moves the pointer with the first client and checks that only the
+ * expected client, if any, has the pointer focus. */
+static void
+check_pick(struct client **clients, int n, struct client *expected,
+	   int x, int y)
+{
+	uint32_t tv_sec_hi, tv_sec_lo, tv_nsec;
+	int i;
+
+	timespec_to_proto(&t0, &tv_sec_hi, &tv_sec_lo, &tv_nsec);
+	weston_test_move_pointer(clients[0]->test->weston_test,
+				 tv_sec_hi, tv_sec_lo, tv_nsec, x, y);
+
+	for (i = 0; i < n; i++)
+		client_roundtrip(clients[i]);
+
+	for (i = 0; i < n; i++) {
+		if (clients[i] == expected)
+			assert(clients[i]->input->pointer->focus ==
+			       clients[i]->surface);
+		else
+			assert(clients[i]->input->pointer->focus == NULL);
+	}
+}
+
+TEST(pick_small_and_large_views)
+{
+	struct client *clients[3];
+
+	/* A large view, in the list of views spanning many cells */
+	clients[0] = create_client_and_test_surface(0, 0, 700, 500);
+	/* Views binned into cells, each stacked above the previous one */
+	clients[1] = create_client_and_test_surface(650, 450, 100, 100);
+	clients[2] = create_client_and_test_surface(900, 50, 50, 50);
+
+	check_pick(clients, 3, clients[0], 10, 10);
+	check_pick(clients, 3, clients[1], 675, 475);
+	check_pick(clients, 3, clients[0], 649, 449);
+	check_pick(clients, 3, clients[1], 740, 540);
+	check_pick(clients, 3, clients[2], 920, 70);
+	check_pick(clients, 3, NULL, 800, 300);
+}
+
+TEST(pick_after_move)
+{
+	struct client *clients[2];
+
+	clients[0] = create_client_and_test_surface(0, 0, 700, 500);
+	clients[1] = create_client_and_test_surface(800, 100, 100, 100);
+
+	check_pick(clients, 2, clients[1], 850, 150);
+	check_pick(clients, 2, clients[0], 50, 50);
+
+	/* Onto the large view, whose pixels it now hides */
+	move_client(clients[1], 20, 20);
+	check_pick(clients, 2, clients[1], 50, 50);
+	check_pick(clients, 2, NULL, 850, 150);
+	check_pick(clients, 2, clients[0], 10, 10);
+
+	/* Further than the grid reached when it was built */
+	move_client(clients[1], 950, 550);
+	check_pick(clients, 2, clients[1], 960, 560);
+	check_pick(clients, 2, clients[0], 50, 50);
+}
+
+TEST(pick_after_restack)
+{
+	struct client *clients[3];
+
+	clients[0] = create_client_and_test_surface(100, 100, 200, 200);
+	clients[1] = create_client_and_test_surface(150, 150, 200, 200);
+
+	check_pick(clients, 2, clients[1], 200, 200);
+	check_pick(clients, 2, clients[0], 120, 120);
+
+	/* A new view is stacked on top of both */
+	clients[2] = create_client_and_test_surface(110, 110, 100, 100);
+	check_pick(clients, 3, clients[2], 200, 200);
+	check_pick(clients, 3, clients[2], 120, 120);
+	check_pick(clients, 3, clients[1], 300, 300);
+
+	/* Once it is gone, the views below are picked again */
+	wl_surface_destroy(clients[2]->surface->wl_surface);
+	client_roundtrip(clients[2]);
+	check_pick(clients, 2, clients[1], 200, 200);
+	check_pick(clients, 2, clients[0], 120, 120);
+}
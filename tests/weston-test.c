@@ -320,32 +320,13 @@ struct test_screenshot {
 
 struct test_screenshot_frame_listener {
 	struct wl_listener listener;
-	struct weston_buffer *buffer;
+	struct weston_buffer *buffer; /* NULL once destroyed */
+	struct wl_listener buffer_destroy_listener;
+	struct weston_output *output;
 	weston_test_screenshot_done_func_t done;
 	void *data;
 };
 
-static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	uint8_t *end;
-
-	end = dst + height * stride;
-	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
-}
-
-
-static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
-}
-
 static void
 copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 {
@@ -364,96 +345,111 @@ copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 }
 
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+test_screenshot_frame_listener_destroy(struct test_screenshot_frame_listener *l,
+				       enum weston_test_screenshot_outcome outcome)
 {
-	uint8_t *end;
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	else
+		outcome = WESTON_TEST_SCREENSHOT_BAD_BUFFER;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
+	l->done(l->data, outcome);
+	free(l);
 }
 
 static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
+test_screenshot_buffer_destroy(struct wl_listener *listener, void *data)
 {
-	uint8_t *end;
+	struct test_screenshot_frame_listener *l =
+		container_of(listener, struct test_screenshot_frame_listener,
+			     buffer_destroy_listener);
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
-	}
+	l->buffer = NULL;
 }
 
+/* Rows arrive top-down, possibly with a negative stride, and possibly
+ * after the client destroyed the buffer. */
 static void
-test_screenshot_frame_notify(struct wl_listener *listener, void *data)
+test_screenshot_read_done(void *data, const void *pixels, int32_t src_stride)
 {
-	struct test_screenshot_frame_listener *l =
-		container_of(listener,
-			     struct test_screenshot_frame_listener, listener);
-	struct weston_output *output = data;
-	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
-
-	output->disable_planes--;
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
-
-	if (pixels == NULL) {
-		l->done(l->data, WESTON_TEST_SCREENSHOT_NO_MEMORY);
-		free(l);
+	struct test_screenshot_frame_listener *l = data;
+	struct weston_compositor *compositor = l->output->compositor;
+	int32_t stride, row_bytes;
+	const uint8_t *s = pixels;
+	uint8_t *d;
+	int i;
+
+	if (pixels == NULL || l->buffer == NULL) {
+		test_screenshot_frame_listener_destroy(l,
+				WESTON_TEST_SCREENSHOT_NO_MEMORY);
 		return;
 	}
 
 	/* FIXME: Needs to handle output transformations */
 
-	compositor->renderer->read_pixels(output,
-					  compositor->read_format,
-					  pixels,
-					  0, 0,
-					  output->current_mode->width,
-					  output->current_mode->height);
-
 	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
-
+	row_bytes = l->output->current_mode->width * 4;
 	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
 
 	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
 
 	/* XXX: It would be nice if we used Pixman to do all this rather
 	 *  than our own implementation
 	 */
-	switch (compositor->read_format) {
-	case PIXMAN_a8r8g8b8:
-	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
-		break;
-	case PIXMAN_x8b8g8r8:
-	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
-		break;
-	default:
-		break;
+	for (i = 0; i < l->output->current_mode->height; i++) {
+		switch (compositor->read_format) {
+		case PIXMAN_a8r8g8b8:
+		case PIXMAN_x8r8g8b8:
+			memcpy(d, s, row_bytes);
+			break;
+		case PIXMAN_x8b8g8r8:
+		case PIXMAN_a8b8g8r8:
+			copy_row_swap_RB(d, (void *) s, row_bytes);
+			break;
+		default:
+			break;
+		}
+		d += stride;
+		s += src_stride;
 	}
 
 	wl_shm_buffer_end_access(l->buffer->shm_buffer);
 
-	l->done(l->data, WESTON_TEST_SCREENSHOT_SUCCESS);
-	free(pixels);
-	free(l);
+	test_screenshot_frame_listener_destroy(l,
+					       WESTON_TEST_SCREENSHOT_SUCCESS);
+}
+
+static void
+test_screenshot_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct test_screenshot_frame_listener *l =
+		container_of(listener,
+			     struct test_screenshot_frame_listener, listener);
+	struct weston_output *output = data;
+	struct weston_compositor *compositor = output->compositor;
+	int ret;
+
+	wl_list_remove(&listener->link);
+
+	if (l->buffer == NULL) {
+		weston_output_capture_end(output);
+		test_screenshot_frame_listener_destroy(l,
+				WESTON_TEST_SCREENSHOT_BAD_BUFFER);
+		return;
+	}
+
+	/* Still capturing while queueing, so that a backend reading back
+	 * the frame as scanned out gets to do it. */
+	l->output = output;
+	ret = weston_output_read_pixels_async(output, compositor->read_format,
+					      0, 0,
+					      output->current_mode->width,
+					      output->current_mode->height,
+					      test_screenshot_read_done, l);
+	weston_output_capture_end(output);
+	if (ret < 0)
+		test_screenshot_frame_listener_destroy(l,
+				WESTON_TEST_SCREENSHOT_NO_MEMORY);
 }
 
 static bool
@@ -494,9 +490,11 @@ weston_test_screenshot_shoot(struct weston_output *output,
 	l->data = data;
 	l->listener.notify = test_screenshot_frame_notify;
 	wl_signal_add(&output->frame_signal, &l->listener);
+	l->buffer_destroy_listener.notify = test_screenshot_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
 
 	/* Fire off a repaint */
-	output->disable_planes++;
+	weston_output_capture_begin(output);
 	weston_output_schedule_repaint(output);
 
 	return true;
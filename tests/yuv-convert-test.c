@@ -0,0 +1,169 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "yuv-convert.h"
+
+/* The SSE2 or NEON path of yuv_convert(), whichever the compiler targets,
+ * has to give exactly what the C path gives. Sizes and boxes are odd so
+ * that the vector loops stop at all possible offsets. */
+
+struct yuv_case {
+	enum yuv_layout layout;
+	int32_t width;
+	int32_t height;
+	int32_t stride;
+};
+
+static const struct yuv_case yuv_cases[] = {
+	{ YUV_LAYOUT_YUV420, 37, 19, 40 },
+	{ YUV_LAYOUT_YUV420, 64, 8, 64 },
+	{ YUV_LAYOUT_YUV420, 5, 1, 6 },
+	{ YUV_LAYOUT_NV12, 37, 19, 40 },
+	{ YUV_LAYOUT_NV12, 64, 8, 64 },
+	{ YUV_LAYOUT_NV12, 5, 1, 6 },
+	{ YUV_LAYOUT_YUYV, 37, 19, 80 },
+	{ YUV_LAYOUT_YUYV, 64, 8, 128 },
+	{ YUV_LAYOUT_YUYV, 5, 1, 12 },
+};
+
+static uint8_t *
+create_random_buffer(const struct yuv_case *c, struct yuv_buffer *buf)
+{
+	size_t size = yuv_buffer_size(c->layout, c->width, c->height,
+				      c->stride);
+	uint8_t *data;
+	size_t i;
+
+	assert(size > 0);
+	data = malloc(size);
+	assert(data);
+
+	for (i = 0; i < size; i++)
+		data[i] = rand();
+
+	buf->layout = c->layout;
+	buf->data = data;
+	buf->width = c->width;
+	buf->height = c->height;
+	buf->stride = c->stride;
+
+	return data;
+}
+
+TEST_P(yuv_simd_matches_c, yuv_cases)
+{
+	const struct yuv_case *c = data;
+	struct yuv_buffer buf;
+	size_t n = (size_t)c->width * c->height;
+	uint32_t *simd, *plain;
+	uint8_t *bytes;
+	int x1, y1;
+
+	srand(c->width * c->height);
+	bytes = create_random_buffer(c, &buf);
+	simd = calloc(n, sizeof *simd);
+	plain = calloc(n, sizeof *plain);
+	assert(simd && plain);
+
+	yuv_convert(&buf, simd, c->width, 0, 0, c->width, c->height, true);
+	yuv_convert(&buf, plain, c->width, 0, 0, c->width, c->height, false);
+	assert(memcmp(simd, plain, n * sizeof *simd) == 0);
+
+	/* Boxes starting at every offset of a vector */
+	for (x1 = 0; x1 < 16 && x1 < c->width; x1++) {
+		y1 = x1 % c->height;
+		memset(simd, 0, n * sizeof *simd);
+		memset(plain, 0, n * sizeof *plain);
+		yuv_convert(&buf, simd, c->width,
+			    x1, y1, c->width - x1 / 2, c->height, true);
+		yuv_convert(&buf, plain, c->width,
+			    x1, y1, c->width - x1 / 2, c->height, false);
+		assert(memcmp(simd, plain, n * sizeof *simd) == 0);
+	}
+
+	free(plain);
+	free(simd);
+	free(bytes);
+}
+
+TEST(yuv_reference_colors)
+{
+	/* Y U Y V, for black, white and saturated limited range values */
+	static const uint8_t yuyv[] = {
+		16, 128, 235, 128,
+		0, 0, 255, 255,
+	};
+	struct yuv_buffer buf = {
+		.layout = YUV_LAYOUT_YUYV,
+		.data = yuyv,
+		.width = 2,
+		.height = 2,
+		.stride = 4,
+	};
+	uint32_t out[4];
+	bool simd;
+
+	for (simd = false; ; simd = true) {
+		memset(out, 0, sizeof out);
+		yuv_convert(&buf, out, 2, 0, 0, 2, 2, simd);
+		assert(out[0] == 0xff000000);
+		assert(out[1] == 0xffffffff);
+		assert(out[2] == 0xffb80000);
+		assert(out[3] == 0xffffe114);
+		if (simd)
+			break;
+	}
+}
+
+TEST(yuv_buffer_size_checks_stride)
+{
+	/* Planes of a 4x4 buffer at stride 4: 16 + 4 + 4 bytes */
+	assert(yuv_buffer_size(YUV_LAYOUT_YUV420, 4, 4, 4) == 24);
+	assert(yuv_buffer_size(YUV_LAYOUT_NV12, 4, 4, 4) == 24);
+	assert(yuv_buffer_size(YUV_LAYOUT_YUYV, 4, 4, 8) == 32);
+
+	/* A single row still has one row of chroma */
+	assert(yuv_buffer_size(YUV_LAYOUT_YUV420, 4, 1, 4) == 6);
+	assert(yuv_buffer_size(YUV_LAYOUT_NV12, 4, 1, 4) == 8);
+
+	/* Odd widths need room for the chroma of the last pair */
+	assert(yuv_buffer_size(YUV_LAYOUT_YUV420, 5, 2, 5) == 0);
+	assert(yuv_buffer_size(YUV_LAYOUT_NV12, 5, 2, 5) == 0);
+	assert(yuv_buffer_size(YUV_LAYOUT_YUYV, 5, 2, 10) == 0);
+	assert(yuv_buffer_size(YUV_LAYOUT_YUYV, 5, 2, 12) == 24);
+
+	assert(yuv_buffer_size(YUV_LAYOUT_YUV420, 0, 4, 4) == 0);
+	assert(yuv_buffer_size(YUV_LAYOUT_NV12, 4, -1, 4) == 0);
+}
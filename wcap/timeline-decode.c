@@ -0,0 +1,355 @@
+/*
+ * Copyright © 2017 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Converts a binary timeline ring, as written by weston with
+ * WESTON_TIMELINE_BINARY set, into the JSON timeline format. */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "shared/timeline-ring.h"
+
+/* Object IDs count up from 1 in the compositor; larger ones only come
+ * from a corrupt file. */
+#define TIMELINE_MAX_OBJECTS (1u << 24)
+
+struct timeline_object {
+	uint16_t type;
+	char *text;
+};
+
+struct timeline_decoder {
+	const struct weston_timeline_ring_header *header;
+	const struct weston_timeline_record *records;
+	size_t size;
+	uint64_t pos, end;
+
+	struct timeline_object *objects;
+	uint32_t n_objects;
+
+	FILE *out;
+	uint64_t points, dropped;
+};
+
+static const struct weston_timeline_record *
+decoder_record(struct timeline_decoder *dec, uint64_t pos)
+{
+	return &dec->records[pos % dec->header->capacity];
+}
+
+static struct timeline_object *
+decoder_object(struct timeline_decoder *dec, uint32_t id)
+{
+	if (id == 0 || id >= dec->n_objects || dec->objects[id].type == 0)
+		return NULL;
+
+	return &dec->objects[id];
+}
+
+static struct timeline_object *
+decoder_define(struct timeline_decoder *dec, uint32_t id, uint16_t type)
+{
+	struct timeline_object *objects;
+	uint32_t n = dec->n_objects ? dec->n_objects : 64;
+
+	if (id == 0 || id >= TIMELINE_MAX_OBJECTS)
+		return NULL;
+
+	if (id >= dec->n_objects) {
+		while (n <= id)
+			n *= 2;
+
+		if (n > SIZE_MAX / sizeof *objects)
+			return NULL;
+
+		objects = realloc(dec->objects, n * sizeof *objects);
+		if (!objects)
+			return NULL;
+
+		memset(objects + dec->n_objects, 0,
+		       (n - dec->n_objects) * sizeof *objects);
+		dec->objects = objects;
+		dec->n_objects = n;
+	}
+
+	free(dec->objects[id].text);
+	dec->objects[id].type = type;
+	dec->objects[id].text = NULL;
+
+	return &dec->objects[id];
+}
+
+static void
+fprint_quoted_string(FILE *fp, const char *str)
+{
+	if (!str) {
+		fprintf(fp, "null");
+		return;
+	}
+
+	fprintf(fp, "\"%s\"", str);
+}
+
+/* Reads a definition and its text continuation records. */
+static void
+decode_definition(struct timeline_decoder *dec,
+		  const struct weston_timeline_record *rec)
+{
+	const struct weston_timeline_record *cont;
+	struct timeline_object *obj;
+	uint32_t len = rec->u.def.len;
+	uint32_t done, chunk;
+	char *text = NULL;
+
+	if (!(rec->flags & WESTON_TIMELINE_DEF_NULL_TEXT)) {
+		text = malloc(len + 1);
+		if (!text)
+			return;
+
+		chunk = len < WESTON_TIMELINE_DEF_INLINE_TEXT ?
+			len : WESTON_TIMELINE_DEF_INLINE_TEXT;
+		memcpy(text, rec->u.def.text, chunk);
+
+		for (done = chunk; done < len; done += chunk) {
+			if (dec->pos == dec->end)
+				break;
+
+			cont = decoder_record(dec, dec->pos);
+			if (cont->type != WESTON_TIMELINE_RECORD_TEXT ||
+			    cont->id != rec->id)
+				break;
+			dec->pos++;
+
+			chunk = len - done < WESTON_TIMELINE_TEXT_CHUNK ?
+				len - done : WESTON_TIMELINE_TEXT_CHUNK;
+			memcpy(text + done, cont->u.text, chunk);
+		}
+
+		if (done < len) {
+			free(text);
+			return;
+		}
+		text[len] = '\0';
+	}
+
+	obj = decoder_define(dec, rec->id, rec->type);
+	if (!obj) {
+		free(text);
+		return;
+	}
+	obj->text = text;
+
+	switch (rec->type) {
+	case WESTON_TIMELINE_RECORD_OUTPUT:
+		fprintf(dec->out, "{ \"id\":%u, "
+			"\"type\":\"weston_output\", \"name\":", rec->id);
+		fprint_quoted_string(dec->out, text);
+		fprintf(dec->out, " }\n");
+		break;
+	case WESTON_TIMELINE_RECORD_SURFACE:
+		fprintf(dec->out, "{ \"id\":%u, "
+			"\"type\":\"weston_surface\", \"desc\":", rec->id);
+		fprint_quoted_string(dec->out, text);
+		if (decoder_object(dec, rec->u.def.main_surface))
+			fprintf(dec->out, ", \"main_surface\":%u",
+				rec->u.def.main_surface);
+		fprintf(dec->out, " }\n");
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+decode_point(struct timeline_decoder *dec,
+	     const struct weston_timeline_record *rec)
+{
+	struct timeline_object *name = decoder_object(dec, rec->id);
+
+	/* Points whose definitions were overwritten in the ring. */
+	if (!name || name->type != WESTON_TIMELINE_RECORD_NAME ||
+	    !name->text ||
+	    ((rec->flags & WESTON_TIMELINE_POINT_OUTPUT) &&
+	     !decoder_object(dec, rec->u.point.output)) ||
+	    ((rec->flags & WESTON_TIMELINE_POINT_SURFACE) &&
+	     !decoder_object(dec, rec->u.point.surface))) {
+		dec->dropped++;
+		return;
+	}
+
+	fprintf(dec->out, "{ \"T\":[%" PRId64 ", %u], \"N\":\"%s\"",
+		rec->u.point.sec, rec->u.point.nsec, name->text);
+
+	if (rec->flags & WESTON_TIMELINE_POINT_OUTPUT)
+		fprintf(dec->out, ", \"wo\":%u", rec->u.point.output);
+	if (rec->flags & WESTON_TIMELINE_POINT_SURFACE)
+		fprintf(dec->out, ", \"ws\":%u", rec->u.point.surface);
+	if (rec->flags & WESTON_TIMELINE_POINT_VBLANK)
+		fprintf(dec->out, ", \"vblank\":[%" PRId64 ", %u]",
+			rec->u.point.vblank_sec, rec->u.point.vblank_nsec);
+	if (rec->flags & WESTON_TIMELINE_POINT_GPU)
+		fprintf(dec->out, ", \"gpu\":[%" PRId64 ", %u]",
+			rec->u.point.gpu_sec, rec->u.point.gpu_nsec);
+
+	fprintf(dec->out, " }\n");
+	dec->points++;
+}
+
+static void
+decode(struct timeline_decoder *dec)
+{
+	const struct weston_timeline_record *rec;
+
+	while (dec->pos < dec->end) {
+		rec = decoder_record(dec, dec->pos++);
+
+		switch (rec->type) {
+		case WESTON_TIMELINE_RECORD_POINT:
+			decode_point(dec, rec);
+			break;
+		case WESTON_TIMELINE_RECORD_NAME:
+		case WESTON_TIMELINE_RECORD_OUTPUT:
+		case WESTON_TIMELINE_RECORD_SURFACE:
+			decode_definition(dec, rec);
+			break;
+		default:
+			/* orphaned text or a record never completed */
+			break;
+		}
+	}
+}
+
+static int
+decoder_open(struct timeline_decoder *dec, const char *filename)
+{
+	struct stat buf;
+	uint64_t capacity;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &buf) < 0) {
+		perror(filename);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	dec->size = buf.st_size;
+	if (dec->size < sizeof *dec->header) {
+		fprintf(stderr, "%s: file too short\n", filename);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, dec->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(filename);
+		return -1;
+	}
+
+	dec->header = map;
+	dec->records = (const struct weston_timeline_record *)(dec->header + 1);
+	capacity = dec->header->capacity;
+
+	if (memcmp(dec->header->magic, WESTON_TIMELINE_RING_MAGIC,
+		   sizeof(WESTON_TIMELINE_RING_MAGIC)) != 0 ||
+	    dec->header->version != WESTON_TIMELINE_RING_VERSION ||
+	    dec->header->record_size != sizeof *dec->records ||
+	    capacity == 0 ||
+	    capacity > (dec->size - sizeof *dec->header) /
+		       sizeof *dec->records) {
+		fprintf(stderr, "%s: not a weston timeline ring\n", filename);
+		munmap(map, dec->size);
+		return -1;
+	}
+
+	dec->end = dec->header->head;
+	dec->pos = dec->end > capacity ? dec->end - capacity : 0;
+
+	return 0;
+}
+
+static void
+usage(int exit_code)
+{
+	fprintf(stderr, "usage: weston-timeline-decode "
+		"[--help] <ring file> [<json file>]\n\n"
+		"\t--help\t\tthis help text\n\n"
+		"Writes the JSON timeline to stdout unless an output file "
+		"is given.\n");
+
+	exit(exit_code);
+}
+
+int main(int argc, char *argv[])
+{
+	struct timeline_decoder dec;
+	uint32_t i;
+
+	if (argc > 1 && strcmp(argv[1], "--help") == 0)
+		usage(EXIT_SUCCESS);
+	if (argc < 2 || argc > 3)
+		usage(EXIT_FAILURE);
+
+	memset(&dec, 0, sizeof dec);
+	if (decoder_open(&dec, argv[1]) < 0)
+		exit(EXIT_FAILURE);
+
+	dec.out = stdout;
+	if (argc == 3) {
+		dec.out = fopen(argv[2], "w");
+		if (!dec.out) {
+			perror(argv[2]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	decode(&dec);
+
+	fprintf(stderr, "%" PRIu64 " points converted, %" PRIu64
+		" dropped for lack of definitions\n", dec.points, dec.dropped);
+
+	if (dec.out != stdout)
+		fclose(dec.out);
+
+	for (i = 0; i < dec.n_objects; i++)
+		free(dec.objects[i].text);
+	free(dec.objects);
+	munmap((void *)dec.header, dec.size);
+
+	return 0;
+}